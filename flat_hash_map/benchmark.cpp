@@ -1,12 +1,31 @@
 #include <iostream>
 #include <chrono>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <numeric>
+#include <filesystem>
+#include <memory>
+#include <cstdio>
+#include "test_utils.hpp"
+#include "hugepage_allocator.hpp"
 #include "flat_hash_map_v0.hpp"
 #include "flat_hash_map_v1.hpp"
+#include "flat_hash_map_v3.hpp"
+#include "flat_hash_map_v4.hpp"
+#include "sharded_flat_hash_map.hpp"
+#include "flat_hash_set.hpp"
+#include "frozen_flat_hash_map.hpp"
+#include "static_hash_map.hpp"
+#include "cuckoo_flat_hash_map.hpp"
+#include "node_flat_hash_map.hpp"
 
 #define ChosenFlatHashMap FlatHashMapV1a
 
-// TODO: Use TestManager to rewrite it.
+// Ad-hoc experiments on single features. The workload suite used to compare the versions is benchmark_suite.cpp
 
 constexpr int32_t WarmupTimes = 50;
 constexpr int32_t TestTimes = 50;
@@ -26,12 +45,12 @@ std::vector<int> generate_random_ints(std::size_t count, int min = 0, int max =
 
 // Measures execution time of a function
 template <typename Func>
-double measure_time_us(Func func) {
-    for (int32_t i = 0; i < WarmupTimes; ++i) {
+double measure_time_us(Func func, int32_t warmup_times = WarmupTimes, int32_t test_times = TestTimes) {
+    for (int32_t i = 0; i < warmup_times; ++i) {
         func();
     }
     auto start = Clock::now();
-    for (int32_t i = 0; i < TestTimes; ++i) {
+    for (int32_t i = 0; i < test_times; ++i) {
         func();
     }
     auto end = Clock::now();
@@ -140,6 +159,429 @@ void test_mixed_find() {
     std::cout << "[Mixed Find (hit+miss)] Time: " << time << " us\n";
 }
 
+// Random lookups into a table much bigger than the LLC, one key at a time vs. find_batch
+void test_batched_find() {
+    using MapT = FlatHashMapV3<int, int>;
+    MapT map;
+    constexpr int N = 1 << 22;
+    for (int i = 0; i < N; ++i) {
+        map.insert({i, i});
+    }
+    auto queries = generate_random_ints(N, 0, 2 * N);  // 50% hit, 50% miss
+    std::vector<MapT::IteratorT> out(queries.size());
+
+    double time_single = measure_time_us([&]() {
+        for (std::size_t i = 0; i < queries.size(); ++i) {
+            out[i] = map.find(queries[i]);
+        }
+        doNotOptimizeAway(out.back());
+    }, 1, 5);
+
+    double time_batch = measure_time_us([&]() {
+        map.find_batch(queries, out);
+        doNotOptimizeAway(out.back());
+    }, 1, 5);
+
+    std::cout << "[Random Find, one by one] Time: " << time_single << " us\n";
+    std::cout << "[Random Find, find_batch] Time: " << time_batch << " us\n";
+}
+
+// Keys i << Shift under the identity std::hash<int>: with MaskIndex every key
+// shares the low bits, so the table degenerates into one long probe run.
+template <typename MapT, int Shift>
+double strided_insert_and_find() {
+    constexpr int N = 1 << 13;
+    return measure_time_us([&]() {
+        MapT map;
+        for (int i = 0; i < N; ++i) {
+            map.insert({i << Shift, i});
+        }
+        int sum = 0;
+        for (int i = 0; i < N; ++i) {
+            sum += map.find(i << Shift)->second;
+        }
+        doNotOptimizeAway(sum);
+    }, 1, 3);
+}
+
+template <typename Hash, typename IndexPolicy>
+void test_index_policy(const char * name) {
+    // V3 always mixes the hash internally, so use the Robin Hood map to see the raw policy
+    using MapT = FlatHashMapV4c<int, int, 256, Hash, std::equal_to<int>,
+                                std::allocator<std::pair<const int, int>>, IndexPolicy>;
+    std::cout << "[Index policy " << name << "] sequential: " << strided_insert_and_find<MapT, 0>()
+              << " us, stride 4096: " << strided_insert_and_find<MapT, 12>() << " us\n";
+}
+
+void test_index_policies() {
+    test_index_policy<std::hash<int>, MaskIndex>("mask");
+    test_index_policy<std::hash<int>, FibonacciIndex>("fibonacci");
+    test_index_policy<MixedHash<std::hash<int>>, FastRangeIndex>("mixed + fastrange");
+    test_index_policy<MixedHash<std::hash<int>>, MaskIndex>("mixed + mask");
+}
+
+// 4 ingest threads, 90% lookups / 10% upserts, against one shared table
+template <typename InsertFunc, typename FindFunc>
+double concurrent_mixed(InsertFunc insert, FindFunc find) {
+    constexpr int NumThreads = 4;
+    constexpr int OpsPerThread = 1 << 18;
+    return measure_time_us([&]() {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < NumThreads; ++t) {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                int sum = 0;
+                for (int i = 0; i < OpsPerThread; ++i) {
+                    int key = static_cast<int>(rng() % (1 << 16));
+                    if (i % 10 == 0) {
+                        insert(key, i);
+                    } else {
+                        sum += find(key);
+                    }
+                }
+                doNotOptimizeAway(sum);
+            });
+        }
+        for (auto & thread : threads) {
+            thread.join();
+        }
+    }, 1, 5);
+}
+
+void test_sharded_concurrent() {
+    std::mutex mutex;
+    std::unordered_map<int, int> locked_map;
+    double time_locked = concurrent_mixed(
+        [&](int key, int value) { std::lock_guard<std::mutex> lock(mutex); locked_map[key] = value; },
+        [&](int key) { std::lock_guard<std::mutex> lock(mutex); auto it = locked_map.find(key); return it == locked_map.end() ? 0 : it->second; });
+
+    ShardedFlatHashMap<int, int> sharded_map;
+    double time_sharded = concurrent_mixed(
+        [&](int key, int value) { sharded_map.insert_or_assign(key, value); },
+        [&](int key) { return sharded_map.find(key).value_or(0); });
+
+    std::cout << "[Concurrent 90% find, std::unordered_map + global mutex] Time: " << time_locked << " us\n";
+    std::cout << "[Concurrent 90% find, ShardedFlatHashMap] Time: " << time_sharded << " us\n";
+}
+
+// Per-insert latency while growing a big table: one-shot rehash vs. incremental rehash
+void test_insert_latency() {
+    constexpr int N = 1 << 22;
+    for (bool incremental : {false, true}) {
+        FlatHashMapV3<int, int> map;
+        map.set_incremental_rehash(incremental);
+        std::vector<double> latencies(N);
+        for (int i = 0; i < N; ++i) {
+            auto start = Clock::now();
+            map.insert({i, i});
+            latencies[i] = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+        }
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "[Insert latency, " << (incremental ? "incremental" : "one-shot") << " rehash] p99.9: "
+                  << latencies[N - N / 1000] << " us, max: " << latencies.back() << " us\n";
+    }
+}
+
+// Random lookups into a large table, with 4KB pages vs. 2MB transparent huge pages
+template <typename Alloc>
+double random_find_with_allocator() {
+    FlatHashMapV3<int, int, 256, std::hash<int>, std::equal_to<int>, Alloc> map;
+    constexpr int N = 1 << 22;
+    map.reserve(N);
+    for (int i = 0; i < N; ++i) {
+        map.insert({i, i});
+    }
+    auto queries = generate_random_ints(N, 0, N - 1);
+    return measure_time_us([&]() {
+        int sum = 0;
+        for (int key : queries) {
+            sum += map.find(key)->second;
+        }
+        doNotOptimizeAway(sum);
+    }, 1, 5);
+}
+
+void test_hugepage_allocator() {
+    using Pair = std::pair<const int, int>;
+    std::cout << "[Random Find, std::allocator] Time: " << random_find_with_allocator<std::allocator<Pair>>() << " us\n";
+    std::cout << "[Random Find, HugePageAllocator] Time: " << random_find_with_allocator<HugePageAllocator<Pair>>() << " us\n";
+}
+
+// Dedup of 32-bit ids (about half are duplicates) into a fresh table, then a lookup of every id
+template <typename TableT, bool IsMap>
+double dedup_ids(const std::vector<uint32_t> & ids) {
+    return measure_time_us([&]() {
+        TableT table;
+        std::size_t unique = 0;
+        for (uint32_t id : ids) {
+            if constexpr (IsMap) {
+                unique += table.insert({id, id}).second;
+            } else if constexpr (std::is_same_v<decltype(table.insert(id)), bool>) {
+                unique += table.insert(id);
+            } else {
+                unique += table.insert(id).second;
+            }
+        }
+        for (uint32_t id : ids) {
+            if constexpr (IsMap) {
+                unique += (table.find(id) != table.end());
+            } else {
+                unique += table.count(id);
+            }
+        }
+        doNotOptimizeAway(unique);
+    }, 1, 5);
+}
+
+void test_small_keys() {
+    constexpr int N = 1 << 20;
+    std::vector<uint32_t> ids(N);
+    std::mt19937 rng(42);
+    for (auto & id : ids) {
+        id = rng() % (N / 2);
+    }
+    std::cout << "[Dedup ids, FlatHashSet<uint32_t>, " << sizeof(FlatHashSet<uint32_t>::SlotT) << " B/slot] Time: "
+              << dedup_ids<FlatHashSet<uint32_t>, false>(ids) << " us\n";
+    std::cout << "[Dedup ids, std::unordered_set<uint32_t>] Time: "
+              << dedup_ids<std::unordered_set<uint32_t>, false>(ids) << " us\n";
+    std::cout << "[Dedup ids, SentinelFlatHashMap<uint32_t, uint32_t>, " << sizeof(SentinelFlatHashMap<uint32_t, uint32_t>::SlotT)
+              << " B/slot] Time: " << dedup_ids<SentinelFlatHashMap<uint32_t, uint32_t>, true>(ids) << " us\n";
+    std::cout << "[Dedup ids, FlatHashMapV1c<uint32_t, uint32_t>, " << sizeof(FlatHashMapV1c<uint32_t, uint32_t>::ElementT)
+              << " B/slot] Time: " << dedup_ids<FlatHashMapV1c<uint32_t, uint32_t>, true>(ids) << " us\n";
+}
+
+template <std::size_t Bytes>
+struct Payload {
+    std::array<char, Bytes> bytes;
+};
+
+// Hits read one byte of the value, misses never touch a value
+template <typename Layout, std::size_t Bytes>
+void slot_layout_find(const char * name) {
+    using MapT = FlatHashMapV3<int, Payload<Bytes>, 256, std::hash<int>, std::equal_to<int>,
+                               std::allocator<std::pair<const int, Payload<Bytes>>>, MaskIndex, Layout>;
+    constexpr int N = 1 << 17;
+    MapT map;
+    for (int i = 0; i < N; ++i) {
+        map[i].bytes.fill(static_cast<char>(i));
+    }
+    auto hits = generate_random_ints(N, 0, N - 1);
+    auto misses = generate_random_ints(N, N, 2 * N);
+    double hit_time = measure_time_us([&]() {
+        int sum = 0;
+        for (int key : hits) {
+            sum += (*map.find(key)).second.bytes[0];
+        }
+        doNotOptimizeAway(sum);
+    }, 1, 5);
+    double miss_time = measure_time_us([&]() {
+        int count = 0;
+        for (int key : misses) {
+            count += (map.find(key) == map.end());
+        }
+        doNotOptimizeAway(count);
+    }, 1, 5);
+    std::cout << "[Slot layout " << name << ", " << Bytes << " B values] hit: " << hit_time << " us, miss: " << miss_time << " us\n";
+}
+
+void test_slot_layouts() {
+    slot_layout_find<InterleavedLayout, 64>("interleaved");
+    slot_layout_find<SplitLayout, 64>("split");
+    slot_layout_find<InterleavedLayout, 256>("interleaved");
+    slot_layout_find<SplitLayout, 256>("split");
+}
+
+// Startup of a service with a big read-only table: build it again from the source data, or map a snapshot.
+// The snapshot costs a few system calls up front, then page faults on the first lookups that touch each page
+void test_frozen_startup() {
+    constexpr uint64_t N = 1 << 23;
+    constexpr int Lookups = 100000;
+    const std::string path = (std::filesystem::temp_directory_path() / "hpds_frozen_benchmark.bin").string();
+    std::vector<std::pair<uint64_t, uint64_t>> source(N);
+    for (uint64_t i = 0; i < N; ++i) {
+        source[i] = {i * 0x9E3779B97F4A7C15ull, i};
+    }
+    auto queries = generate_random_ints(Lookups, 0, N - 1);
+
+    auto start = Clock::now();
+    auto map = std::make_unique<FlatHashMapV3<uint64_t, uint64_t>>();
+    map->reserve(N);
+    for (const auto & pair : source) {
+        map->insert(pair);
+    }
+    double build_time = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+
+    start = Clock::now();
+    FrozenFlatHashMapV3<uint64_t, uint64_t>::write(*map, path);
+    double write_time = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+
+    start = Clock::now();
+    auto frozen = FrozenFlatHashMapV3<uint64_t, uint64_t>::open(path);
+    double open_time = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+    start = Clock::now();
+    uint64_t sum = 0;
+    for (int key : queries) {
+        sum += *frozen.find(source[key].first);
+    }
+    doNotOptimizeAway(sum);
+    double first_lookups_time = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+    std::remove(path.c_str());
+
+    std::cout << "[Frozen snapshot, " << N << " elements] rebuild: " << build_time << " us, write: " << write_time
+              << " us, open: " << open_time << " us, first " << Lookups << " lookups: " << first_lookups_time << " us\n";
+}
+
+// Latencies of lookups, taken over batches of 64 dependent lookups (the next key depends on the last value),
+// so that the timer overhead stays small and a slow lookup is not hidden behind the next ones
+template <typename MapT, typename BuildFunc>
+void lookup_latency(const char * title, const char * name, BuildFunc && build, const std::vector<uint64_t> & hits, const std::vector<uint64_t> & misses) {
+    constexpr std::size_t Batch = 64;
+    auto start = Clock::now();
+    std::unique_ptr<MapT> map = build();
+    double build_time = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+    const std::size_t n = hits.size();
+    std::vector<double> latencies;
+    latencies.reserve(n / Batch);
+    uint64_t found = 0;
+    for (std::size_t i = 0; i + Batch <= n; i += Batch) {
+        auto batch_start = Clock::now();
+        for (std::size_t j = 0; j < Batch; ++j) {
+            found += map->find(hits[(i + j + found) % n])->second & 1;
+        }
+        latencies.push_back(std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(Clock::now() - batch_start).count() / Batch);
+    }
+    double miss_time = measure_time_us([&]() {
+        std::size_t count = 0;
+        for (uint64_t key : misses) {
+            count += (map->find(key) != map->end());
+        }
+        doNotOptimizeAway(count);
+    }, 1, 3);
+    doNotOptimizeAway(found);
+    double mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "[" << title << ", " << name << "] build: " << build_time / 1000 << " ms, hit mean: " << mean
+              << " ns, hit p99: " << latencies[latencies.size() * 99 / 100] << " ns, miss: "
+              << miss_time * 1000 / (3.0 * misses.size()) << " ns\n";
+}
+
+// Lookups into a read-only key set: a minimal perfect hash against the probing maps
+void test_static_hash_map(std::size_t N) {
+    std::cout << "[Static key set] " << N << " keys\n";
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(N);
+    for (auto & key : keys) key = rng();
+    std::vector<uint64_t> misses(N);
+    for (auto & key : misses) key = rng();
+    std::vector<uint64_t> hits = keys;
+    std::shuffle(hits.begin(), hits.end(), rng);
+    std::vector<std::pair<uint64_t, uint64_t>> pairs(N);
+    for (std::size_t i = 0; i < N; ++i) pairs[i] = {keys[i], i};
+
+    auto build_dynamic = [&]<typename MapT>() {
+        return [&]() {
+            auto map = std::make_unique<MapT>();
+            for (const auto & pair : pairs) map->insert(pair);
+            return map;
+        };
+    };
+    lookup_latency<StaticHashMap<uint64_t, uint64_t>>("Static key set", "StaticHashMap", [&]() {
+        return std::make_unique<StaticHashMap<uint64_t, uint64_t>>(pairs.begin(), pairs.end());
+    }, hits, misses);
+    lookup_latency<FlatHashMapV3<uint64_t, uint64_t>>("Static key set", "FlatHashMapV3", build_dynamic.template operator()<FlatHashMapV3<uint64_t, uint64_t>>(), hits, misses);
+    lookup_latency<FlatHashMapV4b<uint64_t, uint64_t>>("Static key set", "FlatHashMapV4b", build_dynamic.template operator()<FlatHashMapV4b<uint64_t, uint64_t>>(), hits, misses);
+    lookup_latency<std::unordered_map<uint64_t, uint64_t>>("Static key set", "std::unordered_map", build_dynamic.template operator()<std::unordered_map<uint64_t, uint64_t>>(), hits, misses);
+}
+
+// Lookups at 90% load, where the probe sequences of open addressing grow long tails,
+// against bucketized cuckoo hashing, which reads at most 2 buckets
+void test_cuckoo_map() {
+    constexpr std::size_t Capacity = 1 << 22;
+    constexpr std::size_t N = Capacity * 9 / 10;
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(N);
+    for (auto & key : keys) key = rng() >> 1;
+    std::vector<uint64_t> misses(N);
+    for (auto & key : misses) key = rng() >> 1;
+    std::vector<uint64_t> hits = keys;
+    std::shuffle(hits.begin(), hits.end(), rng);
+
+    auto build = [&]<typename MapT>() {
+        return [&]() {
+            auto map = std::make_unique<MapT>();
+            map->set_max_load_factor(0.95f);
+            for (std::size_t i = 0; i < N; ++i) map->insert({keys[i], i});
+            std::cout << "[High load] load factor: " << map->load_factor() << "\n";
+            return map;
+        };
+    };
+    lookup_latency<CuckooFlatHashMap<uint64_t, uint64_t>>("High load", "CuckooFlatHashMap", build.template operator()<CuckooFlatHashMap<uint64_t, uint64_t>>(), hits, misses);
+    lookup_latency<FlatHashMapV3<uint64_t, uint64_t>>("High load", "FlatHashMapV3", build.template operator()<FlatHashMapV3<uint64_t, uint64_t>>(), hits, misses);
+    lookup_latency<FlatHashMapV4b<uint64_t, uint64_t>>("High load", "FlatHashMapV4b", build.template operator()<FlatHashMapV4b<uint64_t, uint64_t>>(), hits, misses);
+    lookup_latency<SentinelFlatHashMap<uint64_t, uint64_t>>("High load", "SentinelFlatHashMap", build.template operator()<SentinelFlatHashMap<uint64_t, uint64_t>>(), hits, misses);
+}
+
+// Maps whose value addresses survive a rehash, against V3 which moves them
+void test_node_map() {
+    constexpr std::size_t N = 1 << 21;
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(N);
+    for (auto & key : keys) key = rng();
+    std::vector<uint64_t> misses(N);
+    for (auto & key : misses) key = rng();
+    std::vector<uint64_t> hits = keys;
+    std::shuffle(hits.begin(), hits.end(), rng);
+
+    auto build = [&]<typename MapT>() {
+        return [&]() {
+            auto map = std::make_unique<MapT>();
+            for (std::size_t i = 0; i < N; ++i) map->insert({keys[i], i});
+            return map;
+        };
+    };
+    lookup_latency<NodeFlatHashMap<uint64_t, uint64_t>>("Stable values", "NodeFlatHashMap", build.template operator()<NodeFlatHashMap<uint64_t, uint64_t>>(), hits, misses);
+    lookup_latency<std::unordered_map<uint64_t, uint64_t>>("Stable values", "std::unordered_map", build.template operator()<std::unordered_map<uint64_t, uint64_t>>(), hits, misses);
+    lookup_latency<FlatHashMapV3<uint64_t, uint64_t>>("Stable values", "FlatHashMapV3 (not stable)", build.template operator()<FlatHashMapV3<uint64_t, uint64_t>>(), hits, misses);
+}
+
+// Needs as many cores as threads to show a speedup
+void test_parallel_build() {
+    constexpr uint64_t N = 1 << 23;
+    std::mt19937_64 rng(42);
+    std::vector<std::pair<uint64_t, uint64_t>> source(N);
+    for (uint64_t i = 0; i < N; ++i) {
+        source[i] = {rng(), i};
+    }
+    auto time_build = [&](auto && fill) {
+        auto start = Clock::now();
+        auto map = std::make_unique<FlatHashMapV3<uint64_t, uint64_t>>();
+        fill(*map);
+        double time = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+        doNotOptimizeAway(map->size());
+        return time;
+    };
+    double insert_time = time_build([&](auto & map) {
+        map.reserve(N);
+        for (const auto & pair : source) map.insert(pair);
+    });
+    std::cout << "[Parallel build, " << N << " elements] insert loop: " << insert_time << " us";
+    for (std::size_t threads : {1, 2, 4, 8}) {
+        double time = time_build([&](auto & map) { map.bulk_insert(source.begin(), source.end(), threads); });
+        std::cout << ", bulk_insert " << threads << " threads: " << time << " us";
+    }
+    std::cout << "\n";
+
+    std::cout << "[Parallel rehash, " << N << " elements]";
+    for (std::size_t threads : {1, 2, 4, 8}) {
+        FlatHashMapV3<uint64_t, uint64_t> map;
+        map.set_rehash_threads(threads);
+        map.bulk_insert(source.begin(), source.end(), threads);
+        auto start = Clock::now();
+        map.reserve(map.capacity());
+        double time = std::chrono::duration_cast<Duration>(Clock::now() - start).count();
+        std::cout << " " << threads << " threads: " << time << " us" << (threads == 8 ? "\n" : ",");
+    }
+}
 int main() {
     test_sequential_insert();
     test_random_insert();
@@ -147,5 +589,18 @@ int main() {
     test_erase_half();
     test_erase_and_reinsert();
     test_mixed_find();
+    test_batched_find();
+    test_index_policies();
+    test_sharded_concurrent();
+    test_insert_latency();
+    test_hugepage_allocator();
+    test_small_keys();
+    test_slot_layouts();
+    test_frozen_startup();
+    test_static_hash_map(200000);
+    test_static_hash_map(3000000);
+    test_cuckoo_map();
+    test_node_map();
+    test_parallel_build();
     return 0;
 }
@@ -0,0 +1,394 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <optional>
+#include "test_utils.hpp"
+#include "flat_hash_map_v3.hpp"
+#include "flat_hash_map_v4.hpp"
+#include "flat_hash_set.hpp"
+#include "cuckoo_flat_hash_map.hpp"
+
+/**
+ * The hash map suite, driven by a TestManager config (see config.json):
+ *   ./benchmark_suite config.json
+ * input_params are the numbers of entries, from a table which fits in L1 to one far beyond the LLC.
+ * Every case "<map>/<workload>" reports ns per operation, and "metrics" in the output
+ * holds "<map>/bytes_per_entry" and "<map>/probe_histogram" for every size.
+ * The optional "maps" and "workloads" arrays of the config pick a subset of the cases.
+ */
+
+using namespace hpds;
+using Clock = std::chrono::high_resolution_clock;
+
+// Lookups per measurement: small tables are queried many times over, so that timer overhead disappears
+constexpr std::size_t MinQueries = 1 << 20;
+// Each measurement is repeated, and the fastest run is kept
+constexpr int32_t Repeats = 3;
+// The skew of YCSB's Zipfian distribution, ~80% of the lookups hit ~20% of the keys
+constexpr double ZipfTheta = 0.99;
+
+// Counts the bytes held by every CountingAllocator, to measure the footprint of a map
+inline std::ptrdiff_t allocated_bytes = 0;
+
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U> &) {}
+
+    T * allocate(std::size_t n) {
+        allocated_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T * ptr, std::size_t n) {
+        allocated_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U> &) const {
+        return true;
+    }
+};
+
+// Ranks in [0, n) following a Zipfian distribution, rank 0 being the most frequent.
+// The generator of YCSB (Gray et al., "Quickly Generating Billion-Record Synthetic Databases")
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(std::size_t n, double theta) : n_(n), theta_(theta) {
+        double zeta2 = 1.0 + std::pow(0.5, theta_);
+        zetan_ = 0;
+        for(std::size_t i = 1; i <= n_; i++) {
+            zetan_ += 1.0 / std::pow(static_cast<double>(i), theta_);
+        }
+        alpha_ = 1.0 / (1.0 - theta_);
+        eta_ = (1.0 - std::pow(2.0 / n_, 1.0 - theta_)) / (1.0 - zeta2 / zetan_);
+    }
+
+    template <typename Rng>
+    std::size_t operator()(Rng & rng) {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan_;
+        if(uz < 1.0) {
+            return 0;
+        }
+        if(uz < 1.0 + std::pow(0.5, theta_)) {
+            return 1;
+        }
+        return std::min(n_ - 1, static_cast<std::size_t>(n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_)));
+    }
+
+private:
+    std::size_t n_;
+    double theta_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+};
+
+// The keys of one size, shared by all the maps so that they all run the same workload
+struct Workload {
+    std::vector<uint64_t> keys;
+    // Distinct from keys
+    std::vector<uint64_t> misses;
+    std::vector<uint64_t> hit_queries;
+    // Half of them are misses
+    std::vector<uint64_t> mixed_queries;
+    std::vector<uint64_t> miss_queries;
+    std::vector<uint64_t> zipf_queries;
+    std::vector<std::string> string_keys;
+    std::vector<std::string> string_queries;
+};
+
+Workload make_workload(std::size_t size) {
+    std::mt19937_64 rng(42);
+    Workload workload;
+    // Draw 2 * size distinct keys, and keep the sentinel of SentinelFlatHashMap out of the way
+    std::unordered_set<uint64_t> drawn;
+    while(drawn.size() < 2 * size) {
+        uint64_t key = rng();
+        if(key != SentinelKeyTraits<uint64_t>::empty_key() && drawn.insert(key).second) {
+            ((drawn.size() % 2 == 0) ? workload.keys : workload.misses).push_back(key);
+        }
+    }
+
+    const std::size_t num_queries = std::max(size, MinQueries);
+    std::uniform_int_distribution<std::size_t> index(0, size - 1);
+    // Hot keys are scattered over the table, not the first inserted ones
+    std::vector<std::size_t> rank_to_index(size);
+    for(std::size_t i = 0; i < size; i++) {
+        rank_to_index[i] = i;
+    }
+    std::shuffle(rank_to_index.begin(), rank_to_index.end(), rng);
+    ZipfianGenerator zipf(size, ZipfTheta);
+    for(std::size_t i = 0; i < num_queries; i++) {
+        workload.hit_queries.push_back(workload.keys[index(rng)]);
+        workload.mixed_queries.push_back((rng() & 1) ? workload.keys[index(rng)] : workload.misses[index(rng)]);
+        workload.miss_queries.push_back(workload.misses[index(rng)]);
+        workload.zipf_queries.push_back(workload.keys[rank_to_index[zipf(rng)]]);
+    }
+
+    // Longer than the small string buffer, like most real string keys
+    for(uint64_t key : workload.keys) {
+        workload.string_keys.push_back("user:" + std::to_string(key));
+    }
+    for(std::size_t i = 0; i < num_queries; i++) {
+        workload.string_queries.push_back(workload.string_keys[index(rng)]);
+    }
+    return workload;
+}
+
+/**
+ * A map under test: Map<K, V, Alloc> instantiates it, and IntegerKeysOnly skips the string workloads.
+ * V0 - V2 are left out: their find() does not stop at an empty slot, so a miss walks the whole table.
+ */
+struct V3Map {
+    static constexpr const char * Name = "V3";
+    static constexpr bool IntegerKeysOnly = false;
+    template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>>
+    using Map = FlatHashMapV3<K, V, 256, std::hash<K>, std::equal_to<K>, Alloc>;
+};
+
+struct V3SplitMap {
+    static constexpr const char * Name = "V3_split";
+    static constexpr bool IntegerKeysOnly = false;
+    template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>>
+    using Map = FlatHashMapV3<K, V, 256, std::hash<K>, std::equal_to<K>, Alloc, MaskIndex, SplitLayout>;
+};
+
+struct V4bMap {
+    static constexpr const char * Name = "V4b";
+    static constexpr bool IntegerKeysOnly = false;
+    template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>>
+    using Map = FlatHashMapV4b<K, V, 256, std::hash<K>, std::equal_to<K>, Alloc>;
+};
+
+struct SentinelMap {
+    static constexpr const char * Name = "Sentinel";
+    static constexpr bool IntegerKeysOnly = true;
+    template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>>
+    using Map = SentinelFlatHashMap<K, V, 256, std::hash<K>, std::equal_to<K>, Alloc>;
+};
+
+struct CuckooMap {
+    static constexpr const char * Name = "Cuckoo";
+    static constexpr bool IntegerKeysOnly = true;
+    template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>>
+    using Map = CuckooFlatHashMap<K, V, 256, std::hash<K>, Alloc>;
+};
+
+struct StdMap {
+    static constexpr const char * Name = "std::unordered_map";
+    static constexpr bool IntegerKeysOnly = false;
+    template <typename K, typename V, typename Alloc = std::allocator<std::pair<const K, V>>>
+    using Map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, Alloc>;
+};
+
+// Runs "func" Repeats times and returns the fastest run in ns per operation.
+// "set_up" runs untimed before each run.
+template <typename SetUp, typename Func>
+double best_ns_per_op(std::size_t num_ops, SetUp && set_up, Func && func) {
+    double best = std::numeric_limits<double>::max();
+    for(int32_t i = 0; i < Repeats; i++) {
+        set_up();
+        auto start_time = Clock::now();
+        func();
+        auto end_time = Clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time);
+        best = std::min(best, duration.count() * 1.0 / num_ops);
+    }
+    return best;
+}
+
+// Not every version is movable, so maps are built in place
+template <typename MapT, typename KeyT>
+void fill_map(MapT & map, const std::vector<KeyT> & keys) {
+    for(std::size_t i = 0; i < keys.size(); i++) {
+        map.insert({keys[i], i});
+    }
+}
+
+template <typename MapT, typename KeyT>
+double insert_ns(const std::vector<KeyT> & keys) {
+    std::optional<MapT> map;
+    return best_ns_per_op(keys.size(), [&]() { map.emplace(); }, [&]() {
+        fill_map(*map, keys);
+    });
+}
+
+template <typename MapT, typename KeyT>
+double find_ns(MapT & map, const std::vector<KeyT> & queries) {
+    return best_ns_per_op(queries.size(), []() {}, [&]() {
+        uint64_t sum = 0;
+        for(const KeyT & query : queries) {
+            auto it = map.find(query);
+            if(it != map.end()) {
+                sum += it->second;
+            }
+        }
+        doNotOptimizeAway(sum);
+    });
+}
+
+// A map of a steady size whose keys are replaced over time: erase a live key, insert a new one.
+// Every round swaps the whole key set between "keys" and "misses"
+template <typename MapT>
+double churn_ns(const Workload & workload) {
+    const std::size_t size = workload.keys.size();
+    const std::size_t rounds = std::max<std::size_t>(2, MinQueries / size) & ~std::size_t(1);
+    std::optional<MapT> map;
+    return best_ns_per_op(rounds * size * 2, [&]() { map.emplace(); fill_map(*map, workload.keys); }, [&]() {
+        for(std::size_t round = 0; round < rounds; round++) {
+            const auto & live = (round % 2 == 0) ? workload.keys : workload.misses;
+            const auto & fresh = (round % 2 == 0) ? workload.misses : workload.keys;
+            for(std::size_t i = 0; i < size; i++) {
+                map->erase(live[i]);
+                map->insert({fresh[i], i});
+            }
+        }
+    });
+}
+
+// Bytes allocated by the map per entry, including the empty slots and, for strings, the heap buffers of the keys
+template <typename MapFamily, typename KeyT>
+double bytes_per_entry(const std::vector<KeyT> & keys) {
+    using MapT = typename MapFamily::template Map<KeyT, uint64_t, CountingAllocator<std::pair<const KeyT, uint64_t>>>;
+    std::ptrdiff_t before = allocated_bytes;
+    MapT map;
+    fill_map(map, keys);
+    std::ptrdiff_t bytes = allocated_bytes - before;
+    // std::string allocates with std::allocator, so add the buffers of the stored keys
+    if constexpr (std::is_same_v<KeyT, std::string>) {
+        for(const std::string & key : keys) {
+            if(key.capacity() > std::string().capacity()) {
+                bytes += key.capacity() + 1;
+            }
+        }
+    }
+    return bytes * 1.0 / keys.size();
+}
+
+template <typename MapFamily>
+void launch_map(TestManager & test_manager, const std::map<int32_t, Workload> & workloads,
+                const std::unordered_set<std::string> & chosen_workloads) {
+    using IntMapT = typename MapFamily::template Map<uint64_t, uint64_t>;
+    const std::string name = MapFamily::Name;
+    auto chosen = [&](const std::string & workload_name) {
+        return chosen_workloads.empty() || chosen_workloads.count(workload_name) != 0;
+    };
+    // Build the map of each size once for all the lookup workloads
+    std::map<int32_t, IntMapT> maps;
+    auto map_of = [&](int32_t size) -> IntMapT & {
+        auto [it, inserted] = maps.try_emplace(size);
+        if(inserted) {
+            fill_map(it->second, workloads.at(size).keys);
+        }
+        return it->second;
+    };
+
+    if(chosen("insert")) {
+        test_manager.launchTest(name + "/insert", [&](int32_t size) {
+            return insert_ns<IntMapT>(workloads.at(size).keys);
+        });
+    }
+    if(chosen("find_hit")) {
+        test_manager.launchTest(name + "/find_hit", [&](int32_t size) {
+            return find_ns(map_of(size), workloads.at(size).hit_queries);
+        });
+    }
+    if(chosen("find_50_hit")) {
+        test_manager.launchTest(name + "/find_50_hit", [&](int32_t size) {
+            return find_ns(map_of(size), workloads.at(size).mixed_queries);
+        });
+    }
+    if(chosen("find_miss")) {
+        test_manager.launchTest(name + "/find_miss", [&](int32_t size) {
+            return find_ns(map_of(size), workloads.at(size).miss_queries);
+        });
+    }
+    if(chosen("find_zipf")) {
+        test_manager.launchTest(name + "/find_zipf", [&](int32_t size) {
+            return find_ns(map_of(size), workloads.at(size).zipf_queries);
+        });
+    }
+    if constexpr (requires (IntMapT & map) { map.probe_histogram(); }) {
+        test_manager.launchMetric(name + "/probe_histogram", [&](int32_t size) {
+            return map_of(size).probe_histogram();
+        });
+    }
+    maps.clear();
+
+    if(chosen("churn")) {
+        test_manager.launchTest(name + "/churn", [&](int32_t size) {
+            return churn_ns<IntMapT>(workloads.at(size));
+        });
+    }
+    test_manager.launchMetric(name + "/bytes_per_entry", [&](int32_t size) {
+        return bytes_per_entry<MapFamily>(workloads.at(size).keys);
+    });
+
+    if constexpr (!MapFamily::IntegerKeysOnly) {
+        using StringMapT = typename MapFamily::template Map<std::string, uint64_t>;
+        if(chosen("string_insert")) {
+            test_manager.launchTest(name + "/string_insert", [&](int32_t size) {
+                return insert_ns<StringMapT>(workloads.at(size).string_keys);
+            });
+        }
+        if(chosen("string_find_hit")) {
+            test_manager.launchTest(name + "/string_find_hit", [&](int32_t size) {
+                StringMapT map;
+                fill_map(map, workloads.at(size).string_keys);
+                return find_ns(map, workloads.at(size).string_queries);
+            });
+        }
+        test_manager.launchMetric(name + "/string_bytes_per_entry", [&](int32_t size) {
+            return bytes_per_entry<MapFamily>(workloads.at(size).string_keys);
+        });
+    }
+    std::cout << name << " done" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if(argc != 2) {
+        throw std::runtime_error("Usage : ./executable config_path");
+    }
+    TestManager test_manager(argv[1]);
+
+    // TestManager ignores the optional fields picking the maps and the workloads
+    json config;
+    std::ifstream(argv[1]) >> config;
+    std::unordered_set<std::string> chosen_maps;
+    std::unordered_set<std::string> chosen_workloads;
+    if(config.contains("maps")) {
+        chosen_maps = config["maps"].get<std::unordered_set<std::string>>();
+    }
+    if(config.contains("workloads")) {
+        chosen_workloads = config["workloads"].get<std::unordered_set<std::string>>();
+    }
+
+    std::map<int32_t, Workload> workloads;
+    for(int32_t input_param : test_manager.getInputParams()) {
+        workloads.emplace(input_param, make_workload(input_param));
+    }
+
+    #define launchMapTest(MapFamily) \
+        if(chosen_maps.empty() || chosen_maps.count(MapFamily::Name) != 0) {    \
+            launch_map<MapFamily>(test_manager, workloads, chosen_workloads);   \
+        }
+
+    launchMapTest(V3Map);
+    launchMapTest(V3SplitMap);
+    launchMapTest(V4bMap);
+    launchMapTest(SentinelMap);
+    launchMapTest(CuckooMap);
+    launchMapTest(StdMap);
+
+    test_manager.dump();
+}
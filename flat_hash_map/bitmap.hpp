@@ -1,27 +1,123 @@
 #pragma once
 
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <bit>
 #include <cstdint>
+#include <cstddef>
 #include <type_traits>
 #include <concepts>
 
 namespace hpds {
- 
+
 template <int32_t BlockSize>
-concept ValidBlockSize = (BlockSize % 8 == 0) && (BlockSize <= 64) && (BlockSize > 0);
+concept ValidBlockSize = (BlockSize == 8) || (BlockSize == 16) || (BlockSize == 32) || (BlockSize == 64);
 
-template <std::size_t InitCapacity, ValidBlockSize BlockSize>
+/**
+ * @brief A dynamically sized bitmap stored in BlockSize-bit words.
+ * It is used as an occupancy layer beside the element array of a flat hash map, so that
+ * scanning for live slots reads one word per BlockSize slots and skips empty words entirely.
+ * The words are allocated through Allocator rebound to the word type, so a map can share its allocator with it.
+ */
+template <std::size_t InitCapacity, int32_t BlockSize = 64, typename Allocator = std::allocator<uint64_t>>
+requires ValidBlockSize<BlockSize>
 class Bitmap {
-    using ElementT = std::conditional_t<InitCapacity == 8, uint8_t,
-                                        InitCapacity == 16, uint16_t,
-                                        InitCapacity == 32, uint32_t,
-                                        InitCapacity == 64, uint64_t>;
+    using ElementT = std::conditional_t<BlockSize == 8, uint8_t,
+                     std::conditional_t<BlockSize == 16, uint16_t,
+                     std::conditional_t<BlockSize == 32, uint32_t, uint64_t>>>;
+    using WordAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<ElementT>;
+
+    static std::size_t num_blocks(std::size_t num_bits) {
+        return (num_bits + BlockSize - 1) / BlockSize;
+    }
+    static ElementT bit(std::size_t pos) {
+        return static_cast<ElementT>(ElementT(1) << (pos % BlockSize));
+    }
 public:
-    
+    Bitmap() : Bitmap(Allocator()) {}
+    explicit Bitmap(const Allocator & alloc) : elements_(num_blocks(InitCapacity), WordAllocator(alloc)), size_(InitCapacity) {}
+
+    Allocator get_allocator() const {
+        return Allocator(elements_.get_allocator());
+    }
+
+    // Number of bits
+    std::size_t size() const noexcept {
+        return size_;
+    }
+
+    bool test(std::size_t pos) const {
+        return (elements_[pos / BlockSize] & bit(pos)) != 0;
+    }
+
+    void set(std::size_t pos) {
+        elements_[pos / BlockSize] |= bit(pos);
+    }
+
+    void reset(std::size_t pos) {
+        elements_[pos / BlockSize] &= static_cast<ElementT>(~bit(pos));
+    }
+
+    // Reset every bit, the size is kept
+    void clear() {
+        std::fill(elements_.begin(), elements_.end(), ElementT(0));
+    }
+
+    // Number of set bits
+    std::size_t count() const {
+        std::size_t result = 0;
+        for(ElementT element : elements_) {
+            result += std::popcount(element);
+        }
+        return result;
+    }
+
+    /**
+     * @brief Return the position of the first set bit at or after "pos", or size() if there is none.
+     * Zero words are skipped one block at a time, and std::countr_zero compiles to tzcnt.
+     */
+    std::size_t find_next_set(std::size_t pos) const {
+        if(pos >= size_) {
+            return size_;
+        }
+        std::size_t block = pos / BlockSize;
+        // mask off the bits below "pos" in the first block
+        ElementT element = elements_[block] & static_cast<ElementT>(static_cast<ElementT>(~ElementT(0)) << (pos % BlockSize));
+        while(element == 0) {
+            if(++block == elements_.size()) {
+                return size_;
+            }
+            element = elements_[block];
+        }
+        return block * BlockSize + std::countr_zero(element);
+    }
+
+    // Call func(pos) for every set bit in ascending order
+    template <typename Func>
+    void for_each_set(Func && func) const {
+        for(std::size_t block = 0; block < elements_.size(); block++) {
+            for(ElementT element = elements_[block]; element != 0; element &= (element - 1)) {
+                func(block * BlockSize + std::countr_zero(element));
+            }
+        }
+    }
+
+    /**
+     * @brief Change the number of bits. New bits are zero, and when shrinking the tail bits
+     * of the last block are cleared so that find_next_set / count never see them.
+     */
+    void resize(std::size_t new_size) {
+        elements_.resize(num_blocks(new_size), ElementT(0));
+        size_ = new_size;
+        if((new_size % BlockSize) != 0) {
+            elements_.back() &= static_cast<ElementT>(bit(new_size) - 1);
+        }
+    }
 
-    void resize();
 private:
-    std::vector<ElementT> elements_;
+    std::vector<ElementT, WordAllocator> elements_;
+    std::size_t size_;
 };
 
-}
\ No newline at end of file
+}
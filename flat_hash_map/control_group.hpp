@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace hpds {
+
+/**
+ * @brief 1-byte control tag for SwissTable-style maps.
+ * 0b1000'0000 : empty slot
+ * 0b1111'1110 : deleted slot (tombstone)
+ * 0b0xxx'xxxx : full slot, the low 7 bits are H2 (7 bits of the hash of the key)
+ * Both special states have the sign bit set, so "is full" is just "ctrl >= 0".
+ */
+using ctrl_t = int8_t;
+
+constexpr static ctrl_t kCtrlEmpty = static_cast<ctrl_t>(0b1000'0000);
+constexpr static ctrl_t kCtrlDeleted = static_cast<ctrl_t>(0b1111'1110);
+
+inline bool is_full(ctrl_t ctrl) {
+    return ctrl >= 0;
+}
+
+/**
+ * @brief A group of control bytes which are examined together in one probe step.
+ * With AVX2 a group is 32 bytes, with SSE2 it is 16 bytes. Each "match" function returns
+ * a bitmask in which bit i is set iff control byte i satisfies the predicate, so the caller
+ * can walk the candidates with __builtin_ctz and "mask &= mask - 1".
+ */
+struct ControlGroup {
+#if defined(__AVX2__)
+    constexpr static std::size_t Width = 32;
+
+    explicit ControlGroup(const ctrl_t * pos)
+        : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos))) {}
+
+    uint32_t match(ctrl_t h2) const {
+        return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl)));
+    }
+
+    uint32_t match_empty() const {
+        return match(kCtrlEmpty);
+    }
+
+    uint32_t match_empty_or_deleted() const {
+        // kCtrlEmpty and kCtrlDeleted are the only values less than -1
+        return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-1), ctrl)));
+    }
+
+    uint32_t match_full() const {
+        // movemask collects the sign bits, which are clear for full slots
+        return ~static_cast<uint32_t>(_mm256_movemask_epi8(ctrl));
+    }
+
+    __m256i ctrl;
+#elif defined(__SSE2__)
+    constexpr static std::size_t Width = 16;
+
+    explicit ControlGroup(const ctrl_t * pos)
+        : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pos))) {}
+
+    uint32_t match(ctrl_t h2) const {
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)));
+    }
+
+    uint32_t match_empty() const {
+        return match(kCtrlEmpty);
+    }
+
+    uint32_t match_empty_or_deleted() const {
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl)));
+    }
+
+    uint32_t match_full() const {
+        return (~static_cast<uint32_t>(_mm_movemask_epi8(ctrl))) & 0xFFFF;
+    }
+
+    __m128i ctrl;
+#else
+    // Portable fallback, mainly for non-x86 builds
+    constexpr static std::size_t Width = 16;
+
+    explicit ControlGroup(const ctrl_t * pos) : ctrl(pos) {}
+
+    template <typename Pred>
+    uint32_t match_if(Pred && pred) const {
+        uint32_t mask = 0;
+        for(std::size_t i = 0; i < Width; i++) {
+            mask |= (static_cast<uint32_t>(pred(ctrl[i])) << i);
+        }
+        return mask;
+    }
+
+    uint32_t match(ctrl_t h2) const {
+        return match_if([h2](ctrl_t c) { return c == h2; });
+    }
+
+    uint32_t match_empty() const {
+        return match(kCtrlEmpty);
+    }
+
+    uint32_t match_empty_or_deleted() const {
+        return match_if([](ctrl_t c) { return c < -1; });
+    }
+
+    uint32_t match_full() const {
+        return match_if([](ctrl_t c) { return c >= 0; });
+    }
+
+    const ctrl_t * ctrl;
+#endif
+};
+
+}
@@ -0,0 +1,495 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <optional>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "hash_policy.hpp"
+#include "slot_layout.hpp"
+#include "flat_hash_set.hpp"
+
+namespace hpds {
+
+/**
+ * @brief The keys of a bucket of CuckooFlatHashMap: one cache line, so Ways = 8 keys of 8 bytes or 16 of 4 bytes.
+ * match(key) returns a bitmask in which bit i is set iff keys[i] == key, compared all at once
+ * with two AVX2 compares (a portable loop otherwise, which compilers vectorize as well as they can).
+ */
+template <typename K>
+struct alignas(64) CuckooBucket {
+    constexpr static std::size_t Ways = 64 / sizeof(K);
+
+    uint32_t match(K key) const {
+#if defined(__AVX2__)
+        const __m256i lo = _mm256_load_si256(reinterpret_cast<const __m256i *>(keys));
+        const __m256i hi = _mm256_load_si256(reinterpret_cast<const __m256i *>(keys) + 1);
+        if constexpr (sizeof(K) == 8) {
+            const __m256i needle = _mm256_set1_epi64x(static_cast<int64_t>(key));
+            return static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(lo, needle))))
+                   | (static_cast<uint32_t>(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(hi, needle)))) << 4);
+        } else {
+            const __m256i needle = _mm256_set1_epi32(static_cast<int32_t>(key));
+            return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(lo, needle))))
+                   | (static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(hi, needle)))) << 8);
+        }
+#else
+        uint32_t mask = 0;
+        for(std::size_t i = 0; i < Ways; i++) {
+            mask |= static_cast<uint32_t>(keys[i] == key) << i;
+        }
+        return mask;
+#endif
+    }
+
+    K keys[Ways];
+};
+
+/**
+ * @brief Bucketized cuckoo hashing for integer keys of 4 or 8 bytes: a key lives in one of its 2 buckets,
+ * and a bucket is one cache line of keys (see CuckooBucket). So a lookup, hit or miss, reads at most
+ * 2 cache lines of keys, plus the value on a hit, whatever the load and the key set. There are no probe
+ * sequences and no clusters, which bounds the worst case of the latency-sensitive lookups.
+ *
+ * Like SentinelFlatHashMap, empty slots hold the sentinel key (SentinelKeyTraits) and the sentinel itself
+ * is stored out of line, so a bucket is nothing but keys. Values live in a parallel array.
+ * Keys are compared bitwise by SIMD, hence no KeyEqual parameter.
+ *
+ * An insert into 2 full buckets searches, breadth-first, for the shortest chain of keys which can each
+ * move to their other bucket and end on an empty slot (at most MaxPathNodes buckets visited), then moves
+ * them from the end of the chain. With 8 or 16 ways a table fills up to about 95% before the search
+ * fails; the map grows at max_load_factor (0.9), or when the search fails anyway.
+ * More than 2 * Ways keys with the same Hash value cannot fit in any table: the insert throws
+ * std::length_error once growing stops helping, and leaves the map as it was.
+ */
+template <typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+class CuckooFlatHashMap {
+    using BucketT = CuckooBucket<K>;
+
+public:
+    constexpr static K EmptyKey = SentinelKeyTraits<K>::empty_key();
+    constexpr static std::size_t Ways = BucketT::Ways;
+
+    using IteratorT = SplitIterator<K, V>;
+
+    CuckooFlatHashMap() : CuckooFlatHashMap(Allocator()) {}
+    explicit CuckooFlatHashMap(const Allocator & alloc)
+        : buckets_(std::max<std::size_t>(2, InitCapacity / Ways), empty_bucket(), BucketAllocator(alloc)),
+          values_(buckets_.size() * Ways, ValueAllocator(alloc)) {}
+    CuckooFlatHashMap(const CuckooFlatHashMap & other) = default;
+    // The source is left as an empty map of InitCapacity slots, which is why moving allocates
+    CuckooFlatHashMap(CuckooFlatHashMap && other) : CuckooFlatHashMap(other.get_allocator()) {
+        std::swap(buckets_, other.buckets_);
+        std::swap(values_, other.values_);
+        std::swap(size_, other.size_);
+        std::swap(max_load_factor_, other.max_load_factor_);
+        std::swap(empty_key_slot_, other.empty_key_slot_);
+    }
+    CuckooFlatHashMap & operator=(const CuckooFlatHashMap & other) {
+        if(this != &other) {
+            *this = CuckooFlatHashMap(other);
+        }
+        return *this;
+    }
+    CuckooFlatHashMap & operator=(CuckooFlatHashMap && other) {
+        if(this != &other) {
+            // The vectors take care of the allocators
+            CuckooFlatHashMap moved(std::move(other));
+            buckets_ = std::move(moved.buckets_);
+            values_ = std::move(moved.values_);
+            size_ = moved.size_;
+            max_load_factor_ = moved.max_load_factor_;
+            empty_key_slot_ = std::move(moved.empty_key_slot_);
+        }
+        return *this;
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(buckets_.get_allocator());
+    }
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+    std::size_t size() const noexcept {
+        return size_;
+    }
+    std::size_t capacity() const noexcept {
+        return buckets_.size() * Ways;
+    }
+    float load_factor() const noexcept {
+        return (size_ * 1.0f) / capacity();
+    }
+    void set_max_load_factor(float max_load_factor) {
+        max_load_factor_ = max_load_factor;
+    }
+
+    IteratorT find(K key);
+    IteratorT end() const {
+        return IteratorT(nullptr, nullptr);
+    }
+    bool contains(K key) {
+        return find(key) != end();
+    }
+    const V & at(K key) const;
+    V & operator[](K key) {
+        return (*try_emplace(key).first).second;
+    }
+
+    // Return the element of "key" if it exists, otherwise insert V(args...)
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(K key, Args && ... args);
+    std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair) {
+        return try_emplace(pair.first, pair.second);
+    }
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair) {
+        return try_emplace(pair.first, std::move(pair.second));
+    }
+
+    std::size_t erase(K key);
+    void clear();
+    // Make room for "n" elements, so that inserting up to "n" elements does not rehash
+    void reserve(std::size_t n);
+
+    // For debug only. Number of elements in their first bucket ([0]) and in their second one ([1])
+    std::vector<std::size_t> probe_histogram() const;
+
+    // Call func(key, value) for every element, in slot order and then the sentinel key if it is present
+    template <typename Func>
+    void for_each(Func && func) {
+        for(std::size_t bucket = 0; bucket < buckets_.size(); bucket++) {
+            for(std::size_t way = 0; way < Ways; way++) {
+                if(buckets_[bucket].keys[way] != EmptyKey) {
+                    func(buckets_[bucket].keys[way], values_[bucket * Ways + way]);
+                }
+            }
+        }
+        if(empty_key_slot_) {
+            func(empty_key_slot_->first, empty_key_slot_->second);
+        }
+    }
+
+private:
+    using BucketAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<BucketT>;
+    using ValueAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<V>;
+    using BucketsT = std::vector<BucketT, BucketAllocator>;
+    using ValuesT = std::vector<V, ValueAllocator>;
+
+    // Buckets visited by the search of a free slot before giving up and growing
+    constexpr static std::size_t MaxPathNodes = 256;
+
+    // A bucket of the breadth-first search, reached by moving keys[slot] of its parent bucket into it
+    struct PathNode {
+        std::size_t bucket;
+        std::size_t parent;
+        uint32_t slot;
+    };
+    constexpr static std::size_t NoParent = static_cast<std::size_t>(-1);
+
+    static BucketT empty_bucket() {
+        BucketT bucket;
+        std::fill(std::begin(bucket.keys), std::end(bucket.keys), EmptyKey);
+        return bucket;
+    }
+    // The 2 buckets of a key: from the low and the high half of its hash, and never the same one
+    static std::pair<std::size_t, std::size_t> buckets_of(K key, std::size_t num_buckets) {
+        const std::size_t hash = mix_hash(Hash()(key));
+        const std::size_t first = hash & (num_buckets - 1);
+        std::size_t second = (hash >> 32) & (num_buckets - 1);
+        if(second == first) {
+            second ^= 1;
+        }
+        return {first, second};
+    }
+    static std::size_t other_bucket(K key, std::size_t bucket, std::size_t num_buckets) {
+        auto [first, second] = buckets_of(key, num_buckets);
+        return (bucket == first) ? second : first;
+    }
+    IteratorT iterator_at(std::size_t pos) {
+        return IteratorT(&buckets_[pos / Ways].keys[pos % Ways], &values_[pos]);
+    }
+    // Slot of "key" (not the sentinel), capacity() if it is not found
+    std::size_t find_index(K key) const;
+    // Make a slot of "first" or "second" empty, moving keys along a cuckoo path if needed.
+    // Returns the slot, or capacity() if no path was found
+    std::size_t free_slot(BucketsT & buckets, ValuesT & values, std::size_t first, std::size_t second) const;
+    void rehash_to(std::size_t new_capacity);
+    // Called when no path was found at "capacity": below 1 / 64 load, growing more will not help
+    void check_growth(std::size_t capacity) const {
+        if(capacity / 64 > size_ + Ways) {
+            throw std::length_error("[CuckooFlatHashMap] too many keys share their 2 buckets, the hash function is too weak");
+        }
+    }
+
+    BucketsT buckets_;
+    ValuesT values_;
+    std::size_t size_{0};
+    float max_load_factor_{0.9};
+    std::optional<std::pair<K, V>> empty_key_slot_;
+};
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+std::size_t CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::find_index(K key) const {
+    auto [first, second] = buckets_of(key, buckets_.size());
+    // Both lines are independent, so fetch the second one while the first one is compared
+    __builtin_prefetch(&buckets_[second]);
+    if(uint32_t mask = buckets_[first].match(key); mask != 0) {
+        return first * Ways + __builtin_ctz(mask);
+    }
+    if(uint32_t mask = buckets_[second].match(key); mask != 0) {
+        return second * Ways + __builtin_ctz(mask);
+    }
+    return capacity();
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+auto CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::find(K key) -> IteratorT {
+    if(key == EmptyKey) {
+        return empty_key_slot_ ? IteratorT(&empty_key_slot_->first, &empty_key_slot_->second) : end();
+    }
+    std::size_t pos = find_index(key);
+    return (pos == capacity()) ? end() : iterator_at(pos);
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+const V & CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::at(K key) const {
+    if(key == EmptyKey) {
+        if(!empty_key_slot_) {
+            throw std::out_of_range("[CuckooFlatHashMap::at] key is not found");
+        }
+        return empty_key_slot_->second;
+    }
+    std::size_t pos = find_index(key);
+    if(pos == capacity()) {
+        throw std::out_of_range("[CuckooFlatHashMap::at] key is not found");
+    }
+    return values_[pos];
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+std::size_t CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::free_slot(BucketsT & buckets, ValuesT & values,
+                                                                              std::size_t first, std::size_t second) const {
+    const std::size_t num_buckets = buckets.size();
+    // Most inserts find room in one of the 2 buckets, without a search
+    for(std::size_t bucket : {first, second}) {
+        if(uint32_t empty_mask = buckets[bucket].match(EmptyKey); empty_mask != 0) {
+            return bucket * Ways + __builtin_ctz(empty_mask);
+        }
+    }
+    std::vector<PathNode> nodes;
+    nodes.reserve(MaxPathNodes + Ways);
+    nodes.push_back({first, NoParent, 0});
+    nodes.push_back({second, NoParent, 0});
+    for(std::size_t i = 0; i < nodes.size(); i++) {
+        const BucketT & bucket = buckets[nodes[i].bucket];
+        if(uint32_t empty_mask = bucket.match(EmptyKey); empty_mask != 0) {
+            // Walk back to the root, moving every key of the path into the hole left by the next one
+            std::size_t hole = nodes[i].bucket * Ways + __builtin_ctz(empty_mask);
+            for(std::size_t node = i; nodes[node].parent != NoParent; node = nodes[node].parent) {
+                const std::size_t from = nodes[nodes[node].parent].bucket * Ways + nodes[node].slot;
+                buckets[hole / Ways].keys[hole % Ways] = buckets[from / Ways].keys[from % Ways];
+                values[hole] = std::move(values[from]);
+                buckets[from / Ways].keys[from % Ways] = EmptyKey;
+                hole = from;
+            }
+            return hole;
+        }
+        if(nodes.size() >= MaxPathNodes) {
+            continue;
+        }
+        for(uint32_t slot = 0; slot < Ways; slot++) {
+            const std::size_t next = other_bucket(bucket.keys[slot], nodes[i].bucket, num_buckets);
+            // A bucket already on the path would move a key twice
+            bool on_path = false;
+            for(std::size_t node = i; node != NoParent && !on_path; node = nodes[node].parent) {
+                on_path = (nodes[node].bucket == next);
+            }
+            if(!on_path) {
+                nodes.push_back({next, i, slot});
+            }
+        }
+    }
+    return num_buckets * Ways;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+template <typename ... Args>
+auto CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::try_emplace(K key, Args && ... args) -> std::pair<IteratorT, bool> {
+    if(key == EmptyKey) {
+        if(empty_key_slot_) {
+            return {IteratorT(&empty_key_slot_->first, &empty_key_slot_->second), false};
+        }
+        empty_key_slot_.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                                std::forward_as_tuple(std::forward<Args>(args)...));
+        size_++;
+        return {IteratorT(&empty_key_slot_->first, &empty_key_slot_->second), true};
+    }
+    std::size_t pos = find_index(key);
+    if(pos != capacity()) {
+        return {iterator_at(pos), false};
+    }
+    if((size_ + 1) > capacity() * max_load_factor_) {
+        rehash_to(capacity() * 2);
+    }
+    for(;;) {
+        auto [first, second] = buckets_of(key, buckets_.size());
+        pos = free_slot(buckets_, values_, first, second);
+        if(pos != capacity()) {
+            break;
+        }
+        check_growth(capacity());
+        rehash_to(capacity() * 2);
+    }
+    values_[pos] = V(std::forward<Args>(args)...);
+    buckets_[pos / Ways].keys[pos % Ways] = key;
+    size_++;
+    return {iterator_at(pos), true};
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+std::size_t CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::erase(K key) {
+    if(key == EmptyKey) {
+        if(!empty_key_slot_) {
+            return 0;
+        }
+        empty_key_slot_.reset();
+        size_--;
+        return 1;
+    }
+    std::size_t pos = find_index(key);
+    if(pos == capacity()) {
+        return 0;
+    }
+    // No probe sequence goes through a slot, so it is simply emptied
+    buckets_[pos / Ways].keys[pos % Ways] = EmptyKey;
+    values_[pos] = V();
+    size_--;
+    return 1;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+void CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::rehash_to(std::size_t new_capacity) {
+    for(;; new_capacity *= 2) {
+        const std::size_t num_buckets = new_capacity / Ways;
+        BucketsT new_buckets(num_buckets, empty_bucket(), buckets_.get_allocator());
+        ValuesT new_values(new_capacity, values_.get_allocator());
+        std::size_t moved = 0;
+        for(; moved < capacity(); moved++) {
+            const K key = buckets_[moved / Ways].keys[moved % Ways];
+            if(key == EmptyKey) {
+                continue;
+            }
+            auto [first, second] = buckets_of(key, num_buckets);
+            std::size_t pos = free_slot(new_buckets, new_values, first, second);
+            if(pos == new_capacity) {
+                break;
+            }
+            new_values[pos] = std::move(values_[moved]);
+            new_buckets[pos / Ways].keys[pos % Ways] = key;
+        }
+        if(moved == capacity()) {
+            buckets_ = std::move(new_buckets);
+            values_ = std::move(new_values);
+            return;
+        }
+        // Very unlikely at half the load: move the values back and try twice as big
+        for(std::size_t pos = 0; pos < moved; pos++) {
+            const K key = buckets_[pos / Ways].keys[pos % Ways];
+            if(key == EmptyKey) {
+                continue;
+            }
+            auto [first, second] = buckets_of(key, num_buckets);
+            uint32_t mask = new_buckets[first].match(key);
+            std::size_t new_pos = (mask != 0) ? (first * Ways + __builtin_ctz(mask))
+                                              : (second * Ways + __builtin_ctz(new_buckets[second].match(key)));
+            values_[pos] = std::move(new_values[new_pos]);
+        }
+        check_growth(new_capacity);
+    }
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+void CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::reserve(std::size_t n) {
+    std::size_t new_capacity = capacity();
+    while(n > new_capacity * max_load_factor_) {
+        new_capacity *= 2;
+    }
+    if(new_capacity != capacity()) {
+        rehash_to(new_capacity);
+    }
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+void CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::clear() {
+    buckets_ = BucketsT(std::max<std::size_t>(2, InitCapacity / Ways), empty_bucket(), buckets_.get_allocator());
+    values_ = ValuesT(buckets_.size() * Ways, values_.get_allocator());
+    size_ = 0;
+    empty_key_slot_.reset();
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename Allocator>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K> && (sizeof(K) == 4 || sizeof(K) == 8)
+std::vector<std::size_t> CuckooFlatHashMap<K, V, InitCapacity, Hash, Allocator>::probe_histogram() const {
+    std::vector<std::size_t> histogram(2, 0);
+    for(std::size_t bucket = 0; bucket < buckets_.size(); bucket++) {
+        for(std::size_t way = 0; way < Ways; way++) {
+            const K key = buckets_[bucket].keys[way];
+            if(key != EmptyKey) {
+                histogram[(buckets_of(key, buckets_.size()).first == bucket) ? 0 : 1]++;
+            }
+        }
+    }
+    return histogram;
+}
+
+}
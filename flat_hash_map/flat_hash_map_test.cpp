@@ -2,15 +2,40 @@
 #include <unordered_map>
 #include <random>
 #include <string>
+#include <string_view>
+#include <set>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <optional>
+#include <numeric>
+#include <memory_resource>
+#include <filesystem>
+#include <cstdio>
+#include <chrono>
 #include "flat_hash_map_v0.hpp"
 #include "flat_hash_map_v1.hpp"
 #include "flat_hash_map_v2.hpp"
+#include "flat_hash_map_v3.hpp"
+#include "flat_hash_map_v4.hpp"
+#include "sharded_flat_hash_map.hpp"
+#include "flat_hash_set.hpp"
+#include "frozen_flat_hash_map.hpp"
+#include "static_hash_map.hpp"
+#include "cuckoo_flat_hash_map.hpp"
+#include "node_flat_hash_map.hpp"
+#include "bitmap.hpp"
+#include "arena_allocator.hpp"
+#include "hugepage_allocator.hpp"
 
 using namespace hpds;
 
 // #define DEBUG_FHM_TEST
 
+// The version under test can be chosen at build time, e.g. -DChosenFlatHashMap=FlatHashMapV3
+#ifndef ChosenFlatHashMap
 #define ChosenFlatHashMap FlatHashMapV1c
+#endif
 
 // Basic functionality tests
 TEST(FlatHashMapTest, BasicOperations) {
@@ -87,6 +112,45 @@ TEST(FlatHashMapTest, DuplicateInsertion) {
     EXPECT_EQ(it2->second, "one");  // Value should remain unchanged
 }
 
+// Default-constructible, as the V0-V2 slots need, and counts its copies
+struct CopyCountingSlotValue {
+    static inline int copies = 0;
+    int value = 0;
+    CopyCountingSlotValue() = default;
+    explicit CopyCountingSlotValue(int v) : value(v) {}
+    CopyCountingSlotValue(const CopyCountingSlotValue & other) : value(other.value) {
+        ++copies;
+    }
+    CopyCountingSlotValue(CopyCountingSlotValue &&) noexcept = default;
+    CopyCountingSlotValue & operator=(const CopyCountingSlotValue & other) {
+        value = other.value;
+        ++copies;
+        return *this;
+    }
+    CopyCountingSlotValue & operator=(CopyCountingSlotValue &&) noexcept = default;
+};
+
+// insert(const value_type &) copies the value once when it inserts, and not at all when the key is there
+template <typename MapT>
+void check_insert_copies() {
+    MapT map;
+    const std::pair<const int, CopyCountingSlotValue> pair{1, CopyCountingSlotValue(1)};
+    CopyCountingSlotValue::copies = 0;
+    EXPECT_TRUE(map.insert(pair).second);
+    EXPECT_EQ(CopyCountingSlotValue::copies, 1);
+    EXPECT_FALSE(map.insert(pair).second);
+    EXPECT_EQ(CopyCountingSlotValue::copies, 1);
+    EXPECT_TRUE(map.insert({2, CopyCountingSlotValue(2)}).second);
+    EXPECT_EQ(CopyCountingSlotValue::copies, 1);
+    EXPECT_EQ(map.at(1).value, 1);
+}
+
+TEST(FlatHashMapTest, InsertCopiesOnlyOnInsertion) {
+    check_insert_copies<FlatHashMapV0<int, CopyCountingSlotValue>>();
+    check_insert_copies<FlatHashMapV1c<int, CopyCountingSlotValue>>();
+    check_insert_copies<FlatHashMapV2c<int, CopyCountingSlotValue>>();
+}
+
 TEST(FlatHashMapTest, IteratorBehavior) {
     ChosenFlatHashMap<int, std::string> map;
     map[1] = "one";
@@ -287,6 +351,1630 @@ TEST(FlatHashMapTest, RandomFuzzAgainstUnorderedMap) {
     }
 }
 
+// Repeatedly fill and drain the map so that erased slots get reused
+TEST(FlatHashMapTest, EraseReinsertChurn) {
+    ChosenFlatHashMap<int, int, 64> map;
+    std::unordered_map<int, int> std_map;
+    map.set_max_load_factor(0.9);
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> key_dist(0, 5000);
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 2000; ++i) {
+            int key = key_dist(rng);
+            map[key] = round;
+            std_map[key] = round;
+        }
+        for (int i = 0; i < 2000; ++i) {
+            int key = key_dist(rng);
+            EXPECT_EQ(map.erase(key), std_map.erase(key));
+        }
+        ASSERT_EQ(map.size(), std_map.size());
+        for (const auto& [key, value] : std_map) {
+            auto it = map.find(key);
+            ASSERT_NE(it, map.end());
+            EXPECT_EQ(it->second, value);
+        }
+    }
+}
+
+TEST(BitmapTest, BasicOperations) {
+    Bitmap<200> bitmap;
+    EXPECT_EQ(bitmap.size(), 200);
+    EXPECT_EQ(bitmap.count(), 0);
+    EXPECT_EQ(bitmap.find_next_set(0), 200);
+
+    for (std::size_t pos : {0, 63, 64, 130, 199}) {
+        bitmap.set(pos);
+    }
+    EXPECT_TRUE(bitmap.test(63));
+    EXPECT_FALSE(bitmap.test(62));
+    EXPECT_EQ(bitmap.count(), 5);
+    EXPECT_EQ(bitmap.find_next_set(0), 0);
+    EXPECT_EQ(bitmap.find_next_set(1), 63);
+    EXPECT_EQ(bitmap.find_next_set(65), 130);
+    EXPECT_EQ(bitmap.find_next_set(131), 199);
+
+    bitmap.reset(130);
+    EXPECT_EQ(bitmap.find_next_set(65), 199);
+
+    std::vector<std::size_t> positions;
+    bitmap.for_each_set([&](std::size_t pos) { positions.push_back(pos); });
+    EXPECT_EQ(positions, (std::vector<std::size_t>{0, 63, 64, 199}));
+
+    // Shrinking drops the tail bits, growing adds zero bits
+    bitmap.resize(100);
+    EXPECT_EQ(bitmap.count(), 3);
+    bitmap.resize(400);
+    EXPECT_EQ(bitmap.count(), 3);
+    EXPECT_EQ(bitmap.find_next_set(65), 400);
+
+    bitmap.clear();
+    EXPECT_EQ(bitmap.count(), 0);
+}
+
+TEST(BitmapTest, SmallBlocks) {
+    Bitmap<40, 8> bitmap;
+    bitmap.set(3);
+    bitmap.set(17);
+    EXPECT_EQ(bitmap.count(), 2);
+    EXPECT_EQ(bitmap.find_next_set(4), 17);
+    EXPECT_EQ(bitmap.find_next_set(18), 40);
+}
+
+// V2 keeps an occupancy bitmap, which drives full-table iteration
+TEST(FlatHashMapV2Test, IterationAndClear) {
+    FlatHashMapV2c<int, int> map;
+    std::unordered_map<int, int> std_map;
+    for (int i = 0; i < 5000; ++i) {
+        map[i * 7] = i;
+        std_map[i * 7] = i;
+    }
+    for (int i = 0; i < 5000; i += 3) {
+        map.erase(i * 7);
+        std_map.erase(i * 7);
+    }
+
+    std::size_t visited = 0;
+    for (auto it = map.begin(); it != map.end(); ++it) {
+        ASSERT_EQ(std_map.count(it->first), 1);
+        EXPECT_EQ(std_map[it->first], it->second);
+        ++visited;
+    }
+    EXPECT_EQ(visited, std_map.size());
+
+    EXPECT_GT(map.get_capacity(), 256u);
+    map.clear();
+    EXPECT_EQ(map.begin(), map.end());
+    EXPECT_EQ(map.get_capacity(), 256u);
+    EXPECT_EQ(map.find(14), map.end());
+    map[14] = 1;
+    EXPECT_EQ(map.at(14), 1);
+}
+
+// With a constant hash every key has a longer probe distance than the previous one,
+// so a uint8_t distance field must eventually give up instead of growing forever
+TEST(FlatHashMapV4Test, ProbeDistanceOverflow) {
+    struct ConstantHash {
+        size_t operator()(int) const {
+            return 42;
+        }
+    };
+
+    FlatHashMapV4a<int, int, 256, ConstantHash> map;
+    int inserted = 0;
+    EXPECT_THROW({
+        for (; inserted < 1000; ++inserted) {
+            map[inserted] = inserted;
+        }
+    }, std::overflow_error);
+    EXPECT_GT(inserted, 200);
+
+    // The map stays consistent after the failed insertion
+    EXPECT_EQ(map.size(), static_cast<std::size_t>(inserted));
+    for (int i = 0; i < inserted; ++i) {
+        EXPECT_EQ(map.at(i), i);
+    }
+    EXPECT_EQ(map.find(inserted), map.end());
+}
+
+// Fails every allocation bigger than *max_bytes, to make a rehash run out of memory
+template <typename T>
+struct LimitedAllocator {
+    using value_type = T;
+
+    explicit LimitedAllocator(std::size_t * max_bytes) : max_bytes_(max_bytes) {}
+    template <typename U>
+    LimitedAllocator(const LimitedAllocator<U> & other) : max_bytes_(other.max_bytes_) {}
+
+    T * allocate(std::size_t n) {
+        if (n * sizeof(T) > *max_bytes_) {
+            throw std::bad_alloc();
+        }
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T * ptr, std::size_t n) {
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    std::size_t * max_bytes_;
+};
+
+template <typename T, typename U>
+bool operator==(const LimitedAllocator<T> & lhs, const LimitedAllocator<U> & rhs) {
+    return lhs.max_bytes_ == rhs.max_bytes_;
+}
+
+// The insertion which starts the rehash fails, and the map still holds everything at its old capacity
+template <typename MapT>
+void check_failed_rehash(MapT & map, int inserted, std::size_t capacity) {
+    EXPECT_EQ(map.size(), static_cast<std::size_t>(inserted));
+    EXPECT_EQ(map.capacity(), capacity);
+    for (int i = 0; i < inserted; ++i) {
+        ASSERT_NE(map.find(i), map.end());
+        EXPECT_TRUE(map.find(i)->second == i);
+    }
+    EXPECT_EQ(map.find(inserted), map.end());
+}
+
+TEST(FlatHashMapV4Test, RehashAllocationFailure) {
+    std::size_t max_bytes = std::numeric_limits<std::size_t>::max();
+    using Alloc = LimitedAllocator<std::pair<const int, int>>;
+    FlatHashMapV4a<int, int, 256, std::hash<int>, std::equal_to<int>, Alloc> map{Alloc(&max_bytes)};
+    int inserted = 0;
+    for (; map.size() < 1000 || map.load_factor() <= 0.9f; ++inserted) {
+        map[inserted] = inserted;
+    }
+    std::size_t capacity = map.capacity();
+
+    max_bytes = 0;
+    EXPECT_THROW(map[inserted] = inserted, std::bad_alloc);
+    check_failed_rehash(map, inserted, capacity);
+
+    max_bytes = std::numeric_limits<std::size_t>::max();
+    map[inserted] = inserted;
+    EXPECT_EQ(map.capacity(), capacity * 2);
+    EXPECT_EQ(map.at(inserted), inserted);
+}
+
+// V3 allocates the control bytes, then the slots: fail either one
+TEST(FlatHashMapV3Test, RehashAllocationFailure) {
+    using Alloc = LimitedAllocator<std::pair<const int, int>>;
+    for (bool fail_slots : {false, true}) {
+        std::size_t max_bytes = std::numeric_limits<std::size_t>::max();
+        FlatHashMapV3<int, int, 256, std::hash<int>, std::equal_to<int>, Alloc> map{Alloc(&max_bytes)};
+        int inserted = 0;
+        for (; inserted < 1000; ++inserted) {
+            map[inserted] = inserted;
+        }
+        std::size_t capacity = map.capacity();
+
+        // The control bytes of the doubled table fit, its slots do not
+        max_bytes = fail_slots ? capacity * 2 : 0;
+        bool threw = false;
+        for (; !threw && inserted < 100000; ++inserted) {
+            try {
+                map[inserted] = inserted;
+            } catch (const std::bad_alloc &) {
+                threw = true;
+                --inserted;
+            }
+        }
+        ASSERT_TRUE(threw);
+        check_failed_rehash(map, inserted, capacity);
+
+        max_bytes = std::numeric_limits<std::size_t>::max();
+        map[inserted] = inserted;
+        EXPECT_EQ(map.capacity(), capacity * 2);
+        EXPECT_EQ(map.at(inserted), inserted);
+    }
+}
+
+// Its move constructor may throw, so a rehash copies it, and copying throws when "countdown" reaches 0
+struct ThrowingCopy {
+    static inline int countdown = -1;
+
+    explicit ThrowingCopy(int v) : value(v) {}
+    ThrowingCopy(const ThrowingCopy & other) : value(other.value) {
+        tick();
+    }
+    ThrowingCopy(ThrowingCopy && other) noexcept(false) : value(other.value) {
+        tick();
+    }
+    ThrowingCopy & operator=(const ThrowingCopy &) = default;
+    ThrowingCopy & operator=(ThrowingCopy &&) = default;
+
+    static void tick() {
+        if (countdown >= 0 && countdown-- == 0) {
+            throw std::runtime_error("copy failed");
+        }
+    }
+
+    bool operator==(int v) const {
+        return value == v;
+    }
+
+    int value;
+};
+
+TEST(FlatHashMapV4Test, RehashThrowingCopy) {
+    FlatHashMapV4a<int, ThrowingCopy> map;
+    int inserted = 0;
+    for (; map.size() < 1000 || map.load_factor() <= 0.9f; ++inserted) {
+        map.try_emplace(inserted, inserted);
+    }
+    std::size_t capacity = map.capacity();
+
+    ThrowingCopy::countdown = 500;
+    EXPECT_THROW(map.try_emplace(inserted, inserted), std::runtime_error);
+    ThrowingCopy::countdown = -1;
+    check_failed_rehash(map, inserted, capacity);
+
+    map.try_emplace(inserted, inserted);
+    EXPECT_EQ(map.capacity(), capacity * 2);
+    EXPECT_TRUE(map.at(inserted) == inserted);
+}
+
+// Counts how many times a key is hashed, and accepts std::string_view without building a std::string
+struct CountingStringHash {
+    using is_transparent = void;
+    static inline int calls = 0;
+
+    std::size_t operator()(std::string_view key) const {
+        ++calls;
+        return std::hash<std::string_view>()(key);
+    }
+};
+
+template <typename MapT>
+void check_heterogeneous_lookup() {
+    MapT map;
+    map["apple"] = 1;
+    map.insert({"banana", 2});
+
+    std::string_view wire = "apple";
+    auto it = map.find(wire);
+    ASSERT_NE(it, map.end());
+    EXPECT_EQ(it->second, 1);
+    EXPECT_EQ(map.at(std::string_view("banana")), 2);
+    EXPECT_EQ(map.find(std::string_view("cherry")), map.end());
+
+    // A precomputed hash is used as is
+    std::size_t hash = TransparentStringHash()(wire);
+    EXPECT_EQ(map.find(wire, hash), it);
+    EXPECT_EQ(map.find(std::string("apple"), hash), it);
+
+    // try_emplace probes once and does not overwrite
+    auto [it2, inserted2] = map.try_emplace(std::string_view("cherry"), 3);
+    EXPECT_TRUE(inserted2);
+    EXPECT_EQ(it2->first, "cherry");
+    auto [it3, inserted3] = map.try_emplace(std::string_view("cherry"), 4);
+    EXPECT_FALSE(inserted3);
+    EXPECT_EQ(it3->second, 3);
+
+    EXPECT_EQ(map.erase(std::string_view("apple")), 1);
+    EXPECT_EQ(map.size(), 2);
+}
+
+TEST(FlatHashMapV3Test, HeterogeneousLookup) {
+    check_heterogeneous_lookup<FlatHashMapV3<std::string, int, 16, TransparentStringHash, std::equal_to<>>>();
+}
+
+TEST(FlatHashMapV4Test, HeterogeneousLookup) {
+    check_heterogeneous_lookup<FlatHashMapV4b<std::string, int, 16, TransparentStringHash, std::equal_to<>>>();
+}
+
+TEST(FlatHashMapV3Test, HashOncePerOperation) {
+    FlatHashMapV3<std::string, int, 1024, CountingStringHash, std::equal_to<>> map;
+    CountingStringHash::calls = 0;
+    map[std::string_view("key")] = 1;
+    EXPECT_EQ(CountingStringHash::calls, 1);
+    map[std::string_view("key")] += 1;
+    EXPECT_EQ(CountingStringHash::calls, 2);
+    map.try_emplace(std::string_view("key"), 5);
+    EXPECT_EQ(CountingStringHash::calls, 3);
+    EXPECT_EQ(map.at(std::string_view("key")), 2);
+}
+
+template <typename MapT>
+void check_find_batch() {
+    MapT map;
+    std::vector<int> keys;
+    for (int i = 0; i < 20000; ++i) {
+        map[i * 3] = i;
+    }
+    // Every third key hits, the others miss
+    for (int i = 0; i < 30011; ++i) {
+        keys.push_back(i);
+    }
+    std::vector<typename MapT::IteratorT> out(keys.size());
+    map.find_batch(keys, out);
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        EXPECT_EQ(out[i], map.find(keys[i])) << "Mismatch for key " << keys[i];
+    }
+}
+
+TEST(FlatHashMapV3Test, FindBatch) {
+    check_find_batch<FlatHashMapV3<int, int>>();
+}
+
+TEST(FlatHashMapV4Test, FindBatch) {
+    check_find_batch<FlatHashMapV4b<int, int>>();
+}
+
+// A copy does not share anything with its source, and a moved-from map is an empty map which still works
+template <typename MapT>
+void check_copy_and_move() {
+    MapT a;
+    for (int i = 0; i < 1000; ++i) {
+        a[i] = std::to_string(i);
+    }
+    MapT b;
+    b[-1] = "-1";
+    b = a;
+    EXPECT_EQ(b.size(), 1000u);
+    EXPECT_EQ(b.find(-1), b.end());
+    b[0] = "zero";
+    EXPECT_EQ(a.at(0), "0");
+
+    MapT c(std::move(a));
+    EXPECT_EQ(c.size(), 1000u);
+    EXPECT_EQ(c.at(999), "999");
+    EXPECT_TRUE(a.empty());
+    EXPECT_EQ(a.find(3), a.end());
+    a[3] = "3";
+    EXPECT_EQ(a.at(3), "3");
+
+    MapT d;
+    d[-7] = "-7";
+    d = std::move(c);
+    EXPECT_EQ(d.size(), 1000u);
+    EXPECT_EQ(d.find(-7), d.end());
+    EXPECT_EQ(d.at(500), "500");
+    EXPECT_TRUE(c.empty());
+    EXPECT_EQ(c.find(999), c.end());
+    for (int i = 0; i < 1000; ++i) {
+        c[i] = "again";
+    }
+    EXPECT_EQ(c.size(), 1000u);
+}
+
+TEST(FlatHashMapV3Test, CopyAndMove) {
+    check_copy_and_move<FlatHashMapV3<int, std::string>>();
+}
+
+TEST(FlatHashMapV4Test, CopyAndMove) {
+    check_copy_and_move<FlatHashMapV4a<int, std::string>>();
+    check_copy_and_move<FlatHashMapV4b<int, std::string>>();
+}
+
+TEST(FlatHashMapV3Test, MoveAssignBetweenResources) {
+    // polymorphic_allocator does not propagate, so the pairs are copied into the resource of the target
+    std::pmr::monotonic_buffer_resource resource_a;
+    std::pmr::monotonic_buffer_resource resource_b;
+    hpds::pmr::FlatHashMapV3<int, int> a{&resource_a};
+    hpds::pmr::FlatHashMapV3<int, int> b{&resource_b};
+    for (int i = 0; i < 1000; ++i) {
+        a[i] = i;
+    }
+    b = std::move(a);
+    EXPECT_EQ(b.get_allocator().resource(), &resource_b);
+    EXPECT_EQ(b.size(), 1000u);
+    EXPECT_EQ(b.at(999), 999);
+    EXPECT_TRUE(a.empty());
+    EXPECT_EQ(a.find(1), a.end());
+    a[1] = 1;
+    EXPECT_EQ(a.get_allocator().resource(), &resource_a);
+}
+
+TEST(IndexPolicyTest, RangeAndSpread) {
+    for (std::size_t capacity = 1; capacity <= (std::size_t(1) << 20); capacity <<= 1) {
+        for (std::size_t hash : {std::size_t(0), std::size_t(1), std::size_t(12345), ~std::size_t(0)}) {
+            EXPECT_LT(MaskIndex::index(hash, capacity), capacity);
+            EXPECT_LT(FibonacciIndex::index(hash, capacity), capacity);
+            EXPECT_LT(FastRangeIndex::index(hash, capacity), capacity);
+        }
+    }
+    // Keys with a stride of 4096 under the identity std::hash<int> all share the low 12 bits.
+    // MaskIndex piles them into one slot, the others must spread them out.
+    std::set<std::size_t> mask_slots, fibonacci_slots, mixed_slots;
+    for (int i = 0; i < 1024; ++i) {
+        std::size_t hash = std::hash<int>()(i << 12);
+        mask_slots.insert(MaskIndex::index(hash, 1024));
+        fibonacci_slots.insert(FibonacciIndex::index(hash, 1024));
+        mixed_slots.insert(FastRangeIndex::index(MixedHash<std::hash<int>>()(i << 12), 1024));
+    }
+    EXPECT_EQ(mask_slots.size(), 1u);
+    EXPECT_GT(fibonacci_slots.size(), 512u);
+    EXPECT_GT(mixed_slots.size(), 512u);
+}
+
+template <typename MapT>
+void check_strided_keys() {
+    MapT map;
+    for (int i = 0; i < 4096; ++i) {
+        map[i << 12] = i;
+    }
+    EXPECT_EQ(map.size(), 4096u);
+    for (int i = 0; i < 4096; ++i) {
+        ASSERT_NE(map.find(i << 12), map.end());
+        EXPECT_EQ(map.at(i << 12), i);
+        EXPECT_EQ(map.find((i << 12) + 1), map.end());
+    }
+    for (int i = 0; i < 4096; i += 2) {
+        map.erase(i << 12);
+    }
+    EXPECT_EQ(map.size(), 2048u);
+    for (int i = 1; i < 4096; i += 2) {
+        EXPECT_EQ(map.at(i << 12), i);
+    }
+}
+
+TEST(IndexPolicyTest, StridedKeys) {
+    using IntHash = std::hash<int>;
+    using IntEqual = std::equal_to<int>;
+    using Alloc = std::allocator<std::pair<const int, int>>;
+    check_strided_keys<FlatHashMapV1c<int, int, 256, IntHash, IntEqual, Alloc, FibonacciIndex>>();
+    check_strided_keys<FlatHashMapV1c<int, int, 256, MixedHash<IntHash>, IntEqual, Alloc, FastRangeIndex>>();
+    check_strided_keys<FlatHashMapV2c<int, int, 256, IntHash, IntEqual, Alloc, FibonacciIndex>>();
+    check_strided_keys<FlatHashMapV3<int, int, 256, IntHash, IntEqual, Alloc, FibonacciIndex>>();
+    check_strided_keys<FlatHashMapV3<int, int, 256, IntHash, IntEqual, Alloc, FastRangeIndex>>();
+    check_strided_keys<FlatHashMapV4b<int, int, 256, IntHash, IntEqual, Alloc, FibonacciIndex>>();
+    check_strided_keys<FlatHashMapV4c<int, int, 256, MixedHash<IntHash>, IntEqual, Alloc, FastRangeIndex>>();
+}
+
+TEST(FlatHashMapV3Test, IncrementalRehashFuzz) {
+    FlatHashMapV3<int, int, 32> map;
+    map.set_incremental_rehash(true);
+    std::unordered_map<int, int> ref;
+    std::mt19937 rng(7);
+    bool saw_rehashing = false;
+    for (int i = 0; i < 200000; ++i) {
+        int key = static_cast<int>(rng() % 50000);
+        switch (rng() % 4) {
+        case 0:
+        case 1:
+            EXPECT_EQ(map.insert({key, i}).second, ref.insert({key, i}).second);
+            break;
+        case 2:
+            EXPECT_EQ(map.erase(key), ref.erase(key));
+            break;
+        default: {
+            auto it = map.find(key);
+            auto ref_it = ref.find(key);
+            ASSERT_EQ(it == map.end(), ref_it == ref.end()) << "Mismatch for key " << key;
+            if (ref_it != ref.end()) {
+                EXPECT_EQ(it->second, ref_it->second);
+            }
+        }
+        }
+        saw_rehashing |= map.rehashing();
+        ASSERT_EQ(map.size(), ref.size());
+    }
+    EXPECT_TRUE(saw_rehashing);
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(map.at(key), value);
+    }
+    // Turning it off drains the old table
+    map.set_incremental_rehash(false);
+    EXPECT_FALSE(map.rehashing());
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(map.at(key), value);
+    }
+}
+
+TEST(FlatHashMapV3Test, Reserve) {
+    FlatHashMapV3<int, int> map;
+    map.reserve(100000);
+    std::size_t capacity = map.capacity();
+    EXPECT_GE(capacity * 0.875, 100000);
+    for (int i = 0; i < 100000; ++i) {
+        map[i] = i;
+    }
+    EXPECT_EQ(map.capacity(), capacity);
+    // reserve keeps the elements, and never shrinks the table
+    map.reserve(10);
+    EXPECT_EQ(map.capacity(), capacity);
+    map.set_incremental_rehash(true);
+    map.reserve(400000);
+    EXPECT_GT(map.capacity(), capacity);
+    for (int i = 0; i < 100000; ++i) {
+        EXPECT_EQ(map.at(i), i);
+    }
+}
+
+TEST(FlatHashMapV3Test, BulkInsert) {
+    // Duplicates within the input and with the map, and tombstones, as insert() in order would do
+    std::mt19937 rng(11);
+    std::vector<std::pair<int, int>> input;
+    for (int i = 0; i < 300000; ++i) {
+        input.emplace_back(static_cast<int>(rng() % 200000), i);
+    }
+    for (std::size_t threads : {1, 3, 4}) {
+        FlatHashMapV3<int, int> map;
+        std::unordered_map<int, int> ref;
+        for (int i = 0; i < 50000; ++i) {
+            map.insert({i * 7, -i});
+            ref.insert({i * 7, -i});
+        }
+        for (int i = 0; i < 50000; i += 3) {
+            map.erase(i * 7);
+            ref.erase(i * 7);
+        }
+        map.bulk_insert(input.begin(), input.end(), threads);
+        ref.insert(input.begin(), input.end());
+        ASSERT_EQ(map.size(), ref.size());
+        for (auto & [key, value] : ref) {
+            EXPECT_EQ(map.at(key), value);
+        }
+        // Tiny inputs take the sequential path
+        map.bulk_insert(input.begin(), input.begin() + 10, threads);
+        EXPECT_EQ(map.size(), ref.size());
+    }
+    // Owning keys and values, with a rehash in progress
+    FlatHashMapV3<std::string, std::string, 32> map;
+    map.set_incremental_rehash(true);
+    std::unordered_map<std::string, std::string> ref;
+    for (int i = 0; i < 1000; ++i) {
+        map.insert({std::to_string(i), std::to_string(-i)});
+        ref.insert({std::to_string(i), std::to_string(-i)});
+    }
+    std::vector<std::pair<std::string, std::string>> strings;
+    for (int i = 0; i < 40000; ++i) {
+        strings.emplace_back(std::to_string(rng() % 30000), std::string(20, 'a' + i % 26));
+    }
+    map.bulk_insert(strings.begin(), strings.end(), 4);
+    ref.insert(strings.begin(), strings.end());
+    ASSERT_EQ(map.size(), ref.size());
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(map.at(key), value);
+    }
+}
+
+TEST(FlatHashMapV3Test, ParallelRehash) {
+    FlatHashMapV3<std::string, std::string> map;
+    map.set_rehash_threads(4);
+    std::unordered_map<std::string, std::string> ref;
+    for (int i = 0; i < 200000; ++i) {
+        std::string key = "key" + std::to_string(i);
+        map.insert({key, std::to_string(i)});
+        ref.insert({key, std::to_string(i)});
+        if (i % 5 == 0) {
+            map.erase("key" + std::to_string(i / 2));
+            ref.erase("key" + std::to_string(i / 2));
+        }
+    }
+    EXPECT_GE(map.capacity(), std::size_t(1) << 17);
+    EXPECT_FALSE(map.rehashing());
+    ASSERT_EQ(map.size(), ref.size());
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(map.at(key), value);
+    }
+    // A copy keeps the setting, and the copy grows the same way
+    auto copy = map;
+    copy.reserve(copy.capacity() * 2);
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(copy.at(key), value);
+    }
+}
+
+// No default constructor, and counts its copies
+struct CopyCountingValue {
+    static inline int copies = 0;
+
+    explicit CopyCountingValue(int v) : value(v) {}
+    CopyCountingValue(const CopyCountingValue & other) : value(other.value) {
+        ++copies;
+    }
+    CopyCountingValue(CopyCountingValue && other) noexcept = default;
+    CopyCountingValue & operator=(const CopyCountingValue & other) {
+        value = other.value;
+        ++copies;
+        return *this;
+    }
+    CopyCountingValue & operator=(CopyCountingValue && other) noexcept = default;
+
+    int value;
+};
+
+template <typename MapT>
+void check_move_semantics() {
+    MapT map;
+    CopyCountingValue::copies = 0;
+    // Growing from 16 slots rehashes many times, and no slot is default-constructed
+    for (int i = 0; i < 10000; ++i) {
+        EXPECT_TRUE(map.try_emplace(i, i).second);
+    }
+    EXPECT_TRUE(map.insert({10000, CopyCountingValue(10000)}).second);
+    EXPECT_TRUE(map.emplace(10001, CopyCountingValue(10001)).second);
+    EXPECT_FALSE(map.emplace(10001, CopyCountingValue(-1)).second);
+    EXPECT_TRUE(map.insert_or_assign(10002, CopyCountingValue(10002)).second);
+    EXPECT_FALSE(map.insert_or_assign(0, CopyCountingValue(-1)).second);
+    for (int i = 1; i < 10000; i += 2) {
+        EXPECT_EQ(map.erase(i), 1u);
+    }
+    EXPECT_EQ(CopyCountingValue::copies, 0);
+
+    EXPECT_EQ(map.size(), 5003u);
+    EXPECT_EQ(map.at(0).value, -1);
+    EXPECT_EQ(map.at(9998).value, 9998);
+    EXPECT_EQ(map.at(10001).value, 10001);
+    EXPECT_EQ(map.find(9999), map.end());
+
+    // Copying a map copies each live value once
+    MapT copy = map;
+    EXPECT_EQ(CopyCountingValue::copies, 5003);
+    EXPECT_EQ(copy.at(10002).value, 10002);
+}
+
+TEST(MoveSemanticsTest, NoCopiesAndNoDefaultConstruction) {
+    check_move_semantics<FlatHashMapV3<int, CopyCountingValue, 16>>();
+    check_move_semantics<FlatHashMapV4b<int, CopyCountingValue, 16>>();
+}
+
+// Heap-owning keys and values under churn, so that a leaked, doubly destroyed or stale pair shows up under ASan
+template <typename MapT, typename SetUp>
+void check_owning_values(SetUp set_up) {
+    MapT map;
+    set_up(map);
+    std::unordered_map<std::string, std::vector<int>> ref;
+    std::mt19937 rng(11);
+    for (int i = 0; i < 100000; ++i) {
+        std::string key = "key-" + std::to_string(rng() % 5000);
+        std::vector<int> value(rng() % 8, i);
+        switch (rng() % 4) {
+        case 0:
+            EXPECT_EQ(map.try_emplace(std::string(key), value).second, ref.try_emplace(key, value).second);
+            break;
+        case 1:
+            map.insert_or_assign(key, value);
+            ref.insert_or_assign(key, value);
+            break;
+        case 2:
+            EXPECT_EQ(map.erase(key), ref.erase(key));
+            break;
+        default:
+            map[std::string(key)].push_back(i);
+            ref[key].push_back(i);
+        }
+        ASSERT_EQ(map.size(), ref.size());
+    }
+    MapT copy = map;
+    map.clear();
+    EXPECT_TRUE(map.empty());
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(copy.at(key), value);
+    }
+}
+
+TEST(MoveSemanticsTest, OwningKeysAndValues) {
+    using V3 = FlatHashMapV3<std::string, std::vector<int>, 16>;
+    using V4 = FlatHashMapV4b<std::string, std::vector<int>, 16>;
+    check_owning_values<V3>([](V3 &) {});
+    check_owning_values<V3>([](V3 & map) { map.set_incremental_rehash(true); });
+    check_owning_values<V4>([](V4 &) {});
+}
+
+template <typename K, typename V, std::size_t InitCapacity = 256, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>>
+using SplitFlatHashMapV3 = FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, MaskIndex, SplitLayout>;
+
+// The layout must not change what the map does, so rerun the V3 checks with keys and values split
+TEST(SlotLayoutTest, SplitLayout) {
+    check_heterogeneous_lookup<SplitFlatHashMapV3<std::string, int, 16, TransparentStringHash, std::equal_to<>>>();
+    check_find_batch<SplitFlatHashMapV3<int, int>>();
+    check_move_semantics<SplitFlatHashMapV3<int, CopyCountingValue, 16>>();
+    check_copy_and_move<SplitFlatHashMapV3<int, std::string>>();
+    using MapT = SplitFlatHashMapV3<std::string, std::vector<int>, 16>;
+    check_owning_values<MapT>([](MapT &) {});
+    check_owning_values<MapT>([](MapT & map) { map.set_incremental_rehash(true); });
+
+    SplitFlatHashMapV3<int, std::array<char, 200>> map;
+    for (int i = 0; i < 1000; ++i) {
+        map[i].fill(static_cast<char>(i));
+    }
+    auto it = map.find(7);
+    ASSERT_NE(it, map.end());
+    EXPECT_EQ(it->first, 7);
+    EXPECT_EQ(it->second[199], 7);
+    auto [key, value] = *it;
+    value[0] = 42;
+    EXPECT_EQ(map.at(7)[0], 42);
+}
+
+// Integer keys get a bare-key slot, other keys keep an occupancy bitmap
+static_assert(sizeof(FlatHashSet<uint32_t>::SlotT) == 4);
+static_assert(sizeof(SentinelFlatHashMap<uint32_t, uint32_t>::SlotT) == 8);
+
+template <typename SetT, typename KeyGen>
+void check_set_against_unordered_set(KeyGen key_gen) {
+    SetT set;
+    std::unordered_set<decltype(key_gen())> ref;
+    for (int i = 0; i < 200000; ++i) {
+        auto key = key_gen();
+        switch (i % 3) {
+        case 0:
+            EXPECT_EQ(set.insert(key), ref.insert(key).second);
+            break;
+        case 1:
+            EXPECT_EQ(set.erase(key), ref.erase(key));
+            break;
+        default:
+            ASSERT_EQ(set.contains(key), ref.count(key) == 1) << "Mismatch for key " << key;
+        }
+        ASSERT_EQ(set.size(), ref.size());
+    }
+    std::size_t visited = 0;
+    set.for_each([&](const auto & key) {
+        EXPECT_EQ(ref.count(key), 1u);
+        ++visited;
+    });
+    EXPECT_EQ(visited, ref.size());
+    set.clear();
+    EXPECT_TRUE(set.empty());
+    EXPECT_FALSE(set.contains(key_gen()));
+}
+
+TEST(FlatHashSetTest, IntegerKeys) {
+    std::mt19937 rng(5);
+    // Small ranges keep clusters long, and the sentinel value itself is a valid key
+    check_set_against_unordered_set<FlatHashSet<uint32_t, 16>>([&]() {
+        uint32_t key = rng() % 3000;
+        return (key == 0) ? std::numeric_limits<uint32_t>::max() : key;
+    });
+    check_set_against_unordered_set<FlatHashSet<int64_t, 16>>([&]() {
+        return static_cast<int64_t>(rng() % 3000) - 1500;
+    });
+}
+
+TEST(FlatHashSetTest, StringKeys) {
+    std::mt19937 rng(6);
+    check_set_against_unordered_set<FlatHashSet<std::string, 16>>([&]() {
+        return "id-" + std::to_string(rng() % 3000);
+    });
+}
+
+// A moved-from set is an empty set which still works, and a copy is independent of its source
+template <typename SetT, typename MakeKey>
+void check_set_copy_and_move(MakeKey make_key) {
+    SetT a;
+    for (int i = 0; i < 1000; ++i) {
+        a.insert(make_key(i));
+    }
+    SetT b(std::move(a));
+    EXPECT_EQ(b.size(), 1000u);
+    EXPECT_TRUE(b.contains(make_key(999)));
+    EXPECT_TRUE(a.empty());
+    EXPECT_FALSE(a.contains(make_key(3)));
+    EXPECT_TRUE(a.insert(make_key(3)));
+
+    a = b;
+    EXPECT_EQ(a.size(), 1000u);
+    EXPECT_EQ(a.erase(make_key(0)), 1u);
+    EXPECT_TRUE(b.contains(make_key(0)));
+
+    SetT c;
+    c.insert(make_key(-1));
+    c = std::move(b);
+    EXPECT_EQ(c.size(), 1000u);
+    EXPECT_FALSE(c.contains(make_key(-1)));
+    EXPECT_TRUE(b.empty());
+    EXPECT_FALSE(b.contains(make_key(999)));
+    for (int i = 0; i < 1000; ++i) {
+        b.insert(make_key(i));
+    }
+    EXPECT_EQ(b.size(), 1000u);
+}
+
+TEST(FlatHashSetTest, CopyAndMove) {
+    check_set_copy_and_move<FlatHashSet<uint64_t, 16>>([](int i) { return static_cast<uint64_t>(i); });
+    check_set_copy_and_move<FlatHashSet<std::string, 16>>([](int i) { return std::to_string(i); });
+}
+
+TEST(SentinelFlatHashMapTest, CopyAndMove) {
+    constexpr uint64_t Sentinel = std::numeric_limits<uint64_t>::max();
+    SentinelFlatHashMap<uint64_t, uint64_t, 16> a;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        a[i] = i;
+    }
+    a[Sentinel] = 7;
+    SentinelFlatHashMap<uint64_t, uint64_t, 16> b(std::move(a));
+    EXPECT_EQ(b.size(), 1001u);
+    EXPECT_EQ(b.at(Sentinel), 7u);
+    EXPECT_TRUE(a.empty());
+    EXPECT_EQ(a.find(3), a.end());
+    EXPECT_EQ(a.find(Sentinel), a.end());
+    a[3] = 3;
+    EXPECT_EQ(a.at(3), 3u);
+
+    a = b;
+    EXPECT_EQ(a.size(), 1001u);
+    a[0] = 42;
+    EXPECT_EQ(b.at(0), 0u);
+
+    SentinelFlatHashMap<uint64_t, uint64_t, 16> c;
+    c = std::move(b);
+    EXPECT_EQ(c.size(), 1001u);
+    EXPECT_EQ(c.at(999), 999u);
+    EXPECT_TRUE(b.empty());
+    EXPECT_EQ(b.find(999), b.end());
+    b[999] = 1;
+    EXPECT_EQ(b.size(), 1u);
+}
+
+TEST(SentinelFlatHashMapTest, AgainstUnorderedMap) {
+    constexpr uint64_t Sentinel = std::numeric_limits<uint64_t>::max();
+    SentinelFlatHashMap<uint64_t, int, 16> map;
+    std::unordered_map<uint64_t, int> ref;
+    std::mt19937 rng(8);
+    for (int i = 0; i < 200000; ++i) {
+        uint64_t key = rng() % 3000;
+        key = (key == 0) ? Sentinel : key;
+        switch (rng() % 4) {
+        case 0:
+            EXPECT_EQ(map.insert({key, i}).second, ref.insert({key, i}).second);
+            break;
+        case 1:
+            map.insert_or_assign(key, i);
+            ref.insert_or_assign(key, i);
+            break;
+        case 2:
+            EXPECT_EQ(map.erase(key), ref.erase(key));
+            break;
+        default: {
+            auto it = map.find(key);
+            auto ref_it = ref.find(key);
+            ASSERT_EQ(it == map.end(), ref_it == ref.end()) << "Mismatch for key " << key;
+            if (ref_it != ref.end()) {
+                EXPECT_EQ(it->second, ref_it->second);
+            }
+        }
+        }
+        ASSERT_EQ(map.size(), ref.size());
+    }
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(map.at(key), value);
+    }
+    map[Sentinel] += 1;
+    EXPECT_EQ(map.at(Sentinel), ref.count(Sentinel) ? ref[Sentinel] + 1 : 1);
+}
+
+// Every element is counted once, and home is the most common place to sit
+template <typename MapT>
+void check_probe_histogram() {
+    MapT map;
+    std::mt19937_64 rng(13);
+    std::vector<uint64_t> keys;
+    for (int i = 0; i < 100000; ++i) {
+        keys.push_back(rng() >> 1);
+        map.insert({keys.back(), i});
+    }
+    for (std::size_t i = 0; i < keys.size(); i += 5) {
+        map.erase(keys[i]);
+    }
+    auto histogram = map.probe_histogram();
+    ASSERT_FALSE(histogram.empty());
+    EXPECT_EQ(std::accumulate(histogram.begin(), histogram.end(), std::size_t{0}), map.size());
+    EXPECT_EQ(std::max_element(histogram.begin(), histogram.end()), histogram.begin());
+}
+
+TEST(ProbeHistogramTest, CountsEveryElement) {
+    check_probe_histogram<FlatHashMapV3<uint64_t, int>>();
+    check_probe_histogram<SplitFlatHashMapV3<uint64_t, int>>();
+    check_probe_histogram<FlatHashMapV4b<uint64_t, int>>();
+    check_probe_histogram<SentinelFlatHashMap<uint64_t, int>>();
+}
+
+// Only 4 distinct hash values: the kind of hash function stats() is meant to catch
+struct FewValuesHash {
+    std::size_t operator()(int key) const {
+        return std::hash<int>()(key % 4);
+    }
+};
+
+template <typename MapT, typename BadMapT>
+void check_stats() {
+    MapT map;
+    for (int i = 0; i < 10000; ++i) {
+        map.insert({i, i});
+    }
+    for (int i = 0; i < 10000; i += 2) {
+        EXPECT_EQ(map.erase(i), 1u);
+    }
+    for (int i = 0; i < 20000; ++i) {
+        EXPECT_EQ(map.find(i) != map.end(), (i % 2 == 1) && (i < 10000));
+    }
+    HashMapStats stats = map.stats();
+    EXPECT_EQ(stats.size, 5000u);
+    EXPECT_EQ(stats.capacity, map.capacity());
+    // Every non-empty slot belongs to exactly one cluster
+    std::size_t non_empty = 0;
+    for (std::size_t length = 0; length < stats.cluster_lengths.size(); ++length) {
+        non_empty += length * stats.cluster_lengths[length];
+    }
+    EXPECT_EQ(non_empty, stats.size + stats.tombstones);
+    auto total = [](const std::vector<uint64_t> & histogram) {
+        return std::accumulate(histogram.begin(), histogram.end(), uint64_t{0});
+    };
+    EXPECT_EQ(total(stats.hit_probe_lengths), 5000u + 5000u);
+    EXPECT_EQ(total(stats.miss_probe_lengths), 15000u);
+    EXPECT_GT(stats.rehash_count, 0u);
+    EXPECT_LT(histogram_mean(stats.hit_probe_lengths), 1.0);
+
+    map.reset_stats();
+    EXPECT_TRUE(map.stats().hit_probe_lengths.empty());
+
+    BadMapT bad_map;
+    for (int i = 0; i < 2000; ++i) {
+        bad_map.insert({i, i});
+    }
+    for (int i = 0; i < 2000; ++i) {
+        EXPECT_EQ(bad_map.at(i), i);
+    }
+    EXPECT_GT(histogram_mean(bad_map.stats().hit_probe_lengths), 4.0);
+}
+
+TEST(StatsTest, ProbeStats) {
+    using Alloc = std::allocator<std::pair<const int, int>>;
+    check_stats<FlatHashMapV3<int, int, 256, std::hash<int>, std::equal_to<int>, Alloc, MaskIndex, InterleavedLayout, ProbeStats>,
+                FlatHashMapV3<int, int, 256, FewValuesHash, std::equal_to<int>, Alloc, MaskIndex, InterleavedLayout, ProbeStats>>();
+    check_stats<FlatHashMapV4c<int, int, 256, std::hash<int>, std::equal_to<int>, Alloc, MaskIndex, ProbeStats>,
+                FlatHashMapV4c<int, int, 256, FewValuesHash, std::equal_to<int>, Alloc, MaskIndex, ProbeStats>>();
+}
+
+TEST(StatsTest, NoStatsRecordsNothing) {
+    FlatHashMapV3<int, int> map;
+    for (int i = 0; i < 1000; ++i) {
+        map.insert({i, i});
+        map.find(i);
+    }
+    HashMapStats stats = map.stats();
+    EXPECT_EQ(stats.size, 1000u);
+    EXPECT_EQ(stats.tombstones, 0u);
+    EXPECT_TRUE(stats.hit_probe_lengths.empty());
+    EXPECT_EQ(stats.rehash_count, 0u);
+}
+
+// A value type with padding, to check that the snapshot reads the slots byte for byte
+struct FrozenValue {
+    uint32_t id;
+    double weight;
+    bool operator==(const FrozenValue &) const = default;
+};
+
+template <typename MapT, typename FrozenT>
+void check_frozen_map() {
+    const std::string path = testing::TempDir() + "frozen_flat_hash_map_test.bin";
+    MapT map;
+    for (uint64_t i = 0; i < 50000; ++i) {
+        map.insert({i * 7, FrozenValue{static_cast<uint32_t>(i), i * 0.5}});
+    }
+    // Leave tombstones behind: the probes must still walk over them
+    for (uint64_t i = 0; i < 50000; i += 3) {
+        EXPECT_EQ(map.erase(i * 7), 1u);
+    }
+    FrozenT::write(map, path, 42);
+
+    {
+        FrozenT frozen = FrozenT::open(path, 42);
+        EXPECT_EQ(frozen.size(), map.size());
+        EXPECT_EQ(frozen.capacity(), map.capacity());
+        for (uint64_t key = 0; key < 50000 * 7; ++key) {
+            auto it = map.find(key);
+            const FrozenValue * value = frozen.find(key);
+            ASSERT_EQ(value != nullptr, it != map.end()) << "Mismatch for key " << key;
+            if (value != nullptr) {
+                EXPECT_EQ(*value, it->second);
+            }
+        }
+        EXPECT_EQ(frozen.at(7).id, 1u);
+        EXPECT_THROW(frozen.at(0), std::out_of_range);
+        std::size_t count = 0;
+        frozen.for_each([&](uint64_t key, const FrozenValue & value) {
+            EXPECT_EQ(value.id * 7, key);
+            count++;
+        });
+        EXPECT_EQ(count, map.size());
+
+        // Moving the mapping keeps it valid
+        FrozenT moved = std::move(frozen);
+        EXPECT_TRUE(moved.contains(7));
+    }
+    // Snapshots written with another seed, or hashed differently, are refused
+    EXPECT_THROW(FrozenT::open(path, 43), std::runtime_error);
+    EXPECT_THROW(FrozenT::open(path + ".missing"), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+struct OtherHash {
+    std::size_t operator()(uint64_t key) const {
+        return std::hash<uint64_t>()(key * 0x9E3779B97F4A7C15ull + 1);
+    }
+};
+
+TEST(FrozenFlatHashMapTest, RoundTrip) {
+    check_frozen_map<FlatHashMapV3<uint64_t, FrozenValue>, FrozenFlatHashMapV3<uint64_t, FrozenValue>>();
+    check_frozen_map<SplitFlatHashMapV3<uint64_t, FrozenValue>,
+                     FrozenFlatHashMapV3<uint64_t, FrozenValue, std::hash<uint64_t>, std::equal_to<uint64_t>, MaskIndex, SplitLayout>>();
+}
+
+TEST(FrozenFlatHashMapTest, RejectsMismatches) {
+    using FrozenT = FrozenFlatHashMapV3<uint64_t, uint64_t>;
+    const std::string path = testing::TempDir() + "frozen_flat_hash_map_mismatch.bin";
+    FlatHashMapV3<uint64_t, uint64_t> map;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        map.insert({i, i});
+    }
+    FrozenT::write(map, path);
+    EXPECT_EQ(*FrozenT::open(path).find(999), 999u);
+
+    // Another value size, another layout, another hash function
+    EXPECT_THROW((FrozenFlatHashMapV3<uint64_t, uint32_t>::open(path)), std::runtime_error);
+    EXPECT_THROW((FrozenFlatHashMapV3<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, MaskIndex, SplitLayout>::open(path)),
+                 std::runtime_error);
+    EXPECT_THROW((FrozenFlatHashMapV3<uint64_t, uint64_t, OtherHash>::open(path)), std::runtime_error);
+
+    // A truncated file
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    EXPECT_THROW(FrozenT::open(path), std::runtime_error);
+
+    // An empty map round-trips too
+    FlatHashMapV3<uint64_t, uint64_t> empty_map;
+    FrozenT::write(empty_map, path);
+    FrozenT frozen = FrozenT::open(path);
+    EXPECT_TRUE(frozen.empty());
+    EXPECT_FALSE(frozen.contains(0));
+    std::remove(path.c_str());
+}
+
+TEST(StaticHashMapTest, AgainstUnorderedMap) {
+    for (std::size_t n : {1, 2, 3, 100, 1000, 100000}) {
+        std::mt19937_64 rng(n);
+        std::unordered_map<uint64_t, uint64_t> reference;
+        std::vector<std::pair<uint64_t, uint64_t>> pairs;
+        while (reference.size() < n) {
+            uint64_t key = rng();
+            if (reference.emplace(key, key / 3).second) {
+                pairs.emplace_back(key, key / 3);
+            }
+        }
+        // Duplicates keep the first value, like std::unordered_map
+        pairs.emplace_back(pairs.front().first, 0);
+        StaticHashMap<uint64_t, uint64_t> map(pairs.begin(), pairs.end());
+        ASSERT_EQ(map.size(), n);
+        for (const auto & [key, value] : reference) {
+            ASSERT_TRUE(map.contains(key)) << "Missing key " << key;
+            EXPECT_EQ(map.at(key), value);
+        }
+        // Every slot is used
+        std::size_t count = 0;
+        for (const auto & pair : map) {
+            EXPECT_EQ(reference.at(pair.first), pair.second);
+            count++;
+        }
+        EXPECT_EQ(count, n);
+        for (int i = 0; i < 1000; ++i) {
+            uint64_t key = rng();
+            EXPECT_EQ(map.contains(key), reference.count(key) == 1);
+        }
+        EXPECT_THROW(map.at(rng()), std::out_of_range);
+    }
+}
+
+TEST(StaticHashMapTest, StringKeysAndEdgeCases) {
+    std::vector<std::pair<std::string, int>> pairs;
+    for (int i = 0; i < 5000; ++i) {
+        pairs.emplace_back("key" + std::to_string(i), i);
+    }
+    StaticHashMap<std::string, int, TransparentStringHash, std::equal_to<>> map(pairs.begin(), pairs.end());
+    EXPECT_EQ(map.find(std::string_view("key4999"))->second, 4999);
+    EXPECT_EQ(map.find(std::string_view("key5000")), map.end());
+
+    StaticHashMap<int, int> small{{1, 10}, {2, 20}, {3, 30}};
+    EXPECT_EQ(small.at(2), 20);
+    EXPECT_FALSE(small.contains(4));
+
+    StaticHashMap<int, int> empty_map;
+    EXPECT_TRUE(empty_map.empty());
+    EXPECT_EQ(empty_map.find(0), empty_map.end());
+
+    // Different keys with the same hash cannot be separated
+    std::vector<std::pair<int, int>> colliding{{0, 0}, {4, 4}};
+    EXPECT_THROW((StaticHashMap<int, int, FewValuesHash>(colliding.begin(), colliding.end())), std::invalid_argument);
+}
+
+template <typename K>
+void check_cuckoo_map() {
+    CuckooFlatHashMap<K, uint64_t> map;
+    // A high load, so that most inserts into full buckets need a cuckoo path
+    map.set_max_load_factor(0.97f);
+    std::unordered_map<K, uint64_t> reference;
+    std::mt19937_64 rng(7);
+    // Few distinct keys, so that erases and re-inserts hit existing ones
+    auto random_key = [&]() {
+        uint64_t draw = rng() % 20000;
+        return (draw == 0) ? CuckooFlatHashMap<K, uint64_t>::EmptyKey : static_cast<K>(draw * 2654435761u);
+    };
+    for (int i = 0; i < 200000; ++i) {
+        K key = random_key();
+        switch (rng() % 4) {
+            case 0:
+            case 1: {
+                bool inserted = map.insert({key, static_cast<uint64_t>(i)}).second;
+                EXPECT_EQ(inserted, reference.emplace(key, i).second);
+                break;
+            }
+            case 2:
+                EXPECT_EQ(map.erase(key), reference.erase(key));
+                break;
+            default: {
+                auto it = map.find(key);
+                auto ref_it = reference.find(key);
+                ASSERT_EQ(it != map.end(), ref_it != reference.end()) << "Mismatch for key " << key;
+                if (ref_it != reference.end()) {
+                    EXPECT_EQ((*it).second, ref_it->second);
+                }
+            }
+        }
+    }
+    ASSERT_EQ(map.size(), reference.size());
+    for (const auto & [key, value] : reference) {
+        EXPECT_EQ(map.at(key), value);
+    }
+    std::size_t count = 0;
+    map.for_each([&](K key, uint64_t value) {
+        EXPECT_EQ(reference.at(key), value);
+        count++;
+    });
+    EXPECT_EQ(count, reference.size());
+    auto histogram = map.probe_histogram();
+    EXPECT_EQ(histogram[0] + histogram[1] + reference.count(CuckooFlatHashMap<K, uint64_t>::EmptyKey), reference.size());
+
+    map.clear();
+    EXPECT_TRUE(map.empty());
+    map.reserve(100000);
+    std::size_t capacity = map.capacity();
+    for (K key = 0; key < 100000; ++key) {
+        map[key] = key;
+    }
+    EXPECT_EQ(map.capacity(), capacity);
+    EXPECT_EQ(map.at(99999), 99999u);
+}
+
+TEST(CuckooFlatHashMapTest, AgainstUnorderedMap) {
+    check_cuckoo_map<uint64_t>();
+    check_cuckoo_map<uint32_t>();
+}
+
+TEST(CuckooFlatHashMapTest, TooManyEqualHashes) {
+    CuckooFlatHashMap<int, int, 256, FewValuesHash> map;
+    EXPECT_THROW({
+        for (int i = 0; i < 1000; ++i) {
+            map.insert({i, i});
+        }
+    }, std::length_error);
+    // The failed insert left the map as it was
+    std::size_t size = map.size();
+    for (int i = 0; i < static_cast<int>(size); ++i) {
+        EXPECT_EQ(map.at(i), i);
+    }
+}
+
+TEST(CuckooFlatHashMapTest, CopyAndMove) {
+    constexpr uint64_t Sentinel = std::numeric_limits<uint64_t>::max();
+    CuckooFlatHashMap<uint64_t, uint64_t, 16> a;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        a[i] = i;
+    }
+    a[Sentinel] = 7;
+    CuckooFlatHashMap<uint64_t, uint64_t, 16> b(std::move(a));
+    EXPECT_EQ(b.size(), 1001u);
+    EXPECT_EQ(b.at(Sentinel), 7u);
+    EXPECT_TRUE(a.empty());
+    EXPECT_EQ(a.capacity(), 16u);
+    EXPECT_FALSE(a.contains(3));
+    EXPECT_FALSE(a.contains(Sentinel));
+    a[3] = 3;
+    EXPECT_EQ(a.at(3), 3u);
+
+    a = b;
+    EXPECT_EQ(a.size(), 1001u);
+    a[0] = 42;
+    EXPECT_EQ(b.at(0), 0u);
+
+    CuckooFlatHashMap<uint64_t, uint64_t, 16> c;
+    c = std::move(b);
+    EXPECT_EQ(c.size(), 1001u);
+    EXPECT_EQ(c.at(999), 999u);
+    EXPECT_TRUE(b.empty());
+    EXPECT_FALSE(b.contains(999));
+    for (uint64_t i = 0; i < 1000; ++i) {
+        b[i] = i + 1;
+    }
+    EXPECT_EQ(b.at(999), 1000u);
+}
+
+TEST(NodeFlatHashMapTest, AgainstUnorderedMap) {
+    NodeFlatHashMap<int, int, 16> map;
+    std::unordered_map<int, int> ref;
+    // Where every live value was when it was inserted
+    std::unordered_map<int, int *> addresses;
+    std::mt19937 rng(5);
+    for (int i = 0; i < 200000; ++i) {
+        int key = static_cast<int>(rng() % 40000);
+        switch (rng() % 4) {
+        case 0:
+        case 1: {
+            auto [it, inserted] = map.try_emplace(key, i);
+            ASSERT_EQ(inserted, ref.insert({key, i}).second);
+            if (inserted) {
+                addresses[key] = &it->second;
+            }
+            break;
+        }
+        case 2:
+            ASSERT_EQ(map.erase(key), ref.erase(key));
+            addresses.erase(key);
+            break;
+        default: {
+            auto it = map.find(key);
+            ASSERT_EQ(it == map.end(), !ref.contains(key));
+            if (it != map.end()) {
+                EXPECT_EQ(&it->second, addresses[key]);
+                it->second++;
+                ref[key]++;
+            }
+        }
+        }
+        ASSERT_EQ(map.size(), ref.size());
+    }
+    EXPECT_GT(map.capacity(), 16u);
+    for (auto & [key, value] : ref) {
+        EXPECT_EQ(map.at(key), value);
+        EXPECT_EQ(*addresses[key], value);
+    }
+    std::size_t count = 0;
+    map.for_each([&](const int & key, int & value) {
+        EXPECT_EQ(ref.at(key), value);
+        ++count;
+    });
+    EXPECT_EQ(count, ref.size());
+    EXPECT_THROW(map.at(-1), std::out_of_range);
+    map.clear();
+    EXPECT_TRUE(map.empty());
+    EXPECT_FALSE(map.contains(1));
+}
+
+TEST(NodeFlatHashMapTest, StringKeysStayPut) {
+    NodeFlatHashMap<std::string, std::string, 16, TransparentStringHash, std::equal_to<>> map;
+    std::vector<const std::string *> values;
+    for (int i = 0; i < 5000; ++i) {
+        values.push_back(&map.try_emplace("key" + std::to_string(i), std::string(30, 'a' + i % 26)).first->second);
+    }
+    map.reserve(100000);
+    for (int i = 0; i < 5000; ++i) {
+        std::string key = "key" + std::to_string(i);
+        EXPECT_EQ(&map.find(std::string_view(key))->second, values[i]);
+        EXPECT_EQ(*values[i], std::string(30, 'a' + i % 26));
+    }
+    // Erased nodes are reused, and the erased pair released what it owned
+    const std::string * erased = values[10];
+    EXPECT_EQ(map.erase("key10"), 1u);
+    EXPECT_TRUE(erased->empty());
+    map["new"] = "value";
+    EXPECT_EQ(&map.find("new")->second, erased);
+    EXPECT_EQ(map.size(), 5000u);
+}
+
+// The nodes move with the map, and the moved-from map is empty and still works
+TEST(NodeFlatHashMapTest, Move) {
+    NodeFlatHashMap<int, std::string, 16> a;
+    for (int i = 0; i < 100; ++i) {
+        a[i] = std::to_string(i);
+    }
+    const std::string * value = &a.find(42)->second;
+    NodeFlatHashMap<int, std::string, 16> b(std::move(a));
+    EXPECT_EQ(b.size(), 100u);
+    EXPECT_EQ(&b.find(42)->second, value);
+    EXPECT_TRUE(a.empty());
+    EXPECT_FALSE(a.contains(3));
+    EXPECT_EQ(a.find(3), a.end());
+    EXPECT_TRUE(a.insert({3, "three"}).second);
+    EXPECT_EQ(a.at(3), "three");
+
+    NodeFlatHashMap<int, std::string, 16> c;
+    c[-1] = "-1";
+    c = std::move(b);
+    EXPECT_EQ(c.size(), 100u);
+    EXPECT_FALSE(c.contains(-1));
+    EXPECT_EQ(&c.find(42)->second, value);
+    EXPECT_TRUE(b.empty());
+    EXPECT_EQ(b.find(42), b.end());
+    for (int i = 0; i < 100; ++i) {
+        b[i] = "again";
+    }
+    EXPECT_EQ(b.size(), 100u);
+}
+
+// Counts live bytes, to check that every array of a map goes through its allocator
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+
+    explicit CountingAllocator(std::ptrdiff_t * live_bytes) : live_bytes_(live_bytes) {}
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U> & other) : live_bytes_(other.live_bytes_) {}
+
+    T * allocate(std::size_t n) {
+        *live_bytes_ += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T * ptr, std::size_t n) {
+        *live_bytes_ -= n * sizeof(T);
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    std::ptrdiff_t * live_bytes_;
+};
+
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T> & lhs, const CountingAllocator<U> & rhs) {
+    return lhs.live_bytes_ == rhs.live_bytes_;
+}
+
+using CountingIntAllocator = CountingAllocator<std::pair<const int, int>>;
+
+template <typename MapT>
+void check_counting_allocator() {
+    using Alloc = CountingIntAllocator;
+    std::ptrdiff_t live_bytes = 0;
+    {
+        MapT map{Alloc(&live_bytes)};
+        EXPECT_GT(live_bytes, 0);
+        for (int i = 0; i < 10000; ++i) {
+            map[i] = i;
+        }
+        // At least the elements themselves must be counted
+        EXPECT_GE(live_bytes, static_cast<std::ptrdiff_t>(map.capacity() * sizeof(std::pair<int, int>)));
+        EXPECT_EQ(map.get_allocator().live_bytes_, &live_bytes);
+        MapT copy = map;
+        EXPECT_EQ(copy.at(9999), 9999);
+        map.clear();
+    }
+    EXPECT_EQ(live_bytes, 0);
+}
+
+TEST(AllocatorTest, EveryVersionUsesItsAllocator) {
+    check_counting_allocator<FlatHashMapV0<int, int, 256, std::hash<int>, std::equal_to<int>, CountingIntAllocator>>();
+    check_counting_allocator<FlatHashMapV1c<int, int, 256, std::hash<int>, std::equal_to<int>, CountingIntAllocator>>();
+    check_counting_allocator<FlatHashMapV2c<int, int, 256, std::hash<int>, std::equal_to<int>, CountingIntAllocator>>();
+    check_counting_allocator<FlatHashMapV3<int, int, 256, std::hash<int>, std::equal_to<int>, CountingIntAllocator>>();
+    check_counting_allocator<SplitFlatHashMapV3<int, int, 256, std::hash<int>, std::equal_to<int>, CountingIntAllocator>>();
+    check_counting_allocator<FlatHashMapV4b<int, int, 256, std::hash<int>, std::equal_to<int>, CountingIntAllocator>>();
+}
+
+TEST(AllocatorTest, ArenaAndPmr) {
+    MonotonicArena arena;
+    {
+        using Alloc = ArenaAllocator<std::pair<const std::string, int>>;
+        FlatHashMapV3<std::string, int, 256, std::hash<std::string>, std::equal_to<std::string>, Alloc> map{Alloc(arena)};
+        map.reserve(1000);
+        std::size_t reserved = arena.bytes_allocated();
+        for (int i = 0; i < 1000; ++i) {
+            map[std::to_string(i)] = i;
+        }
+        EXPECT_EQ(arena.bytes_allocated(), reserved);
+        EXPECT_EQ(map.at("999"), 999);
+    }
+    arena.release();
+    EXPECT_EQ(arena.bytes_allocated(), 0u);
+
+    std::pmr::monotonic_buffer_resource resource;
+    hpds::pmr::FlatHashMapV3<int, int> map{&resource};
+    for (int i = 0; i < 10000; ++i) {
+        map[i] = -i;
+    }
+    EXPECT_EQ(map.get_allocator().resource(), &resource);
+    EXPECT_EQ(map.at(1234), -1234);
+}
+
+TEST(AllocatorTest, HugePages) {
+    using Alloc = HugePageAllocator<std::pair<const int, int>>;
+    FlatHashMapV4b<int, int, 256, std::hash<int>, std::equal_to<int>, Alloc> map;
+    for (int i = 0; i < (1 << 18); ++i) {
+        map[i] = i;
+    }
+    for (int i = 0; i < (1 << 18); ++i) {
+        ASSERT_EQ(map.at(i), i);
+    }
+    HugePageAllocator<int> alloc;
+    int * big = alloc.allocate(1 << 20);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(big) % HugePageAllocator<int>::HugePageSize, 0u);
+    alloc.deallocate(big, 1 << 20);
+}
+
+TEST(ShardedFlatHashMapTest, BasicOperations) {
+    ShardedFlatHashMap<std::string, int, 8> map;
+    EXPECT_TRUE(map.empty());
+    EXPECT_TRUE(map.insert("one", 1));
+    EXPECT_FALSE(map.insert("one", 100));
+    EXPECT_EQ(map.find("one"), std::optional<int>(1));
+    EXPECT_TRUE(map.insert_or_assign("two", 2));
+    EXPECT_FALSE(map.insert_or_assign("two", 22));
+    EXPECT_EQ(map.find("two"), std::optional<int>(22));
+    map.update("three", [](int & value) { value += 3; });
+    map.update("three", [](int & value) { value += 3; });
+    EXPECT_EQ(map.find("three"), std::optional<int>(6));
+    EXPECT_EQ(map.size(), 3u);
+    EXPECT_EQ(map.erase("one"), 1u);
+    EXPECT_EQ(map.erase("one"), 0u);
+    EXPECT_FALSE(map.contains("one"));
+    EXPECT_EQ(map.find("one"), std::nullopt);
+    map.clear();
+    EXPECT_TRUE(map.empty());
+}
+
+TEST(ShardedFlatHashMapTest, KeysSpreadOverShards) {
+    ShardedFlatHashMap<int, int, 16> map;
+    for (int i = 0; i < 16000; ++i) {
+        map.insert(i, i);
+    }
+    for (std::size_t shard = 0; shard < map.shard_count(); ++shard) {
+        EXPECT_GT(map.shard_size(shard), 500u);
+        EXPECT_LT(map.shard_size(shard), 1500u);
+    }
+}
+
+TEST(ShardedFlatHashMapTest, ConcurrentReadersAndWriters) {
+    ShardedFlatHashMap<int, std::string, 8> map;
+    constexpr int NumWriters = 4;
+    constexpr int KeysPerWriter = 20000;
+    std::atomic<bool> done{false};
+    std::atomic<int> bad_reads{0};
+
+    // Readers run during the writers' rehashes. A found value must always be the one its key was inserted with.
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; ++r) {
+        readers.emplace_back([&, r]() {
+            std::mt19937 rng(r);
+            while (!done.load()) {
+                int key = static_cast<int>(rng() % (NumWriters * KeysPerWriter));
+                auto value = map.find(key);
+                if (value && *value != std::to_string(key)) {
+                    bad_reads++;
+                }
+            }
+        });
+    }
+    std::vector<std::thread> writers;
+    for (int w = 0; w < NumWriters; ++w) {
+        writers.emplace_back([&, w]() {
+            for (int i = w * KeysPerWriter; i < (w + 1) * KeysPerWriter; ++i) {
+                map.insert(i, std::to_string(i));
+                map.update(-1, [](std::string & counter) { counter.push_back('x'); });
+            }
+            // Erase the odd keys of this writer again
+            for (int i = w * KeysPerWriter + 1; i < (w + 1) * KeysPerWriter; i += 2) {
+                EXPECT_EQ(map.erase(i), 1u);
+            }
+        });
+    }
+    for (auto & writer : writers) {
+        writer.join();
+    }
+    done = true;
+    for (auto & reader : readers) {
+        reader.join();
+    }
+
+    EXPECT_EQ(bad_reads.load(), 0);
+    EXPECT_EQ(map.size(), NumWriters * KeysPerWriter / 2 + 1u);
+    EXPECT_EQ(map.find(-1)->size(), static_cast<std::size_t>(NumWriters * KeysPerWriter));
+    for (int i = 0; i < NumWriters * KeysPerWriter; ++i) {
+        EXPECT_EQ(map.contains(i), i % 2 == 0) << "Mismatch for key " << i;
+    }
+}
+
+TEST(ShardedFlatHashMapTest, ReadersProgressWhileAWriterHoldsTheShard) {
+    // A single shard, so that the reader and the writer always meet
+    ShardedFlatHashMap<int, int, 1> map;
+    static_assert(ShardedFlatHashMap<int, int, 1>::OptimisticReads);
+    static_assert(!ShardedFlatHashMap<int, std::string, 1>::OptimisticReads);
+    map.insert(1, 10);
+    constexpr int NumReads = 1000;
+    std::atomic<bool> in_update{false};
+    std::atomic<int> reads{0};
+    bool readers_progressed = false;
+
+    std::thread writer([&]() {
+        map.update(2, [&](int & value) {
+            in_update = true;
+            // Without the deadline, a reader blocked by this writer would hang the test instead of failing it
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (reads.load() < NumReads && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::yield();
+            }
+            readers_progressed = reads.load() >= NumReads;
+            value = 20;
+        });
+    });
+    while (!in_update.load()) {
+        std::this_thread::yield();
+    }
+    for (int i = 0; i < NumReads; ++i) {
+        EXPECT_EQ(map.find(1), std::optional<int>(10));
+        EXPECT_FALSE(map.contains(2));
+        reads++;
+    }
+    writer.join();
+
+    EXPECT_TRUE(readers_progressed);
+    EXPECT_EQ(map.find(2), std::optional<int>(20));
+}
+
+TEST(ShardedFlatHashMapTest, OptimisticReadersNeverSeeTornValues) {
+    // hi is always ~lo, and the writers rewrite both halves, so a torn copy breaks the invariant
+    struct Pair {
+        uint64_t lo;
+        uint64_t hi;
+    };
+    ShardedFlatHashMap<int, Pair, 4> map;
+    static_assert(ShardedFlatHashMap<int, Pair, 4>::OptimisticReads);
+    constexpr int NumWriters = 4;
+    constexpr int KeysPerWriter = 20000;
+    std::atomic<bool> done{false};
+    std::atomic<int> bad_reads{0};
+
+    // Readers run while the writers rehash, replace and reclaim the shard maps
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; ++r) {
+        readers.emplace_back([&, r]() {
+            std::mt19937 rng(r);
+            while (!done.load()) {
+                int key = static_cast<int>(rng() % (NumWriters * KeysPerWriter));
+                auto value = map.find(key);
+                if (value && value->hi != ~value->lo) {
+                    bad_reads++;
+                }
+            }
+        });
+    }
+    std::vector<std::thread> writers;
+    for (int w = 0; w < NumWriters; ++w) {
+        writers.emplace_back([&, w]() {
+            for (int i = w * KeysPerWriter; i < (w + 1) * KeysPerWriter; ++i) {
+                EXPECT_TRUE(map.insert(i, Pair{0, ~uint64_t(0)}));
+                map.update(i, [](Pair & value) {
+                    value.lo++;
+                    value.hi = ~value.lo;
+                });
+            }
+            for (int i = w * KeysPerWriter + 1; i < (w + 1) * KeysPerWriter; i += 2) {
+                EXPECT_EQ(map.erase(i), 1u);
+            }
+        });
+    }
+    for (auto & writer : writers) {
+        writer.join();
+    }
+    done = true;
+    for (auto & reader : readers) {
+        reader.join();
+    }
+
+    EXPECT_EQ(bad_reads.load(), 0);
+    EXPECT_EQ(map.size(), NumWriters * KeysPerWriter / 2u);
+    for (int i = 0; i < NumWriters * KeysPerWriter; ++i) {
+        auto value = map.find(i);
+        ASSERT_EQ(value.has_value(), i % 2 == 0) << "Mismatch for key " << i;
+        if (value) {
+            EXPECT_EQ(value->lo, 1u);
+        }
+    }
+    map.clear();
+    EXPECT_TRUE(map.empty());
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
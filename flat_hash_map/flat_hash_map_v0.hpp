@@ -8,6 +8,7 @@
 #include <optional>
 #include <cassert>
 #include <cstddef>
+#include "hash_policy.hpp"
 
 //#define DEBUG_FHM
 
@@ -18,7 +19,8 @@ template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>, // for simplicity I ignore this template parameter temporarily
-          typename Allocator = std::allocator<std::pair<const K, V>>>
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
 requires ((InitCapacity > 0) && ((InitCapacity & (InitCapacity - 1)) == 0))
 class FlatHashMapV0 {
 public:
@@ -57,11 +59,16 @@ public:
         std::pair<K, V> * pair_ptr_;
     };
 
-    FlatHashMapV0() : elements_(InitCapacity), capacity_(InitCapacity) {}
+    FlatHashMapV0() : FlatHashMapV0(Allocator()) {}
+    // The elements are allocated through a copy of "alloc" rebound to ElementT
+    explicit FlatHashMapV0(const Allocator & alloc) : elements_(InitCapacity, ElementAllocator(alloc)), capacity_(InitCapacity) {}
     FlatHashMapV0(const FlatHashMapV0 & other) = default;
     FlatHashMapV0(FlatHashMapV0 && other) noexcept = default;
 
     bool empty() const noexcept;
+    Allocator get_allocator() const {
+        return Allocator(elements_.get_allocator());
+    }
     std::size_t size() const noexcept;
     std::size_t capacity() const noexcept;
 
@@ -69,7 +76,8 @@ public:
     V & operator[](const K & key);
 
     std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair);
-    // std::pair<IteratorT, bool> insert(value_tyupe && pair);
+    // The key of a value_type is const, so only the value is moved into the slot
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair);
 
     std::size_t erase(const K & key);
     // IteratorT erase(ConstIterator position);
@@ -99,9 +107,13 @@ public:
 
     // void rehash(std::size_t num_buckets);
 private:
+    // Both inserts: probe with the key of "pair", and only copy or move it into a slot if the key is absent
+    template <typename P>
+    std::pair<IteratorT, bool> insert_impl(P && pair);
     void expand_and_rehash();
 
-    using ContainerT = std::vector<ElementT>;
+    using ElementAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<ElementT>;
+    using ContainerT = std::vector<ElementT, ElementAllocator>;
 
     ContainerT elements_;
     std::size_t size_{0}; // TODO: Test use std::size_t or std::ssize_t here
@@ -113,8 +125,9 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-bool FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::empty() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+bool FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::empty() const noexcept {
     return size_ == 0;
 }
 
@@ -122,8 +135,9 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::size() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::size() const noexcept {
     return size_;
 }
 
@@ -131,8 +145,9 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::capacity() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::capacity() const noexcept {
     return capacity_;
 }
 
@@ -140,9 +155,10 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-const V & FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::at(const K & key) const {
-    std::size_t pos = Hash()(key) % capacity_;
+          typename Allocator,
+          typename IndexPolicy>
+const V & FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::at(const K & key) const {
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t cnt = 0;
     do {
         auto & element = elements_.at(pos);
@@ -156,9 +172,8 @@ const V & FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::at(const
                 break;
             }
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
         cnt++;
-        // make sure capacity_ is a power of 2 to optimize this
     } while (cnt < capacity_);
 
     if(cnt == capacity_) {
@@ -171,12 +186,13 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-V & FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::operator[](const K & key) {
+          typename Allocator,
+          typename IndexPolicy>
+V & FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::operator[](const K & key) {
     if(load_factor() > max_load_factor_) {
         expand_and_rehash();
     }
-    std::size_t pos = Hash()(key) % capacity_;
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
 
     // NOTE: In this naive implementation, I cannot just iterate through the element
     // from position "pos", and insert a dump element if we encounter an invalid element.
@@ -213,7 +229,7 @@ V & FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::operator[](con
         else if(element.pair.first == key) {
             break;
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
     } while (true);
     return elements_[pos].pair.second;
 }
@@ -222,16 +238,17 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::find(const K & key) -> IteratorT {
-    std::size_t pos = Hash()(key) % capacity_;
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::find(const K & key) -> IteratorT {
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t cnt = 0;
     do {
         auto & element = elements_[pos];
         if((element.is_valid) && (element.pair.first == key)) {
             return IteratorT(&element.pair);
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
         cnt++;
     } while (cnt < capacity_);
     return end();
@@ -241,8 +258,30 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+    return insert_impl(pair);
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert(std::pair<const K, V> && pair) -> std::pair<IteratorT, bool> {
+    return insert_impl(std::move(pair));
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+template <typename P>
+auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert_impl(P && pair) -> std::pair<IteratorT, bool> {
     if(load_factor() > max_load_factor_) {
         // #ifdef DEBUG_FHM
         //     std::cout << "size is " << size_ << "capacity is " << capacity_ << std::endl;
@@ -252,7 +291,7 @@ auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::insert(const
     }
 
     const K & key = pair.first;
-    std::size_t pos = Hash()(key) % capacity_;
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     do {
         auto & element = elements_.at(pos);
         if(element.pair.first == key) {
@@ -261,15 +300,14 @@ auto FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::insert(const
         if(!element.is_valid) {
             break;
         }
-        pos = (pos + 1) % capacity_;
-        // make sure capacity_ is a power of 2 to optimize this
+        pos = (pos + 1) & (capacity_ - 1);
     } while (true);
 
     // #ifdef DEBUG_FHM
     //     std::cout << "[insert] Setting" << std::endl;
     // #endif
 
-    elements_[pos] = {true, {pair.first, pair.second}};
+    elements_[pos] = {true, {pair.first, std::forward<P>(pair).second}};
     size_++;
     return {IteratorT(&(elements_[pos].pair)), true};
 }
@@ -278,8 +316,9 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::erase(const K & key) {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::erase(const K & key) {
     IteratorT it = find(key);
     if(it == end()) {
         return 0;
@@ -305,21 +344,22 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::expand_and_rehash() {
-    ContainerT new_elements(elements_.size() * 2);
+          typename Allocator,
+          typename IndexPolicy>
+void FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::expand_and_rehash() {
+    ContainerT new_elements(elements_.size() * 2, elements_.get_allocator());
     capacity_ *= 2;
     for(auto & element : elements_) {
         if(element.is_valid) {
-            std::size_t new_pos = Hash()(element.pair.first) % capacity_;
+            std::size_t new_pos = IndexPolicy::index(Hash()(element.pair.first), capacity_);
             while(true) {
                 // Don't forget to apply linear probe when resizing
                 auto & new_element = new_elements[new_pos];
                 if(!new_element.is_valid) {
-                    new_element = element;
+                    new_element = std::move(element);
                     break;
                 }
-                new_pos = (new_pos + 1) % capacity_;
+                new_pos = (new_pos + 1) & (capacity_ - 1);
             }
         }
     }
@@ -330,8 +370,9 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator>::clear() {
+          typename Allocator,
+          typename IndexPolicy>
+void FlatHashMapV0<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::clear() {
     capacity_ = InitCapacity;
     elements_.clear();
     elements_.resize(InitCapacity);
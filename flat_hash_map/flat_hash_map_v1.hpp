@@ -8,6 +8,7 @@
 #include <optional>
 #include <cassert>
 #include <cstddef>
+#include "hash_policy.hpp"
 
 // #define DEBUG_FHM
 // #define PRINT_FHM_CMP_POS
@@ -33,7 +34,8 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
 requires ((std::is_same_v<ValidAndPosStructType,uint8_t> || (std::is_same_v<ValidAndPosStructType, uint16_t>)
      || (std::is_same_v<ValidAndPosStructType, uint32_t>))
     && (InitCapacity > 0) && ((InitCapacity & (InitCapacity - 1)) == 0))
@@ -48,10 +50,10 @@ public:
         std::pair<K, V> pair;
 
         ElementT() : is_valid(0), pos(0) {}
-        void set(ValidAndPosStructType p, const K& key, const V& value) {
+        void set(ValidAndPosStructType p, const K& key, V value) {
             is_valid = true;
             pos = p;
-            pair = std::pair<K, V>(key, value);
+            pair = std::pair<K, V>(key, std::move(value));
         }
 
         friend std::ostream & operator<<(std::ostream & cout, const ElementT & element) {
@@ -112,11 +114,16 @@ public:
         std::pair<K, V> * pair_ptr_;
     };
 
-    FlatHashMapV1() : elements_(InitCapacity), capacity_(InitCapacity) {}
+    FlatHashMapV1() : FlatHashMapV1(Allocator()) {}
+    // The elements are allocated through a copy of "alloc" rebound to ElementT
+    explicit FlatHashMapV1(const Allocator & alloc) : elements_(InitCapacity, ElementAllocator(alloc)), capacity_(InitCapacity) {}
     FlatHashMapV1(const FlatHashMapV1 & other) = default;
     FlatHashMapV1(FlatHashMapV1 && other) noexcept = default;
 
     bool empty() const noexcept;
+    Allocator get_allocator() const {
+        return Allocator(elements_.get_allocator());
+    }
     std::size_t size() const noexcept;
     std::size_t capacity() const noexcept;
 
@@ -124,7 +131,8 @@ public:
     V & operator[](const K & key);
 
     std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair);
-    // std::pair<IteratorT, bool> insert(value_tyupe && pair);
+    // The key of a value_type is const, so only the value is moved into the slot
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair);
 
     std::size_t erase(const K & key);
     // IteratorT erase(ConstIterator position);
@@ -154,9 +162,13 @@ public:
 
     // void rehash(std::size_t num_buckets);
 private:
+    // Both inserts: probe with the key of "pair", and only copy or move it into a slot if the key is absent
+    template <typename P>
+    std::pair<IteratorT, bool> insert_impl(P && pair);
     void expand_and_rehash();
 
-    using ContainerT = std::vector<ElementT>;
+    using ElementAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<ElementT>;
+    using ContainerT = std::vector<ElementT, ElementAllocator>;
 
     ContainerT elements_;
     std::size_t size_{0}; // TODO: Test use std::size_t or std::ssize_t here
@@ -169,8 +181,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-bool FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::empty() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+bool FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::empty() const noexcept {
     return size_ == 0;
 }
 
@@ -179,8 +192,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::size() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::size() const noexcept {
     return size_;
 }
 
@@ -189,8 +203,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::capacity() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::capacity() const noexcept {
     return capacity_;
 }
 
@@ -199,9 +214,10 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-const V & FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::at(const K & key) const {
-    std::size_t pos = Hash()(key) % capacity_;
+          typename Allocator,
+          typename IndexPolicy>
+const V & FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::at(const K & key) const {
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
     std::size_t cnt = 0;
     do {
@@ -216,9 +232,8 @@ const V & FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqua
                 break;
             }
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
         cnt++;
-        // make sure capacity_ is a power of 2 to optimize this
     } while (cnt < capacity_);
 
     if(cnt == capacity_) {
@@ -232,12 +247,13 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-V & FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::operator[](const K & key) {
+          typename Allocator,
+          typename IndexPolicy>
+V & FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::operator[](const K & key) {
     if(load_factor() > max_load_factor_) {
         expand_and_rehash();
     }
-    std::size_t pos = Hash()(key) % capacity_;
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
 
     // DEBUGING
@@ -289,7 +305,7 @@ V & FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, All
         else if(element.compare_pos(start_pos) && (element.pair.first == key)) {
             break;
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
     } while (true);
     return elements_[pos].pair.second;
 }
@@ -299,9 +315,10 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::find(const K & key) -> IteratorT {
-    std::size_t pos = Hash()(key) % capacity_;
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::find(const K & key) -> IteratorT {
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
     std::size_t cnt = 0;
     do {
@@ -309,7 +326,7 @@ auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Al
         if((element.is_valid) && element.compare_pos(start_pos) && (element.pair.first == key)) {
             return IteratorT(&element.pair);
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
         cnt++;
     } while (cnt < capacity_);
     return end();
@@ -320,8 +337,32 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+    return insert_impl(pair);
+}
+
+template <typename ValidAndPosStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert(std::pair<const K, V> && pair) -> std::pair<IteratorT, bool> {
+    return insert_impl(std::move(pair));
+}
+
+template <typename ValidAndPosStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+template <typename P>
+auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert_impl(P && pair) -> std::pair<IteratorT, bool> {
     if(load_factor() > max_load_factor_) {
         // #ifdef DEBUG_FHM
         //     std::cout << "size is " << size_ << "capacity is " << capacity_ << std::endl;
@@ -331,7 +372,7 @@ auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Al
     }
 
     const K & key = pair.first;
-    std::size_t pos = Hash()(key) % capacity_;
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
     do {
         auto & element = elements_.at(pos);
@@ -341,15 +382,14 @@ auto FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Al
         if(!element.is_valid) {
             break;
         }
-        pos = (pos + 1) % capacity_;
-        // make sure capacity_ is a power of 2 to optimize this
+        pos = (pos + 1) & (capacity_ - 1);
     } while (true);
 
     // #ifdef DEBUG_FHM
     //     std::cout << "[insert] Setting" << std::endl;
     // #endif
 
-    elements_[pos].set(start_pos, pair.first, pair.second);
+    elements_[pos].set(start_pos, pair.first, std::forward<P>(pair).second);
     size_++;
     return {IteratorT(&(elements_[pos].pair)), true};
 }
@@ -359,8 +399,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::erase(const K & key) {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::erase(const K & key) {
     IteratorT it = find(key);
     if(it == end()) {
         return 0;
@@ -387,23 +428,24 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::expand_and_rehash() {
-    ContainerT new_elements(elements_.size() * 2);
+          typename Allocator,
+          typename IndexPolicy>
+void FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::expand_and_rehash() {
+    ContainerT new_elements(elements_.size() * 2, elements_.get_allocator());
     capacity_ *= 2;
     for(auto & element : elements_) {
         if(element.is_valid) {
-            std::size_t new_pos = Hash()(element.pair.first) % capacity_;
+            std::size_t new_pos = IndexPolicy::index(Hash()(element.pair.first), capacity_);
             std::size_t new_start_pos = new_pos;
             while(true) {
                 // Don't forget to apply linear probe when resizing
                 auto & new_element = new_elements[new_pos];
                 if(!new_element.is_valid) {
-                    new_element = element;
+                    new_element = std::move(element);
                     new_element.pos = new_start_pos;
                     break;
                 }
-                new_pos = (new_pos + 1) % capacity_;
+                new_pos = (new_pos + 1) & (capacity_ - 1);
             }
         }
     }
@@ -415,8 +457,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::clear() {
+          typename Allocator,
+          typename IndexPolicy>
+void FlatHashMapV1<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::clear() {
     capacity_ = InitCapacity;
     elements_.clear();
     elements_.resize(InitCapacity);
@@ -427,21 +470,24 @@ template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
-using FlatHashMapV1a = FlatHashMapV1<uint8_t, K, V, InitCapacity, Hash, KeyEqual, Allocator>;
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
+using FlatHashMapV1a = FlatHashMapV1<uint8_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>;
 
 template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
-using FlatHashMapV1b = FlatHashMapV1<uint16_t, K, V, InitCapacity, Hash, KeyEqual, Allocator>;
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
+using FlatHashMapV1b = FlatHashMapV1<uint16_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>;
 
 template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
-using FlatHashMapV1c = FlatHashMapV1<uint32_t, K, V, InitCapacity, Hash, KeyEqual, Allocator>;
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
+using FlatHashMapV1c = FlatHashMapV1<uint32_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>;
 
 }
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include <cassert>
 #include <bitset>
 #include <cstddef>
+#include "hash_policy.hpp"
+#include "bitmap.hpp"
 
 // #define DEBUG_FHM
 // #define PRINT_FHM_CMP_POS
@@ -18,13 +20,17 @@ namespace hpds {
 
 /** 
  * @brief Add a "is_removed" bit to serve as the tombersome flag.
+ * Occupied slots and tombstones are also mirrored in two Bitmaps, so that full-table iteration,
+ * clear() and expand_and_rehash() only visit live slots and skip empty regions 64 slots at a time
+ * instead of reading every ElementT.
  */
 template <typename ValidAndPosStructType,
           typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
 requires ((std::is_same_v<ValidAndPosStructType,uint8_t> || (std::is_same_v<ValidAndPosStructType, uint16_t>)
      || (std::is_same_v<ValidAndPosStructType, uint32_t>))
     && (InitCapacity > 0) && ((InitCapacity & (InitCapacity - 1)) == 0))
@@ -40,11 +46,11 @@ public:
         std::pair<K, V> pair;
 
         ElementT() : is_valid(0), is_removed(0), pos(0) {}
-        void set(ValidAndPosStructType p, const K& key, const V& value) {
+        void set(ValidAndPosStructType p, const K& key, V value) {
             is_valid = true;
             is_removed = false;
             pos = p;
-            pair = std::pair<K, V>(key, value);
+            pair = std::pair<K, V>(key, std::move(value));
         }
 
         friend std::ostream & operator<<(std::ostream & cout, const ElementT & element) {
@@ -90,7 +96,7 @@ public:
     class IteratorT {
     public:
         friend class FlatHashMapV2;
-        IteratorT(std::pair<K, V> * pair = nullptr) : pair_ptr_(pair) {}
+        IteratorT(std::pair<K, V> * pair = nullptr, FlatHashMapV2 * map = nullptr) : pair_ptr_(pair), map_(map) {}
         IteratorT(const IteratorT & other) = default;
 
         bool operator== (const IteratorT & other) const {
@@ -104,6 +110,13 @@ public:
             return pair_ptr_;
         }
 
+        // Move to the next live slot, found through the occupancy bitmap
+        IteratorT & operator++() {
+            std::size_t next = map_ -> occupied_.find_next_set(map_ -> index_of(pair_ptr_) + 1);
+            pair_ptr_ = (next < map_ -> capacity_) ? &(map_ -> elements_[next].pair) : nullptr;
+            return *this;
+        }
+
     private:
         void invalidate() {
             // A fatal bug happened here, here's the reason for the bug
@@ -114,13 +127,21 @@ public:
             element_ptr -> is_removed = true;
         }
         std::pair<K, V> * pair_ptr_;
+        FlatHashMapV2 * map_;
     };
 
-    FlatHashMapV2() : elements_(InitCapacity), capacity_(InitCapacity) {}
+    FlatHashMapV2() : FlatHashMapV2(Allocator()) {}
+    // Every array of the map (the elements and both bitmaps) is allocated through a rebound copy of "alloc"
+    explicit FlatHashMapV2(const Allocator & alloc)
+        : elements_(InitCapacity, ElementAllocator(alloc)), occupied_(BitmapAllocator(alloc)), removed_(BitmapAllocator(alloc)),
+          capacity_(InitCapacity) {}
     FlatHashMapV2(const FlatHashMapV2 & other) = default;
     FlatHashMapV2(FlatHashMapV2 && other) noexcept = default;
 
     bool empty() const noexcept;
+    Allocator get_allocator() const {
+        return Allocator(elements_.get_allocator());
+    }
     std::size_t size() const noexcept;
     std::size_t capacity() const noexcept;
 
@@ -128,7 +149,8 @@ public:
     V & operator[](const K & key);
 
     std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair);
-    // std::pair<IteratorT, bool> insert(value_tyupe && pair);
+    // The key of a value_type is const, so only the value is moved into the slot
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair);
 
     std::size_t erase(const K & key);
     // IteratorT erase(ConstIterator position);
@@ -140,6 +162,11 @@ public:
 
     // std::size_t count(const K & key) const noexcept;
 
+    IteratorT begin() {
+        std::size_t first = occupied_.find_next_set(0);
+        return (first < capacity_) ? IteratorT(&(elements_[first].pair), this) : end();
+    }
+
     IteratorT end() const {
         return IteratorT(nullptr);
     }
@@ -158,11 +185,24 @@ public:
 
     // void rehash(std::size_t num_buckets);
 private:
+    // Both inserts: probe with the key of "pair", and only copy or move it into a slot if the key is absent
+    template <typename P>
+    std::pair<IteratorT, bool> insert_impl(P && pair);
     void expand_and_rehash();
 
-    using ContainerT = std::vector<ElementT>;
+    std::size_t index_of(const std::pair<K, V> * pair_ptr) const {
+        return reinterpret_cast<const ElementT *>(reinterpret_cast<const uint8_t *>(pair_ptr) - offsetof(ElementT, pair)) 
+            - elements_.data();
+    }
+
+    using ElementAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<ElementT>;
+    using ContainerT = std::vector<ElementT, ElementAllocator>;
+    using BitmapAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<uint64_t>;
+    using BitmapT = Bitmap<InitCapacity, 64, BitmapAllocator>;
 
     ContainerT elements_;
+    BitmapT occupied_;
+    BitmapT removed_;
     std::size_t size_{0}; // TODO: Test use std::size_t or std::ssize_t here
     std::size_t capacity_;
     float max_load_factor_{0.6};
@@ -173,8 +213,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-bool FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::empty() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+bool FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::empty() const noexcept {
     return size_ == 0;
 }
 
@@ -183,8 +224,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::size() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::size() const noexcept {
     return size_;
 }
 
@@ -193,8 +235,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::capacity() const noexcept {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::capacity() const noexcept {
     return capacity_;
 }
 
@@ -203,9 +246,10 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-const V & FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::at(const K & key) const {
-    std::size_t pos = Hash()(key) % capacity_;
+          typename Allocator,
+          typename IndexPolicy>
+const V & FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::at(const K & key) const {
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
     std::size_t cnt = 0;
     do {
@@ -224,9 +268,8 @@ const V & FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqua
             // Use the tombersome flag to accelerate finding for removed elements
             throw std::out_of_range("[FlatHashMapV2::at] key is not found");
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
         cnt++;
-        // make sure capacity_ is a power of 2 to optimize this
     } while (cnt < capacity_);
 
     if(cnt == capacity_) {
@@ -240,12 +283,13 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-V & FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::operator[](const K & key) {
+          typename Allocator,
+          typename IndexPolicy>
+V & FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::operator[](const K & key) {
     if(load_factor() > max_load_factor_) {
         expand_and_rehash();
     }
-    std::size_t pos = Hash()(key) % capacity_;
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
 
     // DEBUGING
@@ -285,8 +329,11 @@ V & FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, All
             // If map[k] does not exists, we insert a dump element and increment the size.
             // And we return the dump element.
             element.is_valid = true;
+            element.is_removed = false;
             element.pos = start_pos;
             element.pair.first = key;
+            occupied_.set(pos);
+            removed_.reset(pos);
 
             // // DEBUGING
             // element.pair.second = 1;
@@ -297,7 +344,7 @@ V & FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, All
         else if(element.compare_pos(start_pos) && (element.pair.first == key)) {
             break;
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
     } while (true);
     return elements_[pos].pair.second;
 }
@@ -307,9 +354,10 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::find(const K & key) -> IteratorT {
-    std::size_t pos = Hash()(key) % capacity_;
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::find(const K & key) -> IteratorT {
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
     std::size_t cnt = 0;
     do {
@@ -323,7 +371,7 @@ auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Al
         // DEBUGING
 
         if((element.is_valid) && element.compare_pos(start_pos) && (element.pair.first == key)) {
-            return IteratorT(&element.pair);
+            return IteratorT(&element.pair, this);
         }
         else if((element.is_removed) && element.compare_pos(start_pos) && (element.pair.first== key)) {
             // Use the tombersome flag to accelerate finding for removed elements
@@ -337,7 +385,7 @@ auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Al
 
             return end();
         }
-        pos = (pos + 1) % capacity_;
+        pos = (pos + 1) & (capacity_ - 1);
         cnt++;
     } while (cnt < capacity_);
     return end();
@@ -348,8 +396,32 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+    return insert_impl(pair);
+}
+
+template <typename ValidAndPosStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert(std::pair<const K, V> && pair) -> std::pair<IteratorT, bool> {
+    return insert_impl(std::move(pair));
+}
+
+template <typename ValidAndPosStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+template <typename P>
+auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert_impl(P && pair) -> std::pair<IteratorT, bool> {
     if(load_factor() > max_load_factor_) {
         // #ifdef DEBUG_FHM
         //     std::cout << "size is " << size_ << "capacity is " << capacity_ << std::endl;
@@ -359,27 +431,28 @@ auto FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Al
     }
 
     const K & key = pair.first;
-    std::size_t pos = Hash()(key) % capacity_;
+    std::size_t pos = IndexPolicy::index(Hash()(key), capacity_);
     std::size_t start_pos = pos;
     do {
         auto & element = elements_.at(pos);
         if(element.pair.first == key) {
-            return {IteratorT(&element.pair), false};
+            return {IteratorT(&element.pair, this), false};
         }
         if(!element.is_valid) {
             break;
         }
-        pos = (pos + 1) % capacity_;
-        // make sure capacity_ is a power of 2 to optimize this
+        pos = (pos + 1) & (capacity_ - 1);
     } while (true);
 
     // #ifdef DEBUG_FHM
     //     std::cout << "[insert] Setting" << std::endl;
     // #endif
 
-    elements_[pos].set(start_pos, pair.first, pair.second);
+    elements_[pos].set(start_pos, pair.first, std::forward<P>(pair).second);
+    occupied_.set(pos);
+    removed_.reset(pos);
     size_++;
-    return {IteratorT(&(elements_[pos].pair)), true};
+    return {IteratorT(&(elements_[pos].pair), this), true};
 }
 
 template <typename ValidAndPosStructType,
@@ -387,8 +460,9 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::erase(const K & key) {
+          typename Allocator,
+          typename IndexPolicy>
+std::size_t FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::erase(const K & key) {
     IteratorT it = find(key);
     if(it == end()) {
         return 0;
@@ -405,7 +479,10 @@ std::size_t FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEq
     assert(key == it -> first);
 
     // assert(static_cast<uint8_t>(it.getValidFlagField()) == 0x1);
+    std::size_t pos = index_of(&(*it));
     it.invalidate();
+    occupied_.reset(pos);
+    removed_.set(pos);
     size_--;
     return 1;
 }
@@ -415,27 +492,34 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::expand_and_rehash() {
-    ContainerT new_elements(elements_.size() * 2);
+          typename Allocator,
+          typename IndexPolicy>
+void FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::expand_and_rehash() {
+    ContainerT new_elements(elements_.size() * 2, elements_.get_allocator());
+    BitmapT new_occupied(occupied_.get_allocator());
+    new_occupied.resize(capacity_ * 2);
     capacity_ *= 2;
-    for(auto & element : elements_) {
-        if(element.is_valid) {
-            std::size_t new_pos = Hash()(element.pair.first) % capacity_;
-            std::size_t new_start_pos = new_pos;
-            while(true) {
-                // Don't forget to apply linear probe when resizing
-                auto & new_element = new_elements[new_pos];
-                if(!new_element.is_valid) {
-                    new_element = element;
-                    new_element.pos = new_start_pos;
-                    break;
-                }
-                new_pos = (new_pos + 1) % capacity_;
+    // Only visit live slots. Tombstones are dropped by the rehash.
+    occupied_.for_each_set([&](std::size_t pos) {
+        auto & element = elements_[pos];
+        std::size_t new_pos = IndexPolicy::index(Hash()(element.pair.first), capacity_);
+        std::size_t new_start_pos = new_pos;
+        while(true) {
+            // Don't forget to apply linear probe when resizing
+            auto & new_element = new_elements[new_pos];
+            if(!new_element.is_valid) {
+                new_element = std::move(element);
+                new_element.pos = new_start_pos;
+                new_occupied.set(new_pos);
+                break;
             }
+            new_pos = (new_pos + 1) & (capacity_ - 1);
         }
-    }
+    });
     elements_ = std::move(new_elements);
+    occupied_ = std::move(new_occupied);
+    removed_.clear();
+    removed_.resize(capacity_);
 }
 
 template <typename ValidAndPosStructType,
@@ -443,11 +527,22 @@ template <typename ValidAndPosStructType,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator>::clear() {
+          typename Allocator,
+          typename IndexPolicy>
+void FlatHashMapV2<ValidAndPosStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::clear() {
+    // Only reset the slots which are live or tombstones, instead of reconstructing every ElementT,
+    // then go back to InitCapacity like the other versions: the slots cut off are already empty
+    auto reset_element = [this](std::size_t pos) {
+        elements_[pos] = ElementT();
+    };
+    occupied_.for_each_set(reset_element);
+    removed_.for_each_set(reset_element);
     capacity_ = InitCapacity;
-    elements_.clear();
     elements_.resize(InitCapacity);
+    occupied_.clear();
+    occupied_.resize(InitCapacity);
+    removed_.clear();
+    removed_.resize(InitCapacity);
     size_ = 0;
 }
 
@@ -455,21 +550,24 @@ template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
-using FlatHashMapV2a = FlatHashMapV2<uint8_t, K, V, InitCapacity, Hash, KeyEqual, Allocator>;
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
+using FlatHashMapV2a = FlatHashMapV2<uint8_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>;
 
 template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
-using FlatHashMapV2b = FlatHashMapV2<uint16_t, K, V, InitCapacity, Hash, KeyEqual, Allocator>;
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
+using FlatHashMapV2b = FlatHashMapV2<uint16_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>;
 
 template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
-using FlatHashMapV2c = FlatHashMapV2<uint32_t, K, V, InitCapacity, Hash, KeyEqual, Allocator>;
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
+using FlatHashMapV2c = FlatHashMapV2<uint32_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>;
 
 }
\ No newline at end of file
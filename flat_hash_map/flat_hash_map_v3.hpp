@@ -8,104 +8,286 @@
 #include <optional>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <span>
+#include <thread>
+#include <exception>
+#include <iterator>
+#include <algorithm>
+#include <memory_resource>
+#include "control_group.hpp"
+#include "hash_policy.hpp"
+#include "slot_layout.hpp"
+#include "hash_stats.hpp"
 
 // #define DEBUG_FHM
 
 namespace hpds {
 // hpds is for High-Performance Data Structures
 
+template <typename K, typename V, typename Hash, typename KeyEqual, typename IndexPolicy, typename Layout>
+class FrozenFlatHashMapV3;
+
+/**
+ * @brief Split the metadata out of ElementT into a separate array of 1-byte control tags
+ * (SwissTable style). Each control byte is kCtrlEmpty, kCtrlDeleted or the 7-bit H2 of the key
+ * stored in the slot, and the rest of the hash (H1) selects the home group.
+ * Instead of walking one fat ElementT at a time, a probe step loads a whole ControlGroup
+ * (16 control bytes with SSE2, 32 with AVX2), compares all of them against H2 with cmpeq + movemask,
+ * and only touches the ElementTs whose tags match. A probe stops at the first group that has an empty slot.
+ *
+ * Groups are aligned to ControlGroup::Width and probed in triangular order (0, 1, 3, 6, ...),
+ * which visits every group exactly once because the number of groups is a power of 2.
+ *
+ * The hash of a key is computed once per operation. Callers that already have Hash()(key)
+ * can pass it to find(key, hash), and with a transparent Hash / KeyEqual (see hash_policy.hpp)
+ * lookups accept any compatible key type, e.g. std::string_view for std::string keys.
+ *
+ * With set_incremental_rehash(true), growing the table does not move every element in one call.
+ * The old table is kept beside the new one, each insert / erase migrates the next MigrateSlots slots,
+ * and lookups probe the new table first and then the old one until the migration is done.
+ * This bounds the work of a single operation, at the cost of a second probe for misses meanwhile.
+ *
+ * Big tables can be built and grown with several threads: bulk_insert() fills the table in parallel, and
+ * set_rehash_threads() makes the one-shot rehash parallel. Both split the elements by the region of the table
+ * their home group falls into, one region per thread, so threads never write to the same group.
+ *
+ * Layout picks how the slots are stored (see slot_layout.hpp): InterleavedLayout keeps a std::pair<K, V>
+ * per slot, SplitLayout keeps keys and values in parallel arrays so that probes never pull value bytes
+ * into cache. With SplitLayout, iterators hand out std::pair<const K &, V &> instead of std::pair<K, V> &.
+ *
+ * stats() reports the load, tombstones and cluster lengths of the table. StatsPolicy (see hash_stats.hpp)
+ * can also record the number of groups probed by every lookup and the rehashes, e.g. with ProbeStats.
+ * The default NoStats records nothing and compiles away.
+ */
 template <typename K, typename V,
           std::size_t InitCapacity = 256,
           typename Hash = std::hash<K>,
           typename KeyEqual = std::equal_to<K>,
-          typename Allocator = std::allocator<std::pair<const K, V>>>
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex,
+          typename Layout = InterleavedLayout,
+          typename StatsPolicy = NoStats>
 requires ((InitCapacity > 0) && ((InitCapacity & (InitCapacity - 1)) == 0))
-class FlatHashMapV2 {
+class FlatHashMapV3 {
 public:
-    struct MetaT {
-        uint32_t is_valid : 1;
-        uint32_t pos : 31;
-
-        MetaT() : is_valid(0), pos(0) {}
-
-        void set(bool valid, uint32_t p) {
-            is_valid = valid;
-            pos = p;
-        }
-
-        friend std::ostream & operator<<(std::ostream & cout, const ElementT & element) {
-            return (cout << "{ is_valid : " << is_valid << ", pos : " << pos  <<  " }\n");
-        }
-    };
-
-    // Keep struct alignment padding in mind
-    struct ElementT {
-        std::pair<K, V> pair;
-
-        void set(const K& key, const V& value) {
-            pair = std::pair<K, V>(key, value);
-        }
+    constexpr static std::size_t GroupWidth = ControlGroup::Width;
 
-        friend std::ostream & operator<<(std::ostream & cout, const ElementT & element) {
-            return (cout << "{ key : " << element.pair.first << ", value : " << element.pair.second << " }\n");
-        }
-    };
-        
-    friend class IteratorT;
-
-    class IteratorT {
-    public:
-        friend class FlatHashMapV2;
-        IteratorT(std::pair<K, V> * pair = nullptr) : pair_ptr_(pair) {}
-        IteratorT(const IteratorT & other) = default;
-
-        bool operator== (const IteratorT & other) const {
-            return (pair_ptr_ == other.pair_ptr_);
-        }
+    using SlotsT = typename Layout::template Slots<K, V, Allocator>;
+    using IteratorT = typename SlotsT::IteratorT;
 
-        std::pair<K, V> & operator*() {
-            return *pair_ptr_;
+    FlatHashMapV3() : FlatHashMapV3(Allocator()) {}
+    // Both the control bytes and the elements are allocated through copies of "alloc" rebound to their types
+    explicit FlatHashMapV3(const Allocator & alloc)
+        : ctrl_(InitSlots, kCtrlEmpty, ControlAllocator(alloc)), elements_(alloc, InitSlots), capacity_(InitSlots),
+          old_ctrl_(ControlAllocator(alloc)), old_elements_(alloc) {}
+    // Only the live pairs of both tables are copied
+    FlatHashMapV3(const FlatHashMapV3 & other)
+        : FlatHashMapV3(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(other.get_allocator())) {}
+    FlatHashMapV3(const FlatHashMapV3 & other, const Allocator & alloc)
+        : ctrl_(other.ctrl_, ControlAllocator(alloc)), elements_(alloc, other.capacity_),
+          size_(other.size_), num_deleted_(other.num_deleted_), capacity_(other.capacity_), max_load_factor_(other.max_load_factor_),
+          old_ctrl_(other.old_ctrl_, ControlAllocator(alloc)), old_elements_(alloc, other.old_elements_.size()),
+          old_capacity_(other.old_capacity_), migrate_pos_(other.migrate_pos_), incremental_rehash_(other.incremental_rehash_),
+          rehash_threads_(other.rehash_threads_), stats_(other.stats_) {
+        copy_elements(ctrl_, other.elements_, elements_);
+        try {
+            copy_elements(old_ctrl_, other.old_elements_, old_elements_);
+        } catch(...) {
+            destroy_elements(ctrl_, elements_);
+            throw;
         }
-        std::pair<K, V> * operator->() {
-            return pair_ptr_;
+    }
+    // The source is left as an empty map of InitSlots slots, which is why moving allocates
+    FlatHashMapV3(FlatHashMapV3 && other) : FlatHashMapV3(other.get_allocator()) {
+        swap(other);
+    }
+    FlatHashMapV3 & operator=(const FlatHashMapV3 & other) {
+        if(this != &other) {
+            using Traits = std::allocator_traits<Allocator>;
+            FlatHashMapV3 copy(other, Traits::propagate_on_container_copy_assignment::value ? other.get_allocator() : get_allocator());
+            take(copy);
         }
-
-    private:
-        bool & getValidFlagField() {
-            // A fatal bug happened here, here's the reason for the bug
-            // 1. I don't consider struct alignment rule
-            // 2. I don't convert pair_ptr to uint8_t * before pointer arithmatic
-            return *(reinterpret_cast<bool *>(reinterpret_cast<uint8_t *>(pair_ptr_) - offsetof(ElementT, pair)));
+        return *this;
+    }
+    // The source is left as an empty map of InitSlots slots. If the allocators differ and do not propagate,
+    // our allocator cannot free the arrays of "other", so its pairs are copied instead
+    FlatHashMapV3 & operator=(FlatHashMapV3 && other) {
+        if(this != &other) {
+            using Traits = std::allocator_traits<Allocator>;
+            if constexpr (!Traits::propagate_on_container_move_assignment::value && !Traits::is_always_equal::value) {
+                if(!(get_allocator() == other.get_allocator())) {
+                    FlatHashMapV3 copy(other, get_allocator());
+                    take(copy);
+                    other.clear();
+                    return *this;
+                }
+            }
+            FlatHashMapV3 moved(std::move(other));
+            take(moved);
         }
-        std::pair<K, V> * pair_ptr_;
-    };
-
-    FlatHashMapV2() : elements_(InitCapacity), capacity_(InitCapacity) {}
-    FlatHashMapV2(const FlatHashMapV2 & other) = default;
-    FlatHashMapV2(FlatHashMapV2 && other) noexcept = default;
+        return *this;
+    }
+    // The allocators must compare equal
+    void swap(FlatHashMapV3 & other) noexcept {
+        assert(get_allocator() == other.get_allocator());
+        std::swap(ctrl_, other.ctrl_);
+        std::swap(elements_, other.elements_);
+        std::swap(size_, other.size_);
+        std::swap(num_deleted_, other.num_deleted_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(max_load_factor_, other.max_load_factor_);
+        std::swap(old_ctrl_, other.old_ctrl_);
+        std::swap(old_elements_, other.old_elements_);
+        std::swap(old_capacity_, other.old_capacity_);
+        std::swap(migrate_pos_, other.migrate_pos_);
+        std::swap(incremental_rehash_, other.incremental_rehash_);
+        std::swap(rehash_threads_, other.rehash_threads_);
+        std::swap(stats_, other.stats_);
+    }
+    ~FlatHashMapV3() {
+        destroy_elements(ctrl_, elements_);
+        destroy_elements(old_ctrl_, old_elements_);
+    }
 
     bool empty() const noexcept;
+    Allocator get_allocator() const {
+        return elements_.get_allocator();
+    }
     std::size_t size() const noexcept;
     std::size_t capacity() const noexcept;
 
     const V & at(const K & key) const;
     V & operator[](const K & key);
+    V & operator[](K && key);
 
     std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair);
-    // std::pair<IteratorT, bool> insert(value_tyupe && pair);
+    // The key of a value_type is const, so only the value is moved
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair);
+
+    // Make room for "n" elements, so that inserting up to "n" elements does not rehash
+    void reserve(std::size_t n);
+
+    /**
+     * @brief Insert the pairs of [first, last) with "threads" threads. The result is the same as insert() on each
+     * of them in order: keys already in the map keep their value, and the first of duplicate keys wins.
+     * The table is reserved up front, then the keys are hashed in parallel and split by region (see above).
+     * Each thread only places keys whose home group has an empty slot: then both the duplicate check and
+     * the insertion stay inside that group. The other keys may probe into another region, so they are
+     * inserted by the calling thread at the end, which is rare below the max load factor.
+     * Hash, KeyEqual and the copy constructors of K and V are called concurrently, on different elements.
+     */
+    template <std::random_access_iterator It>
+    void bulk_insert(It first, It last, std::size_t threads = std::thread::hardware_concurrency());
+
+    // Threads used by a one-shot rehash of ParallelRehashMinSlots slots or more. The default 1 rehashes on
+    // the calling thread. Elements are moved concurrently, and an incremental rehash is never parallel.
+    void set_rehash_threads(std::size_t threads) {
+        rehash_threads_ = std::max<std::size_t>(1, threads);
+    }
+
+    // Probe exactly once: return the element of "key" if it exists,
+    // otherwise construct the pair in place from "key" and V(args...)
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(const K & key, Args && ... args) {
+        return try_emplace_impl(key, mix(Hash()(key)), std::forward<Args>(args)...);
+    }
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(K && key, Args && ... args) {
+        const std::size_t hash = mix(Hash()(key));
+        return try_emplace_impl(std::move(key), hash, std::forward<Args>(args)...);
+    }
+
+    // The key has to be known before probing, so the pair is built first and then moved into its slot.
+    // Prefer try_emplace when the key is at hand.
+    template <typename ... Args>
+    std::pair<IteratorT, bool> emplace(Args && ... args) {
+        std::pair<K, V> pair(std::forward<Args>(args)...);
+        return try_emplace(std::move(pair.first), std::move(pair.second));
+    }
+
+    template <typename M>
+    std::pair<IteratorT, bool> insert_or_assign(const K & key, M && value) {
+        auto result = try_emplace(key, std::forward<M>(value));
+        if(!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
+    template <typename M>
+    std::pair<IteratorT, bool> insert_or_assign(K && key, M && value) {
+        auto result = try_emplace(std::move(key), std::forward<M>(value));
+        if(!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
 
     std::size_t erase(const K & key);
-    // IteratorT erase(ConstIterator position);
 
     void clear();
 
     IteratorT find(const K & key);
-    // ConstIteratorT find(const K & key) const;
 
-    // std::size_t count(const K & key) const noexcept;
+    // "hash" must be Hash()(key), e.g. computed once and reused across several maps
+    IteratorT find(const K & key, std::size_t hash) {
+        return find_it(key, mix(hash));
+    }
+
+    // Heterogeneous lookup, only available with a transparent Hash and KeyEqual
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    IteratorT find(const Q & key) {
+        return find_it(key, mix(Hash()(key)));
+    }
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    IteratorT find(const Q & key, std::size_t hash) {
+        return find_it(key, mix(hash));
+    }
+
+    /**
+     * @brief Look up keys[i] into out[i] (end() on a miss). The lookups are software-pipelined:
+     * while key i is resolved, the control group of key i + PrefetchDistance is matched and its first
+     * candidate element is prefetched, and key i + 2 * PrefetchDistance is hashed and its control group
+     * is prefetched. So many independent cache misses are in flight instead of one at a time.
+     */
+    void find_batch(std::span<const K> keys, std::span<IteratorT> out);
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    const V & at(const Q & key) const {
+        IteratorT it = find_it(key, mix(Hash()(key)));
+        if(it == end()) {
+            throw std::out_of_range("[FlatHashMapV3::at] key is not found");
+        }
+        return (*it).second;
+    }
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    V & operator[](const Q & key) {
+        return try_emplace(key).first -> second;
+    }
+
+    // K is only constructed from "key" if the element is inserted
+    template <typename Q, typename ... Args>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    std::pair<IteratorT, bool> try_emplace(const Q & key, Args && ... args) {
+        return try_emplace_impl(key, mix(Hash()(key)), std::forward<Args>(args)...);
+    }
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    std::size_t erase(const Q & key) {
+        return erase_impl(key, mix(Hash()(key)));
+    }
 
     IteratorT end() const {
-        return IteratorT(nullptr);
+        return IteratorT();
     }
 
     float load_factor() const noexcept {
@@ -114,30 +296,224 @@ public:
     void set_max_load_factor(float max_load_factor) {
         max_load_factor_ = max_load_factor;
     }
+    // Turning it off finishes a migration in progress
+    void set_incremental_rehash(bool incremental_rehash) {
+        incremental_rehash_ = incremental_rehash;
+        if(!incremental_rehash_ && rehashing()) {
+            migrate_step(old_capacity_);
+        }
+    }
+    // Whether an incremental rehash is in progress, i.e. the old table still holds elements
+    bool rehashing() const noexcept {
+        return old_capacity_ != 0;
+    }
+    // Whether the next try_emplace moves elements to new arrays (a rehash, or a step of the one in progress)
+    // before it inserts. Every other update changes at most the slot of its key in place.
+    bool insert_needs_rehash() const noexcept {
+        return rehashing() || need_rehash();
+    }
+
+    // Shape of the table, plus what StatsPolicy recorded so far
+    HashMapStats stats() const;
+    void reset_stats() {
+        stats_.reset();
+    }
 
     // For debug only
     std::size_t get_capacity() const {
         return capacity_;
     }
+    // Number of elements of the current table by the number of groups probed past their home group
+    std::vector<std::size_t> probe_histogram() const;
 
-    // void rehash(std::size_t num_buckets);
 private:
+    // Writes the tables as they are and probes them with find_in_table
+    template <typename, typename, typename, typename, typename, typename>
+    friend class FrozenFlatHashMapV3;
+
+    constexpr static std::size_t PrefetchDistance = 8;
+    // Below these sizes, starting threads costs more than it saves
+    constexpr static std::size_t ParallelRehashMinSlots = std::size_t(1) << 16;
+    constexpr static std::size_t ParallelInsertMinItems = std::size_t(1) << 12;
+    // Old slots migrated per insert / erase during an incremental rehash. A migration starts with
+    // the new table at most half full, so one group per operation finishes it long before the new table fills up.
+    constexpr static std::size_t MigrateSlots = GroupWidth;
+
+    // A group must fit in the table, so tiny InitCapacity values are rounded up
+    constexpr static std::size_t InitSlots = (InitCapacity < GroupWidth) ? GroupWidth : InitCapacity;
+
+    // std::hash<int> is the identity function, and H1 / H2 are carved out of fixed bit ranges,
+    // so mix the hash before using it. Otherwise sequential keys share the same H2 and
+    // small keys all land in the same group.
+    static std::size_t mix(std::size_t hash) {
+        return mix_hash(hash);
+    }
+    // H1 picks the home group through IndexPolicy, and H2 takes 7 bits from the other end of the hash,
+    // so that the elements of one group do not all share the bits of H2
+    static std::size_t home_group(std::size_t hash, std::size_t num_groups) {
+        return IndexPolicy::index(hash, num_groups);
+    }
+    static ctrl_t h2(std::size_t hash) {
+        if constexpr (IndexPolicy::HighBits) {
+            return static_cast<ctrl_t>(hash & 0x7F);
+        } else {
+            return static_cast<ctrl_t>(hash >> 57);
+        }
+    }
+
+    // Probe one table (the current or the old one, or a frozen snapshot of one). Returns "capacity" if the key is not found.
+    // "probe_length" is set to the number of groups probed past the home group
+    template <typename Q, typename Elements = SlotsT>
+    static std::size_t find_in_table(const ctrl_t * ctrl, const Elements & elements, std::size_t capacity,
+                                     const Q & key, std::size_t hash, std::size_t & probe_length);
+    // Returns capacity_ if the key is not found in the current table
+    template <typename Q>
+    std::size_t find_index(const Q & key, std::size_t hash, std::size_t & probe_length) const {
+        return find_in_table(ctrl_.data(), elements_, capacity_, key, hash, probe_length);
+    }
+    // Look in the current table, then in the old one if a migration is in progress. Returns end() if not found
+    template <typename Q>
+    IteratorT find_it(const Q & key, std::size_t hash);
+    template <typename Q>
+    IteratorT find_it(const Q & key, std::size_t hash) const {
+        return const_cast<FlatHashMapV3 *>(this)->find_it(key, hash);
+    }
+    // Probe once for "key". Returns {index of key, false} if it exists,
+    // otherwise {first empty or deleted slot on the probe sequence, true}
+    template <typename Q>
+    std::pair<std::size_t, bool> find_or_prepare_insert(const Q & key, std::size_t hash);
+    // K is constructed from std::forward<Q>(key) only on insertion
+    template <typename Q, typename ... Args>
+    std::pair<IteratorT, bool> try_emplace_impl(Q && key, std::size_t hash, Args && ... args);
+    template <typename Q>
+    std::size_t erase_impl(const Q & key, std::size_t hash);
+    std::size_t erase_at(std::size_t pos);
+    void set_ctrl(std::size_t pos, ctrl_t ctrl) {
+        ctrl_[pos] = ctrl;
+    }
+
+    bool need_rehash() const {
+        // tombstones lengthen probe sequences just like live elements
+        return (size_ + num_deleted_ + 1) > capacity_ * max_load_factor_;
+    }
     void expand_and_rehash();
+    // Make the current table the old one and start moving it into a new table of "new_capacity" slots.
+    // Unless incremental_rehash_ is set, the migration is finished right away.
+    void rehash_to(std::size_t new_capacity);
+    // Migrate up to "max_slots" slots of the old table, and release it once it is drained
+    void migrate_step(std::size_t max_slots = MigrateSlots);
+    // Replace our tables with those of "other", whose allocator is ours or propagates on move assignment.
+    // "other" is left without tables, and is only fit for destruction
+    void take(FlatHashMapV3 & other) noexcept {
+        destroy_elements(ctrl_, elements_);
+        destroy_elements(old_ctrl_, old_elements_);
+        ctrl_ = std::move(other.ctrl_);
+        elements_ = std::move(other.elements_);
+        old_ctrl_ = std::move(other.old_ctrl_);
+        old_elements_ = std::move(other.old_elements_);
+        size_ = other.size_;
+        num_deleted_ = other.num_deleted_;
+        capacity_ = other.capacity_;
+        max_load_factor_ = other.max_load_factor_;
+        old_capacity_ = other.old_capacity_;
+        migrate_pos_ = other.migrate_pos_;
+        incremental_rehash_ = other.incremental_rehash_;
+        rehash_threads_ = other.rehash_threads_;
+        stats_ = other.stats_;
+        // Moved-from vectors are empty here, so the destructor of "other" destroys nothing
+        other.ctrl_.clear();
+        other.old_ctrl_.clear();
+    }
+    // Free the old table. Assign empty containers with the same allocator instead of swapping,
+    // since swapping containers with unequal non-propagating allocators is undefined
+    void release_old_table() {
+        old_ctrl_ = ControlT(ctrl_.get_allocator());
+        old_elements_ = ContainerT(elements_.get_allocator());
+    }
+    // First empty or deleted slot on the probe sequence of "hash" in the current table
+    std::size_t find_free_slot(std::size_t hash) const;
+    // One-shot migration of the whole old table with rehash_threads_ threads
+    void parallel_migrate(std::size_t threads);
 
-    using ContainerT = std::vector<ElementT>;
+    // Items (input indices or old slots) grouped by the region of the current table where their home group is:
+    // region r holds items[starts[r] .. starts[r + 1]), in increasing order
+    struct RegionPartition {
+        std::vector<std::size_t> items;
+        std::vector<std::size_t> starts;
+    };
+    // Items are [0, hashes.size()) minus those for which skip(i) is true. hashes[i] is the mixed hash of item i
+    template <typename Skip>
+    RegionPartition partition_by_region(const std::vector<std::size_t> & hashes, std::size_t threads, Skip && skip) const;
+    // Run func(t) for t in [0, threads), t = 0 on the calling thread. The first exception is rethrown after all of them end
+    template <typename Func>
+    static void run_threads(std::size_t threads, Func && func);
+    // The part [begin, end) of [0, count) that thread t of "threads" handles
+    static std::pair<std::size_t, std::size_t> chunk_of(std::size_t count, std::size_t threads, std::size_t t) {
+        return {count * t / threads, count * (t + 1) / threads};
+    }
 
+    using ControlAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<ctrl_t>;
+    using ControlT = std::vector<ctrl_t, ControlAllocator>;
+    using ContainerT = SlotsT;
+
+    // Destroy the live elements of a table, "ctrl" tells which slots are alive
+    static void destroy_elements(const ControlT & ctrl, ContainerT & elements) {
+        if constexpr (!std::is_trivially_destructible_v<K> || !std::is_trivially_destructible_v<V>) {
+            for(std::size_t i = 0; i < ctrl.size(); i++) {
+                if(is_full(ctrl[i])) {
+                    elements.destroy(i);
+                }
+            }
+        }
+    }
+    // Copy the live elements of "from" into the same slots of "to". On exception, the copies made so far are destroyed
+    static void copy_elements(const ControlT & ctrl, const ContainerT & from, ContainerT & to) {
+        std::size_t i = 0;
+        try {
+            for(; i < ctrl.size(); i++) {
+                if(is_full(ctrl[i])) {
+                    to.copy_construct(i, from, i);
+                }
+            }
+        } catch(...) {
+            for(std::size_t j = 0; j < i; j++) {
+                if(is_full(ctrl[j])) {
+                    to.destroy(j);
+                }
+            }
+            throw;
+        }
+    }
+
+    ControlT ctrl_;
     ContainerT elements_;
-    std::size_t size_{0}; // TODO: Test use std::size_t or std::ssize_t here
+    std::size_t size_{0};
+    std::size_t num_deleted_{0};
     std::size_t capacity_;
-    float max_load_factor_{0.6};
+    float max_load_factor_{0.875};
+
+    // Incremental rehash. old_capacity_ is 0 when no migration is in progress,
+    // otherwise the old slots below migrate_pos_ have been moved to the current table.
+    ControlT old_ctrl_;
+    ContainerT old_elements_;
+    std::size_t old_capacity_{0};
+    std::size_t migrate_pos_{0};
+    bool incremental_rehash_{false};
+    std::size_t rehash_threads_{1};
+
+    // Lookups of a const map record too
+    [[no_unique_address]] mutable StatsPolicy stats_;
 };
 
 template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-bool FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::empty() const noexcept {
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+bool FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::empty() const noexcept {
     return size_ == 0;
 }
 
@@ -145,8 +521,11 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::size() const noexcept {
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+std::size_t FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::size() const noexcept {
     return size_;
 }
 
@@ -154,8 +533,11 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::capacity() const noexcept {
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+std::size_t FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::capacity() const noexcept {
     return capacity_;
 }
 
@@ -163,222 +545,788 @@ template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-const V & FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::at(const K & key) const {
-    std::size_t pos = Hash()(key) % capacity_;
-    std::size_t start_pos = pos;
-    std::size_t cnt = 0;
-    do {
-        auto & element = elements_.at(pos);
-        if(element.is_valid) {
-            // DEBUGING
-            #ifdef DEBUG_FHM
-            std::cout << "[FlatHashMapV2::at] key " << key << " is not found. pos is " << pos << std::endl;
-            #endif
-            // DEBUGING
-            if((element.pos == start_pos) && (element.pair.first == key)) {
-                break;
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <typename Q, typename Elements>
+std::size_t FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::find_in_table(const ctrl_t * ctrl, const Elements & elements, std::size_t capacity,
+                                                                                                      const Q & key, std::size_t hash, std::size_t & probe_length) {
+    const ctrl_t tag = h2(hash);
+    const std::size_t group_mask = capacity / GroupWidth - 1;
+    std::size_t group = home_group(hash, group_mask + 1);
+    for(std::size_t step = 1; step <= group_mask + 1; step++) {
+        probe_length = step - 1;
+        const std::size_t base = group * GroupWidth;
+        ControlGroup control_group(ctrl + base);
+        for(uint32_t mask = control_group.match(tag); mask != 0; mask &= (mask - 1)) {
+            std::size_t pos = base + __builtin_ctz(mask);
+            if(KeyEqual()(elements.key(pos), key)) {
+                return pos;
             }
         }
-        pos = (pos + 1) % capacity_;
-        cnt++;
-        // make sure capacity_ is a power of 2 to optimize this
-    } while (cnt < capacity_);
+        if(control_group.match_empty() != 0) {
+            // An empty slot means no element ever probed past this group
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+    return capacity;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <typename Q>
+auto FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::find_it(const Q & key, std::size_t hash) -> IteratorT {
+    std::size_t probe_length = 0;
+    std::size_t pos = find_index(key, hash, probe_length);
+    if(pos != capacity_) {
+        stats_.record_hit(probe_length);
+        return elements_.iterator_at(pos);
+    }
+    if(rehashing()) {
+        // The groups of both tables count
+        std::size_t old_probe_length = 0;
+        pos = find_in_table(old_ctrl_.data(), old_elements_, old_capacity_, key, hash, old_probe_length);
+        probe_length += old_probe_length + 1;
+        if(pos != old_capacity_) {
+            stats_.record_hit(probe_length);
+            return old_elements_.iterator_at(pos);
+        }
+    }
+    stats_.record_miss(probe_length);
+    return end();
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <typename Q>
+auto FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::find_or_prepare_insert(const Q & key, std::size_t hash) -> std::pair<std::size_t, bool> {
+    const ctrl_t tag = h2(hash);
+    const std::size_t group_mask = capacity_ / GroupWidth - 1;
+    std::size_t group = home_group(hash, group_mask + 1);
+    std::size_t insert_pos = capacity_;
+    for(std::size_t step = 1; step <= group_mask + 1; step++) {
+        const std::size_t base = group * GroupWidth;
+        ControlGroup control_group(ctrl_.data() + base);
+        for(uint32_t mask = control_group.match(tag); mask != 0; mask &= (mask - 1)) {
+            std::size_t pos = base + __builtin_ctz(mask);
+            if(KeyEqual()(elements_.key(pos), key)) {
+                return {pos, false};
+            }
+        }
+        if(insert_pos == capacity_) {
+            // Remember the first free slot, tombstones can be reused
+            uint32_t free_mask = control_group.match_empty_or_deleted();
+            if(free_mask != 0) {
+                insert_pos = base + __builtin_ctz(free_mask);
+            }
+        }
+        if(control_group.match_empty() != 0) {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+    assert(insert_pos != capacity_);
+    return {insert_pos, true};
+}
 
-    if(cnt == capacity_) {
-        throw std::out_of_range("[FlatHashMapV2::at] key is not found");
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+const V & FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::at(const K & key) const {
+    IteratorT it = find_it(key, mix(Hash()(key)));
+    if(it == end()) {
+        throw std::out_of_range("[FlatHashMapV3::at] key is not found");
     }
-    return elements_.at(pos).pair.second;
+    return (*it).second;
 }
 
 template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-V & FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::operator[](const K & key) {
-    if(load_factor() > max_load_factor_) {
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <typename Q, typename ... Args>
+auto FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::try_emplace_impl(Q && key, std::size_t hash, Args && ... args) -> std::pair<IteratorT, bool> {
+    if(rehashing()) {
+        migrate_step();
+    }
+    if(need_rehash()) {
         expand_and_rehash();
     }
-    std::size_t pos = Hash()(key) % capacity_;
-    std::size_t start_pos = pos;
+    if(rehashing()) {
+        // The key may still wait in the old table
+        std::size_t probe_length = 0;
+        std::size_t old_pos = find_in_table(old_ctrl_.data(), old_elements_, old_capacity_, key, hash, probe_length);
+        if(old_pos != old_capacity_) {
+            return {old_elements_.iterator_at(old_pos), false};
+        }
+    }
+
+    // Unlike V0 - V2, tombstones and empty slots are told apart by the control bytes,
+    // so one probe is enough to both look for the key and find where to put it.
+    auto [pos, need_insert] = find_or_prepare_insert(key, hash);
 
     // DEBUGING
     #ifdef DEBUG_FHM
-    std::cout << "[FlatHashMap::operator[]] capacity is " << capacity_ << ", key is " << key 
-        << ", start_pos is " << start_pos << "\n";
+    std::cout << "[FlatHashMapV3::try_emplace_impl] capacity is " << capacity_ << ", pos is " << pos 
+        << ", need_insert is " << need_insert << "\n";
     #endif
     // DEBUGING
 
-    // NOTE: In this naive implementation, I cannot just iterate through the element
-    // from position "pos", and insert a dump element if we encounter an invalid element.
-    // This is because such thing can happen: 
-    // 1. We insert (k0, v0) which Hash(k0) % cap = h0. The pair is placed at position "h0".
-    // 2. We insert (k1, v1) which Hash(k1) % cap = h0. The pair is placed at position "h0 + 1".
-    // 3. We erase (k0, v0).
-    // 4. We call operator[k1]. If we don't find out whether k1 exist or not first, we would insert dump element
-    // at position "h0" and return. That is totally wrong. 
-    // Therefore I call "find" function here.
-    // And this is obviously non-efficient. Further optimizations will improve it.
-    auto it = find(key);
-    if(it != end()) {
-        return it -> second;
-    }
-
-    do {
-        auto & element = elements_[pos];
-
-        // DEBUGING
-        #ifdef DEBUG_FHM
-        std::cout << "[FlatHashMap::operator[]] pos is " << pos << ", and element is " << element << "\n";
-        #endif
-        // DEBUGING
-
-        if((!element.is_valid)) {
-            // How does the statement "map[k] = v" automatically update the size of the hashmap?
-            // We can define the semantic of operator[] in a smart way.
-            // If map[k] does not exists, we insert a dump element and increment the size.
-            // And we return the dump element.
-            element.is_valid = true;
-            element.pos = start_pos;
-            element.pair.first = key;
-
-            // // DEBUGING
-            // element.pair.second = 1;
-            // // DEBUGING
-            size_++;
-            break;
+    if(!need_insert) {
+        return {elements_.iterator_at(pos), false};
+    }
+    // Construct first, so that nothing changes if K or V throws
+    elements_.emplace(pos, std::forward<Q>(key), std::forward<Args>(args)...);
+    if(ctrl_[pos] == kCtrlDeleted) {
+        num_deleted_--;
+    }
+    set_ctrl(pos, h2(hash));
+    size_++;
+    return {elements_.iterator_at(pos), true};
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+V & FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::operator[](const K & key) {
+    return try_emplace(key).first -> second;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+V & FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::operator[](K && key) {
+    return try_emplace(std::move(key)).first -> second;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+auto FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::find(const K & key) -> IteratorT {
+    return find_it(key, mix(Hash()(key)));
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::find_batch(std::span<const K> keys, std::span<IteratorT> out) {
+    assert(out.size() >= keys.size());
+    // Large enough that the hash of key i is not overwritten before it is resolved
+    constexpr std::size_t RingSize = 4 * PrefetchDistance;
+    std::array<std::size_t, RingSize> hashes;
+    const std::size_t num_keys = keys.size();
+    const std::size_t group_mask = capacity_ / GroupWidth - 1;
+
+    auto home_base = [&](std::size_t hash) {
+        return home_group(hash, group_mask + 1) * GroupWidth;
+    };
+    auto hash_and_prefetch_ctrl = [&](std::size_t i) {
+        std::size_t hash = mix(Hash()(keys[i]));
+        hashes[i % RingSize] = hash;
+        __builtin_prefetch(ctrl_.data() + home_base(hash));
+    };
+    auto match_and_prefetch_element = [&](std::size_t i) {
+        std::size_t hash = hashes[i % RingSize];
+        std::size_t base = home_base(hash);
+        uint32_t mask = ControlGroup(ctrl_.data() + base).match(h2(hash));
+        if(mask != 0) {
+            elements_.prefetch(base + __builtin_ctz(mask));
         }
-        else if((element.pos == start_pos) && (element.pair.first == key)) {
-            break;
+    };
+
+    // Fill the pipeline
+    for(std::size_t i = 0; i < std::min(num_keys, 2 * PrefetchDistance); i++) {
+        hash_and_prefetch_ctrl(i);
+    }
+    for(std::size_t i = 0; i < std::min(num_keys, PrefetchDistance); i++) {
+        match_and_prefetch_element(i);
+    }
+    for(std::size_t i = 0; i < num_keys; i++) {
+        if(i + 2 * PrefetchDistance < num_keys) {
+            hash_and_prefetch_ctrl(i + 2 * PrefetchDistance);
         }
-        pos = (pos + 1) % capacity_;
-    } while (true);
-    return elements_[pos].pair.second;
+        if(i + PrefetchDistance < num_keys) {
+            match_and_prefetch_element(i + PrefetchDistance);
+        }
+        out[i] = find_it(keys[i], hashes[i % RingSize]);
+    }
 }
 
 template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::find(const K & key) -> IteratorT {
-    std::size_t pos = Hash()(key) % capacity_;
-    std::size_t start_pos = pos;
-    std::size_t cnt = 0;
-    do {
-        auto & element = elements_[pos];
-        if((element.is_valid) && (element.pos == start_pos) && (element.pair.first == key)) {
-            return IteratorT(&element.pair);
-        }
-        pos = (pos + 1) % capacity_;
-        cnt++;
-    } while (cnt < capacity_);
-    return end();
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+auto FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+    return try_emplace(pair.first, pair.second);
 }
 
 template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-auto FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
-    if(load_factor() > max_load_factor_) {
-        // #ifdef DEBUG_FHM
-        //     std::cout << "size is " << size_ << "capacity is " << capacity_ << std::endl;
-        //     std::cout << "[insert] load_factor() > max_load_factor_" << std::endl;
-        // #endif
-        expand_and_rehash();
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+auto FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::insert(std::pair<const K, V> && pair) -> std::pair<IteratorT, bool> {
+    return try_emplace(pair.first, std::move(pair.second));
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+std::size_t FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::erase(const K & key) {
+    return erase_impl(key, mix(Hash()(key)));
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <typename Q>
+std::size_t FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::erase_impl(const Q & key, std::size_t hash) {
+    if(rehashing()) {
+        migrate_step();
+    }
+    std::size_t probe_length = 0;
+    std::size_t pos = find_index(key, hash, probe_length);
+    if(pos != capacity_ || !rehashing()) {
+        if(pos != capacity_) {
+            stats_.record_hit(probe_length);
+        } else {
+            stats_.record_miss(probe_length);
+        }
+        return erase_at(pos);
+    }
+    std::size_t old_probe_length = 0;
+    pos = find_in_table(old_ctrl_.data(), old_elements_, old_capacity_, key, hash, old_probe_length);
+    probe_length += old_probe_length + 1;
+    if(pos == old_capacity_) {
+        stats_.record_miss(probe_length);
+        return 0;
+    }
+    stats_.record_hit(probe_length);
+    // The old table is only probed until it is drained, so a tombstone is always fine there
+    old_elements_.destroy(pos);
+    old_ctrl_[pos] = kCtrlDeleted;
+    size_--;
+    return 1;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+std::size_t FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::erase_at(std::size_t pos) {
+    if(pos == capacity_) {
+        return 0;
+    }
+    elements_.destroy(pos);
+
+    // If the group still has an empty slot, no probe sequence has ever passed through it
+    // (a group only loses its last empty slot to an insertion), so the slot can become empty again.
+    // Otherwise we must leave a tombstone.
+    ControlGroup control_group(ctrl_.data() + (pos & ~(GroupWidth - 1)));
+    if(control_group.match_empty() != 0) {
+        set_ctrl(pos, kCtrlEmpty);
+    } else {
+        set_ctrl(pos, kCtrlDeleted);
+        num_deleted_++;
+    }
+    size_--;
+    return 1;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::expand_and_rehash() {
+    // If most of the load comes from tombstones, rehash in place to drop them
+    // instead of doubling the capacity
+    std::size_t new_capacity = ((size_ + 1) * 2 > capacity_ * max_load_factor_) ? capacity_ * 2 : capacity_;
+    rehash_to(new_capacity);
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::rehash_to(std::size_t new_capacity) {
+    auto timer = stats_.start_rehash();
+    // Only one old table at a time
+    if(rehashing()) {
+        migrate_step(old_capacity_);
     }
+    // Allocate both new arrays before touching the current ones, so a bad_alloc leaves the map as it was
+    ControlT new_ctrl(new_capacity, kCtrlEmpty, ctrl_.get_allocator());
+    ContainerT new_elements(elements_.get_allocator(), new_capacity);
+    old_ctrl_ = std::exchange(ctrl_, std::move(new_ctrl));
+    old_elements_ = std::exchange(elements_, std::move(new_elements));
+    old_capacity_ = capacity_;
+    migrate_pos_ = 0;
+    capacity_ = new_capacity;
+    num_deleted_ = 0;
 
-    const K & key = pair.first;
-    std::size_t pos = Hash()(key) % capacity_;
-    std::size_t start_pos = pos;
-    do {
-        auto & element = elements_.at(pos);
-        if(element.pair.first == key) {
-            return {IteratorT(&element.pair), false};
+    if(!incremental_rehash_) {
+        const std::size_t threads = std::min(rehash_threads_, capacity_ / GroupWidth);
+        if(threads > 1 && old_capacity_ >= ParallelRehashMinSlots) {
+            parallel_migrate(threads);
+        } else {
+            migrate_step(old_capacity_);
         }
-        if(!element.is_valid) {
-            break;
+    }
+    stats_.finish_rehash(timer);
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::migrate_step(std::size_t max_slots) {
+    const std::size_t end = std::min(old_capacity_, migrate_pos_ + max_slots);
+    for(; migrate_pos_ < end; migrate_pos_++) {
+        if(!is_full(old_ctrl_[migrate_pos_])) {
+            continue;
+        }
+        const std::size_t hash = mix(Hash()(old_elements_.key(migrate_pos_)));
+        // The new table may already have tombstones of elements erased during the migration
+        std::size_t pos = find_free_slot(hash);
+        if(ctrl_[pos] == kCtrlDeleted) {
+            num_deleted_--;
         }
-        pos = (pos + 1) % capacity_;
-        // make sure capacity_ is a power of 2 to optimize this
-    } while (true);
+        // Move the element itself: no default construction of the new slot and no copy
+        elements_.relocate(pos, old_elements_, migrate_pos_);
+        set_ctrl(pos, h2(hash));
+        // Keep the probe sequences of the old table intact for the elements which are not migrated yet
+        old_ctrl_[migrate_pos_] = kCtrlDeleted;
+    }
+    if(migrate_pos_ == old_capacity_) {
+        release_old_table();
+        old_capacity_ = 0;
+        migrate_pos_ = 0;
+    }
+}
 
-    // #ifdef DEBUG_FHM
-    //     std::cout << "[insert] Setting" << std::endl;
-    // #endif
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+std::size_t FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::find_free_slot(std::size_t hash) const {
+    const std::size_t group_mask = capacity_ / GroupWidth - 1;
+    std::size_t group = home_group(hash, group_mask + 1);
+    for(std::size_t step = 1; ; step++) {
+        const std::size_t base = group * GroupWidth;
+        uint32_t free_mask = ControlGroup(ctrl_.data() + base).match_empty_or_deleted();
+        if(free_mask != 0) {
+            return base + __builtin_ctz(free_mask);
+        }
+        group = (group + step) & group_mask;
+    }
+}
 
-    elements_[pos].set(true, start_pos, pair.first, pair.second);
-    size_++;
-    return {IteratorT(&(elements_[pos].pair)), true};
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <typename Func>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::run_threads(std::size_t threads, Func && func) {
+    std::vector<std::exception_ptr> errors(threads);
+    auto run = [&](std::size_t t) {
+        try {
+            func(t);
+        } catch(...) {
+            errors[t] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for(std::size_t t = 1; t < threads; t++) {
+        workers.emplace_back(run, t);
+    }
+    run(0);
+    for(auto & worker : workers) {
+        worker.join();
+    }
+    for(auto & error : errors) {
+        if(error) {
+            std::rethrow_exception(error);
+        }
+    }
 }
 
 template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-std::size_t FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::erase(const K & key) {
-    IteratorT it = find(key);
-    if(it == end()) {
-        return 0;
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <typename Skip>
+auto FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::partition_by_region(const std::vector<std::size_t> & hashes, std::size_t threads, Skip && skip) const -> RegionPartition {
+    const std::size_t num_groups = capacity_ / GroupWidth;
+    auto region_of = [&](std::size_t hash) {
+        return home_group(hash, num_groups) * threads / num_groups;
+    };
+    // counts[c * threads + r] : items of chunk c in region r. Chunks are counted and scattered in parallel,
+    // and laid out region by region, then chunk by chunk, so that every region keeps the order of the items
+    std::vector<std::size_t> counts(threads * threads, 0);
+    run_threads(threads, [&](std::size_t c) {
+        auto [begin, end] = chunk_of(hashes.size(), threads, c);
+        for(std::size_t i = begin; i < end; i++) {
+            if(!skip(i)) {
+                counts[c * threads + region_of(hashes[i])]++;
+            }
+        }
+    });
+    RegionPartition partition;
+    partition.starts.resize(threads + 1);
+    std::vector<std::size_t> offsets(threads * threads);
+    std::size_t total = 0;
+    for(std::size_t r = 0; r < threads; r++) {
+        partition.starts[r] = total;
+        for(std::size_t c = 0; c < threads; c++) {
+            offsets[c * threads + r] = total;
+            total += counts[c * threads + r];
+        }
     }
+    partition.starts[threads] = total;
+    partition.items.resize(total);
+    run_threads(threads, [&](std::size_t c) {
+        auto [begin, end] = chunk_of(hashes.size(), threads, c);
+        for(std::size_t i = begin; i < end; i++) {
+            if(!skip(i)) {
+                partition.items[offsets[c * threads + region_of(hashes[i])]++] = i;
+            }
+        }
+    });
+    return partition;
+}
 
-    // DEBUGING
-    #ifdef DEBUG_FHM
-    if(key != it -> first) {
-        std::cout << "[FlatHashMapV2::erase] key != it -> first!! Error\n";
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+template <std::random_access_iterator It>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::bulk_insert(It first, It last, std::size_t threads) {
+    const std::size_t count = static_cast<std::size_t>(last - first);
+    // The threads only look at the current table, so the old one is drained, also after reserve() with incremental rehashing
+    reserve(size_ + num_deleted_ + count);
+    if(rehashing()) {
+        migrate_step(old_capacity_);
+    }
+    threads = std::clamp<std::size_t>(threads, 1, capacity_ / GroupWidth);
+    if(threads == 1 || count < ParallelInsertMinItems) {
+        for(It it = first; it != last; ++it) {
+            try_emplace(it->first, it->second);
+        }
+        return;
     }
-    #endif
-    // DEBUGING
 
-    assert(key == it -> first);
+    std::vector<std::size_t> hashes(count);
+    run_threads(threads, [&](std::size_t t) {
+        auto [begin, end] = chunk_of(count, threads, t);
+        for(std::size_t i = begin; i < end; i++) {
+            hashes[i] = mix(Hash()(first[i].first));
+        }
+    });
+    RegionPartition partition = partition_by_region(hashes, threads, [](std::size_t) { return false; });
 
-    // assert(static_cast<uint8_t>(it.getValidFlagField()) == 0x1);
-    it.getValidFlagField() = false;
-    size_--;
-    return 1;
+    const std::size_t num_groups = capacity_ / GroupWidth;
+    std::vector<std::vector<std::size_t>> deferred(threads);
+    std::vector<std::size_t> inserted(threads, 0);
+    std::vector<std::size_t> reused(threads, 0);
+    auto fill_region = [&](std::size_t t) {
+        for(std::size_t k = partition.starts[t]; k < partition.starts[t + 1]; k++) {
+            const std::size_t i = partition.items[k];
+            const std::size_t hash = hashes[i];
+            const std::size_t base = home_group(hash, num_groups) * GroupWidth;
+            ControlGroup control_group(ctrl_.data() + base);
+            // Without an empty slot, a lookup of this key goes on past the home group, out of this region
+            if(control_group.match_empty() == 0) {
+                deferred[t].push_back(i);
+                continue;
+            }
+            bool found = false;
+            for(uint32_t mask = control_group.match(h2(hash)); mask != 0 && !found; mask &= (mask - 1)) {
+                found = KeyEqual()(elements_.key(base + __builtin_ctz(mask)), first[i].first);
+            }
+            if(found) {
+                continue;
+            }
+            const std::size_t pos = base + __builtin_ctz(control_group.match_empty_or_deleted());
+            const bool was_deleted = (ctrl_[pos] == kCtrlDeleted);
+            elements_.emplace(pos, first[i].first, first[i].second);
+            set_ctrl(pos, h2(hash));
+            inserted[t]++;
+            reused[t] += was_deleted;
+        }
+    };
+    auto account = [&]() {
+        for(std::size_t t = 0; t < threads; t++) {
+            size_ += inserted[t];
+            num_deleted_ -= reused[t];
+        }
+    };
+    try {
+        run_threads(threads, fill_region);
+    } catch(...) {
+        account();
+        throw;
+    }
+    account();
+    // A group never gets emptier, so once a key is deferred, every later duplicate of it is deferred too,
+    // and inserting region by region in order keeps the first of them
+    for(const auto & keys : deferred) {
+        for(std::size_t i : keys) {
+            try_emplace_impl(first[i].first, hashes[i], first[i].second);
+        }
+    }
 }
 
 template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::expand_and_rehash() {
-    ContainerT new_elements(elements_.size() * 2);
-    capacity_ *= 2;
-    for(auto & element : elements_) {
-        if(element.is_valid) {
-            std::size_t new_pos = Hash()(element.pair.first) % capacity_;
-            std::size_t new_start_pos = new_pos;
-            while(true) {
-                // Don't forget to apply linear probe when resizing
-                auto & new_element = new_elements[new_pos];
-                if(!new_element.is_valid) {
-                    new_element = element;
-                    new_element.pos = new_start_pos;
-                    break;
-                }
-                new_pos = (new_pos + 1) % capacity_;
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::parallel_migrate(std::size_t threads) {
+    std::vector<std::size_t> hashes(old_capacity_);
+    run_threads(threads, [&](std::size_t t) {
+        auto [begin, end] = chunk_of(old_capacity_, threads, t);
+        for(std::size_t pos = begin; pos < end; pos++) {
+            if(is_full(old_ctrl_[pos])) {
+                hashes[pos] = mix(Hash()(old_elements_.key(pos)));
             }
         }
+    });
+    RegionPartition partition = partition_by_region(hashes, threads, [&](std::size_t pos) { return !is_full(old_ctrl_[pos]); });
+
+    const std::size_t num_groups = capacity_ / GroupWidth;
+    std::vector<std::vector<std::size_t>> deferred(threads);
+    // The new table has no tombstones, so the first free slot of the home group is where migrate_step would put it
+    auto move_region = [&](std::size_t t) {
+        for(std::size_t k = partition.starts[t]; k < partition.starts[t + 1]; k++) {
+            const std::size_t old_pos = partition.items[k];
+            const std::size_t base = home_group(hashes[old_pos], num_groups) * GroupWidth;
+            const uint32_t free_mask = ControlGroup(ctrl_.data() + base).match_empty();
+            if(free_mask == 0) {
+                deferred[t].push_back(old_pos);
+                continue;
+            }
+            const std::size_t pos = base + __builtin_ctz(free_mask);
+            elements_.relocate(pos, old_elements_, old_pos);
+            set_ctrl(pos, h2(hashes[old_pos]));
+            old_ctrl_[old_pos] = kCtrlDeleted;
+        }
+    };
+    // If a move throws, the old table keeps the elements which were not moved, as during an incremental rehash,
+    // and migrate_step picks them up later
+    run_threads(threads, move_region);
+    for(const auto & positions : deferred) {
+        for(std::size_t old_pos : positions) {
+            const std::size_t pos = find_free_slot(hashes[old_pos]);
+            elements_.relocate(pos, old_elements_, old_pos);
+            set_ctrl(pos, h2(hashes[old_pos]));
+            old_ctrl_[old_pos] = kCtrlDeleted;
+        }
+    }
+    release_old_table();
+    old_capacity_ = 0;
+    migrate_pos_ = 0;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::reserve(std::size_t n) {
+    std::size_t new_capacity = capacity_;
+    while(n + 1 > new_capacity * max_load_factor_) {
+        new_capacity *= 2;
+    }
+    if(new_capacity != capacity_) {
+        rehash_to(new_capacity);
     }
-    elements_ = std::move(new_elements);
 }
 
 template <typename K, typename V,
           std::size_t InitCapacity,
           typename Hash,
           typename KeyEqual,
-          typename Allocator>
-void FlatHashMapV2<K, V, InitCapacity, Hash, KeyEqual, Allocator>::clear() {
-    capacity_ = InitCapacity;
-    elements_.clear();
-    elements_.resize(InitCapacity);
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+void FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::clear() {
+    destroy_elements(ctrl_, elements_);
+    destroy_elements(old_ctrl_, old_elements_);
+    capacity_ = InitSlots;
+    ctrl_.assign(InitSlots, kCtrlEmpty);
+    elements_ = ContainerT(elements_.get_allocator(), InitSlots);
     size_ = 0;
+    num_deleted_ = 0;
+    release_old_table();
+    old_capacity_ = 0;
+    migrate_pos_ = 0;
 }
 
-}
\ No newline at end of file
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+std::vector<std::size_t> FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::probe_histogram() const {
+    std::vector<std::size_t> histogram;
+    const std::size_t group_mask = capacity_ / GroupWidth - 1;
+    for(std::size_t pos = 0; pos < capacity_; pos++) {
+        if(!is_full(ctrl_[pos])) {
+            continue;
+        }
+        // Replay the triangular probe sequence until it reaches the group of the element
+        std::size_t group = home_group(mix(Hash()(elements_.key(pos))), group_mask + 1);
+        std::size_t probes = 0;
+        while(group != pos / GroupWidth) {
+            probes++;
+            group = (group + probes) & group_mask;
+        }
+        if(probes >= histogram.size()) {
+            histogram.resize(probes + 1, 0);
+        }
+        histogram[probes]++;
+    }
+    return histogram;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename Layout,
+          typename StatsPolicy>
+HashMapStats FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy>::stats() const {
+    HashMapStats result;
+    result.size = size_;
+    result.capacity = capacity_;
+    result.load_factor = load_factor();
+    result.tombstones = num_deleted_;
+    // Runs of non-empty slots, tombstones included: a probe only stops at an empty slot
+    result.cluster_lengths = cluster_histogram(capacity_, [&](std::size_t pos) {
+        return ctrl_[pos] != kCtrlEmpty;
+    });
+    stats_.fill(result);
+    return result;
+}
+
+namespace pmr {
+
+// FlatHashMapV3 allocating from a std::pmr::memory_resource, e.g. a std::pmr::monotonic_buffer_resource per request
+template <typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename IndexPolicy = MaskIndex,
+          typename Layout = InterleavedLayout,
+          typename StatsPolicy = NoStats>
+using FlatHashMapV3 = hpds::FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual,
+                                          std::pmr::polymorphic_allocator<std::pair<const K, V>>, IndexPolicy, Layout, StatsPolicy>;
+
+}
+
+}
@@ -0,0 +1,892 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <optional>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <iostream>
+#include <stdexcept>
+#include <span>
+#include <algorithm>
+#include "hash_policy.hpp"
+#include "hash_stats.hpp"
+
+// #define DEBUG_FHM
+
+namespace hpds {
+// hpds is for High-Performance Data Structures
+
+/**
+ * @brief Robin Hood hashing with backward-shift deletion.
+ * Instead of the original hashing position (V1 / V2), every element stores its probe distance,
+ * i.e. how far it sits from its home slot. On insertion, an element that has probed further than
+ * the resident of a slot takes the slot ("steals from the rich") and the resident moves on.
+ * This keeps the variance of probe distances low, and it gives two useful properties:
+ *  1. An unsuccessful lookup can stop as soon as its own probe distance exceeds the distance
+ *     of the slot it is looking at, because the key would have been placed there.
+ *  2. Erasure shifts the following elements of the cluster back by one slot, so there are no tombstones.
+ *
+ * Lookups take the same hash-once / heterogeneous API as FlatHashMapV3.
+ *
+ * @tparam DistStructType
+ *  The type used to store "probe distance + 1" (0 means the slot is empty). If an insertion needs
+ *  a longer distance than the type can hold, the table is expanded.
+ * @tparam StatsPolicy
+ *  Records the probe distance of every lookup and the rehashes, see hash_stats.hpp and stats().
+ *  The default NoStats records nothing and compiles away.
+ */
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex,
+          typename StatsPolicy = NoStats>
+requires ((std::is_same_v<DistStructType,uint8_t> || (std::is_same_v<DistStructType, uint16_t>)
+     || (std::is_same_v<DistStructType, uint32_t>))
+    && (InitCapacity > 0) && ((InitCapacity & (InitCapacity - 1)) == 0))
+class FlatHashMapV4 {
+public:
+    constexpr static std::size_t MaxDist = std::numeric_limits<DistStructType>::max() - 1;
+
+    // Keep struct alignment padding in mind
+    // The pair is only alive while dist_plus_one != 0, so empty slots never construct K or V,
+    // and V does not need a default constructor unless operator[] is used.
+    // Shifting a cluster moves pairs, so a throwing move constructor of K or V only gets the basic guarantee.
+    struct ElementT {
+        DistStructType dist_plus_one{0};
+        union {
+            std::pair<K, V> pair;
+        };
+
+        ElementT() {}
+        ElementT(const ElementT & other) : dist_plus_one(other.dist_plus_one) {
+            if(is_valid()) {
+                std::construct_at(&pair, other.pair);
+            }
+        }
+        ElementT(ElementT && other) noexcept(std::is_nothrow_move_constructible_v<std::pair<K, V>>)
+            : dist_plus_one(other.dist_plus_one) {
+            if(is_valid()) {
+                std::construct_at(&pair, std::move(other.pair));
+            }
+        }
+        ElementT & operator=(const ElementT & other) {
+            if(this != &other) {
+                reset();
+                if(other.is_valid()) {
+                    emplace(other.dist_plus_one, other.pair);
+                }
+            }
+            return *this;
+        }
+        ElementT & operator=(ElementT && other) noexcept(std::is_nothrow_move_constructible_v<std::pair<K, V>>) {
+            if(this != &other) {
+                reset();
+                if(other.is_valid()) {
+                    emplace(other.dist_plus_one, std::move(other.pair));
+                }
+            }
+            return *this;
+        }
+        ~ElementT() {
+            reset();
+        }
+
+        // Construct the pair from "args" in an empty slot
+        template <typename ... Args>
+        void emplace(DistStructType new_dist_plus_one, Args && ... args) {
+            std::construct_at(&pair, std::forward<Args>(args)...);
+            dist_plus_one = new_dist_plus_one;
+        }
+        void reset() {
+            if(is_valid()) {
+                std::destroy_at(&pair);
+                dist_plus_one = 0;
+            }
+        }
+
+        bool is_valid() const {
+            return dist_plus_one != 0;
+        }
+        std::size_t dist() const {
+            return dist_plus_one - 1;
+        }
+
+        friend std::ostream & operator<<(std::ostream & cout, const ElementT & element) {
+            return (cout << "{ dist_plus_one : " << static_cast<int32_t>(element.dist_plus_one)
+                << ", key : " << element.pair.first << ", value : " << element.pair.second << " }\n");
+        }
+    };
+
+    friend class IteratorT;
+
+    class IteratorT {
+    public:
+        friend class FlatHashMapV4;
+        IteratorT(std::pair<K, V> * pair = nullptr) : pair_ptr_(pair) {}
+        IteratorT(const IteratorT & other) = default;
+
+        bool operator== (const IteratorT & other) const {
+            return (pair_ptr_ == other.pair_ptr_);
+        }
+
+        std::pair<K, V> & operator*() {
+            return *pair_ptr_;
+        }
+        std::pair<K, V> * operator->() {
+            return pair_ptr_;
+        }
+
+    private:
+        std::pair<K, V> * pair_ptr_;
+    };
+
+    FlatHashMapV4() : FlatHashMapV4(Allocator()) {}
+    // The elements are allocated through a copy of "alloc" rebound to ElementT
+    explicit FlatHashMapV4(const Allocator & alloc) : elements_(InitCapacity, ElementAllocator(alloc)), capacity_(InitCapacity) {}
+    FlatHashMapV4(const FlatHashMapV4 & other)
+        : FlatHashMapV4(other, std::allocator_traits<Allocator>::select_on_container_copy_construction(other.get_allocator())) {}
+    FlatHashMapV4(const FlatHashMapV4 & other, const Allocator & alloc)
+        : elements_(other.elements_, ElementAllocator(alloc)), size_(other.size_), capacity_(other.capacity_),
+          max_load_factor_(other.max_load_factor_), stats_(other.stats_) {}
+    // The source is left as an empty map of InitCapacity slots, which is why moving allocates
+    FlatHashMapV4(FlatHashMapV4 && other) : FlatHashMapV4(other.get_allocator()) {
+        swap(other);
+    }
+    FlatHashMapV4 & operator=(const FlatHashMapV4 & other) {
+        if(this != &other) {
+            using Traits = std::allocator_traits<Allocator>;
+            FlatHashMapV4 copy(other, Traits::propagate_on_container_copy_assignment::value ? other.get_allocator() : get_allocator());
+            take(copy);
+        }
+        return *this;
+    }
+    // The source is left as an empty map of InitCapacity slots. If the allocators differ and do not propagate,
+    // our allocator cannot free the table of "other", so its pairs are copied instead
+    FlatHashMapV4 & operator=(FlatHashMapV4 && other) {
+        if(this != &other) {
+            using Traits = std::allocator_traits<Allocator>;
+            if constexpr (!Traits::propagate_on_container_move_assignment::value && !Traits::is_always_equal::value) {
+                if(!(get_allocator() == other.get_allocator())) {
+                    FlatHashMapV4 copy(other, get_allocator());
+                    take(copy);
+                    other.clear();
+                    return *this;
+                }
+            }
+            FlatHashMapV4 moved(std::move(other));
+            take(moved);
+        }
+        return *this;
+    }
+    // The allocators must compare equal
+    void swap(FlatHashMapV4 & other) noexcept {
+        assert(get_allocator() == other.get_allocator());
+        std::swap(elements_, other.elements_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(max_load_factor_, other.max_load_factor_);
+        std::swap(stats_, other.stats_);
+    }
+
+    bool empty() const noexcept;
+    Allocator get_allocator() const {
+        return Allocator(elements_.get_allocator());
+    }
+    std::size_t size() const noexcept;
+    std::size_t capacity() const noexcept;
+
+    const V & at(const K & key) const;
+    V & operator[](const K & key);
+    V & operator[](K && key);
+
+    std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair);
+    // The key of a value_type is const, so only the value is moved
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair);
+
+    // Probe exactly once: return the element of "key" if it exists,
+    // otherwise construct the pair in place from "key" and V(args...)
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(const K & key, Args && ... args) {
+        return iterator_and_flag(try_emplace_impl(key, Hash()(key), std::forward<Args>(args)...));
+    }
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(K && key, Args && ... args) {
+        const std::size_t hash = Hash()(key);
+        return iterator_and_flag(try_emplace_impl(std::move(key), hash, std::forward<Args>(args)...));
+    }
+
+    // The key has to be known before probing, so the pair is built first and then moved into its slot.
+    // Prefer try_emplace when the key is at hand.
+    template <typename ... Args>
+    std::pair<IteratorT, bool> emplace(Args && ... args) {
+        std::pair<K, V> pair(std::forward<Args>(args)...);
+        return try_emplace(std::move(pair.first), std::move(pair.second));
+    }
+
+    template <typename M>
+    std::pair<IteratorT, bool> insert_or_assign(const K & key, M && value) {
+        auto result = try_emplace(key, std::forward<M>(value));
+        if(!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
+    template <typename M>
+    std::pair<IteratorT, bool> insert_or_assign(K && key, M && value) {
+        auto result = try_emplace(std::move(key), std::forward<M>(value));
+        if(!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
+
+    std::size_t erase(const K & key);
+
+    void clear();
+
+    IteratorT find(const K & key);
+
+    // "hash" must be Hash()(key)
+    IteratorT find(const K & key, std::size_t hash) {
+        return iterator_at(find_index(key, hash));
+    }
+
+    // Heterogeneous lookup, only available with a transparent Hash and KeyEqual
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    IteratorT find(const Q & key) {
+        return iterator_at(find_index(key, Hash()(key)));
+    }
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    IteratorT find(const Q & key, std::size_t hash) {
+        return iterator_at(find_index(key, hash));
+    }
+
+    /**
+     * @brief Look up keys[i] into out[i] (end() on a miss). Keys are hashed and their home slots
+     * prefetched PrefetchDistance keys ahead of the one being resolved, so the cache misses of
+     * independent lookups overlap.
+     */
+    void find_batch(std::span<const K> keys, std::span<IteratorT> out);
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    const V & at(const Q & key) const {
+        std::size_t pos = find_index(key, Hash()(key));
+        if(pos == capacity_) {
+            throw std::out_of_range("[FlatHashMapV4::at] key is not found");
+        }
+        return elements_[pos].pair.second;
+    }
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    V & operator[](const Q & key) {
+        return elements_[try_emplace_impl(key, Hash()(key)).first].pair.second;
+    }
+
+    // K is only constructed from "key" if the element is inserted
+    template <typename Q, typename ... Args>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    std::pair<IteratorT, bool> try_emplace(const Q & key, Args && ... args) {
+        return iterator_and_flag(try_emplace_impl(key, Hash()(key), std::forward<Args>(args)...));
+    }
+
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    std::size_t erase(const Q & key) {
+        return erase_at(find_index(key, Hash()(key)));
+    }
+
+    IteratorT end() const {
+        return IteratorT(nullptr);
+    }
+
+    float load_factor() const noexcept {
+        return (size_ * 1.0f) / capacity_;
+    }
+    void set_max_load_factor(float max_load_factor) {
+        max_load_factor_ = max_load_factor;
+    }
+
+    // Shape of the table, plus what StatsPolicy recorded so far. There are no tombstones
+    HashMapStats stats() const {
+        HashMapStats result;
+        result.size = size_;
+        result.capacity = capacity_;
+        result.load_factor = load_factor();
+        result.cluster_lengths = cluster_histogram(capacity_, [&](std::size_t pos) {
+            return elements_[pos].is_valid();
+        });
+        stats_.fill(result);
+        return result;
+    }
+    void reset_stats() {
+        stats_.reset();
+    }
+
+    // For debug only
+    std::size_t get_capacity() const {
+        return capacity_;
+    }
+    // Number of elements by probe distance
+    std::vector<std::size_t> probe_histogram() const {
+        std::vector<std::size_t> histogram;
+        for(const ElementT & element : elements_) {
+            if(element.is_valid()) {
+                if(element.dist() >= histogram.size()) {
+                    histogram.resize(element.dist() + 1, 0);
+                }
+                histogram[element.dist()]++;
+            }
+        }
+        return histogram;
+    }
+
+private:
+    constexpr static std::size_t PrefetchDistance = 16;
+
+    // Returns capacity_ if the key is not found
+    template <typename Q>
+    std::size_t find_index(const Q & key, std::size_t hash) const;
+    // Returns {position of key, inserted or not}. K is constructed from std::forward<Q>(key) only on insertion
+    template <typename Q, typename ... Args>
+    std::pair<std::size_t, bool> try_emplace_impl(Q && key, std::size_t hash, Args && ... args);
+    std::size_t erase_at(std::size_t pos);
+    // Slot "pos" is empty: pull the rest of the cluster one slot closer to home
+    void close_gap(std::size_t pos);
+    void expand_and_rehash(bool probe_overflow = false);
+
+    std::size_t home_of(std::size_t hash) const {
+        return IndexPolicy::index(hash, capacity_);
+    }
+
+    IteratorT iterator_at(std::size_t pos) {
+        return (pos == capacity_) ? end() : IteratorT(&elements_[pos].pair);
+    }
+    std::pair<IteratorT, bool> iterator_and_flag(std::pair<std::size_t, bool> result) {
+        return {IteratorT(&elements_[result.first].pair), result.second};
+    }
+
+    using ElementAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<ElementT>;
+    using ContainerT = std::vector<ElementT, ElementAllocator>;
+
+    // These work on any table, not only elements_, so that a rehash can fill the new table aside.
+    // Follow the probe sequence of an absent element from "pos" with probe distance "dist",
+    // until the slot where Robin Hood would place it. Returns table.size() if "dist" would overflow.
+    static std::size_t probe_insert_pos(const ContainerT & table, std::size_t pos, std::size_t & dist);
+    // Empty slot "pos" by displacing the rest of the cluster by one slot.
+    // Returns false (and changes nothing) if some displaced element would overflow MaxDist.
+    static bool make_room(ContainerT & table, std::size_t pos);
+
+    // The elements leave the old table by move, or by copy when a move could throw (like std::move_if_noexcept),
+    // so that the old table is still whole if the rehash fails half way.
+    constexpr static bool CopyOnRehash = !std::is_nothrow_move_constructible_v<std::pair<K, V>>
+                                         && std::is_copy_constructible_v<std::pair<K, V>>;
+
+    // Place every element in a new table of "new_capacity" slots, allocated before anything changes,
+    // and make it elements_ once they are all in. Returns false on probe distance overflow.
+    // On overflow or on an exception elements_ is left as it was, except that with a move-only K or V
+    // whose move constructor throws, the element being moved is lost (the basic guarantee).
+    bool place_all(std::size_t new_capacity);
+    // Put the elements that place_all() moved into "to" back into elements_, at their Robin Hood slots again
+    void undo_place_all(ContainerT & to);
+
+    // Replace our table with the one of "other", whose allocator is ours or propagates on move assignment.
+    // "other" is left without a table, and is only fit for destruction
+    void take(FlatHashMapV4 & other) noexcept {
+        elements_ = std::move(other.elements_);
+        size_ = other.size_;
+        capacity_ = other.capacity_;
+        max_load_factor_ = other.max_load_factor_;
+        stats_ = other.stats_;
+    }
+
+    ContainerT elements_;
+    std::size_t size_{0};
+    std::size_t capacity_;
+    float max_load_factor_{0.9};
+
+    // Lookups of a const map record too
+    [[no_unique_address]] mutable StatsPolicy stats_;
+};
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+bool FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::empty() const noexcept {
+    return size_ == 0;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+std::size_t FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::size() const noexcept {
+    return size_;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+std::size_t FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::capacity() const noexcept {
+    return capacity_;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+template <typename Q>
+std::size_t FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::find_index(const Q & key, std::size_t hash) const {
+    std::size_t pos = home_of(hash);
+    for(std::size_t dist = 0; ; dist++) {
+        const auto & element = elements_[pos];
+        // Early exit: an empty slot, or a resident closer to its home than we are to ours,
+        // means the key would have been placed before this point
+        if(!element.is_valid() || element.dist() < dist) {
+            stats_.record_miss(dist);
+            return capacity_;
+        }
+        if((element.dist() == dist) && KeyEqual()(element.pair.first, key)) {
+            stats_.record_hit(dist);
+            return pos;
+        }
+        pos = (pos + 1) & (capacity_ - 1);
+    }
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+std::size_t FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::probe_insert_pos(const ContainerT & table, std::size_t pos, std::size_t & dist) {
+    while(table[pos].is_valid() && table[pos].dist() >= dist) {
+        if(dist == MaxDist) {
+            return table.size();
+        }
+        pos = (pos + 1) & (table.size() - 1);
+        dist++;
+    }
+    return pos;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+bool FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::make_room(ContainerT & table, std::size_t pos) {
+    // Residents of a cluster are ordered by their home slot, so "the poorer element steals the slot
+    // and the richer one moves on" ends up moving every element between "pos" and the next empty slot
+    // one step further. Doing it as a shift lets us check for distance overflow before touching anything.
+    const std::size_t mask = table.size() - 1;
+    std::size_t last = pos;
+    while(table[last].is_valid()) {
+        if(table[last].dist() == MaxDist) {
+            return false;
+        }
+        last = (last + 1) & mask;
+    }
+    while(last != pos) {
+        std::size_t prev = (last - 1) & mask;
+        table[last] = std::move(table[prev]);
+        table[last].dist_plus_one++;
+        last = prev;
+    }
+    table[pos].reset();
+    return true;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+template <typename Q, typename ... Args>
+auto FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::try_emplace_impl(Q && key, std::size_t hash, Args && ... args) -> std::pair<std::size_t, bool> {
+    if(load_factor() > max_load_factor_) {
+        expand_and_rehash();
+    }
+
+    while(true) {
+        std::size_t pos = home_of(hash);
+        std::size_t dist = 0;
+        while(elements_[pos].is_valid() && elements_[pos].dist() >= dist) {
+            if((elements_[pos].dist() == dist) && KeyEqual()(elements_[pos].pair.first, key)) {
+                return {pos, false};
+            }
+            if(dist == MaxDist) {
+                break;
+            }
+            pos = (pos + 1) & (capacity_ - 1);
+            dist++;
+        }
+
+        bool overflow = elements_[pos].is_valid() && elements_[pos].dist() >= dist;
+        if(!overflow && make_room(elements_, pos)) {
+            try {
+                elements_[pos].emplace(static_cast<DistStructType>(dist + 1), std::piecewise_construct,
+                                       std::forward_as_tuple(std::forward<Q>(key)),
+                                       std::forward_as_tuple(std::forward<Args>(args)...));
+            } catch(...) {
+                close_gap(pos);
+                throw;
+            }
+            size_++;
+            return {pos, true};
+        }
+        // Some probe distance would not fit in DistStructType
+        expand_and_rehash(true);
+    }
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+const V & FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::at(const K & key) const {
+    std::size_t pos = find_index(key, Hash()(key));
+    if(pos == capacity_) {
+        throw std::out_of_range("[FlatHashMapV4::at] key is not found");
+    }
+    return elements_[pos].pair.second;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+V & FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::operator[](const K & key) {
+    // Without tombstones, a probe that finds the insertion point has also proven the key absent,
+    // so there is no need to call "find" first as V0 - V2 do
+    return elements_[try_emplace_impl(key, Hash()(key)).first].pair.second;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+V & FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::operator[](K && key) {
+    const std::size_t hash = Hash()(key);
+    return elements_[try_emplace_impl(std::move(key), hash).first].pair.second;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+auto FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::find(const K & key) -> IteratorT {
+    return iterator_at(find_index(key, Hash()(key)));
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+void FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::find_batch(std::span<const K> keys, std::span<IteratorT> out) {
+    assert(out.size() >= keys.size());
+    constexpr std::size_t RingSize = 2 * PrefetchDistance;
+    std::array<std::size_t, RingSize> hashes;
+    const std::size_t num_keys = keys.size();
+
+    auto hash_and_prefetch = [&](std::size_t i) {
+        std::size_t hash = Hash()(keys[i]);
+        hashes[i % RingSize] = hash;
+        __builtin_prefetch(&elements_[home_of(hash)]);
+    };
+
+    for(std::size_t i = 0; i < std::min(num_keys, PrefetchDistance); i++) {
+        hash_and_prefetch(i);
+    }
+    for(std::size_t i = 0; i < num_keys; i++) {
+        if(i + PrefetchDistance < num_keys) {
+            hash_and_prefetch(i + PrefetchDistance);
+        }
+        out[i] = iterator_at(find_index(keys[i], hashes[i % RingSize]));
+    }
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+auto FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::insert(const std::pair<const K, V> & pair) -> std::pair<IteratorT, bool> {
+    return try_emplace(pair.first, pair.second);
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+auto FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::insert(std::pair<const K, V> && pair) -> std::pair<IteratorT, bool> {
+    return try_emplace(pair.first, std::move(pair.second));
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+std::size_t FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::erase(const K & key) {
+    return erase_at(find_index(key, Hash()(key)));
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+std::size_t FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::erase_at(std::size_t pos) {
+    if(pos == capacity_) {
+        return 0;
+    }
+    elements_[pos].reset();
+    close_gap(pos);
+    size_--;
+    return 1;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+void FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::close_gap(std::size_t pos) {
+    // Backward-shift deletion: pull the rest of the cluster one slot closer to home,
+    // until we meet an empty slot or an element which is already at its home
+    std::size_t next = (pos + 1) & (capacity_ - 1);
+    while(elements_[next].is_valid() && elements_[next].dist() > 0) {
+        elements_[pos] = std::move(elements_[next]);
+        elements_[pos].dist_plus_one--;
+        pos = next;
+        next = (next + 1) & (capacity_ - 1);
+    }
+    elements_[pos].reset();
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+void FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::expand_and_rehash(bool probe_overflow) {
+    auto timer = stats_.start_rehash();
+    std::size_t new_capacity = capacity_ * 2;
+    while(true) {
+        // If probe distances still overflow with a load factor below 1/8,
+        // the hash function is degenerate and growing further will not help
+        if(probe_overflow && (size_ * 8 < new_capacity)) {
+            throw std::overflow_error("[FlatHashMapV4::expand_and_rehash] probe distance overflows DistStructType");
+        }
+        if(place_all(new_capacity)) {
+            break;
+        }
+        new_capacity *= 2;
+        probe_overflow = true;
+    }
+    stats_.finish_rehash(timer);
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+bool FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::place_all(std::size_t new_capacity) {
+    // A bad_alloc here leaves the map untouched
+    ContainerT to(new_capacity, elements_.get_allocator());
+    try {
+        for(auto & element : elements_) {
+            if(!element.is_valid()) {
+                continue;
+            }
+            std::size_t dist = 0;
+            std::size_t pos = probe_insert_pos(to, IndexPolicy::index(Hash()(element.pair.first), new_capacity), dist);
+            if(pos == new_capacity || !make_room(to, pos)) {
+                undo_place_all(to);
+                return false;
+            }
+            if constexpr (CopyOnRehash) {
+                to[pos].emplace(static_cast<DistStructType>(dist + 1), element.pair);
+            } else {
+                // Move the pair, not a copy of it, and leave an empty slot behind
+                to[pos].emplace(static_cast<DistStructType>(dist + 1), std::move(element.pair));
+                element.reset();
+            }
+        }
+    } catch(...) {
+        undo_place_all(to);
+        throw;
+    }
+    elements_ = std::move(to);
+    capacity_ = new_capacity;
+    return true;
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+void FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::undo_place_all(ContainerT & to) {
+    if constexpr (CopyOnRehash) {
+        // elements_ was only read, "to" holds copies
+        return;
+    }
+    // Every element moved to "to" left its slot of elements_ empty, but "to" does not tell which one,
+    // so put them in any empty slot, then lay everything out again in the storage of "to" cut down to the
+    // old capacity. Shrinking a std::vector never allocates, and the same elements fit the same capacity.
+    std::size_t hole = 0;
+    for(auto & placed : to) {
+        if(placed.is_valid()) {
+            while(elements_[hole].is_valid()) {
+                hole++;
+            }
+            elements_[hole].emplace(placed.dist_plus_one, std::move(placed.pair));
+            placed.reset();
+        }
+    }
+    to.resize(capacity_);
+    for(auto & element : elements_) {
+        if(!element.is_valid()) {
+            continue;
+        }
+        std::size_t dist = 0;
+        std::size_t pos = probe_insert_pos(to, home_of(Hash()(element.pair.first)), dist);
+        [[maybe_unused]] bool placed = (pos != capacity_) && make_room(to, pos);
+        assert(placed);
+        to[pos].emplace(static_cast<DistStructType>(dist + 1), std::move(element.pair));
+        element.reset();
+    }
+    elements_.swap(to);
+}
+
+template <typename DistStructType,
+          typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy,
+          typename StatsPolicy>
+void FlatHashMapV4<DistStructType, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>::clear() {
+    capacity_ = InitCapacity;
+    elements_.clear();
+    elements_.resize(InitCapacity);
+    size_ = 0;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex,
+          typename StatsPolicy = NoStats>
+using FlatHashMapV4a = FlatHashMapV4<uint8_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>;
+
+template <typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex,
+          typename StatsPolicy = NoStats>
+using FlatHashMapV4b = FlatHashMapV4<uint16_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>;
+
+template <typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex,
+          typename StatsPolicy = NoStats>
+using FlatHashMapV4c = FlatHashMapV4<uint32_t, K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, StatsPolicy>;
+
+}
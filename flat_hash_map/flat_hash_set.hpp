@@ -0,0 +1,860 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <optional>
+#include <limits>
+#include <type_traits>
+#include <concepts>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include "bitmap.hpp"
+#include "hash_policy.hpp"
+
+namespace hpds {
+
+template <std::size_t InitCapacity>
+concept PowerOfTwoCapacity = (InitCapacity > 0) && ((InitCapacity & (InitCapacity - 1)) == 0);
+
+/**
+ * @brief Integer keys can give up one of their values to mark empty slots, so that a slot is just the key
+ * (and the value for SentinelFlatHashMap), without any metadata word next to it.
+ * The sentinel is the max value of K unless SentinelKeyTraits is specialized. It is still a valid key:
+ * the containers keep it out of line, so no key value is forbidden.
+ */
+template <typename K>
+concept SentinelKey = std::is_integral_v<K> && !std::is_same_v<K, bool>;
+
+template <typename K>
+struct SentinelKeyTraits {
+    constexpr static K empty_key() {
+        return std::numeric_limits<K>::max();
+    }
+};
+
+/**
+ * @brief Open addressing set with linear probing, storing nothing but the keys.
+ * Occupancy lives in a hpds::Bitmap (1 bit per slot) instead of a header in every slot,
+ * and erasure uses backward shifting (Knuth's Algorithm R), so there are no tombstones either.
+ * Like FlatHashMapV3, the hash is mixed before IndexPolicy picks the home slot, because linear probing
+ * turns the clusters of the identity std::hash<int> into long runs.
+ * For integer keys the partial specialization below drops the bitmap as well.
+ */
+template <typename K,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<K>,
+          typename IndexPolicy = MaskIndex>
+requires PowerOfTwoCapacity<InitCapacity>
+class FlatHashSet {
+public:
+    using SlotT = K;
+
+    FlatHashSet() : FlatHashSet(Allocator()) {}
+    explicit FlatHashSet(const Allocator & alloc)
+        : keys_(InitCapacity, KeyAllocator(alloc)), occupied_(BitmapAllocator(alloc)), capacity_(InitCapacity) {}
+    FlatHashSet(const FlatHashSet & other) = default;
+    // The source is left as an empty set of InitCapacity slots, which is why moving allocates
+    FlatHashSet(FlatHashSet && other) : FlatHashSet(other.get_allocator()) {
+        std::swap(keys_, other.keys_);
+        std::swap(occupied_, other.occupied_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(max_load_factor_, other.max_load_factor_);
+    }
+    FlatHashSet & operator=(const FlatHashSet & other) {
+        if(this != &other) {
+            *this = FlatHashSet(other);
+        }
+        return *this;
+    }
+    FlatHashSet & operator=(FlatHashSet && other) {
+        if(this != &other) {
+            // The vectors take care of the allocators
+            FlatHashSet moved(std::move(other));
+            keys_ = std::move(moved.keys_);
+            occupied_ = std::move(moved.occupied_);
+            size_ = moved.size_;
+            capacity_ = moved.capacity_;
+            max_load_factor_ = moved.max_load_factor_;
+        }
+        return *this;
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(keys_.get_allocator());
+    }
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+    std::size_t size() const noexcept {
+        return size_;
+    }
+    std::size_t capacity() const noexcept {
+        return capacity_;
+    }
+    float load_factor() const noexcept {
+        return (size_ * 1.0f) / capacity_;
+    }
+    void set_max_load_factor(float max_load_factor) {
+        max_load_factor_ = max_load_factor;
+    }
+
+    // Returns true if "key" was inserted, false if it was already there
+    bool insert(const K & key) {
+        return insert_impl(key);
+    }
+    bool insert(K && key) {
+        return insert_impl(std::move(key));
+    }
+    bool contains(const K & key) const {
+        return find_index(key, hash_of(key)) != capacity_;
+    }
+    std::size_t count(const K & key) const {
+        return contains(key) ? 1 : 0;
+    }
+    std::size_t erase(const K & key);
+    void clear();
+    // Make room for "n" keys, so that inserting up to "n" keys does not rehash
+    void reserve(std::size_t n);
+
+    // Call func(key) for every key, in slot order
+    template <typename Func>
+    void for_each(Func && func) const {
+        occupied_.for_each_set([&](std::size_t pos) { func(keys_[pos]); });
+    }
+
+private:
+    using KeyAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<K>;
+    using BitmapAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<uint64_t>;
+    using ContainerT = std::vector<K, KeyAllocator>;
+    using BitmapT = Bitmap<InitCapacity, 64, BitmapAllocator>;
+
+    static std::size_t hash_of(const K & key) {
+        return mix_hash(Hash()(key));
+    }
+    std::size_t home_of(std::size_t hash) const {
+        return IndexPolicy::index(hash, capacity_);
+    }
+    // Returns capacity_ if the key is not found
+    std::size_t find_index(const K & key, std::size_t hash) const;
+    template <typename Q>
+    bool insert_impl(Q && key);
+    void rehash_to(std::size_t new_capacity);
+
+    ContainerT keys_;
+    BitmapT occupied_;
+    std::size_t size_{0};
+    std::size_t capacity_;
+    float max_load_factor_{0.75};
+};
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity>
+std::size_t FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::find_index(const K & key, std::size_t hash) const {
+    for(std::size_t pos = home_of(hash); occupied_.test(pos); pos = (pos + 1) & (capacity_ - 1)) {
+        if(KeyEqual()(keys_[pos], key)) {
+            return pos;
+        }
+    }
+    return capacity_;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity>
+template <typename Q>
+bool FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert_impl(Q && key) {
+    if((size_ + 1) > capacity_ * max_load_factor_) {
+        rehash_to(capacity_ * 2);
+    }
+    std::size_t pos = home_of(hash_of(key));
+    for(; occupied_.test(pos); pos = (pos + 1) & (capacity_ - 1)) {
+        if(KeyEqual()(keys_[pos], key)) {
+            return false;
+        }
+    }
+    keys_[pos] = std::forward<Q>(key);
+    occupied_.set(pos);
+    size_++;
+    return true;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity>
+std::size_t FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::erase(const K & key) {
+    std::size_t hole = find_index(key, hash_of(key));
+    if(hole == capacity_) {
+        return 0;
+    }
+    // Pull the later keys of the cluster into the hole, except those whose home lies
+    // after the hole, which would then be unreachable from their home
+    for(std::size_t next = (hole + 1) & (capacity_ - 1); occupied_.test(next); next = (next + 1) & (capacity_ - 1)) {
+        std::size_t home = home_of(hash_of(keys_[next]));
+        if(((next - home) & (capacity_ - 1)) >= ((next - hole) & (capacity_ - 1))) {
+            keys_[hole] = std::move(keys_[next]);
+            hole = next;
+        }
+    }
+    occupied_.reset(hole);
+    size_--;
+    return 1;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity>
+void FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::rehash_to(std::size_t new_capacity) {
+    ContainerT new_keys(new_capacity, keys_.get_allocator());
+    BitmapT new_occupied(occupied_.get_allocator());
+    new_occupied.resize(new_capacity);
+    occupied_.for_each_set([&](std::size_t pos) {
+        std::size_t new_pos = IndexPolicy::index(hash_of(keys_[pos]), new_capacity);
+        while(new_occupied.test(new_pos)) {
+            new_pos = (new_pos + 1) & (new_capacity - 1);
+        }
+        new_keys[new_pos] = std::move(keys_[pos]);
+        new_occupied.set(new_pos);
+    });
+    keys_ = std::move(new_keys);
+    occupied_ = std::move(new_occupied);
+    capacity_ = new_capacity;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity>
+void FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::reserve(std::size_t n) {
+    std::size_t new_capacity = capacity_;
+    while(n > new_capacity * max_load_factor_) {
+        new_capacity *= 2;
+    }
+    if(new_capacity != capacity_) {
+        rehash_to(new_capacity);
+    }
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity>
+void FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::clear() {
+    keys_ = ContainerT(InitCapacity, keys_.get_allocator());
+    occupied_ = BitmapT(occupied_.get_allocator());
+    capacity_ = InitCapacity;
+    size_ = 0;
+}
+
+/**
+ * @brief FlatHashSet for integer keys: a slot is the bare key, and an empty slot holds
+ * SentinelKeyTraits<K>::empty_key(). So a FlatHashSet<uint32_t> takes 4 bytes per slot,
+ * and a probe reads a single array.
+ */
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+class FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy> {
+public:
+    using SlotT = K;
+
+    constexpr static K EmptyKey = SentinelKeyTraits<K>::empty_key();
+
+    FlatHashSet() : FlatHashSet(Allocator()) {}
+    explicit FlatHashSet(const Allocator & alloc) : keys_(InitCapacity, EmptyKey, KeyAllocator(alloc)), capacity_(InitCapacity) {}
+    FlatHashSet(const FlatHashSet & other) = default;
+    // The source is left as an empty set of InitCapacity slots, which is why moving allocates
+    FlatHashSet(FlatHashSet && other) : FlatHashSet(other.get_allocator()) {
+        std::swap(keys_, other.keys_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(max_load_factor_, other.max_load_factor_);
+        std::swap(has_empty_key_, other.has_empty_key_);
+    }
+    FlatHashSet & operator=(const FlatHashSet & other) {
+        if(this != &other) {
+            *this = FlatHashSet(other);
+        }
+        return *this;
+    }
+    FlatHashSet & operator=(FlatHashSet && other) {
+        if(this != &other) {
+            // The vectors take care of the allocators
+            FlatHashSet moved(std::move(other));
+            keys_ = std::move(moved.keys_);
+            size_ = moved.size_;
+            capacity_ = moved.capacity_;
+            max_load_factor_ = moved.max_load_factor_;
+            has_empty_key_ = moved.has_empty_key_;
+        }
+        return *this;
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(keys_.get_allocator());
+    }
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+    std::size_t size() const noexcept {
+        return size_;
+    }
+    std::size_t capacity() const noexcept {
+        return capacity_;
+    }
+    float load_factor() const noexcept {
+        return (size_ * 1.0f) / capacity_;
+    }
+    void set_max_load_factor(float max_load_factor) {
+        max_load_factor_ = max_load_factor;
+    }
+
+    // Returns true if "key" was inserted, false if it was already there
+    bool insert(K key);
+    bool contains(K key) const {
+        return (key == EmptyKey) ? has_empty_key_ : (find_index(key) != capacity_);
+    }
+    std::size_t count(K key) const {
+        return contains(key) ? 1 : 0;
+    }
+    std::size_t erase(K key);
+    void clear();
+    // Make room for "n" keys, so that inserting up to "n" keys does not rehash
+    void reserve(std::size_t n);
+
+    // Call func(key) for every key, in slot order and then the sentinel key if it is present
+    template <typename Func>
+    void for_each(Func && func) const {
+        for(K key : keys_) {
+            if(key != EmptyKey) {
+                func(key);
+            }
+        }
+        if(has_empty_key_) {
+            func(EmptyKey);
+        }
+    }
+
+private:
+    using KeyAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<K>;
+    using ContainerT = std::vector<K, KeyAllocator>;
+
+    static std::size_t home_of(K key, std::size_t capacity) {
+        return IndexPolicy::index(mix_hash(Hash()(key)), capacity);
+    }
+    // Returns capacity_ if the key is not found. "key" is not the sentinel
+    std::size_t find_index(K key) const;
+    void rehash_to(std::size_t new_capacity);
+
+    ContainerT keys_;
+    std::size_t size_{0};
+    std::size_t capacity_;
+    float max_load_factor_{0.75};
+    bool has_empty_key_{false};
+};
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+std::size_t FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::find_index(K key) const {
+    for(std::size_t pos = home_of(key, capacity_); keys_[pos] != EmptyKey; pos = (pos + 1) & (capacity_ - 1)) {
+        if(KeyEqual()(keys_[pos], key)) {
+            return pos;
+        }
+    }
+    return capacity_;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+bool FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::insert(K key) {
+    if(key == EmptyKey) {
+        if(has_empty_key_) {
+            return false;
+        }
+        has_empty_key_ = true;
+        size_++;
+        return true;
+    }
+    if((size_ + 1) > capacity_ * max_load_factor_) {
+        rehash_to(capacity_ * 2);
+    }
+    std::size_t pos = home_of(key, capacity_);
+    for(; keys_[pos] != EmptyKey; pos = (pos + 1) & (capacity_ - 1)) {
+        if(KeyEqual()(keys_[pos], key)) {
+            return false;
+        }
+    }
+    keys_[pos] = key;
+    size_++;
+    return true;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+std::size_t FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::erase(K key) {
+    if(key == EmptyKey) {
+        if(!has_empty_key_) {
+            return 0;
+        }
+        has_empty_key_ = false;
+        size_--;
+        return 1;
+    }
+    std::size_t hole = find_index(key);
+    if(hole == capacity_) {
+        return 0;
+    }
+    // Backward shifting, see the primary template
+    for(std::size_t next = (hole + 1) & (capacity_ - 1); keys_[next] != EmptyKey; next = (next + 1) & (capacity_ - 1)) {
+        std::size_t home = home_of(keys_[next], capacity_);
+        if(((next - home) & (capacity_ - 1)) >= ((next - hole) & (capacity_ - 1))) {
+            keys_[hole] = keys_[next];
+            hole = next;
+        }
+    }
+    keys_[hole] = EmptyKey;
+    size_--;
+    return 1;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+void FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::rehash_to(std::size_t new_capacity) {
+    ContainerT new_keys(new_capacity, EmptyKey, keys_.get_allocator());
+    for(K key : keys_) {
+        if(key == EmptyKey) {
+            continue;
+        }
+        std::size_t new_pos = home_of(key, new_capacity);
+        while(new_keys[new_pos] != EmptyKey) {
+            new_pos = (new_pos + 1) & (new_capacity - 1);
+        }
+        new_keys[new_pos] = key;
+    }
+    keys_ = std::move(new_keys);
+    capacity_ = new_capacity;
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+void FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::reserve(std::size_t n) {
+    std::size_t new_capacity = capacity_;
+    while(n > new_capacity * max_load_factor_) {
+        new_capacity *= 2;
+    }
+    if(new_capacity != capacity_) {
+        rehash_to(new_capacity);
+    }
+}
+
+template <typename K,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+void FlatHashSet<K, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::clear() {
+    keys_ = ContainerT(InitCapacity, EmptyKey, keys_.get_allocator());
+    capacity_ = InitCapacity;
+    size_ = 0;
+    has_empty_key_ = false;
+}
+
+/**
+ * @brief Hash map for integer keys whose slot is a bare std::pair<K, V>: the sentinel key marks empty slots
+ * instead of the is_valid / pos header of V0 - V2, so e.g. <uint32_t, uint32_t> takes 8 bytes per slot
+ * instead of 12. Linear probing with backward-shift erasure, like the integer FlatHashSet.
+ * Empty slots hold a value-initialized V, so V must be default constructible.
+ * The sentinel key itself is kept out of line, and an erase or a rehash invalidates iterators.
+ */
+template <typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>,
+          typename IndexPolicy = MaskIndex>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+class SentinelFlatHashMap {
+public:
+    using SlotT = std::pair<K, V>;
+
+    constexpr static K EmptyKey = SentinelKeyTraits<K>::empty_key();
+
+    class IteratorT {
+    public:
+        IteratorT(std::pair<K, V> * pair = nullptr) : pair_ptr_(pair) {}
+
+        bool operator== (const IteratorT & other) const {
+            return (pair_ptr_ == other.pair_ptr_);
+        }
+
+        std::pair<K, V> & operator*() {
+            return *pair_ptr_;
+        }
+        std::pair<K, V> * operator->() {
+            return pair_ptr_;
+        }
+
+    private:
+        std::pair<K, V> * pair_ptr_;
+    };
+
+    SentinelFlatHashMap() : SentinelFlatHashMap(Allocator()) {}
+    explicit SentinelFlatHashMap(const Allocator & alloc)
+        : slots_(InitCapacity, SlotT(EmptyKey, V()), SlotAllocator(alloc)), capacity_(InitCapacity) {}
+    SentinelFlatHashMap(const SentinelFlatHashMap & other) = default;
+    // The source is left as an empty map of InitCapacity slots, which is why moving allocates
+    SentinelFlatHashMap(SentinelFlatHashMap && other) : SentinelFlatHashMap(other.get_allocator()) {
+        std::swap(slots_, other.slots_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(max_load_factor_, other.max_load_factor_);
+        std::swap(empty_key_slot_, other.empty_key_slot_);
+    }
+    SentinelFlatHashMap & operator=(const SentinelFlatHashMap & other) {
+        if(this != &other) {
+            *this = SentinelFlatHashMap(other);
+        }
+        return *this;
+    }
+    SentinelFlatHashMap & operator=(SentinelFlatHashMap && other) {
+        if(this != &other) {
+            // The vectors take care of the allocators
+            SentinelFlatHashMap moved(std::move(other));
+            slots_ = std::move(moved.slots_);
+            size_ = moved.size_;
+            capacity_ = moved.capacity_;
+            max_load_factor_ = moved.max_load_factor_;
+            empty_key_slot_ = std::move(moved.empty_key_slot_);
+        }
+        return *this;
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(slots_.get_allocator());
+    }
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+    std::size_t size() const noexcept {
+        return size_;
+    }
+    std::size_t capacity() const noexcept {
+        return capacity_;
+    }
+    float load_factor() const noexcept {
+        return (size_ * 1.0f) / capacity_;
+    }
+    void set_max_load_factor(float max_load_factor) {
+        max_load_factor_ = max_load_factor;
+    }
+
+    IteratorT find(K key);
+    IteratorT end() const {
+        return IteratorT(nullptr);
+    }
+    const V & at(K key) const;
+    V & operator[](K key) {
+        return try_emplace(key).first -> second;
+    }
+
+    // Probe exactly once: return the element of "key" if it exists, otherwise insert V(args...)
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(K key, Args && ... args);
+    std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair) {
+        return try_emplace(pair.first, pair.second);
+    }
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair) {
+        return try_emplace(pair.first, std::move(pair.second));
+    }
+    template <typename M>
+    std::pair<IteratorT, bool> insert_or_assign(K key, M && value) {
+        auto result = try_emplace(key, std::forward<M>(value));
+        if(!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
+
+    std::size_t erase(K key);
+    void clear();
+    // Make room for "n" elements, so that inserting up to "n" elements does not rehash
+    void reserve(std::size_t n);
+
+    // For debug only. Number of elements in the slots by distance from their home slot
+    std::vector<std::size_t> probe_histogram() const {
+        std::vector<std::size_t> histogram;
+        for(std::size_t pos = 0; pos < capacity_; pos++) {
+            if(slots_[pos].first != EmptyKey) {
+                std::size_t dist = (pos - home_of(slots_[pos].first, capacity_)) & (capacity_ - 1);
+                if(dist >= histogram.size()) {
+                    histogram.resize(dist + 1, 0);
+                }
+                histogram[dist]++;
+            }
+        }
+        return histogram;
+    }
+
+    // Call func(key, value) for every element, in slot order and then the sentinel key if it is present
+    template <typename Func>
+    void for_each(Func && func) {
+        for(auto & slot : slots_) {
+            if(slot.first != EmptyKey) {
+                func(slot.first, slot.second);
+            }
+        }
+        if(empty_key_slot_) {
+            func(empty_key_slot_->first, empty_key_slot_->second);
+        }
+    }
+
+private:
+    using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<SlotT>;
+    using ContainerT = std::vector<SlotT, SlotAllocator>;
+
+    static std::size_t home_of(K key, std::size_t capacity) {
+        return IndexPolicy::index(mix_hash(Hash()(key)), capacity);
+    }
+    // Returns capacity_ if the key is not found. "key" is not the sentinel
+    std::size_t find_index(K key) const;
+    void rehash_to(std::size_t new_capacity);
+
+    ContainerT slots_;
+    std::size_t size_{0};
+    std::size_t capacity_;
+    float max_load_factor_{0.75};
+    std::optional<SlotT> empty_key_slot_;
+};
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+std::size_t SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::find_index(K key) const {
+    for(std::size_t pos = home_of(key, capacity_); slots_[pos].first != EmptyKey; pos = (pos + 1) & (capacity_ - 1)) {
+        if(KeyEqual()(slots_[pos].first, key)) {
+            return pos;
+        }
+    }
+    return capacity_;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+auto SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::find(K key) -> IteratorT {
+    if(key == EmptyKey) {
+        return empty_key_slot_ ? IteratorT(&*empty_key_slot_) : end();
+    }
+    std::size_t pos = find_index(key);
+    return (pos == capacity_) ? end() : IteratorT(&slots_[pos]);
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+const V & SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::at(K key) const {
+    if(key == EmptyKey) {
+        if(!empty_key_slot_) {
+            throw std::out_of_range("[SentinelFlatHashMap::at] key is not found");
+        }
+        return empty_key_slot_->second;
+    }
+    std::size_t pos = find_index(key);
+    if(pos == capacity_) {
+        throw std::out_of_range("[SentinelFlatHashMap::at] key is not found");
+    }
+    return slots_[pos].second;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+template <typename ... Args>
+auto SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::try_emplace(K key, Args && ... args) -> std::pair<IteratorT, bool> {
+    if(key == EmptyKey) {
+        if(empty_key_slot_) {
+            return {IteratorT(&*empty_key_slot_), false};
+        }
+        empty_key_slot_.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                                std::forward_as_tuple(std::forward<Args>(args)...));
+        size_++;
+        return {IteratorT(&*empty_key_slot_), true};
+    }
+    if((size_ + 1) > capacity_ * max_load_factor_) {
+        rehash_to(capacity_ * 2);
+    }
+    std::size_t pos = home_of(key, capacity_);
+    for(; slots_[pos].first != EmptyKey; pos = (pos + 1) & (capacity_ - 1)) {
+        if(KeyEqual()(slots_[pos].first, key)) {
+            return {IteratorT(&slots_[pos]), false};
+        }
+    }
+    slots_[pos].second = V(std::forward<Args>(args)...);
+    slots_[pos].first = key;
+    size_++;
+    return {IteratorT(&slots_[pos]), true};
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+std::size_t SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::erase(K key) {
+    if(key == EmptyKey) {
+        if(!empty_key_slot_) {
+            return 0;
+        }
+        empty_key_slot_.reset();
+        size_--;
+        return 1;
+    }
+    std::size_t hole = find_index(key);
+    if(hole == capacity_) {
+        return 0;
+    }
+    // Backward shifting, see FlatHashSet::erase
+    for(std::size_t next = (hole + 1) & (capacity_ - 1); slots_[next].first != EmptyKey; next = (next + 1) & (capacity_ - 1)) {
+        std::size_t home = home_of(slots_[next].first, capacity_);
+        if(((next - home) & (capacity_ - 1)) >= ((next - hole) & (capacity_ - 1))) {
+            slots_[hole] = std::move(slots_[next]);
+            hole = next;
+        }
+    }
+    slots_[hole] = SlotT(EmptyKey, V());
+    size_--;
+    return 1;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+void SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::rehash_to(std::size_t new_capacity) {
+    ContainerT new_slots(new_capacity, SlotT(EmptyKey, V()), slots_.get_allocator());
+    for(auto & slot : slots_) {
+        if(slot.first == EmptyKey) {
+            continue;
+        }
+        std::size_t new_pos = home_of(slot.first, new_capacity);
+        while(new_slots[new_pos].first != EmptyKey) {
+            new_pos = (new_pos + 1) & (new_capacity - 1);
+        }
+        new_slots[new_pos] = std::move(slot);
+    }
+    slots_ = std::move(new_slots);
+    capacity_ = new_capacity;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+void SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::reserve(std::size_t n) {
+    std::size_t new_capacity = capacity_;
+    while(n > new_capacity * max_load_factor_) {
+        new_capacity *= 2;
+    }
+    if(new_capacity != capacity_) {
+        rehash_to(new_capacity);
+    }
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          typename Allocator,
+          typename IndexPolicy>
+requires PowerOfTwoCapacity<InitCapacity> && SentinelKey<K>
+void SentinelFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy>::clear() {
+    slots_ = ContainerT(InitCapacity, SlotT(EmptyKey, V()), slots_.get_allocator());
+    capacity_ = InitCapacity;
+    size_ = 0;
+    empty_key_slot_.reset();
+}
+
+}
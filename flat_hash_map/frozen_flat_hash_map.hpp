@@ -0,0 +1,321 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "flat_hash_map_v3.hpp"
+
+namespace hpds {
+
+/**
+ * @brief A read-only FlatHashMapV3 opened from a snapshot file with mmap, without deserialization.
+ * write() stores the control bytes and the slot arrays of a built map in their native layout, after a header.
+ * open() maps the file and probes it with the same code as FlatHashMapV3 (find_in_table), so opening
+ * costs a few system calls whatever the size, and pages are only read from disk when a lookup touches them.
+ *
+ * The snapshot is only valid for the same K / V layout, Hash, IndexPolicy, Layout and ControlGroup::Width
+ * (SSE2 and AVX2 builds group slots differently). open() checks what it can and throws std::runtime_error otherwise:
+ *  - the magic, the format version, the group width, the layout and the sizes of K and V,
+ *  - hash_seed, an opaque value chosen by the writer (e.g. the seed of a seeded Hash), which must match,
+ *  - the position of one stored key, which a lookup must find again, so a different Hash or IndexPolicy is caught.
+ *
+ * K and V must be trivially copyable: the bytes of the slots are the elements.
+ */
+template <typename K, typename V,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename IndexPolicy = MaskIndex,
+          typename Layout = InterleavedLayout>
+class FrozenFlatHashMapV3 {
+    static_assert(std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>,
+                  "a snapshot stores the bytes of the elements");
+
+    // Only the static members are used: the probe sequence does not depend on InitCapacity, Allocator or StatsPolicy
+    using MapT = FlatHashMapV3<K, V, 256, Hash, KeyEqual, std::allocator<std::pair<const K, V>>, IndexPolicy, Layout>;
+    using SlotsT = typename MapT::SlotsT;
+    using ViewT = typename SlotsT::ViewT;
+    constexpr static std::size_t NumArrays = SlotsT::NumArrays;
+
+public:
+    constexpr static uint32_t FormatVersion = 1;
+
+    // Every section starts on a cache line
+    constexpr static std::size_t SectionAlignment = 64;
+
+    struct Header {
+        std::array<char, 8> magic;
+        uint32_t version;
+        uint32_t group_width;
+        uint32_t num_arrays;
+        uint32_t key_size;
+        uint32_t value_size;
+        uint32_t reserved;
+        std::array<uint64_t, 2> array_strides;
+        uint64_t hash_seed;
+        uint64_t size;
+        uint64_t capacity;
+        // A stored key and its slot, or capacity if the map is empty
+        uint64_t check_pos;
+        uint64_t ctrl_offset;
+        std::array<uint64_t, 2> array_offsets;
+        uint64_t file_size;
+    };
+
+    // Write the tables of "map" to "path". An incremental rehash in progress must be finished first
+    template <std::size_t InitCapacity, typename Allocator, typename StatsPolicy>
+    static void write(const FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy> & map,
+                      const std::string & path, uint64_t hash_seed = 0);
+
+    // Map the snapshot at "path" read-only
+    static FrozenFlatHashMapV3 open(const std::string & path, uint64_t hash_seed = 0);
+
+    FrozenFlatHashMapV3(FrozenFlatHashMapV3 && other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), file_size_(std::exchange(other.file_size_, 0)),
+          ctrl_(other.ctrl_), slots_(other.slots_), size_(other.size_), capacity_(other.capacity_) {}
+    FrozenFlatHashMapV3 & operator=(FrozenFlatHashMapV3 && other) noexcept {
+        if(this != &other) {
+            unmap();
+            data_ = std::exchange(other.data_, nullptr);
+            file_size_ = std::exchange(other.file_size_, 0);
+            ctrl_ = other.ctrl_;
+            slots_ = other.slots_;
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+        }
+        return *this;
+    }
+    ~FrozenFlatHashMapV3() {
+        unmap();
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+    std::size_t size() const noexcept {
+        return size_;
+    }
+    std::size_t capacity() const noexcept {
+        return capacity_;
+    }
+
+    // The value in the mapping, nullptr if "key" is not found
+    const V * find(const K & key) const {
+        std::size_t pos = find_index(key);
+        return (pos == capacity_) ? nullptr : &slots_.value(pos);
+    }
+    bool contains(const K & key) const {
+        return find_index(key) != capacity_;
+    }
+    const V & at(const K & key) const {
+        const V * value = find(key);
+        if(value == nullptr) {
+            throw std::out_of_range("[FrozenFlatHashMapV3::at] key is not found");
+        }
+        return *value;
+    }
+
+    // Call func(key, value) for every element, in slot order
+    template <typename Func>
+    void for_each(Func && func) const {
+        for(std::size_t pos = 0; pos < capacity_; pos++) {
+            if(is_full(ctrl_[pos])) {
+                func(slots_.key(pos), slots_.value(pos));
+            }
+        }
+    }
+
+private:
+    constexpr static std::array<char, 8> Magic = {'H', 'P', 'D', 'S', 'F', 'H', 'M', '3'};
+
+    FrozenFlatHashMapV3(const std::byte * data, std::size_t file_size, const Header & header)
+        : data_(data), file_size_(file_size), ctrl_(reinterpret_cast<const ctrl_t *>(data + header.ctrl_offset)),
+          slots_(view_arrays(data, header)), size_(header.size), capacity_(header.capacity) {}
+
+    static std::size_t align_up(std::size_t offset) {
+        return (offset + SectionAlignment - 1) & ~(SectionAlignment - 1);
+    }
+    static ViewT view_arrays(const std::byte * data, const Header & header) {
+        std::array<const std::byte *, NumArrays> arrays;
+        for(std::size_t i = 0; i < NumArrays; i++) {
+            arrays[i] = data + header.array_offsets[i];
+        }
+        return ViewT(arrays);
+    }
+    // Header of a snapshot of "capacity" slots, with the offsets of every section
+    static Header make_header(std::size_t size, std::size_t capacity, uint64_t hash_seed);
+
+    std::size_t find_index(const K & key) const {
+        std::size_t probe_length = 0;
+        return MapT::find_in_table(ctrl_, slots_, capacity_, key, MapT::mix(Hash()(key)), probe_length);
+    }
+
+    void unmap() {
+        if(data_ != nullptr) {
+            munmap(const_cast<std::byte *>(data_), file_size_);
+            data_ = nullptr;
+        }
+    }
+
+    const std::byte * data_;
+    std::size_t file_size_;
+    const ctrl_t * ctrl_;
+    ViewT slots_;
+    std::size_t size_;
+    std::size_t capacity_;
+};
+
+template <typename K, typename V, typename Hash, typename KeyEqual, typename IndexPolicy, typename Layout>
+auto FrozenFlatHashMapV3<K, V, Hash, KeyEqual, IndexPolicy, Layout>::make_header(std::size_t size, std::size_t capacity,
+                                                                                  uint64_t hash_seed) -> Header {
+    Header header{};
+    header.magic = Magic;
+    header.version = FormatVersion;
+    header.group_width = MapT::GroupWidth;
+    header.num_arrays = NumArrays;
+    header.key_size = sizeof(K);
+    header.value_size = sizeof(V);
+    header.hash_seed = hash_seed;
+    header.size = size;
+    header.capacity = capacity;
+    header.check_pos = capacity;
+    header.ctrl_offset = align_up(sizeof(Header));
+    std::size_t offset = header.ctrl_offset + capacity;
+    for(std::size_t i = 0; i < NumArrays; i++) {
+        header.array_strides[i] = SlotsT::ArrayStrides[i];
+        header.array_offsets[i] = align_up(offset);
+        offset = header.array_offsets[i] + capacity * SlotsT::ArrayStrides[i];
+    }
+    header.file_size = offset;
+    return header;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual, typename IndexPolicy, typename Layout>
+template <std::size_t InitCapacity, typename Allocator, typename StatsPolicy>
+void FrozenFlatHashMapV3<K, V, Hash, KeyEqual, IndexPolicy, Layout>::write(
+        const FlatHashMapV3<K, V, InitCapacity, Hash, KeyEqual, Allocator, IndexPolicy, Layout, StatsPolicy> & map,
+        const std::string & path, uint64_t hash_seed) {
+    if(map.rehashing()) {
+        throw std::logic_error("[FrozenFlatHashMapV3::write] an incremental rehash is in progress");
+    }
+    const std::size_t capacity = map.capacity_;
+    const ctrl_t * ctrl = map.ctrl_.data();
+    Header header = make_header(map.size_, capacity, hash_seed);
+    for(std::size_t pos = 0; pos < capacity; pos++) {
+        if(is_full(ctrl[pos])) {
+            header.check_pos = pos;
+            break;
+        }
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if(!file.is_open()) {
+        throw std::runtime_error("[FrozenFlatHashMapV3::write] could not open " + path);
+    }
+    // Writes go through a buffer, and the sections are padded with zeros up to their offsets
+    std::vector<char> buffer;
+    buffer.reserve(std::size_t(1) << 20);
+    std::size_t written = 0;
+    auto flush = [&]() {
+        file.write(buffer.data(), buffer.size());
+        written += buffer.size();
+        buffer.clear();
+    };
+    auto append = [&](const void * bytes, std::size_t count) {
+        if(buffer.size() + count > buffer.capacity()) {
+            flush();
+        }
+        buffer.insert(buffer.end(), static_cast<const char *>(bytes), static_cast<const char *>(bytes) + count);
+    };
+    auto pad_to = [&](std::size_t offset) {
+        buffer.resize(buffer.size() + (offset - written - buffer.size()), 0);
+    };
+
+    append(&header, sizeof(Header));
+    pad_to(header.ctrl_offset);
+    append(ctrl, capacity);
+    // Empty slots hold no element, so they are written as zeros instead of leaking stale memory
+    const std::array<const std::byte *, NumArrays> arrays = map.elements_.arrays();
+    const std::vector<char> zeros(*std::max_element(SlotsT::ArrayStrides.begin(), SlotsT::ArrayStrides.end()), 0);
+    for(std::size_t i = 0; i < NumArrays; i++) {
+        pad_to(header.array_offsets[i]);
+        const std::size_t stride = SlotsT::ArrayStrides[i];
+        for(std::size_t pos = 0; pos < capacity; pos++) {
+            append(is_full(ctrl[pos]) ? static_cast<const void *>(arrays[i] + pos * stride) : zeros.data(), stride);
+        }
+    }
+    flush();
+    if(!file.good()) {
+        throw std::runtime_error("[FrozenFlatHashMapV3::write] could not write " + path);
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual, typename IndexPolicy, typename Layout>
+auto FrozenFlatHashMapV3<K, V, Hash, KeyEqual, IndexPolicy, Layout>::open(const std::string & path, uint64_t hash_seed) -> FrozenFlatHashMapV3 {
+    auto fail = [&](const std::string & reason) {
+        return std::runtime_error("[FrozenFlatHashMapV3::open] " + path + " : " + reason);
+    };
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw fail("could not open the file");
+    }
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0 || static_cast<std::size_t>(file_stat.st_size) < sizeof(Header)) {
+        ::close(fd);
+        throw fail("not a snapshot");
+    }
+    const std::size_t file_size = file_stat.st_size;
+    void * mapping = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive
+    ::close(fd);
+    if(mapping == MAP_FAILED) {
+        throw fail("mmap failed");
+    }
+    // Lookups jump around the table, so read-ahead would only load pages nobody asked for
+    madvise(mapping, file_size, MADV_RANDOM);
+
+    const std::byte * data = static_cast<const std::byte *>(mapping);
+    Header header;
+    std::memcpy(&header, data, sizeof(Header));
+    const Header expected = make_header(header.size, header.capacity, hash_seed);
+    std::string reason;
+    if(header.magic != Magic || header.version != FormatVersion) {
+        reason = "unknown format or version";
+    } else if(header.group_width != expected.group_width) {
+        reason = "written with another ControlGroup::Width";
+    } else if(header.num_arrays != expected.num_arrays || header.key_size != expected.key_size
+              || header.value_size != expected.value_size || header.array_strides != expected.array_strides) {
+        reason = "written with another K, V or Layout";
+    } else if(header.hash_seed != hash_seed) {
+        reason = "written with another hash seed";
+    } else if(header.capacity < MapT::GroupWidth || (header.capacity & (header.capacity - 1)) != 0
+              || header.ctrl_offset != expected.ctrl_offset || header.array_offsets != expected.array_offsets
+              || header.file_size != expected.file_size || file_size < header.file_size) {
+        reason = "corrupted or truncated";
+    }
+    if(reason.empty()) {
+        FrozenFlatHashMapV3 frozen(data, file_size, header);
+        // The stored key must be found where the writer put it, otherwise Hash or IndexPolicy changed
+        if(header.check_pos == header.capacity
+           || (header.check_pos < header.capacity && frozen.find_index(frozen.slots_.key(header.check_pos)) == header.check_pos)) {
+            return frozen;
+        }
+        // The destructor of "frozen" unmaps the file
+        throw fail("written with another Hash or IndexPolicy");
+    }
+    munmap(mapping, file_size);
+    throw fail(reason);
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace hpds {
+
+/**
+ * @brief Heterogeneous lookup is enabled when both the hasher and the key comparator
+ * declare "is_transparent", the same convention as the standard unordered containers.
+ * Then find / at / try_emplace / erase accept any type Q that Hash and KeyEqual can handle,
+ * and a K is only constructed when an element is actually inserted.
+ */
+template <typename Hash, typename KeyEqual>
+concept TransparentHashAndEqual = requires {
+    typename Hash::is_transparent;
+    typename KeyEqual::is_transparent;
+};
+
+/**
+ * @brief Transparent hasher for std::string keys. std::string, std::string_view and const char *
+ * all hash to the same value, so a std::string_view coming off the wire can be looked up
+ * without allocating a temporary std::string. Use it together with std::equal_to<>.
+ */
+struct TransparentStringHash {
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view key) const {
+        return std::hash<std::string_view>()(key);
+    }
+};
+
+/**
+ * @brief Index policies map a hash to a home slot in [0, capacity). The maps keep capacity a power of 2,
+ * so none of them needs a division, but they read different bits of the hash:
+ *  - MaskIndex keeps the low bits. It is the cheapest, but with an identity hash like std::hash<int>,
+ *    keys with a stride of a power of 2 all collide.
+ *  - FibonacciIndex multiplies by 2^64 / golden ratio and keeps the high bits, so every bit of the hash
+ *    affects the index.
+ *  - FastRangeIndex is Lemire's multiply-shift reduction (hash * capacity) >> 64. It keeps the high bits
+ *    of the hash and works for any capacity, so it needs a hash with good high bits (see MixedHash).
+ * HighBits tells which end of the hash the policy reads, so that a map which carves other bits out of
+ * the same hash (the H2 tag of FlatHashMapV3) can take them from the other end.
+ */
+struct MaskIndex {
+    constexpr static bool HighBits = false;
+
+    static std::size_t index(std::size_t hash, std::size_t capacity) {
+        return hash & (capacity - 1);
+    }
+};
+
+struct FibonacciIndex {
+    constexpr static bool HighBits = true;
+
+    static std::size_t index(std::size_t hash, std::size_t capacity) {
+        // capacity is a power of 2, so log2(capacity) is a single tzcnt.
+        // A capacity of 1 would need a shift by 64, so fall back to 0.
+        const int shift = 64 - std::countr_zero(capacity);
+        return (shift == 64) ? 0 : static_cast<std::size_t>((hash * 11400714819323198485ull) >> shift);
+    }
+};
+
+struct FastRangeIndex {
+    constexpr static bool HighBits = true;
+
+    static std::size_t index(std::size_t hash, std::size_t capacity) {
+        return static_cast<std::size_t>((static_cast<__uint128_t>(hash) * capacity) >> 64);
+    }
+};
+
+/**
+ * @brief Strong 64-bit mixing: fold the high and low halves of a 128-bit multiplication.
+ * Every input bit affects both the low and the high bits of the result.
+ */
+inline std::size_t mix_hash(std::size_t hash) {
+    __uint128_t product = static_cast<__uint128_t>(hash) * 0x9E3779B97F4A7C15ull;
+    return static_cast<std::size_t>(product) ^ static_cast<std::size_t>(product >> 64);
+}
+
+/**
+ * @brief Hash adapter that applies mix_hash on top of Hash. Use it as the Hash parameter of a map
+ * to protect it from weak hashes, e.g. MixedHash<std::hash<int>> instead of the identity std::hash<int>.
+ * is_transparent is inherited from Hash, so heterogeneous lookup keeps working.
+ */
+template <typename Hash>
+struct MixedHash : public Hash {
+    template <typename Q>
+    std::size_t operator()(const Q & key) const {
+        return mix_hash(Hash::operator()(key));
+    }
+};
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+namespace hpds {
+
+/**
+ * @brief What stats() of FlatHashMapV3 / FlatHashMapV4 returns.
+ * The shape of the table (load, tombstones, clusters) is computed from the slots on each call.
+ * The history (probe lengths of lookups, rehashes) is only recorded by a StatsPolicy such as ProbeStats,
+ * and stays empty with the default NoStats.
+ *
+ * A good hash function gives short probes whatever the key set: if the mean probe length of hits
+ * keeps growing with the size, or a few clusters are much longer than the rest, the keys collide.
+ */
+struct HashMapStats {
+    std::size_t size{0};
+    std::size_t capacity{0};
+    float load_factor{0};
+    std::size_t tombstones{0};
+    // cluster_lengths[n] : number of maximal runs of n consecutive non-empty slots
+    std::vector<uint64_t> cluster_lengths;
+
+    // hit_probe_lengths[n] : number of successful lookups that probed n steps past the home position
+    // (groups for V3, slots for V4). The last bucket of a ProbeStats histogram also counts longer probes.
+    std::vector<uint64_t> hit_probe_lengths;
+    std::vector<uint64_t> miss_probe_lengths;
+    uint64_t rehash_count{0};
+    // Total time spent in rehashes. With V3's incremental rehash, only the part done by the growing insert
+    uint64_t rehash_ns{0};
+};
+
+// Mean of a histogram indexed by length, 0 for an empty one
+inline double histogram_mean(const std::vector<uint64_t> & histogram) {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    for(std::size_t length = 0; length < histogram.size(); length++) {
+        count += histogram[length];
+        sum += histogram[length] * length;
+    }
+    return (count == 0) ? 0.0 : (sum * 1.0 / count);
+}
+
+// Histogram of the lengths of the maximal runs of slots for which occupied(pos) is true,
+// in a table of "capacity" (a power of 2) slots. A run which wraps around the end counts as one.
+template <typename Occupied>
+std::vector<uint64_t> cluster_histogram(std::size_t capacity, Occupied && occupied) {
+    std::vector<uint64_t> histogram;
+    auto add = [&](std::size_t length) {
+        if(length >= histogram.size()) {
+            histogram.resize(length + 1, 0);
+        }
+        histogram[length]++;
+    };
+    // Start from an empty slot, so that no run is split in two by the wrap-around
+    std::size_t start = 0;
+    while(start < capacity && occupied(start)) {
+        start++;
+    }
+    if(start == capacity) {
+        add(capacity);
+        return histogram;
+    }
+    std::size_t length = 0;
+    for(std::size_t i = 1; i <= capacity; i++) {
+        if(occupied((start + i) & (capacity - 1))) {
+            length++;
+        } else if(length > 0) {
+            add(length);
+            length = 0;
+        }
+    }
+    return histogram;
+}
+
+/**
+ * @brief Stats policies, the StatsPolicy parameter of FlatHashMapV3 / FlatHashMapV4.
+ * The map calls record_hit / record_miss with the probe length of every lookup by key
+ * (find, at, find_batch, erase), and brackets every rehash with start_rehash / finish_rehash.
+ *  - NoStats (default) : every hook is an empty inline function and the map stores it with
+ *    [[no_unique_address]], so it costs neither time nor space.
+ *  - ProbeStats : fixed-size histograms and a steady_clock timer. The counters are plain integers,
+ *    so do not use it in a map read by several threads at once (e.g. the shards of ShardedFlatHashMap).
+ */
+struct NoStats {
+    struct RehashTimer {};
+
+    void record_hit(std::size_t) {}
+    void record_miss(std::size_t) {}
+    RehashTimer start_rehash() {
+        return {};
+    }
+    void finish_rehash(RehashTimer) {}
+    void fill(HashMapStats &) const {}
+    void reset() {}
+};
+
+struct ProbeStats {
+    // Probes of MaxProbeLength steps or more share the last bucket
+    constexpr static std::size_t MaxProbeLength = 63;
+
+    using RehashTimer = std::chrono::steady_clock::time_point;
+
+    void record_hit(std::size_t probe_length) {
+        hits_[std::min(probe_length, MaxProbeLength)]++;
+    }
+    void record_miss(std::size_t probe_length) {
+        misses_[std::min(probe_length, MaxProbeLength)]++;
+    }
+    RehashTimer start_rehash() {
+        return std::chrono::steady_clock::now();
+    }
+    void finish_rehash(RehashTimer start) {
+        rehash_count_++;
+        rehash_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+    void fill(HashMapStats & stats) const {
+        stats.hit_probe_lengths = trimmed(hits_);
+        stats.miss_probe_lengths = trimmed(misses_);
+        stats.rehash_count = rehash_count_;
+        stats.rehash_ns = rehash_ns_;
+    }
+    void reset() {
+        *this = ProbeStats();
+    }
+
+private:
+    using HistogramT = std::array<uint64_t, MaxProbeLength + 1>;
+
+    // Without the trailing zero buckets
+    static std::vector<uint64_t> trimmed(const HistogramT & histogram) {
+        std::size_t length = histogram.size();
+        while(length > 0 && histogram[length - 1] == 0) {
+            length--;
+        }
+        return std::vector<uint64_t>(histogram.begin(), histogram.begin() + length);
+    }
+
+    HistogramT hits_{};
+    HistogramT misses_{};
+    uint64_t rehash_count_{0};
+    uint64_t rehash_ns_{0};
+};
+
+}
@@ -0,0 +1,410 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <utility>
+#include <tuple>
+#include <stdexcept>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include "control_group.hpp"
+#include "hash_policy.hpp"
+#include "slot_layout.hpp"
+#include "flat_hash_set.hpp"
+#include "../stable_vector/stable_vector.hpp"
+
+namespace hpds {
+
+/**
+ * @brief A flat hash map whose elements never move: the pairs live in a hpds::StableVector ("nodes"),
+ * and the open-addressed table only holds a control byte and a 4-byte node index per slot.
+ * The table is probed like FlatHashMapV3 (groups of control bytes matched with SIMD, triangular probing),
+ * and a key is only read from its node when its 7-bit tag matches.
+ *
+ * A rehash moves the control bytes and the indices, never the pairs, so pointers and references
+ * to keys and values stay valid until their element is erased or the map is cleared, like std::unordered_map.
+ * find() returns a PairIterator to the node, which stays valid as long as the node does.
+ * The price is one more dependent load per hit (the node), and a rehash reads every node to hash its key again.
+ *
+ * Erased nodes are kept on a free list and reused by the next insertions, so the nodes never need compaction.
+ * An erased pair is assigned std::pair<K, V>() to release what it owns, so K and V must be
+ * default-constructible and move-assignable.
+ * StableVector is not copyable, and so neither is this map.
+ */
+template <typename K, typename V,
+          std::size_t InitCapacity = 256,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          std::size_t ChunkSize = 256>
+requires PowerOfTwoCapacity<InitCapacity>
+class NodeFlatHashMap {
+public:
+    constexpr static std::size_t GroupWidth = ControlGroup::Width;
+
+    using NodeT = std::pair<K, V>;
+    using IteratorT = PairIterator<K, V>;
+
+    NodeFlatHashMap() : ctrl_(InitSlots, kCtrlEmpty), indices_(InitSlots), capacity_(InitSlots) {}
+    NodeFlatHashMap(const NodeFlatHashMap &) = delete;
+    NodeFlatHashMap & operator=(const NodeFlatHashMap &) = delete;
+    // The source is left as an empty map of InitSlots slots, which is why moving allocates.
+    // The nodes themselves change hands, so references to them stay valid
+    NodeFlatHashMap(NodeFlatHashMap && other) : NodeFlatHashMap() {
+        swap(other);
+    }
+    NodeFlatHashMap & operator=(NodeFlatHashMap && other) {
+        if(this != &other) {
+            NodeFlatHashMap moved(std::move(other));
+            swap(moved);
+        }
+        return *this;
+    }
+    void swap(NodeFlatHashMap & other) noexcept {
+        std::swap(ctrl_, other.ctrl_);
+        std::swap(indices_, other.indices_);
+        std::swap(nodes_, other.nodes_);
+        std::swap(free_nodes_, other.free_nodes_);
+        std::swap(size_, other.size_);
+        std::swap(num_deleted_, other.num_deleted_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(max_load_factor_, other.max_load_factor_);
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+    std::size_t size() const noexcept {
+        return size_;
+    }
+    std::size_t capacity() const noexcept {
+        return capacity_;
+    }
+    float load_factor() const noexcept {
+        return (size_ * 1.0f) / capacity_;
+    }
+    void set_max_load_factor(float max_load_factor) {
+        max_load_factor_ = max_load_factor;
+    }
+
+    IteratorT find(const K & key) {
+        std::size_t pos = find_index(key, mix_hash(Hash()(key)));
+        return (pos == capacity_) ? end() : node_at(pos);
+    }
+    // Heterogeneous lookup, only available with a transparent Hash and KeyEqual
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    IteratorT find(const Q & key) {
+        std::size_t pos = find_index(key, mix_hash(Hash()(key)));
+        return (pos == capacity_) ? end() : node_at(pos);
+    }
+    IteratorT end() const {
+        return IteratorT();
+    }
+    bool contains(const K & key) const {
+        return find_index(key, mix_hash(Hash()(key))) != capacity_;
+    }
+    const V & at(const K & key) const;
+    V & operator[](const K & key) {
+        return try_emplace(key).first->second;
+    }
+
+    // Return the element of "key" if it exists, otherwise construct the pair from "key" and V(args...)
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(const K & key, Args && ... args) {
+        return try_emplace_impl(key, mix_hash(Hash()(key)), std::forward<Args>(args)...);
+    }
+    template <typename ... Args>
+    std::pair<IteratorT, bool> try_emplace(K && key, Args && ... args) {
+        const std::size_t hash = mix_hash(Hash()(key));
+        return try_emplace_impl(std::move(key), hash, std::forward<Args>(args)...);
+    }
+    std::pair<IteratorT, bool> insert(const std::pair<const K, V> & pair) {
+        return try_emplace(pair.first, pair.second);
+    }
+    std::pair<IteratorT, bool> insert(std::pair<const K, V> && pair) {
+        return try_emplace(pair.first, std::move(pair.second));
+    }
+
+    std::size_t erase(const K & key);
+    // Invalidates every reference, the nodes are freed
+    void clear();
+    // Make room for "n" elements, so that inserting up to "n" elements does not rehash
+    void reserve(std::size_t n);
+
+    // Call func(key, value) for every element, in slot order
+    template <typename Func>
+    void for_each(Func && func) {
+        for(std::size_t pos = 0; pos < capacity_; pos++) {
+            if(is_full(ctrl_[pos])) {
+                NodeT & node = nodes_[indices_[pos]];
+                func(static_cast<const K &>(node.first), node.second);
+            }
+        }
+    }
+
+private:
+    using NodeIndex = uint32_t;
+    constexpr static std::size_t MaxNodes = static_cast<std::size_t>(UINT32_MAX) + 1;
+
+    // A group must fit in the table, so tiny InitCapacity values are rounded up
+    constexpr static std::size_t InitSlots = (InitCapacity < GroupWidth) ? GroupWidth : InitCapacity;
+
+    // Same split of the mixed hash as FlatHashMapV3 with MaskIndex: low bits for the group, high bits for the tag
+    static ctrl_t h2(std::size_t hash) {
+        return static_cast<ctrl_t>(hash >> 57);
+    }
+    IteratorT node_at(std::size_t pos) {
+        return IteratorT(&nodes_[indices_[pos]]);
+    }
+
+    // Slot of "key", capacity_ if it is not found
+    template <typename Q>
+    std::size_t find_index(const Q & key, std::size_t hash) const;
+    // Probe once for "key". Returns {slot of key, false} if it exists,
+    // otherwise {first empty or deleted slot on the probe sequence, true}
+    template <typename Q>
+    std::pair<std::size_t, bool> find_or_prepare_insert(const Q & key, std::size_t hash) const;
+    template <typename Q, typename ... Args>
+    std::pair<IteratorT, bool> try_emplace_impl(Q && key, std::size_t hash, Args && ... args);
+    // Construct a node, on the free list first. Returns its index
+    template <typename Q, typename ... Args>
+    NodeIndex new_node(Q && key, Args && ... args);
+
+    bool need_rehash() const {
+        // tombstones lengthen probe sequences just like live elements
+        return (size_ + num_deleted_ + 1) > capacity_ * max_load_factor_;
+    }
+    // Only the control bytes and the indices are rebuilt, the nodes stay where they are
+    void rehash_to(std::size_t new_capacity);
+
+    std::vector<ctrl_t> ctrl_;
+    std::vector<NodeIndex> indices_;
+    StableVector<NodeT, ChunkSize> nodes_;
+    std::vector<NodeIndex> free_nodes_;
+    std::size_t size_{0};
+    std::size_t num_deleted_{0};
+    std::size_t capacity_;
+    float max_load_factor_{0.875};
+};
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+template <typename Q>
+std::size_t NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::find_index(const Q & key, std::size_t hash) const {
+    const ctrl_t tag = h2(hash);
+    const std::size_t group_mask = capacity_ / GroupWidth - 1;
+    std::size_t group = hash & group_mask;
+    for(std::size_t step = 1; step <= group_mask + 1; step++) {
+        const std::size_t base = group * GroupWidth;
+        ControlGroup control_group(ctrl_.data() + base);
+        for(uint32_t mask = control_group.match(tag); mask != 0; mask &= (mask - 1)) {
+            std::size_t pos = base + __builtin_ctz(mask);
+            if(KeyEqual()(nodes_[indices_[pos]].first, key)) {
+                return pos;
+            }
+        }
+        if(control_group.match_empty() != 0) {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+    return capacity_;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+template <typename Q>
+auto NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::find_or_prepare_insert(const Q & key, std::size_t hash) const -> std::pair<std::size_t, bool> {
+    const ctrl_t tag = h2(hash);
+    const std::size_t group_mask = capacity_ / GroupWidth - 1;
+    std::size_t group = hash & group_mask;
+    std::size_t insert_pos = capacity_;
+    for(std::size_t step = 1; step <= group_mask + 1; step++) {
+        const std::size_t base = group * GroupWidth;
+        ControlGroup control_group(ctrl_.data() + base);
+        for(uint32_t mask = control_group.match(tag); mask != 0; mask &= (mask - 1)) {
+            std::size_t pos = base + __builtin_ctz(mask);
+            if(KeyEqual()(nodes_[indices_[pos]].first, key)) {
+                return {pos, false};
+            }
+        }
+        if(insert_pos == capacity_) {
+            uint32_t free_mask = control_group.match_empty_or_deleted();
+            if(free_mask != 0) {
+                insert_pos = base + __builtin_ctz(free_mask);
+            }
+        }
+        if(control_group.match_empty() != 0) {
+            break;
+        }
+        group = (group + step) & group_mask;
+    }
+    assert(insert_pos != capacity_);
+    return {insert_pos, true};
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+const V & NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::at(const K & key) const {
+    std::size_t pos = find_index(key, mix_hash(Hash()(key)));
+    if(pos == capacity_) {
+        throw std::out_of_range("[NodeFlatHashMap::at] key is not found");
+    }
+    return nodes_[indices_[pos]].second;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+template <typename Q, typename ... Args>
+auto NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::new_node(Q && key, Args && ... args) -> NodeIndex {
+    if(!free_nodes_.empty()) {
+        const NodeIndex index = free_nodes_.back();
+        nodes_[index] = NodeT(std::piecewise_construct, std::forward_as_tuple(std::forward<Q>(key)),
+                              std::forward_as_tuple(std::forward<Args>(args)...));
+        free_nodes_.pop_back();
+        return index;
+    }
+    if(nodes_.size() == MaxNodes) {
+        throw std::length_error("[NodeFlatHashMap] more than 2^32 nodes");
+    }
+    nodes_.emplace_back(std::piecewise_construct, std::forward_as_tuple(std::forward<Q>(key)),
+                        std::forward_as_tuple(std::forward<Args>(args)...));
+    return static_cast<NodeIndex>(nodes_.size() - 1);
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+template <typename Q, typename ... Args>
+auto NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::try_emplace_impl(Q && key, std::size_t hash, Args && ... args) -> std::pair<IteratorT, bool> {
+    if(need_rehash()) {
+        // If most of the load comes from tombstones, rehash in place to drop them
+        rehash_to(((size_ + 1) * 2 > capacity_ * max_load_factor_) ? capacity_ * 2 : capacity_);
+    }
+    auto [pos, need_insert] = find_or_prepare_insert(key, hash);
+    if(!need_insert) {
+        return {node_at(pos), false};
+    }
+    // Construct first, so that nothing changes if K or V throws
+    indices_[pos] = new_node(std::forward<Q>(key), std::forward<Args>(args)...);
+    if(ctrl_[pos] == kCtrlDeleted) {
+        num_deleted_--;
+    }
+    ctrl_[pos] = h2(hash);
+    size_++;
+    return {node_at(pos), true};
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+std::size_t NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::erase(const K & key) {
+    std::size_t pos = find_index(key, mix_hash(Hash()(key)));
+    if(pos == capacity_) {
+        return 0;
+    }
+    // Reserve the free list entry first, so that a throwing push_back leaves the node alive
+    free_nodes_.push_back(indices_[pos]);
+    nodes_[indices_[pos]] = NodeT();
+    // If the group still has an empty slot, no probe sequence has ever passed through it
+    ControlGroup control_group(ctrl_.data() + (pos & ~(GroupWidth - 1)));
+    if(control_group.match_empty() != 0) {
+        ctrl_[pos] = kCtrlEmpty;
+    } else {
+        ctrl_[pos] = kCtrlDeleted;
+        num_deleted_++;
+    }
+    size_--;
+    return 1;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+void NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::clear() {
+    ctrl_.assign(InitSlots, kCtrlEmpty);
+    indices_.assign(InitSlots, 0);
+    nodes_.clear();
+    free_nodes_.clear();
+    size_ = 0;
+    num_deleted_ = 0;
+    capacity_ = InitSlots;
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+void NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::reserve(std::size_t n) {
+    std::size_t new_capacity = capacity_;
+    while(n + 1 > new_capacity * max_load_factor_) {
+        new_capacity *= 2;
+    }
+    if(new_capacity > capacity_) {
+        rehash_to(new_capacity);
+    }
+}
+
+template <typename K, typename V,
+          std::size_t InitCapacity,
+          typename Hash,
+          typename KeyEqual,
+          std::size_t ChunkSize>
+requires PowerOfTwoCapacity<InitCapacity>
+void NodeFlatHashMap<K, V, InitCapacity, Hash, KeyEqual, ChunkSize>::rehash_to(std::size_t new_capacity) {
+    std::vector<ctrl_t> new_ctrl(new_capacity, kCtrlEmpty);
+    std::vector<NodeIndex> new_indices(new_capacity);
+    const std::size_t group_mask = new_capacity / GroupWidth - 1;
+    for(std::size_t pos = 0; pos < capacity_; pos++) {
+        if(!is_full(ctrl_[pos])) {
+            continue;
+        }
+        const std::size_t hash = mix_hash(Hash()(nodes_[indices_[pos]].first));
+        std::size_t group = hash & group_mask;
+        for(std::size_t step = 1; ; step++) {
+            const std::size_t base = group * GroupWidth;
+            uint32_t free_mask = ControlGroup(new_ctrl.data() + base).match_empty();
+            if(free_mask != 0) {
+                const std::size_t new_pos = base + __builtin_ctz(free_mask);
+                new_ctrl[new_pos] = h2(hash);
+                new_indices[new_pos] = indices_[pos];
+                break;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+    ctrl_ = std::move(new_ctrl);
+    indices_ = std::move(new_indices);
+    capacity_ = new_capacity;
+    num_deleted_ = 0;
+}
+
+}
@@ -0,0 +1,519 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <optional>
+#include <vector>
+#include <type_traits>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "hash_policy.hpp"
+#include "flat_hash_map_v3.hpp"
+
+namespace hpds {
+// hpds is for High-Performance Data Structures
+
+/**
+ * @brief A concurrent hash map made of "Shards" independent maps (FlatHashMapV3 by default).
+ * A key is routed to its shard by high bits of its hash, and every shard resizes on its own,
+ * so a rehash only stalls the writers which touch that shard.
+ *
+ * Writers of a shard are serialized by the shard mutex. How readers get in depends on K and V:
+ *
+ * If both are trivially copyable, reads are optimistic and never wait for a writer (a seqlock):
+ *  - A reader snapshots the sequence counter of the shard, probes the map, copies the value out, and
+ *    checks that the counter has not moved. Otherwise it throws the copy away and probes again.
+ *  - A writer makes the counter odd only while it stores into a slot in place (insert into a table
+ *    which has room, assign, erase). update() runs func on a copy of the value before that, so readers
+ *    are never held up by user code. A reader which finds the counter odd retries right away.
+ *  - An insert which would rehash runs on a copy of the map instead, which then replaces the published one.
+ *    Readers keep probing the old map meanwhile, so the arrays a reader probes never move.
+ *  - A replaced map is only freed once no reader can still be probing it. Readers register in one of two
+ *    reader counts picked by the parity of an epoch. A writer flips the epoch and frees the maps replaced
+ *    before the flip once the count of the previous parity drops to 0. It never waits for it:
+ *    if readers are still inside, the next write of the shard tries again.
+ *  Keys are compared while a writer may be storing them, so K has to be trivially copyable too.
+ *  ShardMap must also provide insert_needs_rehash() and must not move its arrays in any other update.
+ *
+ * Otherwise every shard is guarded by a reader-writer spinlock which favours writers:
+ *  - A writer makes the sequence counter odd so that no new reader gets in, waits for the readers
+ *    already inside the shard to leave, mutates the map, and makes the counter even again.
+ *  - A reader increments one of the shard's reader counters, checks that the sequence counter is even,
+ *    copies the value out, and decrements the counter. While a writer of the shard is active it steps out
+ *    and spins until the writer is done.
+ *  A reader then never sees a map being mutated, so values of any type (e.g. std::string) can be copied out.
+ *
+ * The reader counts of a shard are split in ReaderStripes counters, each on its own cache line, and a thread
+ * always uses the same one, so readers of a shard only share a line with the threads of their stripe.
+ *
+ * There are no iterators or references into the map, because they could dangle as soon as
+ * another thread rehashes the shard. Lookups return a copy of the value instead.
+ *
+ * @tparam Shards Number of shards, a power of 2. Use a few times the number of writer threads.
+ * @tparam ShardMap The map type of a shard. It must provide find / end / try_emplace / erase / size / clear.
+ */
+template <typename K, typename V,
+          std::size_t Shards = 64,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename ShardMap = FlatHashMapV3<K, V, 256, Hash, KeyEqual>>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+class ShardedFlatHashMap {
+public:
+    // Whether readers run the seqlock path and never wait for writers
+    constexpr static bool OptimisticReads = std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>;
+
+    ShardedFlatHashMap() = default;
+    ShardedFlatHashMap(const ShardedFlatHashMap & other) = delete;
+    ShardedFlatHashMap & operator=(const ShardedFlatHashMap & other) = delete;
+
+    // Not linearizable with concurrent writers: the shards are summed one by one
+    std::size_t size() const;
+    bool empty() const;
+
+    std::optional<V> find(const K & key) const;
+    bool contains(const K & key) const;
+
+    // Returns false if the key already exists (the value is not changed)
+    bool insert(const K & key, const V & value);
+    // Returns true if the key was inserted, false if an existing value was overwritten
+    bool insert_or_assign(const K & key, const V & value);
+    /**
+     * @brief Call func(V &) on the value of "key" with the other writers of the shard locked out, inserting
+     * a value-initialized V first if the key is absent. This is the read-modify-write primitive,
+     * e.g. map.update(key, [](int & c) { c++; }). func must not access this map.
+     * With OptimisticReads, func runs on a copy which is stored back afterwards, so readers of the shard
+     * keep going meanwhile, and nothing is inserted if func throws.
+     */
+    template <typename Func>
+    void update(const K & key, Func && func);
+    std::size_t erase(const K & key);
+
+    void clear();
+
+    constexpr static std::size_t shard_count() {
+        return Shards;
+    }
+    // For debug only
+    std::size_t shard_size(std::size_t shard) const;
+
+private:
+    constexpr static int ShardBits = std::countr_zero(Shards);
+
+    /**
+     * Route by the bits right below the top 7 of the mixed hash. FlatHashMapV3 takes its H2 tag from
+     * the top 7 bits and its home group from the low bits of the same mixed hash, so neither of them
+     * is constant within a shard.
+     */
+    static std::size_t shard_of(const K & key) {
+        if constexpr (Shards == 1) {
+            return 0;
+        } else {
+            return (mix_hash(Hash()(key)) >> (57 - ShardBits)) & (Shards - 1);
+        }
+    }
+
+    // Spin briefly, then yield, in case the thread we are waiting for has been descheduled
+    struct Backoff {
+        void pause() {
+            if(spins < 64) {
+                spins++;
+#if defined(__SSE2__)
+                _mm_pause();
+#endif
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        int spins{0};
+    };
+
+    constexpr static std::size_t ReaderStripes = 8;
+
+    // The stripe of the calling thread, assigned round-robin on its first read
+    static std::size_t reader_stripe() {
+        static std::atomic<std::size_t> next_stripe{0};
+        thread_local const std::size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % ReaderStripes;
+        return stripe;
+    }
+
+    struct alignas(64) ReaderStripe {
+        std::atomic<uint32_t> readers{0};
+    };
+    using ReaderCount = std::array<ReaderStripe, ReaderStripes>;
+
+    // One shard per cache line pair, so that the counters of neighbouring shards do not false-share
+    struct alignas(128) Shard {
+        // Even: no writer, odd: a writer is mutating the published map
+        std::atomic<uint64_t> seq{0};
+        std::mutex write_mutex;
+        // Owned by the writers, and published to the readers. Only OptimisticReads replaces it
+        std::unique_ptr<ShardMap> map{std::make_unique<ShardMap>()};
+        std::atomic<ShardMap *> published{map.get()};
+        // OptimisticReads: readers registered under each parity of epoch. Otherwise only count[0] is used
+        std::array<ReaderCount, 2> count;
+        std::atomic<uint64_t> epoch{0};
+        // OptimisticReads: maps replaced since the last epoch flip, and maps replaced before it,
+        // which wait for the readers of the previous parity to leave. Guarded by write_mutex
+        std::vector<std::unique_ptr<ShardMap>> retired;
+        std::vector<std::unique_ptr<ShardMap>> draining;
+    };
+
+    // Run func(const ShardMap &) on the published map of the shard as a reader and return its result
+    template <typename Func>
+    auto read(Shard & shard, Func && func) const;
+    /**
+     * With the shard mutex held, run func(ShardMap &) on the map of the shard and return its result.
+     * "inserts" tells that func may call try_emplace. With OptimisticReads, func then runs on a copy of the map
+     * if the insert would rehash, and the copy replaces the map. func must not move the arrays of the map otherwise.
+     */
+    template <typename Func>
+    auto write(Shard & shard, bool inserts, Func && func);
+    // Publish "next" as the map of the shard and retire the current one. The shard mutex must be held
+    void replace_map(Shard & shard, std::unique_ptr<ShardMap> next);
+    // Free the retired maps no reader can still be probing, and start the grace period of the next ones.
+    // Never waits for readers. The shard mutex must be held
+    void reclaim(Shard & shard);
+
+    static bool drained(const ReaderCount & count) {
+        for(const ReaderStripe & stripe : count) {
+            if(stripe.readers.load(std::memory_order_seq_cst) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Readers write the reader counters, but they have to be callable on a const map
+    mutable std::array<Shard, Shards> shards_;
+};
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+template <typename Func>
+auto ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::read(Shard & shard, Func && func) const {
+    // Leave the shard even if func throws, or the next writer would wait forever
+    struct ReaderGuard {
+        std::atomic<uint32_t> & readers;
+        ~ReaderGuard() {
+            readers.fetch_sub(1, std::memory_order_release);
+        }
+    };
+    if constexpr (OptimisticReads) {
+        // The registration only keeps the maps this reader may probe alive, writers never wait for it.
+        // seq_cst: either a writer sees this reader, or this reader sees the map the writer published
+        std::atomic<uint32_t> & readers =
+            shard.count[shard.epoch.load(std::memory_order_seq_cst) & 1][reader_stripe()].readers;
+        readers.fetch_add(1, std::memory_order_seq_cst);
+        ReaderGuard guard{readers};
+        Backoff backoff;
+        while(true) {
+            const uint64_t seq = shard.seq.load(std::memory_order_acquire);
+            if((seq & 1) != 0) {
+                // A writer is storing into a slot right now, which only takes a few instructions
+                backoff.pause();
+                continue;
+            }
+            // The probe may race with a writer storing into a slot in place. It only reads trivially copyable
+            // bytes out of arrays which stay allocated, and the result is dropped unless seq has not moved.
+            auto result = func(static_cast<const ShardMap &>(*shard.published.load(std::memory_order_seq_cst)));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(shard.seq.load(std::memory_order_relaxed) == seq) {
+                return result;
+            }
+        }
+    } else {
+        std::atomic<uint32_t> & readers = shard.count[0][reader_stripe()].readers;
+        while(true) {
+            // seq_cst on both sides: either this reader sees the odd counter, or the writer sees this reader
+            readers.fetch_add(1, std::memory_order_seq_cst);
+            if((shard.seq.load(std::memory_order_seq_cst) & 1) == 0) {
+                ReaderGuard guard{readers};
+                return func(static_cast<const ShardMap &>(*shard.map));
+            }
+            // A writer is active. Step out so that it can drain the readers, and retry after it is done.
+            readers.fetch_sub(1, std::memory_order_release);
+            Backoff backoff;
+            while((shard.seq.load(std::memory_order_acquire) & 1) != 0) {
+                backoff.pause();
+            }
+        }
+    }
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+template <typename Func>
+auto ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::write(Shard & shard, bool inserts, Func && func) {
+    if constexpr (OptimisticReads) {
+        if(inserts && shard.map->insert_needs_rehash()) {
+            // Readers keep probing the current map while the copy rehashes
+            auto next = std::make_unique<ShardMap>(*shard.map);
+            auto result = func(*next);
+            replace_map(shard, std::move(next));
+            reclaim(shard);
+            return result;
+        }
+    }
+    shard.seq.fetch_add(1, std::memory_order_seq_cst);
+    if constexpr (!OptimisticReads) {
+        Backoff backoff;
+        for(ReaderStripe & stripe : shard.count[0]) {
+            while(stripe.readers.load(std::memory_order_seq_cst) != 0) {
+                backoff.pause();
+            }
+        }
+    }
+    // Make the counter even again even if func throws (e.g. std::bad_alloc during a rehash)
+    struct SeqGuard {
+        std::atomic<uint64_t> & seq;
+        ~SeqGuard() {
+            seq.fetch_add(1, std::memory_order_release);
+        }
+    };
+    auto result = [&] {
+        SeqGuard guard{shard.seq};
+        return func(*shard.map);
+    }();
+    if constexpr (OptimisticReads) {
+        reclaim(shard);
+    }
+    return result;
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+void ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::replace_map(Shard & shard, std::unique_ptr<ShardMap> next) {
+    // Make room first: once published, the old map must not be freed by a failing push_back
+    shard.retired.reserve(shard.retired.size() + 1);
+    shard.published.store(next.get(), std::memory_order_seq_cst);
+    shard.retired.push_back(std::exchange(shard.map, std::move(next)));
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+void ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::reclaim(Shard & shard) {
+    if(shard.draining.empty() && shard.retired.empty()) {
+        return;
+    }
+    // The readers registered under the previous parity: those which may probe the maps in draining,
+    // replaced before the last flip, and those which loaded the epoch two flips ago and register late.
+    // The latter would escape the next grace period, so they have to be gone before the next flip too.
+    const uint64_t epoch = shard.epoch.load(std::memory_order_relaxed);
+    if(!drained(shard.count[(epoch + 1) & 1])) {
+        return;
+    }
+    shard.draining.clear();
+    if(!shard.retired.empty()) {
+        shard.epoch.store(epoch + 1, std::memory_order_seq_cst);
+        std::swap(shard.draining, shard.retired);
+    }
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+std::size_t ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::size() const {
+    std::size_t result = 0;
+    for(std::size_t i = 0; i < Shards; i++) {
+        result += shard_size(i);
+    }
+    return result;
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+bool ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::empty() const {
+    return size() == 0;
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+std::size_t ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::shard_size(std::size_t shard) const {
+    return read(shards_[shard], [](const ShardMap & map) {
+        return map.size();
+    });
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+std::optional<V> ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::find(const K & key) const {
+    return read(shards_[shard_of(key)], [&key](const ShardMap & map) -> std::optional<V> {
+        // The lookup API of the maps is not const, but it does not modify the map
+        auto & mutable_map = const_cast<ShardMap &>(map);
+        auto it = mutable_map.find(key);
+        if(it == mutable_map.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    });
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+bool ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::contains(const K & key) const {
+    return read(shards_[shard_of(key)], [&key](const ShardMap & map) {
+        auto & mutable_map = const_cast<ShardMap &>(map);
+        return !(mutable_map.find(key) == mutable_map.end());
+    });
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+bool ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::insert(const K & key, const V & value) {
+    Shard & shard = shards_[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shard.write_mutex);
+    // Writers may look at the map without the counter: readers never modify it.
+    // An existing key must not get to try_emplace, which could rehash first.
+    if(!(shard.map->find(key) == shard.map->end())) {
+        return false;
+    }
+    return write(shard, true, [&](ShardMap & map) {
+        return map.try_emplace(key, value).second;
+    });
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+bool ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::insert_or_assign(const K & key, const V & value) {
+    Shard & shard = shards_[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shard.write_mutex);
+    auto it = shard.map->find(key);
+    if(it == shard.map->end()) {
+        return write(shard, true, [&](ShardMap & map) {
+            return map.try_emplace(key, value).second;
+        });
+    }
+    // Without inserts func gets the map "it" points into
+    return write(shard, false, [&](ShardMap &) {
+        it->second = value;
+        return false;
+    });
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+template <typename Func>
+void ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::update(const K & key, Func && func) {
+    Shard & shard = shards_[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shard.write_mutex);
+    if constexpr (OptimisticReads) {
+        auto it = shard.map->find(key);
+        const bool found = !(it == shard.map->end());
+        V value = found ? V(it->second) : V();
+        func(value);
+        if(found) {
+            write(shard, false, [&](ShardMap &) {
+                it->second = value;
+                return true;
+            });
+        } else {
+            write(shard, true, [&](ShardMap & map) {
+                return map.try_emplace(key, value).second;
+            });
+        }
+    } else {
+        write(shard, true, [&](ShardMap & map) {
+            func(map.try_emplace(key).first->second);
+            return true;
+        });
+    }
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+std::size_t ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::erase(const K & key) {
+    Shard & shard = shards_[shard_of(key)];
+    std::lock_guard<std::mutex> lock(shard.write_mutex);
+    // Do not bump the counter for nothing, it sends the readers of the shard back
+    if(shard.map->find(key) == shard.map->end()) {
+        return 0;
+    }
+    return write(shard, false, [&](ShardMap & map) {
+        return map.erase(key);
+    });
+}
+
+template <typename K, typename V,
+          std::size_t Shards,
+          typename Hash,
+          typename KeyEqual,
+          typename ShardMap>
+requires ((Shards > 0) && ((Shards & (Shards - 1)) == 0) && (Shards <= (std::size_t(1) << 16)))
+void ShardedFlatHashMap<K, V, Shards, Hash, KeyEqual, ShardMap>::clear() {
+    for(auto & shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard.write_mutex);
+        if constexpr (OptimisticReads) {
+            // clear() reallocates the arrays, so swap in an empty map instead
+            replace_map(shard, std::make_unique<ShardMap>());
+            reclaim(shard);
+        } else {
+            write(shard, false, [](ShardMap & map) {
+                map.clear();
+                return true;
+            });
+        }
+    }
+}
+
+}
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <tuple>
+#include <type_traits>
+#include <cassert>
+#include <cstddef>
+#include <array>
+
+namespace hpds {
+
+/**
+ * @brief Slot storage of a table whose metadata lives elsewhere (the control bytes of FlatHashMapV3).
+ * The slots are raw storage: only the map knows which slots are alive, so it constructs and destroys
+ * the elements itself, and growing the table never default-constructs K or V.
+ * Elements are constructed through the map's Allocator rebound to the stored type, so that
+ * e.g. pmr keys and values get the map's memory resource.
+ *
+ * Two layouts share one interface:
+ *  - PairSlots (InterleavedLayout) stores std::pair<K, V> per slot, so a hit finds the value next to the key.
+ *  - SplitSlots (SplitLayout) stores keys and values in two parallel arrays, so probing only ever touches
+ *    key bytes, and the value is fetched once, on a hit. It pays off with big values.
+ *
+ * For snapshots (see frozen_flat_hash_map.hpp), arrays() exposes the raw arrays (NumArrays of them, with
+ * ArrayStrides bytes per slot), and ViewT reads slots laid out the same way from read-only memory.
+ */
+
+// Iterator of PairSlots: a pointer to the pair
+template <typename K, typename V>
+class PairIterator {
+public:
+    PairIterator(std::pair<K, V> * pair = nullptr) : pair_ptr_(pair) {}
+
+    bool operator== (const PairIterator & other) const {
+        return (pair_ptr_ == other.pair_ptr_);
+    }
+
+    std::pair<K, V> & operator*() const {
+        return *pair_ptr_;
+    }
+    std::pair<K, V> * operator->() const {
+        return pair_ptr_;
+    }
+
+private:
+    std::pair<K, V> * pair_ptr_;
+};
+
+// Iterator of SplitSlots: there is no pair in memory, so it hands out a pair of references
+template <typename K, typename V>
+class SplitIterator {
+public:
+    using reference = std::pair<const K &, V &>;
+
+    // it->second goes through this proxy, which holds the pair of references
+    struct ArrowProxy {
+        reference ref;
+        reference * operator->() {
+            return &ref;
+        }
+    };
+
+    SplitIterator(const K * key = nullptr, V * value = nullptr) : key_ptr_(key), value_ptr_(value) {}
+
+    bool operator== (const SplitIterator & other) const {
+        return (value_ptr_ == other.value_ptr_);
+    }
+
+    reference operator*() const {
+        return {*key_ptr_, *value_ptr_};
+    }
+    ArrowProxy operator->() const {
+        return {**this};
+    }
+
+private:
+    const K * key_ptr_;
+    V * value_ptr_;
+};
+
+// Allocate "size" uninitialized T through "alloc", nullptr for 0
+template <typename Alloc>
+typename std::allocator_traits<Alloc>::value_type * allocate_slots(Alloc & alloc, std::size_t size) {
+    return (size > 0) ? std::allocator_traits<Alloc>::allocate(alloc, size) : nullptr;
+}
+
+template <typename K, typename V, typename Allocator>
+class PairSlots {
+    // The pair is only alive while the map says the slot is full
+    struct SlotT {
+        union {
+            std::pair<K, V> pair;
+        };
+
+        SlotT() {}
+        ~SlotT() {}
+    };
+    using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<SlotT>;
+    using PairAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<K, V>>;
+
+public:
+    using IteratorT = PairIterator<K, V>;
+
+    explicit PairSlots(const Allocator & alloc, std::size_t size = 0) : alloc_(alloc), size_(size) {
+        data_ = allocate_slots(alloc_, size_);
+        // SlotT() does nothing, so this loop is optimized away
+        for(std::size_t i = 0; i < size_; i++) {
+            ::new (static_cast<void *>(data_ + i)) SlotT();
+        }
+    }
+    PairSlots(PairSlots && other) noexcept
+        : alloc_(other.alloc_), data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+    // Every slot array of a map shares its allocator, and e.g. std::pmr::polymorphic_allocator is not assignable,
+    // so the allocator is kept unless it propagates on move assignment
+    PairSlots & operator=(PairSlots && other) noexcept {
+        if(this != &other) {
+            free();
+            if constexpr (std::allocator_traits<SlotAllocator>::propagate_on_container_move_assignment::value) {
+                alloc_ = other.alloc_;
+            } else {
+                assert(alloc_ == other.alloc_);
+            }
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+    ~PairSlots() {
+        free();
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+    Allocator get_allocator() const {
+        return Allocator(alloc_);
+    }
+
+    const K & key(std::size_t pos) const {
+        return data_[pos].pair.first;
+    }
+    IteratorT iterator_at(std::size_t pos) {
+        return IteratorT(&data_[pos].pair);
+    }
+    // Bring the slot in ahead of the key comparison
+    void prefetch(std::size_t pos) const {
+        __builtin_prefetch(&data_[pos]);
+    }
+
+    // Construct K from "key" and V from "args" in the empty slot "pos"
+    template <typename KeyArg, typename ... Args>
+    void emplace(std::size_t pos, KeyArg && key, Args && ... args) {
+        PairAllocator alloc(alloc_);
+        std::allocator_traits<PairAllocator>::construct(alloc, &data_[pos].pair, std::piecewise_construct,
+                                                        std::forward_as_tuple(std::forward<KeyArg>(key)),
+                                                        std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+    void copy_construct(std::size_t pos, const PairSlots & from, std::size_t from_pos) {
+        PairAllocator alloc(alloc_);
+        std::allocator_traits<PairAllocator>::construct(alloc, &data_[pos].pair, from.data_[from_pos].pair);
+    }
+    // Move the element at "from_pos" of "from" into the empty slot "pos", and destroy the source
+    void relocate(std::size_t pos, PairSlots & from, std::size_t from_pos) {
+        PairAllocator alloc(alloc_);
+        std::allocator_traits<PairAllocator>::construct(alloc, &data_[pos].pair, std::move(from.data_[from_pos].pair));
+        from.destroy(from_pos);
+    }
+    void destroy(std::size_t pos) {
+        PairAllocator alloc(alloc_);
+        std::allocator_traits<PairAllocator>::destroy(alloc, &data_[pos].pair);
+    }
+
+    constexpr static std::size_t NumArrays = 1;
+    constexpr static std::array<std::size_t, NumArrays> ArrayStrides = {sizeof(std::pair<K, V>)};
+    std::array<const std::byte *, NumArrays> arrays() const {
+        return {reinterpret_cast<const std::byte *>(data_)};
+    }
+
+    class ViewT {
+    public:
+        explicit ViewT(std::array<const std::byte *, NumArrays> arrays)
+            : pairs_(reinterpret_cast<const std::pair<K, V> *>(arrays[0])) {}
+
+        const K & key(std::size_t pos) const {
+            return pairs_[pos].first;
+        }
+        const V & value(std::size_t pos) const {
+            return pairs_[pos].second;
+        }
+
+    private:
+        const std::pair<K, V> * pairs_;
+    };
+
+private:
+    static_assert(sizeof(SlotT) == sizeof(std::pair<K, V>), "a slot is exactly a pair");
+
+    void free() {
+        if(data_ != nullptr) {
+            std::allocator_traits<SlotAllocator>::deallocate(alloc_, data_, size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    SlotAllocator alloc_;
+    SlotT * data_{nullptr};
+    std::size_t size_{0};
+};
+
+template <typename K, typename V, typename Allocator>
+class SplitSlots {
+    using KeyAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<K>;
+    using ValueAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<V>;
+
+public:
+    using IteratorT = SplitIterator<K, V>;
+
+    explicit SplitSlots(const Allocator & alloc, std::size_t size = 0) : key_alloc_(alloc), value_alloc_(alloc), size_(size) {
+        keys_ = allocate_slots(key_alloc_, size_);
+        try {
+            values_ = allocate_slots(value_alloc_, size_);
+        } catch(...) {
+            std::allocator_traits<KeyAllocator>::deallocate(key_alloc_, keys_, size_);
+            throw;
+        }
+    }
+    SplitSlots(SplitSlots && other) noexcept
+        : key_alloc_(other.key_alloc_), value_alloc_(other.value_alloc_),
+          keys_(std::exchange(other.keys_, nullptr)), values_(std::exchange(other.values_, nullptr)),
+          size_(std::exchange(other.size_, 0)) {}
+    // The allocator is kept unless it propagates, see PairSlots
+    SplitSlots & operator=(SplitSlots && other) noexcept {
+        if(this != &other) {
+            free();
+            if constexpr (std::allocator_traits<KeyAllocator>::propagate_on_container_move_assignment::value) {
+                key_alloc_ = other.key_alloc_;
+                value_alloc_ = other.value_alloc_;
+            } else {
+                assert(key_alloc_ == other.key_alloc_);
+            }
+            keys_ = std::exchange(other.keys_, nullptr);
+            values_ = std::exchange(other.values_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+    ~SplitSlots() {
+        free();
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+    Allocator get_allocator() const {
+        return Allocator(key_alloc_);
+    }
+
+    const K & key(std::size_t pos) const {
+        return keys_[pos];
+    }
+    IteratorT iterator_at(std::size_t pos) {
+        return IteratorT(&keys_[pos], &values_[pos]);
+    }
+    // Only the key: the value is not needed unless the key matches
+    void prefetch(std::size_t pos) const {
+        __builtin_prefetch(&keys_[pos]);
+    }
+
+    template <typename KeyArg, typename ... Args>
+    void emplace(std::size_t pos, KeyArg && key, Args && ... args) {
+        std::allocator_traits<KeyAllocator>::construct(key_alloc_, &keys_[pos], std::forward<KeyArg>(key));
+        try {
+            std::allocator_traits<ValueAllocator>::construct(value_alloc_, &values_[pos], std::forward<Args>(args)...);
+        } catch(...) {
+            std::allocator_traits<KeyAllocator>::destroy(key_alloc_, &keys_[pos]);
+            throw;
+        }
+    }
+    void copy_construct(std::size_t pos, const SplitSlots & from, std::size_t from_pos) {
+        emplace(pos, from.keys_[from_pos], from.values_[from_pos]);
+    }
+    void relocate(std::size_t pos, SplitSlots & from, std::size_t from_pos) {
+        emplace(pos, std::move(from.keys_[from_pos]), std::move(from.values_[from_pos]));
+        from.destroy(from_pos);
+    }
+    void destroy(std::size_t pos) {
+        std::allocator_traits<KeyAllocator>::destroy(key_alloc_, &keys_[pos]);
+        std::allocator_traits<ValueAllocator>::destroy(value_alloc_, &values_[pos]);
+    }
+
+    constexpr static std::size_t NumArrays = 2;
+    constexpr static std::array<std::size_t, NumArrays> ArrayStrides = {sizeof(K), sizeof(V)};
+    std::array<const std::byte *, NumArrays> arrays() const {
+        return {reinterpret_cast<const std::byte *>(keys_), reinterpret_cast<const std::byte *>(values_)};
+    }
+
+    class ViewT {
+    public:
+        explicit ViewT(std::array<const std::byte *, NumArrays> arrays)
+            : keys_(reinterpret_cast<const K *>(arrays[0])), values_(reinterpret_cast<const V *>(arrays[1])) {}
+
+        const K & key(std::size_t pos) const {
+            return keys_[pos];
+        }
+        const V & value(std::size_t pos) const {
+            return values_[pos];
+        }
+
+    private:
+        const K * keys_;
+        const V * values_;
+    };
+
+private:
+    void free() {
+        if(keys_ != nullptr) {
+            std::allocator_traits<KeyAllocator>::deallocate(key_alloc_, keys_, size_);
+            std::allocator_traits<ValueAllocator>::deallocate(value_alloc_, values_, size_);
+            keys_ = nullptr;
+            values_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    KeyAllocator key_alloc_;
+    ValueAllocator value_alloc_;
+    K * keys_{nullptr};
+    V * values_{nullptr};
+    std::size_t size_{0};
+};
+
+// Layout policies, the Layout parameter of FlatHashMapV3
+struct InterleavedLayout {
+    template <typename K, typename V, typename Allocator>
+    using Slots = PairSlots<K, V, Allocator>;
+};
+
+struct SplitLayout {
+    template <typename K, typename V, typename Allocator>
+    using Slots = SplitSlots<K, V, Allocator>;
+};
+
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <numeric>
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include "hash_policy.hpp"
+
+namespace hpds {
+
+/**
+ * @brief Read-only map over a key set known up front, built on a minimal perfect hash (PTHash style).
+ * The keys are hashed into buckets of about BucketSize keys, and every bucket gets a 16-bit "pilot":
+ * the first value which sends all of its keys to free slots of a table of size() / Alpha positions.
+ * Buckets are placed from the biggest down, while the table is still empty enough for them.
+ * The few keys which land at or past size() are remapped to the holes left below size(), so the slots
+ * array holds exactly size() elements, without any empty slot.
+ *
+ * A lookup is then one pilot read, one slot access and one key comparison, hit or miss: there is no probe
+ * sequence, and so no long tail of probe lengths whatever the key set. The hash function costs about
+ * 2 bytes of pilots per BucketSize keys, plus the remap of (1 / Alpha - 1) of the keys.
+ *
+ * Building is O(n) in expectation, plus a sort of the hashes to drop duplicate keys (the first one is kept,
+ * like std::unordered_map's range constructor). Keys whose Hash values are equal cannot be told apart
+ * by any pilot, so they throw std::invalid_argument: use a 64-bit hash with few collisions.
+ */
+template <typename K, typename V,
+          typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>>
+class StaticHashMap {
+public:
+    using SlotT = std::pair<K, V>;
+    using IteratorT = const SlotT *;
+
+    // Average number of keys per bucket, and load of the table the pilots are searched in
+    constexpr static std::size_t BucketSize = 4;
+    constexpr static double Alpha = 0.98;
+
+    StaticHashMap() : StaticHashMap(Allocator()) {}
+    explicit StaticHashMap(const Allocator & alloc)
+        : slots_(SlotAllocator(alloc)), pilots_(PilotAllocator(alloc)), remap_(RemapAllocator(alloc)) {}
+
+    // Build from a range of std::pair<K, V> (or anything a SlotT can be constructed from)
+    template <typename InputIt>
+    StaticHashMap(InputIt first, InputIt last, const Allocator & alloc = Allocator());
+    StaticHashMap(std::initializer_list<SlotT> init, const Allocator & alloc = Allocator())
+        : StaticHashMap(init.begin(), init.end(), alloc) {}
+
+    bool empty() const noexcept {
+        return slots_.empty();
+    }
+    std::size_t size() const noexcept {
+        return slots_.size();
+    }
+    // Bytes used by the hash function itself (pilots and remap), on top of the slots
+    std::size_t hash_function_bytes() const noexcept {
+        return pilots_.size() * sizeof(uint16_t) + remap_.size() * sizeof(std::size_t);
+    }
+
+    IteratorT begin() const {
+        return slots_.data();
+    }
+    IteratorT end() const {
+        return slots_.data() + slots_.size();
+    }
+
+    IteratorT find(const K & key) const {
+        return find_impl(key, Hash()(key));
+    }
+    // "hash" must be Hash()(key)
+    IteratorT find(const K & key, std::size_t hash) const {
+        return find_impl(key, hash);
+    }
+
+    // Heterogeneous lookup, only available with a transparent Hash and KeyEqual
+    template <typename Q>
+    requires TransparentHashAndEqual<Hash, KeyEqual>
+    IteratorT find(const Q & key) const {
+        return find_impl(key, Hash()(key));
+    }
+
+    bool contains(const K & key) const {
+        return find(key) != end();
+    }
+    std::size_t count(const K & key) const {
+        return contains(key) ? 1 : 0;
+    }
+    const V & at(const K & key) const {
+        IteratorT it = find(key);
+        if(it == end()) {
+            throw std::out_of_range("[StaticHashMap::at] key is not found");
+        }
+        return it->second;
+    }
+
+private:
+    using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<SlotT>;
+    using PilotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<uint16_t>;
+    using RemapAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::size_t>;
+
+    // Seeds tried before giving up. With 16-bit pilots and Alpha = 0.98, the first one almost always works
+    constexpr static uint64_t MaxSeeds = 64;
+    constexpr static uint64_t MaxPilot = UINT16_MAX;
+
+    static std::size_t seeded(std::size_t hash, uint64_t seed) {
+        return mix_hash(hash ^ (seed * 0xD6E8FEB86659FD93ull));
+    }
+    std::size_t bucket_of(std::size_t hash) const {
+        return FastRangeIndex::index(hash, pilots_.size());
+    }
+    // Position in the table of table_size_ slots, which is larger than size()
+    static std::size_t position(std::size_t hash, uint16_t pilot, std::size_t table_size) {
+        return FastRangeIndex::index(mix_hash(hash ^ ((pilot + 1ull) * 0x9E3779B97F4A7C15ull)), table_size);
+    }
+
+    template <typename Q>
+    IteratorT find_impl(const Q & key, std::size_t hash) const {
+        if(slots_.empty()) {
+            return end();
+        }
+        hash = seeded(hash, seed_);
+        std::size_t pos = position(hash, pilots_[bucket_of(hash)], table_size_);
+        if(pos >= slots_.size()) {
+            pos = remap_[pos - slots_.size()];
+        }
+        return KeyEqual()(slots_[pos].first, key) ? &slots_[pos] : end();
+    }
+
+    // Search the pilots of every bucket for the current seed_. Fills "pos_of" (position of every hash)
+    // and returns false if some bucket found no pilot
+    bool search_pilots(const std::vector<std::size_t> & raw_hashes, std::vector<std::size_t> & pos_of);
+
+    std::vector<SlotT, SlotAllocator> slots_;
+    std::vector<uint16_t, PilotAllocator> pilots_;
+    // remap_[pos - size()] : the slot below size() where a key whose position is pos >= size() lives
+    std::vector<std::size_t, RemapAllocator> remap_;
+    std::size_t table_size_{0};
+    uint64_t seed_{0};
+};
+
+template <typename K, typename V, typename Hash, typename KeyEqual, typename Allocator>
+template <typename InputIt>
+StaticHashMap<K, V, Hash, KeyEqual, Allocator>::StaticHashMap(InputIt first, InputIt last, const Allocator & alloc)
+    : StaticHashMap(alloc) {
+    std::vector<SlotT> entries;
+    for(; first != last; ++first) {
+        entries.emplace_back(*first);
+    }
+    // Drop the duplicates: sort (hash, index) pairs, so that the first occurrence of a key comes first,
+    // and compare the keys of equal hashes
+    std::vector<std::pair<std::size_t, std::size_t>> sorted(entries.size());
+    for(std::size_t i = 0; i < entries.size(); i++) {
+        sorted[i] = {Hash()(entries[i].first), i};
+    }
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::size_t> kept;
+    std::vector<std::size_t> hashes;
+    kept.reserve(entries.size());
+    hashes.reserve(entries.size());
+    for(const auto & [hash, index] : sorted) {
+        // Compare with every kept key of the same hash, so that a duplicate behind a collision is still found
+        bool duplicate = false;
+        bool collision = false;
+        for(std::size_t j = kept.size(); j > 0 && hashes[j - 1] == hash; j--) {
+            if(KeyEqual()(entries[kept[j - 1]].first, entries[index].first)) {
+                duplicate = true;
+                break;
+            }
+            collision = true;
+        }
+        if(collision && !duplicate) {
+            throw std::invalid_argument("[StaticHashMap] two different keys have the same hash");
+        }
+        if(!duplicate) {
+            kept.push_back(index);
+            hashes.push_back(hash);
+        }
+    }
+
+    const std::size_t n = kept.size();
+    if(n == 0) {
+        return;
+    }
+    table_size_ = std::max(n, static_cast<std::size_t>(std::ceil(n / Alpha)));
+    pilots_.resize((n + BucketSize - 1) / BucketSize);
+    std::vector<std::size_t> pos_of(n);
+    for(seed_ = 0; !search_pilots(hashes, pos_of); seed_++) {
+        if(seed_ + 1 == MaxSeeds) {
+            throw std::runtime_error("[StaticHashMap] no perfect hash found, the hash function is too weak");
+        }
+    }
+
+    // Fill the holes below n with the keys positioned at or past n
+    std::vector<std::size_t> entry_at(table_size_, n);
+    for(std::size_t i = 0; i < n; i++) {
+        entry_at[pos_of[i]] = i;
+    }
+    remap_.assign(table_size_ - n, 0);
+    std::size_t hole = 0;
+    for(std::size_t pos = n; pos < table_size_; pos++) {
+        if(entry_at[pos] != n) {
+            while(entry_at[hole] != n) {
+                hole++;
+            }
+            entry_at[hole] = entry_at[pos];
+            remap_[pos - n] = hole;
+            hole++;
+        }
+    }
+    slots_.reserve(n);
+    for(std::size_t pos = 0; pos < n; pos++) {
+        slots_.push_back(std::move(entries[kept[entry_at[pos]]]));
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual, typename Allocator>
+bool StaticHashMap<K, V, Hash, KeyEqual, Allocator>::search_pilots(const std::vector<std::size_t> & raw_hashes,
+                                                                   std::vector<std::size_t> & pos_of) {
+    const std::size_t n = raw_hashes.size();
+    const std::size_t num_buckets = pilots_.size();
+    std::vector<std::size_t> hashes(n);
+    // Counting sort of the keys by bucket
+    std::vector<std::size_t> bucket_start(num_buckets + 1, 0);
+    for(std::size_t i = 0; i < n; i++) {
+        hashes[i] = seeded(raw_hashes[i], seed_);
+        bucket_start[bucket_of(hashes[i]) + 1]++;
+    }
+    std::size_t max_bucket_size = 0;
+    for(std::size_t bucket = 0; bucket < num_buckets; bucket++) {
+        max_bucket_size = std::max(max_bucket_size, bucket_start[bucket + 1]);
+        bucket_start[bucket + 1] += bucket_start[bucket];
+    }
+    std::vector<std::size_t> keys_by_bucket(n);
+    {
+        std::vector<std::size_t> next(bucket_start.begin(), bucket_start.end() - 1);
+        for(std::size_t i = 0; i < n; i++) {
+            keys_by_bucket[next[bucket_of(hashes[i])]++] = i;
+        }
+    }
+    // Counting sort of the buckets by size, biggest first
+    std::vector<std::size_t> size_start(max_bucket_size + 2, 0);
+    for(std::size_t bucket = 0; bucket < num_buckets; bucket++) {
+        size_start[max_bucket_size - (bucket_start[bucket + 1] - bucket_start[bucket]) + 1]++;
+    }
+    std::partial_sum(size_start.begin(), size_start.end(), size_start.begin());
+    std::vector<std::size_t> buckets_by_size(num_buckets);
+    for(std::size_t bucket = 0; bucket < num_buckets; bucket++) {
+        buckets_by_size[size_start[max_bucket_size - (bucket_start[bucket + 1] - bucket_start[bucket])]++] = bucket;
+    }
+
+    std::vector<bool> taken(table_size_, false);
+    std::vector<std::size_t> positions(max_bucket_size);
+    for(std::size_t bucket : buckets_by_size) {
+        const std::size_t begin = bucket_start[bucket];
+        const std::size_t count = bucket_start[bucket + 1] - begin;
+        if(count == 0) {
+            // The buckets are sorted by size, so only empty ones are left
+            break;
+        }
+        uint64_t pilot = 0;
+        for(; pilot <= MaxPilot; pilot++) {
+            std::size_t placed = 0;
+            for(; placed < count; placed++) {
+                std::size_t pos = position(hashes[keys_by_bucket[begin + placed]], static_cast<uint16_t>(pilot), table_size_);
+                // Keys of the same bucket may also collide with each other
+                if(taken[pos] || std::find(positions.begin(), positions.begin() + placed, pos) != positions.begin() + placed) {
+                    break;
+                }
+                positions[placed] = pos;
+            }
+            if(placed == count) {
+                break;
+            }
+        }
+        if(pilot > MaxPilot) {
+            return false;
+        }
+        pilots_[bucket] = static_cast<uint16_t>(pilot);
+        for(std::size_t i = 0; i < count; i++) {
+            taken[positions[i]] = true;
+            pos_of[keys_by_bucket[begin + i]] = positions[i];
+        }
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+
+namespace hpds {
+
+/**
+ * @brief Append-only StableVector for many producers and lock-free readers, e.g. an event log shared by threads.
+ * The chunk directory is allocated once for "max_size" elements and never moves, and the chunks are
+ * allocated on first use: the first producer to need one publishes it with a CAS, the others adopt it.
+ * A producer reserves its index with one fetch_add, then constructs the element in place and marks it ready.
+ *
+ * Elements complete out of order, so size() is the length of the prefix in which every element is done.
+ * The producer which completes the element at size() moves it forward. Readers can use any index below size()
+ * (or try_get() any index at all) while producers keep appending, without locks.
+ * An element whose constructor throws leaves a hole: it counts in size(), but try_get() and for_each() skip it.
+ * If allocating a chunk throws, though, size() stops below that chunk for good.
+ *
+ * Chunks hold raw storage, so T needs no default constructor and only pushed elements are ever constructed.
+ * Elements are never moved nor destroyed before the vector itself.
+ */
+template <typename T, std::size_t ChunkSize = 256>
+requires ((((ChunkSize) & (ChunkSize - 1)) == 0))
+class ConcurrentStableVector {
+    enum State : uint8_t {
+        Pending = 0,
+        Ready = 1,
+        // The constructor threw, there is no element
+        Failed = 2
+    };
+
+    struct Chunk {
+        alignas(T) std::byte storage[ChunkSize * sizeof(T)];
+        std::atomic<uint8_t> states[ChunkSize] = {};
+
+        // User-provided, so "new Chunk()" leaves storage uninitialized instead of zero-filling it
+        Chunk() {}
+
+        T * element(std::size_t index) {
+            return std::launder(reinterpret_cast<T *>(storage) + index);
+        }
+    };
+
+public:
+    explicit ConcurrentStableVector(std::size_t max_size)
+        : num_chunks_((max_size + ChunkSize - 1) / ChunkSize), chunks_(new std::atomic<Chunk *>[num_chunks_]) {
+        for(std::size_t i = 0; i < num_chunks_; i++) {
+            chunks_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    ConcurrentStableVector(const ConcurrentStableVector &) = delete;
+    ConcurrentStableVector & operator=(const ConcurrentStableVector &) = delete;
+    ~ConcurrentStableVector();
+
+    // Maximum number of elements, fixed by the constructor
+    std::size_t max_size() const {
+        return num_chunks_ * ChunkSize;
+    }
+
+    // Construct an element at a fresh index and return the index. Safe to call from any number of threads.
+    // Throws std::length_error past max_size()
+    template <typename ... Args>
+    std::size_t emplace_back(Args && ... args);
+    std::size_t push_back(const T & element) {
+        return emplace_back(element);
+    }
+    std::size_t push_back(T && element) {
+        return emplace_back(std::move(element));
+    }
+
+    // Every index below size() is done (ready, or a hole left by a throwing constructor)
+    std::size_t size() const {
+        return published_.load(std::memory_order_acquire);
+    }
+    // Indices handed out so far, including elements still under construction
+    std::size_t reserved_size() const {
+        return std::min(reserved_.load(std::memory_order_relaxed), max_size());
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // The element at "index", nullptr if it is not ready (yet)
+    const T * try_get(std::size_t index) const {
+        if(index >= max_size()) {
+            return nullptr;
+        }
+        Chunk * chunk = chunks_[index / ChunkSize].load(std::memory_order_acquire);
+        if(chunk == nullptr || chunk->states[index % ChunkSize].load(std::memory_order_acquire) != Ready) {
+            return nullptr;
+        }
+        return chunk->element(index % ChunkSize);
+    }
+    // "index" must be below size(), and not a hole
+    const T & operator[](std::size_t index) const {
+        Chunk * chunk = chunks_[index / ChunkSize].load(std::memory_order_acquire);
+        return *chunk->element(index % ChunkSize);
+    }
+    T & operator[](std::size_t index) {
+        Chunk * chunk = chunks_[index / ChunkSize].load(std::memory_order_acquire);
+        return *chunk->element(index % ChunkSize);
+    }
+
+    // Call func(index, element) for every element below size(), holes skipped
+    template <typename Func>
+    void for_each(Func && func) const {
+        const std::size_t end = size();
+        for(std::size_t index = 0; index < end; index++) {
+            Chunk * chunk = chunks_[index / ChunkSize].load(std::memory_order_acquire);
+            if(chunk->states[index % ChunkSize].load(std::memory_order_relaxed) == Ready) {
+                func(index, static_cast<const T &>(*chunk->element(index % ChunkSize)));
+            }
+        }
+    }
+
+private:
+    // The chunk of "chunk_index", allocated and published by the first thread to need it
+    Chunk * get_or_allocate_chunk(std::size_t chunk_index);
+    // Mark "index" done, then move published_ past every done element
+    void publish(Chunk * chunk, std::size_t index, State state);
+
+    const std::size_t num_chunks_;
+    std::unique_ptr<std::atomic<Chunk *>[]> chunks_;
+    // Producers and readers hit different counters, so they do not share a cache line
+    alignas(64) std::atomic<std::size_t> reserved_{0};
+    alignas(64) std::atomic<std::size_t> published_{0};
+};
+
+template <typename T, std::size_t ChunkSize>
+requires ((((ChunkSize) & (ChunkSize - 1)) == 0))
+ConcurrentStableVector<T, ChunkSize>::~ConcurrentStableVector() {
+    for(std::size_t i = 0; i < num_chunks_; i++) {
+        Chunk * chunk = chunks_[i].load(std::memory_order_acquire);
+        if(chunk == nullptr) {
+            continue;
+        }
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            for(std::size_t j = 0; j < ChunkSize; j++) {
+                if(chunk->states[j].load(std::memory_order_relaxed) == Ready) {
+                    chunk->element(j)->~T();
+                }
+            }
+        }
+        delete chunk;
+    }
+}
+
+template <typename T, std::size_t ChunkSize>
+requires ((((ChunkSize) & (ChunkSize - 1)) == 0))
+auto ConcurrentStableVector<T, ChunkSize>::get_or_allocate_chunk(std::size_t chunk_index) -> Chunk * {
+    Chunk * chunk = chunks_[chunk_index].load(std::memory_order_acquire);
+    if(chunk != nullptr) {
+        return chunk;
+    }
+    Chunk * fresh = new Chunk();
+    if(chunks_[chunk_index].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return fresh;
+    }
+    // Another producer won the race, "chunk" now holds its chunk
+    delete fresh;
+    return chunk;
+}
+
+template <typename T, std::size_t ChunkSize>
+requires ((((ChunkSize) & (ChunkSize - 1)) == 0))
+template <typename ... Args>
+std::size_t ConcurrentStableVector<T, ChunkSize>::emplace_back(Args && ... args) {
+    const std::size_t index = reserved_.fetch_add(1, std::memory_order_relaxed);
+    if(index >= max_size()) {
+        throw std::length_error("[ConcurrentStableVector::emplace_back] max_size reached");
+    }
+    Chunk * chunk = get_or_allocate_chunk(index / ChunkSize);
+    try {
+        ::new (static_cast<void *>(chunk->element(index % ChunkSize))) T(std::forward<Args>(args)...);
+    } catch(...) {
+        publish(chunk, index, Failed);
+        throw;
+    }
+    publish(chunk, index, Ready);
+    return index;
+}
+
+template <typename T, std::size_t ChunkSize>
+requires ((((ChunkSize) & (ChunkSize - 1)) == 0))
+void ConcurrentStableVector<T, ChunkSize>::publish(Chunk * chunk, std::size_t index, State state) {
+    // seq_cst on both sides: a producer marks its element then reads published_ and the next states,
+    // so of two producers finishing neighbours at once, at least one sees the other's mark and moves on
+    chunk->states[index % ChunkSize].store(state, std::memory_order_seq_cst);
+    std::size_t published = published_.load(std::memory_order_seq_cst);
+    while(published < max_size()) {
+        Chunk * next = chunks_[published / ChunkSize].load(std::memory_order_seq_cst);
+        if(next == nullptr || next->states[published % ChunkSize].load(std::memory_order_seq_cst) == Pending) {
+            break;
+        }
+        // On failure "published" is reloaded, and the loop goes on from wherever another producer got to
+        if(published_.compare_exchange_weak(published, published + 1, std::memory_order_seq_cst)) {
+            published++;
+        }
+    }
+}
+
+}
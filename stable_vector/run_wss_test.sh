@@ -4,15 +4,16 @@ WSS_EXE_PATH="../../wss/wss.pl"
 
 # Check if argument is provided
 if [ $# -ne 1 ]; then
-    echo "Usage: $0 <SV|UM>"
+    echo "Usage: $0 <SV|SVM|UM>"
     echo "  SV: Test StableVector"
+    echo "  SVM: Test StableVector with the mmap backend"
     echo "  UM: Test UnorderedMap"
     exit 1
 fi
 
 # Check if argument is valid
-if [ "$1" != "SV" ] && [ "$1" != "UM" ]; then
-    echo "Error: Argument must be either 'SV' or 'UM'"
+if [ "$1" != "SV" ] && [ "$1" != "SVM" ] && [ "$1" != "UM" ]; then
+    echo "Error: Argument must be 'SV', 'SVM' or 'UM'"
     exit 1
 fi
 
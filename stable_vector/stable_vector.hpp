@@ -9,166 +9,238 @@
 #include <optional>
 #include <concepts>
 #include <type_traits>
+#include <new>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+#include <span>
+#include <iterator>
+#include <compare>
 
 // #define DEBUG_STABLE_VECTOR
 
+#include "stable_vector_storage.hpp"
+
 namespace hpds {
 
-template <typename T, std::size_t ChunkSize = 256, std::size_t InitialCapacity = ChunkSize>
+/**
+ * @brief A vector whose elements never move: storage grows without ever reallocating.
+ * The Backend decides how (see stable_vector_storage.hpp):
+ *  - SegmentedBackend (default) adds geometric segments from the heap, an access is one directory load.
+ *  - MmapBackend<MaxBytes> commits pages of one reserved address range, so the elements are also
+ *    contiguous: data() and span() hand them out as a plain array, e.g. to SIMD kernels, and the
+ *    iterators are pointers. It costs MaxBytes of address space, and push_back throws past it.
+ *
+ * Storage is raw: only pushed elements are constructed, and T needs no default constructor.
+ */
+template <typename T, std::size_t ChunkSize = 256, std::size_t InitialCapacity = ChunkSize, typename Backend = SegmentedBackend>
 requires ((((ChunkSize) & (ChunkSize - 1)) == 0))
 // make sure ChunkSize is a power of 2, for the compiler to optimize
 // out modular operations
 class StableVector {
-    class Chunk {
-    public:
-        void push_back(const T & element) {
-            if(chunk_size >= ChunkSize) {
-                throw std::out_of_range("[Chunk::push_back]");
-            }
-            // TODO: I think copy like this is the same fast as placement new
-            // But I can measure on that
-            // (placement new may have a nullptr check depending on the compiler implementation)
-            elements[chunk_size] = element;
-            chunk_size++;
-        }
-
-        template <typename ... Args>
-        void emplace_back(Args && ... args) {
-            if(chunk_size >= ChunkSize) {
-                throw std::out_of_range("[Chunk::push_back]");
-            }
-            new (elements.data() + chunk_size) T(std::forward<Args>(args)...);
-            chunk_size++;
-        }
-
-        T & operator[](std::size_t index) {
-            return elements[index];
-        }
-
-        const T & at (std::size_t index) const {
-            return elements.at(index);
-        }
-
-    private:
-        std::array<T, ChunkSize> elements;
-        // For simplicity, I use std::array here.
-        // Then I have to make sure T has default constructor
-        // if not, I should use std::vector<T> instead
-        std::size_t chunk_size = 0;
-    };
-
+    using Storage = typename Backend::template Storage<T, ChunkSize>;
+
+    // Random access iterator for the non-contiguous backends. It keeps a pointer into the current
+    // contiguous run of the storage (a segment) and the bounds of that run, so ++, -- and * are
+    // pointer operations, and it only goes back to the directory when it leaves the run.
+    // Since nothing ever moves, an iterator stays valid while the vector grows, except at end():
+    // an iterator at or past capacity() has no run to point into, and push_back does not give it one.
+    template <bool IsConst>
     class Iterator {
+        using Vector = std::conditional_t<IsConst, const StableVector, StableVector>;
     public:
-        Iterator(StableVector<T, ChunkSize, InitialCapacity> & stable_vec, std::size_t index) : stable_vec_(stable_vec), index_(index) {}
-        Iterator(const Iterator & other) : stable_vec_(other.stable_vec_), index_(other.index_) {}
-        
-        T & operator*() {
-            return stable_vec_[index_];
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<IsConst, const T *, T *>;
+        using reference = std::conditional_t<IsConst, const T &, T &>;
+
+        Iterator() = default;
+        Iterator(Vector & stable_vec, std::size_t index) : stable_vec_(&stable_vec) {
+            seek(index);
         }
-
-        const T & operator*() const {
-            return stable_vec_[index_];
+        // iterator to const_iterator
+        template <bool OtherConst>
+        requires (IsConst && !OtherConst)
+        Iterator(const Iterator<OtherConst> & other)
+            : stable_vec_(other.stable_vec_), ptr_(other.ptr_), index_(other.index_),
+              run_begin_(other.run_begin_), run_end_(other.run_end_) {}
+
+        reference operator*() const {
+            return *ptr_;
         }
 
-        T * operator->() {
-            return &stable_vec_[index_];
+        pointer operator->() const {
+            return ptr_;
         }
 
-        const T * operator->() const {
-            return &stable_vec_[index_];
+        reference operator[](difference_type n) const {
+            return *(*this + n);
         }
 
         Iterator & operator++() {
-            index_++;
+            if(++index_ == run_end_) {
+                seek(index_);
+            } else {
+                ++ptr_;
+            }
             return *this;
         }
 
         Iterator operator++(int) {
             Iterator tmp = *this;
-            index_++;
+            ++(*this);
             return tmp;
         }
-        
+
         Iterator & operator--() {
-            index_--;
+            if(index_ == run_begin_) {
+                seek(index_ - 1);
+            } else {
+                --index_;
+                --ptr_;
+            }
             return *this;
         }
 
         Iterator operator--(int) {
             Iterator tmp = *this;
-            index_--;
+            --(*this);
             return tmp;
         }
 
-        Iterator operator+(std::size_t n) const {
-            return Iterator(stable_vec_, index_ + n);
+        Iterator & operator+=(difference_type n) {
+            // Unsigned wrap around, as index_ + n with a negative n
+            const std::size_t index = index_ + static_cast<std::size_t>(n);
+            if(index >= run_begin_ && index < run_end_) {
+                ptr_ += n;
+                index_ = index;
+            } else {
+                seek(index);
+            }
+            return *this;
+        }
+
+        Iterator & operator-=(difference_type n) {
+            return (*this += -n);
+        }
+
+        Iterator operator+(difference_type n) const {
+            Iterator tmp = *this;
+            return (tmp += n);
         }
 
-        Iterator operator-(std::size_t n) const {
-            return Iterator(stable_vec_, index_ - n);
+        friend Iterator operator+(difference_type n, const Iterator & it) {
+            return it + n;
+        }
+
+        Iterator operator-(difference_type n) const {
+            Iterator tmp = *this;
+            return (tmp -= n);
+        }
+
+        difference_type operator-(const Iterator & other) const {
+            return static_cast<difference_type>(index_ - other.index_);
         }
 
         bool operator==(const Iterator & other) const {
-            if(index_ >= stable_vec_.size() && other.index_ >= stable_vec_.size()) {
-                // both is end iterator
-                return true;
-            }
             return index_ == other.index_;
         }
 
-        bool operator!=(const Iterator & other) const {
-            return !operator==(other);
+        auto operator<=>(const Iterator & other) const {
+            return index_ <=> other.index_;
         }
+
     private:
-        StableVector<T, ChunkSize, InitialCapacity> & stable_vec_;
-        std::size_t index_;
+        template <bool>
+        friend class Iterator;
+
+        void seek(std::size_t index) {
+            index_ = index;
+            if(index < stable_vec_->storage_.capacity()) {
+                ptr_ = stable_vec_->storage_.address(index);
+                run_begin_ = stable_vec_->storage_.run_begin(index);
+                run_end_ = stable_vec_->storage_.run_end(index);
+            } else {
+                ptr_ = nullptr;
+                run_begin_ = index;
+                run_end_ = index;
+            }
+        }
+
+        Vector * stable_vec_ = nullptr;
+        pointer ptr_ = nullptr;
+        std::size_t index_ = 0;
+        // The run ptr_ is in, as indices: [run_begin_, run_end_)
+        std::size_t run_begin_ = 0;
+        std::size_t run_end_ = 0;
     };
 
+    using IteratorT = std::conditional_t<Storage::Contiguous, T *, Iterator<false>>;
+    using ConstIteratorT = std::conditional_t<Storage::Contiguous, const T *, Iterator<true>>;
+
 public:
     StableVector() {
-        chunks_.reserve(InitialCapacity / ChunkSize);
-        for (size_t i = 0; i < InitialCapacity / ChunkSize; ++i) {
-            chunks_.push_back(std::make_unique<Chunk>());
-        }
+        expand_capacity_to(InitialCapacity);
     }
     StableVector(const StableVector&) = delete;
-    StableVector(StableVector&&) = default;
+    StableVector(StableVector && other) noexcept
+        : storage_(std::move(other.storage_)), size_(std::exchange(other.size_, 0)) {}
     StableVector& operator=(const StableVector&) = delete;
-    StableVector& operator=(StableVector&&) = default;
-    ~StableVector() = default;
+    StableVector& operator=(StableVector && other) noexcept {
+        if(this != &other) {
+            destroy_elements();
+            storage_ = std::move(other.storage_);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+    ~StableVector() {
+        destroy_elements();
+    }
 
     T & operator[](std::size_t index) {
-        return (*chunks_[index / ChunkSize])[index % ChunkSize];
+        return *storage_.address(index);
+    }
+
+    const T & operator[](std::size_t index) const {
+        return *storage_.address(index);
     }
 
     const T & at(std::size_t index) {
         if(index >= size_) {
             throw std::out_of_range("[StableVector::at] index out of range");
         }
-        return chunks_.at(index / ChunkSize) -> at(index % ChunkSize);
+        return (*this)[index];
     }
 
     void push_back(const T & element) {
-        get_last_chunk_for_insert().push_back(element);
-        size_++;
+        emplace_back(element);
     }
 
     template <typename ... Args>
     void emplace_back(Args && ... args) {
-        get_last_chunk_for_insert().emplace_back(std::forward<Args>(args)...);
+        if(size_ == capacity()) {
+            storage_.grow();
+        }
+        // Nothing moves when the storage grows, so "args" may still refer to an element
+        ::new (static_cast<void *>(&(*this)[size_])) T(std::forward<Args>(args)...);
         size_++;
     }
 
+    // Destroy the last element. Its storage is kept for the next push_back
+    void pop_back() {
+        if(size_ == 0) {
+            throw std::out_of_range("[StableVector::pop_back]");
+        }
+        size_--;
+        (*this)[size_].~T();
+    }
+
     void expand_capacity_to(std::size_t capacity) {
-        if((capacity / ChunkSize) > (size_ / ChunkSize)) {
-            // std::unique_ptr is not copyable, so we need to use resize
-            // and then copy the elements
-            chunks_.reserve(capacity / ChunkSize);
-
-            // if the last chunk is not full, we don't need to chunk "size_ / ChunkSize"
-            for(size_t i = size_ / ChunkSize + ((size_ % ChunkSize) != 0); i < capacity / ChunkSize; i++) {
-                chunks_.emplace_back(std::make_unique<Chunk>());
-            }
+        while(this->capacity() < capacity) {
+            storage_.grow();
         }
     }
 
@@ -176,71 +248,127 @@ public:
         return size_;
     }
 
+    // Elements the storage can hold without growing
+    std::size_t capacity() const {
+        return storage_.capacity();
+    }
+
     bool empty() const {
         return (size_ == 0);
     }
 
-    Iterator begin() {
-        return Iterator(*this, 0);
+    // Only with a contiguous Backend: the elements as one array
+    T * data() requires Storage::Contiguous {
+        return storage_.data();
     }
 
-    Iterator end() {
-        return Iterator(*this, size_);
+    const T * data() const requires Storage::Contiguous {
+        return storage_.data();
+    }
+
+    std::span<T> span() requires Storage::Contiguous {
+        return std::span<T>(storage_.data(), size_);
+    }
+
+    std::span<const T> span() const requires Storage::Contiguous {
+        return std::span<const T>(storage_.data(), size_);
+    }
+
+    IteratorT begin() {
+        if constexpr (Storage::Contiguous) {
+            return storage_.data();
+        } else {
+            return IteratorT(*this, 0);
+        }
+    }
+
+    IteratorT end() {
+        if constexpr (Storage::Contiguous) {
+            return storage_.data() + size_;
+        } else {
+            return IteratorT(*this, size_);
+        }
+    }
+
+    ConstIteratorT begin() const {
+        if constexpr (Storage::Contiguous) {
+            return storage_.data();
+        } else {
+            return ConstIteratorT(*this, 0);
+        }
+    }
+
+    ConstIteratorT end() const {
+        if constexpr (Storage::Contiguous) {
+            return storage_.data() + size_;
+        } else {
+            return ConstIteratorT(*this, size_);
+        }
+    }
+
+    // Call func(std::span<T>) on every contiguous run of elements in order: the segments, or all
+    // of them at once with a contiguous backend. Loops over a span vectorize like loops over an array.
+    template <typename Func>
+    void for_each_chunk(Func && func) {
+        for_each_chunk(0, size_, func);
+    }
+
+    template <typename Func>
+    void for_each_chunk(Func && func) const {
+        for_each_chunk(0, size_, func);
+    }
+
+    // The same over the elements [first, last) only, "last" at most size()
+    template <typename Func>
+    void for_each_chunk(std::size_t first, std::size_t last, Func && func) {
+        for(std::size_t begin = first; begin < last;) {
+            const std::size_t end = std::min(storage_.run_end(begin), last);
+            func(std::span<T>(storage_.address(begin), end - begin));
+            begin = end;
+        }
+    }
+
+    template <typename Func>
+    void for_each_chunk(std::size_t first, std::size_t last, Func && func) const {
+        for(std::size_t begin = first; begin < last;) {
+            const std::size_t end = std::min(storage_.run_end(begin), last);
+            func(std::span<const T>(storage_.address(begin), end - begin));
+            begin = end;
+        }
     }
 
     T & front() {
         if(size_ == 0) {
             throw std::out_of_range("[StableVector::front]");
         }
-        return (*(chunks_[0]))[0];
+        return (*this)[0];
     }
 
     T & back() {
         if(size_ == 0) {
             throw std::out_of_range("[StableVector::back]");
         }
-        return (*(chunks_[(size_ - 1) / ChunkSize]))[(size_ - 1) % ChunkSize];
+        return (*this)[size_ - 1];
     }
 
+    // Destroy every element, and give back the storage past InitialCapacity
     void clear() {
-        chunks_.clear();
-        chunks_.reserve(InitialCapacity / ChunkSize);
-        for (size_t i = 0; i < InitialCapacity / ChunkSize; ++i) {
-            chunks_.push_back(std::make_unique<Chunk>());
-        }
-        size_ = 0;
+        destroy_elements();
+        storage_.shrink_to(InitialCapacity);
     }
 
 private:
-    Chunk & get_last_chunk_for_insert() {
-        if(((size_ % ChunkSize) == 0) && ((size_ / ChunkSize) == chunks_.size())) {
-            // DEBUGING 
-            #ifdef DEBUG_STABLE_VECTOR
-            std::cout << "[StableVector::get_last_chunk_for_insert] size_: " << size_
-                << ", chunks_.size(): " << chunks_.size() << std::endl;
-            #endif
-            // DEBUGING
-
-            // no more space, expand the capacity by 2
-            chunks_.reserve(size_ * 2 / ChunkSize);
-
-            for(size_t i = size_ / ChunkSize; i < size_ * 2 / ChunkSize; i++) {
-                chunks_.emplace_back(std::make_unique<Chunk>());
+    void destroy_elements() {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            for(std::size_t i = 0; i < size_; i++) {
+                (*this)[i].~T();
             }
         }
-
-        // DEBUGING
-        #ifdef DEBUG_STABLE_VECTOR
-        std::cout << "[StableVector::get_last_chunk_for_insert] size_: " << size_
-            << ", size_ / ChunkSize: " << (size_ / ChunkSize) << std::endl;
-        #endif
-        // DEBUGING
-
-        return *(chunks_[size_ / ChunkSize]);
+        size_ = 0;
     }
 
-    std::vector<std::unique_ptr<Chunk>> chunks_;
+    Storage storage_;
     std::size_t size_ = 0;
 };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+#include <span>
+#include <utility>
+#include <cstddef>
+#include "stable_vector.hpp"
+#include "work_stealing_pool.hpp"
+
+namespace hpds {
+
+/**
+ * @brief Parallel loops over a StableVector, on a WorkStealingPool (the shared one by default).
+ * A task is a run of whole chunks, about TaskBytes of elements: it starts on a chunk boundary, and the
+ * loop inside it goes over the contiguous spans of for_each_chunk(), so it vectorizes like a serial loop.
+ * Tasks are big enough to pay for taking one, and small enough for stealing to balance the threads.
+ * The vector must not grow nor shrink during the loop.
+ */
+
+namespace stable_vector_detail {
+
+constexpr std::size_t TaskBytes = 64 * 1024;
+
+template <typename T, std::size_t ChunkSize>
+constexpr std::size_t task_size() {
+    return ChunkSize * std::max<std::size_t>(1, TaskBytes / (ChunkSize * sizeof(T)));
+}
+
+}
+
+// func(element) for every element, in no particular order
+template <typename T, std::size_t ChunkSize, std::size_t InitialCapacity, typename Backend, typename Func>
+void parallel_for_each(StableVector<T, ChunkSize, InitialCapacity, Backend> & vec, Func && func,
+                       WorkStealingPool & pool = WorkStealingPool::shared()) {
+    constexpr std::size_t TaskSize = stable_vector_detail::task_size<T, ChunkSize>();
+    const std::size_t size = vec.size();
+    pool.run((size + TaskSize - 1) / TaskSize, [&](std::size_t task) {
+        vec.for_each_chunk(task * TaskSize, std::min(size, (task + 1) * TaskSize), [&](std::span<T> chunk) {
+            for(T & element : chunk) {
+                func(element);
+            }
+        });
+    });
+}
+
+// Fold every task's elements with accumulate(R, element), starting from "identity", then fold the
+// results of the tasks in index order with combine(R, R). The tasks only depend on the size of the
+// vector, so the result is the same for any number of threads, even for floating point sums.
+template <typename T, std::size_t ChunkSize, std::size_t InitialCapacity, typename Backend, typename R,
+          typename Accumulate, typename Combine>
+R parallel_reduce(const StableVector<T, ChunkSize, InitialCapacity, Backend> & vec, R identity,
+                  Accumulate && accumulate, Combine && combine, WorkStealingPool & pool = WorkStealingPool::shared()) {
+    constexpr std::size_t TaskSize = stable_vector_detail::task_size<T, ChunkSize>();
+    const std::size_t size = vec.size();
+    const std::size_t num_tasks = (size + TaskSize - 1) / TaskSize;
+    // std::optional, not R: no default constructor needed, and no std::vector<bool>
+    std::vector<std::optional<R>> partials(num_tasks);
+    pool.run(num_tasks, [&](std::size_t task) {
+        R partial = identity;
+        vec.for_each_chunk(task * TaskSize, std::min(size, (task + 1) * TaskSize), [&](std::span<const T> chunk) {
+            for(const T & element : chunk) {
+                partial = accumulate(std::move(partial), element);
+            }
+        });
+        partials[task].emplace(std::move(partial));
+    });
+    R result = std::move(identity);
+    for(auto & partial : partials) {
+        result = combine(std::move(result), std::move(*partial));
+    }
+    return result;
+}
+
+// out[i] = func(vec[i]) for every i. "out" is a random access iterator over vec.size() existing
+// elements, as the output of std::transform: a std::vector, another StableVector, or vec itself.
+template <typename T, std::size_t ChunkSize, std::size_t InitialCapacity, typename Backend, typename OutIt, typename Func>
+void parallel_transform(const StableVector<T, ChunkSize, InitialCapacity, Backend> & vec, OutIt out, Func && func,
+                        WorkStealingPool & pool = WorkStealingPool::shared()) {
+    constexpr std::size_t TaskSize = stable_vector_detail::task_size<T, ChunkSize>();
+    const std::size_t size = vec.size();
+    pool.run((size + TaskSize - 1) / TaskSize, [&](std::size_t task) {
+        OutIt dest = out + static_cast<std::ptrdiff_t>(task * TaskSize);
+        vec.for_each_chunk(task * TaskSize, std::min(size, (task + 1) * TaskSize), [&](std::span<const T> chunk) {
+            for(const T & element : chunk) {
+                *dest = func(element);
+                ++dest;
+            }
+        });
+    });
+}
+
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <memory>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace hpds {
+
+/**
+ * @brief Raw storage of a StableVector, the Backend parameter picks one. Both only hand out addresses:
+ * StableVector constructs and destroys the elements itself. Neither ever moves what it stores.
+ *  - SegmentStorage (SegmentedBackend) grows by geometric segments allocated from the heap.
+ *  - ReservedStorage (MmapBackend) reserves one range of address space up front and commits it as the
+ *    vector grows, so the elements are contiguous as well as stable: data() and spans work on them.
+ *
+ * The interface: address(index), capacity(), grow() to get more capacity, shrink_to(capacity) to give
+ * back what is past "capacity" (rounded up to what can be freed), and Contiguous, with data() if it is true.
+ * run_begin(index) and run_end(index) bound the contiguous run of storage an index below capacity() is in,
+ * for iterators and chunk-wise loops.
+ */
+
+/**
+ * Segment k holds ChunkSize * 2^k elements and starts at index ChunkSize * (2^k - 1), so the segment
+ * of an index is a bit_width (lzcnt) of index / ChunkSize + 1, and an access is one load from the
+ * fixed-size directory plus arithmetic. The directory lives in the object and has a slot for every
+ * segment a std::size_t index can reach, so it never grows nor moves either. It stores the address
+ * segment k would have if it started at index 0, so the element is at that base + index * sizeof(T).
+ */
+template <typename T, std::size_t ChunkSize>
+class SegmentStorage {
+    constexpr static std::size_t ChunkShift = std::countr_zero(ChunkSize);
+    constexpr static std::size_t MaxSegments = 64 - ChunkShift;
+
+public:
+    constexpr static bool Contiguous = false;
+
+    SegmentStorage() = default;
+    SegmentStorage(const SegmentStorage &) = delete;
+    SegmentStorage & operator=(const SegmentStorage &) = delete;
+    SegmentStorage(SegmentStorage && other) noexcept
+        : bases_(std::exchange(other.bases_, {})), num_segments_(std::exchange(other.num_segments_, 0)) {}
+    SegmentStorage & operator=(SegmentStorage && other) noexcept {
+        if(this != &other) {
+            shrink_to(0);
+            bases_ = std::exchange(other.bases_, {});
+            num_segments_ = std::exchange(other.num_segments_, 0);
+        }
+        return *this;
+    }
+    ~SegmentStorage() {
+        shrink_to(0);
+    }
+
+    T * address(std::size_t index) const {
+        return reinterpret_cast<T *>(bases_[segment_of(index)] + index * sizeof(T));
+    }
+    std::size_t capacity() const {
+        return segment_begin(num_segments_);
+    }
+    // The segment of "index"
+    std::size_t run_begin(std::size_t index) const {
+        return segment_begin(segment_of(index));
+    }
+    std::size_t run_end(std::size_t index) const {
+        return segment_begin(segment_of(index) + 1);
+    }
+
+    // Add the next segment, as big as all the previous ones plus ChunkSize
+    void grow() {
+        if(num_segments_ == MaxSegments) {
+            throw std::length_error("[SegmentStorage::grow] no segment left");
+        }
+        #ifdef DEBUG_STABLE_VECTOR
+        std::cout << "[SegmentStorage::grow] segment: " << num_segments_ << ", segment size: " << segment_size(num_segments_) << std::endl;
+        #endif
+        T * segment = std::allocator<T>().allocate(segment_size(num_segments_));
+        // Integer arithmetic: the base itself is usually outside of the segment
+        bases_[num_segments_] = reinterpret_cast<std::uintptr_t>(segment) - segment_begin(num_segments_) * sizeof(T);
+        num_segments_++;
+    }
+
+    // Free the segments which start at or past "capacity"
+    void shrink_to(std::size_t capacity) {
+        while(num_segments_ > 0 && segment_begin(num_segments_ - 1) >= capacity) {
+            num_segments_--;
+            T * segment = address(segment_begin(num_segments_));
+            std::allocator<T>().deallocate(segment, segment_size(num_segments_));
+            bases_[num_segments_] = 0;
+        }
+    }
+
+private:
+    static std::size_t segment_of(std::size_t index) {
+        return std::bit_width((index >> ChunkShift) + 1) - 1;
+    }
+    static std::size_t segment_begin(std::size_t segment) {
+        return ((std::size_t(1) << segment) - 1) << ChunkShift;
+    }
+    static std::size_t segment_size(std::size_t segment) {
+        return ChunkSize << segment;
+    }
+
+    // bases_[k] is the address of element 0 if segment k started there, for k < num_segments_
+    std::array<std::uintptr_t, MaxSegments> bases_{};
+    std::size_t num_segments_ = 0;
+};
+
+/**
+ * MaxBytes of address space are reserved with mmap(PROT_NONE) on the first grow(), which costs no memory,
+ * and grow() commits the next part of it with mprotect, doubling the committed bytes (at least ChunkSize
+ * elements, in whole pages). Pages only take memory once they are written, so committing ahead is cheap.
+ * The reservation never moves, so the elements are stable, and it is one range, so they are contiguous.
+ * Growing past MaxBytes throws std::length_error. shrink_to() hands whole pages back with MADV_DONTNEED.
+ */
+template <typename T, std::size_t ChunkSize, std::size_t MaxBytes>
+class ReservedStorage {
+public:
+    constexpr static bool Contiguous = true;
+
+    ReservedStorage() = default;
+    ReservedStorage(const ReservedStorage &) = delete;
+    ReservedStorage & operator=(const ReservedStorage &) = delete;
+    ReservedStorage(ReservedStorage && other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), reserved_bytes_(std::exchange(other.reserved_bytes_, 0)),
+          committed_bytes_(std::exchange(other.committed_bytes_, 0)) {}
+    ReservedStorage & operator=(ReservedStorage && other) noexcept {
+        if(this != &other) {
+            release();
+            data_ = std::exchange(other.data_, nullptr);
+            reserved_bytes_ = std::exchange(other.reserved_bytes_, 0);
+            committed_bytes_ = std::exchange(other.committed_bytes_, 0);
+        }
+        return *this;
+    }
+    ~ReservedStorage() {
+        release();
+    }
+
+    T * data() const {
+        return data_;
+    }
+    T * address(std::size_t index) const {
+        return data_ + index;
+    }
+    std::size_t capacity() const {
+        return committed_bytes_ / sizeof(T);
+    }
+    // Everything is one run
+    std::size_t run_begin(std::size_t) const {
+        return 0;
+    }
+    std::size_t run_end(std::size_t) const {
+        return capacity();
+    }
+
+    void grow();
+    void shrink_to(std::size_t capacity);
+
+private:
+    static std::size_t page_size() {
+        static const std::size_t size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        return size;
+    }
+    static std::size_t round_to_pages(std::size_t bytes) {
+        return (bytes + page_size() - 1) / page_size() * page_size();
+    }
+    void release() {
+        if(data_ != nullptr) {
+            munmap(data_, reserved_bytes_);
+            data_ = nullptr;
+            reserved_bytes_ = 0;
+            committed_bytes_ = 0;
+        }
+    }
+
+    T * data_{nullptr};
+    std::size_t reserved_bytes_{0};
+    std::size_t committed_bytes_{0};
+};
+
+template <typename T, std::size_t ChunkSize, std::size_t MaxBytes>
+void ReservedStorage<T, ChunkSize, MaxBytes>::grow() {
+    if(data_ == nullptr) {
+        reserved_bytes_ = round_to_pages(MaxBytes);
+        void * reservation = mmap(nullptr, reserved_bytes_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(reservation == MAP_FAILED) {
+            reserved_bytes_ = 0;
+            throw std::bad_alloc();
+        }
+        data_ = static_cast<T *>(reservation);
+    }
+    const std::size_t target = round_to_pages(std::max(committed_bytes_ * 2, ChunkSize * sizeof(T)));
+    const std::size_t new_committed = std::min(target, reserved_bytes_);
+    // A whole element must fit in what is added
+    if(new_committed / sizeof(T) <= capacity()) {
+        throw std::length_error("[ReservedStorage::grow] the reserved address range is full");
+    }
+    #ifdef DEBUG_STABLE_VECTOR
+    std::cout << "[ReservedStorage::grow] committed bytes: " << committed_bytes_ << " -> " << new_committed << std::endl;
+    #endif
+    char * base = reinterpret_cast<char *>(data_);
+    if(mprotect(base + committed_bytes_, new_committed - committed_bytes_, PROT_READ | PROT_WRITE) != 0) {
+        throw std::bad_alloc();
+    }
+    committed_bytes_ = new_committed;
+}
+
+template <typename T, std::size_t ChunkSize, std::size_t MaxBytes>
+void ReservedStorage<T, ChunkSize, MaxBytes>::shrink_to(std::size_t capacity) {
+    const std::size_t keep = round_to_pages(capacity * sizeof(T));
+    if(data_ == nullptr || keep >= committed_bytes_) {
+        return;
+    }
+    char * base = reinterpret_cast<char *>(data_);
+    // Drop the pages first, then make the range inaccessible again
+    madvise(base + keep, committed_bytes_ - keep, MADV_DONTNEED);
+    mprotect(base + keep, committed_bytes_ - keep, PROT_NONE);
+    committed_bytes_ = keep;
+}
+
+// Backend policies, the Backend parameter of StableVector
+struct SegmentedBackend {
+    template <typename T, std::size_t ChunkSize>
+    using Storage = SegmentStorage<T, ChunkSize>;
+};
+
+// 64 GiB of address space by default, out of the 128 TiB of a 47-bit user address space
+template <std::size_t MaxBytes = (std::size_t(1) << 36)>
+struct MmapBackend {
+    template <typename T, std::size_t ChunkSize>
+    using Storage = ReservedStorage<T, ChunkSize, MaxBytes>;
+};
+
+}
@@ -3,7 +3,16 @@
 #include <cassert>
 #include <vector>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <span>
+#include <algorithm>
+#include <numeric>
+#include <iterator>
+#include <stdexcept>
 #include "stable_vector.hpp"
+#include "concurrent_stable_vector.hpp"
+#include "stable_vector_algorithms.hpp"
 
 // #define DEBUG_STABLE_VECTOR_TEST
 
@@ -238,6 +247,342 @@ void test_iterator_stability_with_random_insertions() {
     print_test_result("Vector content matches std::vector after random insertions", all_passed);
 }
 
+// Test that only pushed elements are constructed, and that every one of them is destroyed
+struct Tracked {
+    static inline int alive = 0;
+    explicit Tracked(int v) : value(v) {
+        ++alive;
+    }
+    Tracked(const Tracked & other) : value(other.value) {
+        ++alive;
+    }
+    ~Tracked() {
+        --alive;
+    }
+    int value;
+};
+
+void test_construction_and_destruction() {
+    std::cout << "\n=== Testing Construction and Destruction ===" << std::endl;
+
+    bool all_passed = true;
+    {
+        // Tracked has no default constructor
+        StableVector<Tracked, 16> vec;
+        vec.expand_capacity_to(1024);
+        all_passed &= (Tracked::alive == 0);
+        print_test_result("Empty chunks construct nothing", all_passed);
+
+        for (int i = 0; i < 100; ++i) {
+            vec.emplace_back(i);
+        }
+        all_passed = (Tracked::alive == 100);
+        for (int i = 0; i < 40; ++i) {
+            vec.pop_back();
+        }
+        all_passed &= (Tracked::alive == 60 && vec.size() == 60 && vec.back().value == 59);
+        // Refill across the chunk boundary left by pop_back
+        for (int i = 60; i < 70; ++i) {
+            vec.push_back(Tracked(i));
+        }
+        for (int i = 0; i < 70; ++i) {
+            all_passed &= (vec[i].value == i);
+        }
+        all_passed &= (Tracked::alive == 70);
+        print_test_result("Pop back destroys", all_passed);
+
+        vec.clear();
+        all_passed = (Tracked::alive == 0);
+        vec.emplace_back(1);
+        all_passed &= (vec.size() == 1 && vec.front().value == 1);
+        print_test_result("Clear destroys", all_passed);
+    }
+    print_test_result("Destructor destroys", Tracked::alive == 0);
+
+    StableVector<int> empty_vec;
+    bool threw = false;
+    try {
+        empty_vec.pop_back();
+    } catch (const std::out_of_range &) {
+        threw = true;
+    }
+    print_test_result("Pop back on empty throws", threw);
+}
+
+// Test indexing across the geometric segments, and that growing never moves an element
+void test_segments() {
+    std::cout << "\n=== Testing Segments ===" << std::endl;
+
+    StableVector<std::size_t, 16> vec;
+    std::vector<const std::size_t *> addresses;
+    bool all_passed = true;
+    for (std::size_t i = 0; i < (1 << 20); ++i) {
+        vec.push_back(i * 3);
+        addresses.push_back(&vec[i]);
+        // Never more than twice the elements, plus the first segment
+        all_passed &= (vec.capacity() <= 2 * vec.size() + 16);
+    }
+    print_test_result("Geometric growth", all_passed);
+
+    all_passed = true;
+    std::mt19937 gen(3);
+    for (int i = 0; i < 100000; ++i) {
+        std::size_t index = gen() % vec.size();
+        all_passed &= (vec[index] == index * 3 && &vec[index] == addresses[index]);
+    }
+    // Both ends of every segment
+    for (std::size_t begin = 16; begin < vec.size(); begin = begin * 2 + 16) {
+        all_passed &= (vec[begin - 1] == (begin - 1) * 3 && vec[begin] == begin * 3);
+    }
+    print_test_result("Random access across segments", all_passed);
+
+    StableVector<std::size_t, 16> moved(std::move(vec));
+    all_passed = (moved.size() == addresses.size() && vec.empty() && &moved[12345] == addresses[12345]);
+    vec = std::move(moved);
+    all_passed &= (vec.size() == addresses.size() && moved.empty() && vec.back() == (addresses.size() - 1) * 3);
+    moved.push_back(7);
+    all_passed &= (moved.front() == 7);
+    print_test_result("Move keeps the elements in place", all_passed);
+}
+
+// Test the random access iterators with standard algorithms, and chunk-wise loops
+void test_random_access_iterators() {
+    std::cout << "\n=== Testing Random Access Iterators ===" << std::endl;
+
+    using Vector = StableVector<int, 16>;
+    static_assert(std::random_access_iterator<decltype(std::declval<Vector &>().begin())>);
+    static_assert(std::random_access_iterator<decltype(std::declval<const Vector &>().begin())>);
+
+    Vector vec;
+    std::vector<int> std_vec;
+    std::mt19937 gen(5);
+    for (int i = 0; i < 5000; ++i) {
+        int value = static_cast<int>(gen() % 1000);
+        vec.push_back(value);
+        std_vec.push_back(value);
+    }
+    std::sort(vec.begin(), vec.end());
+    std::sort(std_vec.begin(), std_vec.end());
+    bool all_passed = std::equal(vec.begin(), vec.end(), std_vec.begin(), std_vec.end());
+    print_test_result("Sort across segments", all_passed);
+
+    all_passed = true;
+    for (int value = -1; value <= 1000; value += 7) {
+        auto it = std::lower_bound(vec.begin(), vec.end(), value);
+        auto std_it = std::lower_bound(std_vec.begin(), std_vec.end(), value);
+        all_passed &= ((it - vec.begin()) == (std_it - std_vec.begin()));
+    }
+    print_test_result("Lower bound", all_passed);
+
+    // Backwards, and by random jumps, over segment boundaries
+    const Vector & const_vec = vec;
+    auto rit = const_vec.end();
+    std::size_t index = vec.size();
+    all_passed = true;
+    while (rit != const_vec.begin()) {
+        --rit;
+        --index;
+        all_passed &= (&*rit == &vec[index]);
+    }
+    for (int i = 0; i < 10000; ++i) {
+        std::ptrdiff_t from = gen() % vec.size();
+        std::ptrdiff_t to = gen() % vec.size();
+        auto it = vec.begin() + from;
+        it += to - from;
+        all_passed &= (&*it == &vec[to] && &it[from - to] == &vec[from] && (it > vec.begin() + from) == (to > from));
+    }
+    print_test_result("Reverse and random jumps", all_passed);
+
+    std::size_t next = 0;
+    long long sum = 0;
+    all_passed = true;
+    vec.for_each_chunk([&](std::span<int> chunk) {
+        all_passed &= (!chunk.empty() && chunk.data() == &vec[next]);
+        next += chunk.size();
+        for (int value : chunk) {
+            sum += value;
+        }
+    });
+    all_passed &= (next == vec.size() && sum == std::accumulate(std_vec.begin(), std_vec.end(), 0LL));
+    std::size_t chunks = 0;
+    const_vec.for_each_chunk([&](std::span<const int>) { chunks++; });
+    // Segments of 16, 32, ..., 2048 elements cover the first 4080
+    all_passed &= (chunks == 9);
+    print_test_result("For each chunk", all_passed);
+}
+
+// Test the parallel loops against serial ones, on a pool with more threads than this test needs
+void test_parallel_algorithms() {
+    std::cout << "\n=== Testing Parallel Algorithms ===" << std::endl;
+
+    WorkStealingPool pool(4);
+    StableVector<uint64_t, 64> vec;
+    for (uint64_t i = 0; i < 1000000; ++i) {
+        vec.push_back(i);
+    }
+    parallel_for_each(vec, [](uint64_t & value) { value = value * 2 + 1; }, pool);
+    bool all_passed = true;
+    for (uint64_t i = 0; i < vec.size(); ++i) {
+        all_passed &= (vec[i] == i * 2 + 1);
+    }
+    print_test_result("Parallel for each", all_passed);
+
+    uint64_t sum = parallel_reduce(vec, uint64_t(0), [](uint64_t acc, uint64_t value) { return acc + value; },
+                                   [](uint64_t a, uint64_t b) { return a + b; }, pool);
+    // Not commutative: the tasks must be combined in order
+    std::vector<uint64_t> firsts = parallel_reduce(vec, std::vector<uint64_t>(),
+        [](std::vector<uint64_t> acc, uint64_t value) {
+            if (acc.empty()) {
+                acc.push_back(value);
+            }
+            return acc;
+        },
+        [](std::vector<uint64_t> a, std::vector<uint64_t> b) {
+            a.insert(a.end(), b.begin(), b.end());
+            return a;
+        }, pool);
+    all_passed = (sum == 1000000ULL * 1000000ULL && !firsts.empty() && std::is_sorted(firsts.begin(), firsts.end()) && firsts[0] == 1);
+    print_test_result("Parallel reduce", all_passed);
+
+    std::vector<uint64_t> halves(vec.size());
+    parallel_transform(vec, halves.begin(), [](uint64_t value) { return value / 2; }, pool);
+    StableVector<uint64_t, 16> squares;
+    for (std::size_t i = 0; i < vec.size(); ++i) {
+        squares.push_back(0);
+    }
+    parallel_transform(vec, squares.begin(), [](uint64_t value) { return value * value; }, pool);
+    all_passed = true;
+    for (uint64_t i = 0; i < vec.size(); ++i) {
+        all_passed &= (halves[i] == i && squares[i] == (i * 2 + 1) * (i * 2 + 1));
+    }
+    print_test_result("Parallel transform", all_passed);
+
+    bool threw = false;
+    try {
+        parallel_for_each(vec, [](uint64_t & value) {
+            if (value == 777777) {
+                throw std::runtime_error("task failed");
+            }
+        }, pool);
+    } catch (const std::runtime_error &) {
+        threw = true;
+    }
+    // The pool is still usable after a failed loop
+    std::atomic<std::size_t> count{0};
+    parallel_for_each(vec, [&count](uint64_t &) { count.fetch_add(1, std::memory_order_relaxed); }, pool);
+    print_test_result("Exceptions reach the caller", threw && count.load() == vec.size());
+}
+
+// Test the mmap backend: contiguous and stable, and bounded by its reservation
+void test_mmap_backend() {
+    std::cout << "\n=== Testing Mmap Backend ===" << std::endl;
+
+    StableVector<std::string, 16, 16, MmapBackend<>> vec;
+    std::vector<const std::string *> addresses;
+    for (int i = 0; i < 100000; ++i) {
+        vec.push_back(std::to_string(i));
+        addresses.push_back(&vec[i]);
+    }
+    bool all_passed = true;
+    for (int i = 0; i < 100000; ++i) {
+        all_passed &= (&vec[i] == addresses[i] && vec.data() + i == addresses[i] && vec[i] == std::to_string(i));
+    }
+    print_test_result("Growing never moves an element", all_passed);
+
+    std::span<std::string> elements = vec.span();
+    all_passed = (elements.size() == vec.size() && elements.data() == vec.data() && elements.back() == "99999");
+    std::size_t count = 0;
+    for (std::string * it = vec.begin(); it != vec.end(); ++it) {
+        count += (*it == std::to_string(it - vec.begin()));
+    }
+    all_passed &= (count == vec.size());
+    print_test_result("Span and pointer iterators", all_passed);
+
+    StableVector<std::string, 16, 16, MmapBackend<>> moved(std::move(vec));
+    all_passed = (vec.empty() && moved.data() == addresses[0] && moved[777] == "777");
+    moved.clear();
+    all_passed &= (moved.empty() && moved.capacity() >= 16 && moved.capacity() < 100000);
+    moved.push_back("again");
+    all_passed &= (moved.front() == "again");
+    print_test_result("Move and clear", all_passed);
+
+    // 4 pages of address space, the fifth page of elements does not fit
+    StableVector<uint64_t, 16, 16, MmapBackend<4 * 4096>> small;
+    bool threw = false;
+    try {
+        for (uint64_t i = 0; i < 4 * 4096; ++i) {
+            small.push_back(i);
+        }
+    } catch (const std::length_error &) {
+        threw = true;
+    }
+    print_test_result("Growing past the reservation throws", threw && small.size() == 4 * 4096 / sizeof(uint64_t));
+}
+
+// Test concurrent appends while a reader scans the published prefix
+void test_concurrent_append() {
+    std::cout << "\n=== Testing Concurrent Append ===" << std::endl;
+
+    constexpr int Producers = 4;
+    constexpr int PerProducer = 50000;
+    // No default constructor, only pushed elements are constructed
+    struct Event {
+        Event(int p, int s) : producer(p), seq(s) {}
+        int producer;
+        int seq;
+    };
+    ConcurrentStableVector<Event, 64> log(Producers * PerProducer);
+    std::atomic<bool> done{false};
+    bool reader_passed = true;
+
+    std::thread reader([&]() {
+        // Events of one producer are published in the order it pushed them
+        while (!done.load()) {
+            std::vector<int> last(Producers, -1);
+            for (std::size_t i = 0; i < log.size(); ++i) {
+                const Event & event = log[i];
+                reader_passed &= (event.seq > last[event.producer]);
+                last[event.producer] = event.seq;
+            }
+        }
+    });
+    std::vector<std::thread> producers;
+    for (int p = 0; p < Producers; ++p) {
+        producers.emplace_back([&log, p]() {
+            for (int s = 0; s < PerProducer; ++s) {
+                log.emplace_back(p, s);
+            }
+        });
+    }
+    for (auto & producer : producers) {
+        producer.join();
+    }
+    done.store(true);
+    reader.join();
+    print_test_result("Readers see consistent published elements", reader_passed);
+
+    bool all_passed = (log.size() == Producers * PerProducer);
+    std::vector<std::vector<bool>> seen(Producers, std::vector<bool>(PerProducer, false));
+    log.for_each([&](std::size_t, const Event & event) {
+        all_passed &= !seen[event.producer][event.seq];
+        seen[event.producer][event.seq] = true;
+    });
+    for (auto & producer_seen : seen) {
+        for (bool s : producer_seen) {
+            all_passed &= s;
+        }
+    }
+    print_test_result("Every append is stored exactly once", all_passed);
+
+    bool threw = false;
+    try {
+        log.emplace_back(0, 0);
+    } catch (const std::length_error &) {
+        threw = true;
+    }
+    print_test_result("Append past max_size throws", threw && log.try_get(log.max_size()) == nullptr);
+}
+
 int main() {
     std::cout << "Starting StableVector Tests...\n" << std::endl;
     
@@ -246,6 +591,12 @@ int main() {
     test_custom_type();
     test_comparison_with_std_vector();
     test_iterator_stability_with_random_insertions();
+    test_construction_and_destruction();
+    test_segments();
+    test_random_access_iterators();
+    test_parallel_algorithms();
+    test_mmap_backend();
+    test_concurrent_append();
     
     std::cout << "\nAll tests completed!" << std::endl;
     return 0;
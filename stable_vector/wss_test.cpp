@@ -29,6 +29,26 @@ void WSS_StableVector() {
     std::cout << "WSS_StableVector done, sum: " << sum << std::endl;
 }
 
+// Same as WSS_StableVector, on one reserved range of address space instead of heap segments
+void WSS_StableVectorMmap() {
+    StableVector<int32_t, ChunkSize, ChunkSize, MmapBackend<>> v;
+    std::list<int32_t> l;
+    // the list is used for heap randomization
+    for(int32_t i = 0; i < TestTimes; i++) {
+        for(int32_t j = 0; j < HeapRandomizationTimes; j++) {
+            l.push_back(j);
+            doNotOptimizeAway(l.back());
+        }
+        v.push_back(i);
+    }
+    int32_t sum = 0;
+    for(int32_t i = 0; i < TestTimes; i++) {
+        sum += v[i];
+    }
+    doNotOptimizeAway(sum);
+    std::cout << "WSS_StableVectorMmap done, sum: " << sum << std::endl;
+}
+
 void WSS_UnorderedMap() {
     std::unordered_map<int32_t, int32_t> m;
     std::list<int32_t> l;
@@ -50,15 +70,17 @@ void WSS_UnorderedMap() {
 
 int32_t main(int32_t argc, char **argv) {
     if(argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " SV / UM" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " SV / SVM / UM" << std::endl;
         return 1;
     }
     if(std::string(argv[1]) == "SV") {
         WSS_StableVector();
+    } else if(std::string(argv[1]) == "SVM") {
+        WSS_StableVectorMmap();
     } else if(std::string(argv[1]) == "UM") {
         WSS_UnorderedMap();
     } else {
-        std::cerr << "Usage: " << argv[0] << " SV / UM" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " SV / SVM / UM" << std::endl;
         return 1;
     }
     return 0;
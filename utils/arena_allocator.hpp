@@ -0,0 +1,106 @@
+#pragma once
+
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief A monotonic arena: allocation bumps a pointer inside the current chunk, deallocation is a no-op,
+ * and everything is freed at once by release() or the destructor, in O(number of chunks).
+ * Chunks grow geometrically, so a long-lived arena makes O(log n) calls to malloc.
+ * Memory given back by a container (e.g. the old table after a rehash) is only reclaimed on release(),
+ * so size per-request maps with reserve() to avoid paying for every intermediate table.
+ * Not thread-safe: use one arena per thread / per request.
+ */
+class MonotonicArena {
+public:
+    explicit MonotonicArena(std::size_t initial_chunk_size = 4096) : next_chunk_size_(initial_chunk_size) {}
+    MonotonicArena(const MonotonicArena &) = delete;
+    MonotonicArena & operator=(const MonotonicArena &) = delete;
+    ~MonotonicArena() {
+        release();
+    }
+
+    void * allocate(std::size_t bytes, std::size_t alignment) {
+        std::uintptr_t pos = (reinterpret_cast<std::uintptr_t>(cur_) + alignment - 1) & ~(alignment - 1);
+        if(cur_ == nullptr || pos + bytes > reinterpret_cast<std::uintptr_t>(end_)) {
+            new_chunk(bytes + alignment);
+            pos = (reinterpret_cast<std::uintptr_t>(cur_) + alignment - 1) & ~(alignment - 1);
+        }
+        cur_ = reinterpret_cast<char *>(pos + bytes);
+        bytes_allocated_ += bytes;
+        return reinterpret_cast<void *>(pos);
+    }
+
+    // Free every chunk. All the memory handed out by this arena becomes invalid.
+    void release() {
+        while(head_ != nullptr) {
+            Chunk * next = head_->next;
+            free(head_);
+            head_ = next;
+        }
+        cur_ = end_ = nullptr;
+        bytes_allocated_ = 0;
+    }
+
+    // Total bytes handed out since the last release()
+    std::size_t bytes_allocated() const {
+        return bytes_allocated_;
+    }
+
+private:
+    struct Chunk {
+        Chunk * next;
+    };
+
+    void new_chunk(std::size_t min_bytes) {
+        std::size_t size = std::max(next_chunk_size_, min_bytes + sizeof(Chunk));
+        next_chunk_size_ = size * 2;
+        Chunk * chunk = static_cast<Chunk *>(malloc(size));
+        if(chunk == nullptr) {
+            throw std::bad_alloc();
+        }
+        chunk->next = head_;
+        head_ = chunk;
+        cur_ = reinterpret_cast<char *>(chunk + 1);
+        end_ = reinterpret_cast<char *>(chunk) + size;
+    }
+
+    Chunk * head_{nullptr};
+    char * cur_{nullptr};
+    char * end_{nullptr};
+    std::size_t next_chunk_size_;
+    std::size_t bytes_allocated_{0};
+};
+
+// Stateful allocator handing out memory of a MonotonicArena. Copies (and rebinds) share the arena.
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    explicit ArenaAllocator(MonotonicArena & arena) : arena_(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> & other) : arena_(other.arena_) {}
+
+    T * allocate(std::size_t n) {
+        return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *, std::size_t) {}
+
+    MonotonicArena * arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> & lhs, const ArenaAllocator<U> & rhs) {
+    return lhs.arena_ == rhs.arena_;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> & lhs, const ArenaAllocator<U> & rhs) {
+    return lhs.arena_ != rhs.arena_;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+/**
+ * @brief Allocator for big flat arrays (hash tables, chunk pools) which suffer from TLB misses.
+ * Allocations of at least HugePageSize bytes are rounded up to whole 2MB pages, aligned to 2MB and
+ * marked with madvise(MADV_HUGEPAGE), so that transparent huge pages can back them even when
+ * /sys/kernel/mm/transparent_hugepage/enabled is "madvise". Smaller allocations go to operator new.
+ * madvise is only a hint, so if THP is disabled this behaves like an aligned allocator.
+ */
+template <typename T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    constexpr static std::size_t HugePageSize = std::size_t(2) << 20;
+
+    HugePageAllocator() = default;
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U> &) {}
+
+    T * allocate(std::size_t n) {
+        const std::size_t bytes = n * sizeof(T);
+        if(bytes < HugePageSize) {
+            return static_cast<T *>(::operator new(bytes, std::align_val_t(alignof(T))));
+        }
+        const std::size_t rounded = round_up(bytes);
+        void * ptr = nullptr;
+        if(posix_memalign(&ptr, HugePageSize, rounded) != 0) {
+            throw std::bad_alloc();
+        }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        madvise(ptr, rounded, MADV_HUGEPAGE);
+#endif
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T * ptr, std::size_t n) {
+        if(n * sizeof(T) < HugePageSize) {
+            ::operator delete(ptr, std::align_val_t(alignof(T)));
+        } else {
+            free(ptr);
+        }
+    }
+
+private:
+    static std::size_t round_up(std::size_t bytes) {
+        return (bytes + HugePageSize - 1) & ~(HugePageSize - 1);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T> &, const HugePageAllocator<U> &) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T> &, const HugePageAllocator<U> &) {
+    return false;
+}
@@ -47,6 +47,18 @@ public:
         test_results_.emplace_back(case_name, std::move(test_result));
     }
 
+    // For results which are not times (e.g. bytes per entry, histograms): func(input_param) returns
+    // anything convertible to json, and the results are dumped as is under "metrics"
+    template <typename Func>
+    void launchMetric(const std::string & metric_name, Func && func) {
+        json metric_result = json::array();
+        for(int32_t input_param : input_params_) {
+            metric_result.push_back(func(input_param));
+        }
+
+        metrics_[metric_name] = std::move(metric_result);
+    }
+
     void dump() {
         json output_json;
         output_json["test_name"] = test_name_;
@@ -83,6 +95,9 @@ public:
             output_json["result"][case_name] = result;
         }
         output_json["unit"] = unit;
+        if(!metrics_.empty()) {
+            output_json["metrics"] = metrics_;
+        }
         std::ofstream output_file(output_file_path_);
         output_file << output_json.dump(4);
         output_file.close();
@@ -102,4 +117,5 @@ private:
 
     std::vector<int32_t> input_params_;
     std::vector<TestResultNode> test_results_;
+    json metrics_ = json::object();
 };
\ No newline at end of file
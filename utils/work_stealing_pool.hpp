@@ -0,0 +1,223 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief A fixed set of threads running parallel loops over independent tasks, balanced by work stealing.
+ * run(num_tasks, func) calls func(task) once for every task in [0, num_tasks) and returns when all are done.
+ * The calling thread works too, so a pool of N threads starts N - 1 workers, once, in the constructor.
+ *
+ * Every thread starts with an even, contiguous share of the tasks and takes them from the front, so
+ * neighbouring tasks (e.g. neighbouring chunks of memory) run in order on one thread. A thread whose share
+ * is empty steals the back half of another share. A share is a [begin, end) pair packed in one 64-bit word,
+ * and owner and thieves both change it by CAS, without locks. So threads which get slower tasks, or get
+ * preempted, end up with fewer tasks.
+ *
+ * If a task throws, the tasks not started yet are skipped and run() rethrows the first exception.
+ * One loop at a time: concurrent run() calls wait for each other, and a task must not call run() on its pool.
+ */
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(std::size_t threads = std::thread::hardware_concurrency())
+        : num_threads_(std::max<std::size_t>(threads, 1)), shares_(new Share[num_threads_]) {
+        workers_.reserve(num_threads_ - 1);
+        for(std::size_t t = 1; t < num_threads_; t++) {
+            workers_.emplace_back([this, t]() { worker_loop(t); });
+        }
+    }
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool & operator=(const WorkStealingPool &) = delete;
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            shutdown_ = true;
+        }
+        wake_.notify_all();
+        for(auto & worker : workers_) {
+            worker.join();
+        }
+    }
+
+    // Threads running tasks, the caller of run() included
+    std::size_t num_threads() const {
+        return num_threads_;
+    }
+
+    template <typename Func>
+    void run(std::size_t num_tasks, Func && func);
+
+    // A pool with a thread per core, started on first use
+    static WorkStealingPool & shared() {
+        static WorkStealingPool pool;
+        return pool;
+    }
+
+private:
+    // One per thread, on its own cache line: thieves hit it far less often than its owner
+    struct alignas(64) Share {
+        std::atomic<uint64_t> range{0};
+    };
+
+    static uint64_t pack(uint64_t begin, uint64_t end) {
+        return (begin << 32) | end;
+    }
+    static uint64_t begin_of(uint64_t range) {
+        return range >> 32;
+    }
+    static uint64_t end_of(uint64_t range) {
+        return range & 0xFFFFFFFF;
+    }
+
+    // Take the front task of our own share
+    bool take(std::size_t self, std::size_t & task);
+    // Take the back half of another share: run its first task, and keep the rest as our share
+    bool steal(std::size_t self, std::size_t & task);
+    void work(std::size_t self);
+    void worker_loop(std::size_t self);
+
+    const std::size_t num_threads_;
+    std::unique_ptr<Share[]> shares_;
+    std::vector<std::thread> workers_;
+
+    // The loop being run: "func" is type-erased to a pointer and a trampoline
+    void (*task_)(void *, std::size_t) = nullptr;
+    void * context_ = nullptr;
+    std::atomic<bool> failed_{false};
+    std::exception_ptr error_;
+    std::mutex error_mutex_;
+
+    std::mutex run_mutex_;
+    // Guards generation_, running_ and shutdown_
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::size_t generation_ = 0;
+    std::size_t running_ = 0;
+    bool shutdown_ = false;
+};
+
+template <typename Func>
+void WorkStealingPool::run(std::size_t num_tasks, Func && func) {
+    if(num_tasks == 0) {
+        return;
+    }
+    if(num_threads_ == 1 || num_tasks == 1) {
+        for(std::size_t task = 0; task < num_tasks; task++) {
+            func(task);
+        }
+        return;
+    }
+    if(num_tasks > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("[WorkStealingPool::run] too many tasks");
+    }
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    using FuncT = std::remove_reference_t<Func>;
+    task_ = [](void * context, std::size_t task) {
+        (*static_cast<FuncT *>(context))(task);
+    };
+    context_ = const_cast<void *>(static_cast<const void *>(std::addressof(func)));
+    failed_.store(false, std::memory_order_relaxed);
+    error_ = nullptr;
+    for(std::size_t t = 0; t < num_threads_; t++) {
+        shares_[t].range.store(pack(num_tasks * t / num_threads_, num_tasks * (t + 1) / num_threads_), std::memory_order_relaxed);
+    }
+    // The mutex publishes the shares and the loop to the workers, and their results back to us
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = num_threads_ - 1;
+        generation_++;
+    }
+    wake_.notify_all();
+    work(0);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this]() { return running_ == 0; });
+    }
+    if(error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+inline bool WorkStealingPool::take(std::size_t self, std::size_t & task) {
+    std::atomic<uint64_t> & range = shares_[self].range;
+    uint64_t current = range.load(std::memory_order_acquire);
+    while(begin_of(current) < end_of(current)) {
+        if(range.compare_exchange_weak(current, pack(begin_of(current) + 1, end_of(current)), std::memory_order_acq_rel, std::memory_order_acquire)) {
+            task = begin_of(current);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool WorkStealingPool::steal(std::size_t self, std::size_t & task) {
+    // Our share is empty, so nobody else touches it until we refill it
+    for(std::size_t i = 1; i < num_threads_; i++) {
+        std::atomic<uint64_t> & range = shares_[(self + i) % num_threads_].range;
+        uint64_t current = range.load(std::memory_order_acquire);
+        while(begin_of(current) < end_of(current)) {
+            // The victim keeps [begin, middle), we take [middle, end)
+            const uint64_t middle = begin_of(current) + (end_of(current) - begin_of(current)) / 2;
+            if(range.compare_exchange_weak(current, pack(begin_of(current), middle), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                task = middle;
+                shares_[self].range.store(pack(middle + 1, end_of(current)), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline void WorkStealingPool::work(std::size_t self) {
+    // A task is only ever in one share, and the thread holding it runs it, so once every share
+    // looks empty, what is left is being run by the threads which took it
+    std::size_t task;
+    while(take(self, task) || steal(self, task)) {
+        if(failed_.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        try {
+            task_(context_, task);
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(error_mutex_);
+            if(!error_) {
+                error_ = std::current_exception();
+            }
+            failed_.store(true, std::memory_order_relaxed);
+        }
+    }
+}
+
+inline void WorkStealingPool::worker_loop(std::size_t self) {
+    std::size_t seen = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]() { return shutdown_ || generation_ != seen; });
+            if(shutdown_) {
+                return;
+            }
+            seen = generation_;
+        }
+        work(self);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(--running_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+}